@@ -4,6 +4,16 @@
 #include <string.h> // memset
 #include <stdio.h>  // fprintf
 #include <assert.h> // assert
+#include <time.h>   // clock_gettime
+#include <unistd.h> // dup
+#include <fcntl.h>  // open
+#include <errno.h>  // errno
+#include <sys/mman.h> // mmap
+#include <sys/stat.h> // fstat
+#include <pthread.h>  // pthread_create
+#if defined(__x86_64__)
+#include <immintrin.h> // _mm256_add_epi64
+#endif
 
 #define NEW(t) (t *)calloc(sizeof(t), 1)
 #define NEW_ARRAY(t, l) (t *)calloc(sizeof(t), l)
@@ -14,25 +24,6 @@
     return new_error(frame, "Type mismatch");             \
   };
 
-struct elem EMPTY_LIST = { 
-  .type = ELEM_TYPE_LIST,
-  .lval.value = 0,
-  .lval.next = 0
-};
-
-struct elem EMPTY_SET = { 
-  .type = ELEM_TYPE_SET,
-  .lval.value = 0,
-  .lval.next = 0 
-};
-
-struct elem EMPTY_MAP  = { 
-  .type       = ELEM_TYPE_MAP,
-  .mval.key   = 0,
-  .mval.value = 0,
-  .mval.next  = 0
-};
-
 #define DEFINE_SYM(name, text)                    \
   struct elem name  = {                           \
     .type       = ELEM_TYPE_SYM,                  \
@@ -43,31 +34,28 @@ struct elem EMPTY_MAP  = {
     return &name;                                 \
   }                                               \
 
-DEFINE_SYM(SYM_ALLOC,  alloc)
-DEFINE_SYM(SYM_ENV,    env)
-DEFINE_SYM(SYM_RHS,    rhs)
-DEFINE_SYM(SYM_LHS,    lhs)
-DEFINE_SYM(SYM_PARENT, parent)
-DEFINE_SYM(SYM_MSG,    msg)
-DEFINE_SYM(SYM_FRAME,  frame)
-DEFINE_SYM(SYM_ERROR,  error)
-DEFINE_SYM(SYM_CURR_CHAR, curr_char)
-DEFINE_SYM(SYM_EXPR, expr)
-DEFINE_SYM(SYM_POS, pos)
-DEFINE_SYM(SYM_INPUT, input)
-DEFINE_SYM(SYM_PRINTLN, println)
-
-struct elem NIL        = { 
-  .type = ELEM_TYPE_NIL,
-};
-
-struct elem TRUE        = { 
-  .type = ELEM_TYPE_TRUE,
-};
-
-struct elem FALSE        = { 
-  .type = ELEM_TYPE_FALSE,
-  .lval.value = 0,
+#define FOR_EACH_BUILTIN_SYM(X)                   \
+  X(SYM_ALLOC,  alloc)                            \
+  X(SYM_ENV,    env)                              \
+  X(SYM_RHS,    rhs)                              \
+  X(SYM_LHS,    lhs)                              \
+  X(SYM_PARENT, parent)                           \
+  X(SYM_MSG,    msg)                              \
+  X(SYM_FRAME,  frame)                            \
+  X(SYM_ERROR,  error)                            \
+  X(SYM_EXPR, expr)                               \
+  X(SYM_PRINTLN, println)                         \
+  X(SYM_CODE, code)                               \
+  X(SYM_IF, if)                                   \
+  X(SYM_PCALL, pcall)                             \
+
+FOR_EACH_BUILTIN_SYM(DEFINE_SYM)
+
+#define BUILTIN_SYM_REF(name, text) &name,
+
+struct elem *BUILTIN_SYMS[] = {
+  FOR_EACH_BUILTIN_SYM(BUILTIN_SYM_REF)
+  0
 };
 
 struct elem* frame_get(struct elem *frame, struct elem *key);
@@ -75,20 +63,43 @@ struct elem* frame_get(struct elem *frame, struct elem *key);
 struct elem *map_get(struct elem *frame, struct elem *m, struct elem *k);
 struct elem *map_set(struct elem *frame, struct elem *m, struct elem *k, struct elem *v);
 
+int is_immediate(struct elem *e) {
+  uintptr_t w = (uintptr_t)e;
+  return (w & ELEM_TAG_FIXNUM) || (w & ELEM_TAG_MASK) == ELEM_TAG_CONST;
+}
+
+int is_pair(struct elem *e) {
+  return ((uintptr_t)e & ELEM_TAG_MASK) == ELEM_TAG_LIST;
+}
+
+uint32_t elem_type(struct elem *e) {
+  uintptr_t w = (uintptr_t)e;
+  if ( w & ELEM_TAG_FIXNUM ) {
+    return ELEM_TYPE_INT;
+  }
+  switch(w & ELEM_TAG_MASK) {
+  case ELEM_TAG_CONST:
+    return w >> ELEM_TAG_BITS;
+  case ELEM_TAG_LIST:
+    return ELEM_TYPE_LIST;
+  }
+  return e->type;
+}
+
 struct elem *nil() {
-  return &NIL;
+  return ELEM_NIL;
 }
 
 struct elem *false_value() {
-  return &FALSE;
+  return ELEM_FALSE;
 }
 
 struct elem *true_value() {
-  return &TRUE;
+  return ELEM_TRUE;
 }
 
 int is_type(struct elem *e, int type) {
-  return e->type == type;
+  return elem_type(e) == type;
 }
 
 int is_nil(struct elem *e) {
@@ -104,1064 +115,10533 @@ int is_false(struct elem *frame, struct elem *expr) {
 }
 
 struct elem *empty_list() {
-  return &EMPTY_LIST;
+  return ELEM_EMPTY_LIST;
 }
 
 struct elem *empty_map() {
-  return &EMPTY_MAP;
+  return ELEM_EMPTY_MAP;
+}
+
+struct elem *empty_set() {
+  return ELEM_EMPTY_SET;
 }
 
 int list_is_empty(struct elem *t) {
-  return t == &EMPTY_LIST;
+  return t == ELEM_EMPTY_LIST;
 }
 
 int map_is_empty(struct elem *t) {
-  return t == &EMPTY_MAP;
+  return t == ELEM_EMPTY_MAP;
 }
 
 int set_is_empty(struct elem *t) {
-  return t == &EMPTY_SET;
+  return t == ELEM_EMPTY_SET;
 }
 
-struct elem *list_value(struct elem *s) {
-  return s->lval.value;
-}
-
-struct elem *list_next(struct elem *s) {
-  return s->lval.next;
+struct elem_list *pair_of(struct elem *s) {
+  return (struct elem_list *)((uintptr_t)s & ~(uintptr_t)ELEM_TAG_MASK);
 }
 
-struct elem *set_value(struct elem *s) {
-  return s->lval.value;
+struct elem *list_value(struct elem *s) {
+  return pair_of(s)->value;
 }
 
-struct elem *set_next(struct elem *s) {
-  return s->lval.next;
+struct elem *list_next(struct elem *s) {
+  return pair_of(s)->next;
 }
 
-struct elem *map_key(struct elem *s) {
-  return s->mval.key;
+// sets share the map's trie, so these take either, empty or not
+uint32_t map_count(struct elem *s) {
+  return is_immediate(s) ? 0 : s->mval.count;
 }
 
-struct elem *map_value(struct elem *s) {
-  return s->mval.value;
+struct elem *map_root(struct elem *m) {
+  return is_immediate(m) ? 0 : m->mval.root;
 }
 
-struct elem *map_next(struct elem *s) {
-  return s->mval.next;
+uint32_t set_count(struct elem *s) {
+  return map_count(s);
 }
 
 int is_list(struct elem *s) {
-  return s->type == ELEM_TYPE_LIST;
+  return is_type(s, ELEM_TYPE_LIST);
 }
 
 int is_ident(struct elem *s) {
-  return s->type == ELEM_TYPE_IDENT;
+  return is_type(s, ELEM_TYPE_IDENT);
 }
 
 int is_fn(struct elem *s) {
-  return s->type == ELEM_TYPE_FN;
-}
-
-int int_value(struct elem *e) {
-  return e->ival.value;
+  return is_type(s, ELEM_TYPE_FN);
 }
 
-int is_sym(struct elem *s) {
-  return s->type == ELEM_TYPE_SYM;
+int64_t int_value(struct elem *e) {
+  return (intptr_t)e >> 1;
 }
 
-struct elem *new_alloc_elem() {
-  struct elem  *e = NEW(struct elem);
-  e->type = ELEM_TYPE_ALLOC;
-  e->aval.alloc = NEW(struct alloc);
-  e->aval.alloc->len = 1000;
-  e->aval.alloc->tail = 0;
-  e->aval.alloc->table = NEW_ARRAY(struct elem, e->aval.alloc->len);
-  e->aval.alloc->free_list = 0;
-  return e;
+int is_fixnum(struct elem *e) {
+  return ((uintptr_t)e & ELEM_TAG_FIXNUM) != 0;
 }
 
-void free_alloc_elem(struct elem *a) {
-  int i;
-  struct elem *e;
-  for(i=0;i<a->aval.alloc->tail;++i) {
-    e = a->aval.alloc->table + i;
-    switch(e->type) {
-    case ELEM_TYPE_IDENT:
-    case ELEM_TYPE_STRING:
-    case ELEM_TYPE_SYM:
-      FREE_ARRAY(e->sval.str);
-      break;
-    }
-  }
-  FREE_ARRAY(a->aval.alloc->table);
-  FREE(a->aval.alloc);
-  FREE(a);
+int is_sym(struct elem *s) {
+  return is_type(s, ELEM_TYPE_SYM);
 }
 
-struct elem *alloc_elem(struct elem *alloc_elem) {
-  struct alloc *alloc = alloc_elem->aval.alloc;
-  struct elem *ret;
-  if ( alloc->free_list != 0 ) {
-    ret = alloc->free_list;
-    alloc->free_list = alloc->free_list->lval.next;
-    memset(ret, 0, sizeof(struct elem));
-    return ret;
-  } else {
-    if ( alloc->tail < alloc->len ) {
-      ret = alloc->table + alloc->tail++;
-      memset(ret, 0, sizeof(struct elem));
-      return ret;
-    } else {
-      ret = nil();
-    }
-  }
-  return ret;
-}
+#define ALLOC_NURSERY_CELLS  16384
+#define ALLOC_NURSERY_SPARE  16
+#define ALLOC_TLAB_CELLS     256
+#define ALLOC_MIN_THRESHOLD  16384
+#define ELEM_TYPE_FORWARD    254
+#define ELEM_TYPE_FREE       255
 
-struct elem *frame_alloc_elem(struct elem *frame) {
-  struct elem *a = map_get(frame, frame, sym_alloc());
-  return alloc_elem(a);
-}
+// the value of a young pair that has been copied, its next is the copy
+#define ELEM_FORWARD         ELEM_CONST(ELEM_TYPE_FORWARD)
 
-struct elem *new_int(struct elem *frame, int i) {
-  struct elem *ret = frame_alloc_elem(frame);
-  if ( ret != 0 ) {
-    ret->type = ELEM_TYPE_INT;
-    ret->ival.value = i;
-  }
-  return ret;
+uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
 }
 
-struct elem *new_string_like(struct elem *frame, char *s, int type) {
-  struct elem *ret = frame_alloc_elem(frame);
-  ret->type = type;
-  ret->sval.len = strlen(s) + 1;
-  ret->sval.str = NEW_ARRAY(char, ret->sval.len+1);
-  memcpy(ret->sval.str, s, ret->sval.len);
-  return ret;
+uint32_t alloc_chunk_hash(uintptr_t base) {
+  return (uint32_t)((base / ALLOC_CHUNK_BYTES) * 2654435761u);
 }
 
-struct elem *new_string(struct elem *frame, char *s) {
-  return new_string_like(frame, s, ELEM_TYPE_STRING);
+void alloc_chunk_set_insert(struct alloc_chunk_set *set, struct alloc_chunk *c) {
+  uint32_t i = alloc_chunk_hash((uintptr_t)c) & (set->len - 1);
+  while( set->table[i] != 0 ) {
+    i = (i + 1) & (set->len - 1);
+  }
+  __atomic_store_n(&set->table[i], c, __ATOMIC_RELEASE);
 }
 
-struct elem *new_ident(struct elem *frame, char *s) {
-  return new_string_like(frame, s, ELEM_TYPE_IDENT);
+/*
+ * Chunks are kept in a set by address, so any pointer can be checked for
+ * ownership. Threads look chunks up without the lock while another adds
+ * one under it: a grown table is filled before it is published, and the
+ * old one is only freed by the next collection, when no thread can be
+ * reading it. Chunks are only removed with the world stopped.
+ */
+void alloc_chunk_set_add(struct alloc *alloc, struct alloc_chunk *c) {
+  struct alloc_chunk_set *old = alloc->chunk_set, *set;
+  uint32_t len, i;
+  if ( old == 0 || 2 * (alloc->chunk_count + 1) > old->len ) {
+    len = old != 0 ? old->len * 2 : 64;
+    set = (struct alloc_chunk_set *)calloc(sizeof(struct alloc_chunk_set) + len * sizeof(struct alloc_chunk *), 1);
+    set->len = len;
+    set->retired = old;
+    for(i=0;old!=0&&i<old->len;++i) {
+      if ( old->table[i] != 0 ) {
+        alloc_chunk_set_insert(set, old->table[i]);
+      }
+    }
+    __atomic_store_n(&alloc->chunk_set, set, __ATOMIC_RELEASE);
+  }
+  alloc_chunk_set_insert(alloc->chunk_set, c);
+  alloc->chunk_count++;
 }
 
-char *c_str(struct elem *e) {
-  assert(is_type(e, ELEM_TYPE_STRING) || is_type(e, ELEM_TYPE_IDENT));
-  return e->sval.str;
+void alloc_chunk_set_free_retired(struct alloc_chunk_set *set) {
+  struct alloc_chunk_set *retired = set->retired, *next;
+  set->retired = 0;
+  for(;retired!=0;retired=next) {
+    next = retired->retired;
+    FREE(retired);
+  }
 }
 
-struct elem *new_sym(struct elem *frame, char *s) {
-  return new_string_like(frame, s, ELEM_TYPE_SYM);
+// removes c and shifts back any later entries of its probe run
+void alloc_chunk_set_remove(struct alloc *alloc, struct alloc_chunk *c) {
+  struct alloc_chunk **table = alloc->chunk_set->table;
+  uint32_t mask = alloc->chunk_set->len - 1;
+  uint32_t i = alloc_chunk_hash((uintptr_t)c) & mask, j, h;
+  while( table[i] != c ) {
+    i = (i + 1) & mask;
+  }
+  table[i] = 0;
+  for(j=(i+1)&mask;table[j]!=0;j=(j+1)&mask) {
+    h = alloc_chunk_hash((uintptr_t)table[j]) & mask;
+    if ( ((j - h) & mask) >= ((j - i) & mask) ) {
+      table[i] = table[j];
+      table[j] = 0;
+      i = j;
+    }
+  }
+  alloc->chunk_count--;
 }
 
-struct elem *new_fn(struct elem *frame, fn *fn) {
-  struct elem *ret = frame_alloc_elem(frame);
-  ret->type = ELEM_TYPE_FN;
-  ret->fval.fn = fn;
-  return ret;
+struct alloc_chunk *alloc_chunk_of(struct alloc *alloc, struct elem *e) {
+  struct alloc_chunk_set *set = __atomic_load_n(&alloc->chunk_set, __ATOMIC_ACQUIRE);
+  uintptr_t base = (uintptr_t)e & ~(uintptr_t)(ALLOC_CHUNK_BYTES - 1);
+  struct alloc_chunk *c;
+  uint32_t i;
+  if ( set == 0 ) {
+    return 0;
+  }
+  i = alloc_chunk_hash(base) & (set->len - 1);
+  while( (c = __atomic_load_n(&set->table[i], __ATOMIC_ACQUIRE)) != 0 ) {
+    if ( (uintptr_t)c == base ) {
+      return c;
+    }
+    i = (i + 1) & (set->len - 1);
+  }
+  return 0;
 }
 
-struct elem *new_root_frame() {
-  struct elem *a = new_alloc_elem();
-  struct elem *f = alloc_elem(a);
-  f->type = ELEM_TYPE_MAP;
-  f->mval.key = sym_alloc();
-  f->mval.value = a;
-  f->mval.next = empty_map();
-  return f;
+void alloc_chunk_init(struct alloc_chunk *c, struct alloc_class *k, uint32_t young) {
+  size_t header = (sizeof(struct alloc_chunk) + 63) & ~(size_t)63;
+  memset(c, 0, sizeof(struct alloc_chunk));
+  c->size = k->size;
+  c->len = (ALLOC_CHUNK_BYTES - header) / k->size;
+  c->young = young;
+  c->table = (char *)c + header;
 }
 
-void free_root_frame(struct elem *frame) {
-  free_alloc_elem(frame_get(frame, sym_alloc()));
+struct alloc_chunk *new_alloc_chunk(struct alloc *alloc, struct alloc_class *k) {
+  struct alloc_chunk *c = (struct alloc_chunk *)aligned_alloc(ALLOC_CHUNK_BYTES, ALLOC_CHUNK_BYTES);
+  alloc_chunk_init(c, k, 0);
+  c->next = k->chunks;
+  k->chunks = c;
+  alloc_chunk_set_add(alloc, c);
+  alloc->stats.capacity += c->len;
+  alloc->stats.bytes += ALLOC_CHUNK_BYTES;
+  return c;
 }
 
-struct elem *to_sym(struct elem *frame, struct elem *ident) {
-  return new_sym(frame, c_str(ident));
+// nursery chunks come from the spares left by the last minor collection if there are any
+struct alloc_chunk *new_nursery_chunk(struct alloc *alloc, struct alloc_class *k) {
+  struct alloc_chunk *c;
+  pthread_mutex_lock(&alloc->lock);
+  c = alloc->spare;
+  if ( c != 0 ) {
+    alloc->spare = c->next;
+    alloc->spare_count--;
+  } else {
+    c = (struct alloc_chunk *)aligned_alloc(ALLOC_CHUNK_BYTES, ALLOC_CHUNK_BYTES);
+    alloc_chunk_set_add(alloc, c);
+    alloc->stats.bytes += ALLOC_CHUNK_BYTES;
+  }
+  alloc_chunk_init(c, k, 1);
+  c->next = k->nursery;
+  k->nursery = c;
+  alloc->stats.capacity += c->len;
+  pthread_mutex_unlock(&alloc->lock);
+  return c;
 }
 
-struct elem *alloc_map(
-  struct elem *frame, 
-  struct elem *m, 
-  struct elem *k, 
-  struct elem *v
-) {
-  struct elem *ret = frame_alloc_elem(frame);
-  ret->type = ELEM_TYPE_MAP;
-  ret->mval.key = k;
-  ret->mval.value = v;
-  ret->mval.next = m;
-  return ret;
+struct elem *new_alloc_elem() {
+  struct elem  *e = NEW(struct elem);
+  uint32_t i;
+  e->type = ELEM_TYPE_ALLOC;
+  e->aval.alloc = NEW(struct alloc);
+  e->aval.alloc->classes[ALLOC_CLASS_PAIR].size = sizeof(struct elem_list);
+  e->aval.alloc->classes[ALLOC_CLASS_CELL].size = sizeof(struct elem);
+  for(i=ALLOC_CLASS_BYTES;i<ALLOC_CLASSES;++i) {
+    e->aval.alloc->classes[i].size = 16 << (i - ALLOC_CLASS_BYTES);
+  }
+  e->aval.alloc->root = 0;
+  e->aval.alloc->tlab.alloc = e->aval.alloc;
+  e->aval.alloc->active = 1;
+  pthread_mutex_init(&e->aval.alloc->lock, 0);
+  pthread_cond_init(&e->aval.alloc->cond, 0);
+  e->aval.alloc->threshold = ALLOC_NURSERY_CELLS;
+  e->aval.alloc->major_threshold = ALLOC_MIN_THRESHOLD;
+  return e;
 }
 
-struct elem *alloc_list(
-  struct elem *frame, 
-  struct elem *l, 
-  struct elem *v
-) {
-  struct elem *ret = frame_alloc_elem(frame);
-  ret->type = ELEM_TYPE_LIST;
-  ret->lval.value = v;
-  ret->lval.next = l;
-  return ret;
+// free cells are linked through their second word, leaving a cell's type alone
+void **cell_link(void *cell) {
+  return (void **)cell + 1;
 }
 
-struct elem *alloc_set(
-  struct elem *frame, 
-  struct elem *s, 
-  struct elem *v
-) {
-  struct elem *ret = frame_alloc_elem(frame);
-  ret->type = ELEM_TYPE_SET;
-  ret->lval.value = v;
-  ret->lval.next = s;
-  return ret;
+// the byte class for n bytes, n at most ALLOC_BYTES_MAX
+struct alloc_class *alloc_bytes_class(struct alloc *alloc, size_t n) {
+  return &alloc->classes[ALLOC_CLASS_BYTES + (n <= 16 ? 0 : 28 - __builtin_clz((uint32_t)n - 1))];
 }
 
-int list_contains(struct elem *frame, struct elem *s, struct elem *x) {
-  if ( list_is_empty(s) ) {
-    return 0;
+/*
+ * Frees n bytes from alloc_bytes or alloc_tenured_bytes, n as they were
+ * asked for. Young ones are freed with the rest of the nursery.
+ */
+void alloc_free_bytes(struct alloc *alloc, void *p, size_t n) {
+  struct alloc_chunk *c;
+  struct alloc_class *k;
+  if ( n > ALLOC_BYTES_MAX ) {
+    FREE_ARRAY(p);
+    return;
   }
-  if ( elem_eq(frame, list_value(s), x) ) {
-    return 1;
+  c = alloc_chunk_of(alloc, (struct elem *)p);
+  assert(c != 0);
+  if ( c->young ) {
+    return;
   }
-  return list_contains(frame, list_next(s), x);
+  k = alloc_bytes_class(alloc, n);
+  *cell_link(p) = k->free_list;
+  k->free_list = p;
 }
 
-int set_contains(struct elem *frame, struct elem *s, struct elem *x) {
-  if ( set_is_empty(s) ) {
+/*
+ * The memory a cell owns outside the heap, such as a bigint's limbs, in
+ * cells. It counts towards collections as that many cells would. Slices
+ * and ropes own no bytes; the string they borrow from counts for them,
+ * and short strings have theirs in the nursery, which counts them itself.
+ */
+uint64_t owned_cells(struct elem *e) {
+  size_t bytes;
+  switch(e->type) {
+  case ELEM_TYPE_STRING:
+  case ELEM_TYPE_IDENT:
+    if ( e->flags & (ELEM_FLAG_BORROWED | ELEM_FLAG_ROPE) || e->sval.len <= ALLOC_BYTES_MAX ) {
+      return 0;
+    }
+    bytes = e->sval.len;
+    break;
+  case ELEM_TYPE_BIGINT:
+    bytes = (size_t)e->bval.len * sizeof(uint64_t);
+    break;
+  case ELEM_TYPE_VECTOR:
+    bytes = (size_t)e->vval.len * sizeof(int64_t);
+    break;
+  case ELEM_TYPE_PVEC_NODE:
+    bytes = (size_t)e->pnval.len * (sizeof(struct elem *) + (e->pnval.sizes != 0 ? sizeof(uint32_t) : 0));
+    break;
+  default:
     return 0;
   }
-  if ( elem_eq(frame, set_value(s), x) ) {
-    return 1;
+  return (bytes + sizeof(struct elem) - 1) / sizeof(struct elem);
+}
+
+void free_cell(struct alloc *alloc, struct elem *e) {
+  switch(e->type) {
+  case ELEM_TYPE_FRAME:
+    e->frval.frame->next = alloc->frame_pool;
+    alloc->frame_pool = e->frval.frame;
+    break;
+  case ELEM_TYPE_IDENT:
+  case ELEM_TYPE_STRING:
+    if ( ! (e->flags & (ELEM_FLAG_BORROWED | ELEM_FLAG_ROPE)) ) {
+      alloc_free_bytes(alloc, e->sval.str, e->sval.len);
+    }
+    break;
+  case ELEM_TYPE_MAP_NODE:
+    alloc_free_bytes(alloc, e->nval.slots, (size_t)e->nval.len * sizeof(struct elem *));
+    break;
+  case ELEM_TYPE_BIGINT:
+    FREE_ARRAY(e->bval.limbs);
+    break;
+  case ELEM_TYPE_VECTOR:
+    FREE_ARRAY(e->vval.items);
+    break;
+  case ELEM_TYPE_PVEC_NODE:
+    FREE_ARRAY(e->pnval.slots);
+    FREE_ARRAY(e->pnval.sizes);
+    break;
+  case ELEM_TYPE_CODE:
+    FREE_ARRAY(e->cval.code->ops);
+    FREE_ARRAY(e->cval.code->consts);
+    FREE_ARRAY(e->cval.code->caches);
+    FREE(e->cval.code);
+    break;
   }
-  return set_contains(frame, set_next(s), x);
 }
 
-int map_contains_key(struct elem *frame, struct elem *m, struct elem *x) {
-  if ( map_is_empty(m) ) {
-    return 0;
+void free_chunk_cells(struct alloc *alloc, struct alloc_chunk *c) {
+  uint32_t i;
+  for(;c!=0;c=c->next) {
+    for(i=0;i<c->tail;++i) {
+      free_cell(alloc, (struct elem *)(c->table + (size_t)i * c->size));
+    }
   }
-  if ( elem_eq(frame, map_key(m), x) ) {
-    return 1;
+}
+
+void free_chunks(struct alloc_chunk *c) {
+  struct alloc_chunk *next;
+  for(;c!=0;c=next) {
+    next = c->next;
+    free(c);
   }
-  return map_contains_key(frame, map_next(m), x);
 }
-  
 
-int set_subset_eq(struct elem *frame, struct elem *a, struct elem *b) {
-  if ( a == b ) {
-    return 1;
+void free_alloc_elem(struct elem *a) {
+  struct alloc *alloc = a->aval.alloc;
+  struct alloc_mapping *m;
+  struct frame *f;
+  uint32_t i;
+  free_chunk_cells(alloc, alloc->classes[ALLOC_CLASS_CELL].chunks);
+  free_chunk_cells(alloc, alloc->classes[ALLOC_CLASS_CELL].nursery);
+  for(i=0;i<ALLOC_CLASSES;++i) {
+    free_chunks(alloc->classes[i].chunks);
+    free_chunks(alloc->classes[i].nursery);
   }
-  if ( list_is_empty(a) ) {
-    return 0;
+  free_chunks(alloc->spare);
+  if ( alloc->chunk_set != 0 ) {
+    alloc_chunk_set_free_retired(alloc->chunk_set);
+    FREE(alloc->chunk_set);
   }
-  if ( list_is_empty(b) ) {
-    return 0;
+  FREE_ARRAY(alloc->remembered);
+  FREE_ARRAY(alloc->owners);
+  FREE_ARRAY(alloc->tlab.owners);
+  while( alloc->frame_pool != 0 ) {
+    f = alloc->frame_pool;
+    alloc->frame_pool = f->next;
+    FREE(f);
   }
-  if ( ! set_contains(frame, list_value(a), b) ) {
-    return 0;
+  while( alloc->tlab.frame_pool != 0 ) {
+    f = alloc->tlab.frame_pool;
+    alloc->tlab.frame_pool = f->next;
+    FREE(f);
+  }
+  pthread_cond_destroy(&alloc->cond);
+  pthread_mutex_destroy(&alloc->lock);
+  while( alloc->mappings != 0 ) {
+    m = alloc->mappings;
+    alloc->mappings = m->next;
+    munmap(m->addr, m->len);
+    FREE(m);
   }
-  return list_eq(frame, list_next(a), b);
+  FREE(alloc);
+  FREE(a);
 }
 
-int set_eq(struct elem *frame, struct elem *a, struct elem *b) {
-  return set_subset_eq(frame, a, b) && set_subset_eq(frame, b, a);
+// the thread's tlab in alloc, the owning thread's unless it attached one of its own
+__thread struct alloc_tlab *TLAB = 0;
+
+struct alloc_tlab *alloc_tlab(struct alloc *alloc) {
+  struct alloc_tlab *t = TLAB;
+  return t != 0 && t->alloc == alloc ? t : &alloc->tlab;
 }
 
-int list_sublist_eq(struct elem *frame, struct elem *a, struct elem *b) {
-  if ( a == b ) {
-    return 1;
-  }
-  if ( list_is_empty(a) ) {
-    return 0;
-  }
-  if ( list_is_empty(b) ) {
-    return 1;
+/*
+ * A thread bumps cells off a nursery chunk of its own in runs of
+ * ALLOC_TLAB_CELLS, and counts each run towards the next collection once
+ * it is used up. Runs start at multiples of ALLOC_TLAB_CELLS.
+ */
+struct alloc_chunk *alloc_tlab_refill(struct alloc *alloc, struct alloc_tlab *t, struct alloc_class *k) {
+  uint32_t j = k - alloc->classes;
+  struct alloc_chunk *c = t->chunks[j];
+  if ( c != 0 ) {
+    __atomic_add_fetch(&alloc->since_collect, (c->tail - 1) % ALLOC_TLAB_CELLS + 1, __ATOMIC_RELAXED);
   }
-  if ( ! elem_eq(frame, list_value(a), list_value(b)) ) {
-    return 0;
+  if ( c == 0 || c->tail == c->len ) {
+    c = t->chunks[j] = new_nursery_chunk(alloc, k);
   }
-  return list_sublist_eq(frame, list_next(a), list_next(b));
+  t->limits[j] = c->tail + ALLOC_TLAB_CELLS < c->len ? c->tail + ALLOC_TLAB_CELLS : c->len;
+  return c;
 }
 
-int list_eq(struct elem *frame, struct elem *a, struct elem *b) {
-  if ( a == b ) {
-    return 1;
+// new cells are bumped off the thread's own nursery chunk
+void *alloc_young_cell(struct alloc *alloc, struct alloc_tlab *t, struct alloc_class *k) {
+  struct alloc_chunk *c = t->chunks[k - alloc->classes];
+  void *ret;
+  // collection only happens at safepoints, so grow rather than fail
+  if ( c == 0 || c->tail == t->limits[k - alloc->classes] ) {
+    c = alloc_tlab_refill(alloc, t, k);
   }
-  if ( list_is_empty(a) ) {
-    return 0;
+  ret = c->table + (size_t)c->tail++ * c->size;
+  memset(ret, 0, k->size);
+  return ret;
+}
+
+void *alloc_cell(struct alloc *alloc, struct alloc_class *k) {
+  struct alloc_tlab *t = alloc_tlab(alloc);
+  t->allocated++;
+  return alloc_young_cell(alloc, t, k);
+}
+
+// n zeroed bytes for a young cell to own, bumped off the nursery if they fit a byte class
+void *alloc_bytes(struct alloc *alloc, size_t n) {
+  if ( n > ALLOC_BYTES_MAX ) {
+    return NEW_ARRAY(char, n);
   }
-  if ( list_is_empty(b) ) {
-    return 0;
+  return alloc_young_cell(alloc, alloc_tlab(alloc), alloc_bytes_class(alloc, n));
+}
+
+// a cell in the old generation, for survivors and cells known to live long, called with the lock held or the world stopped
+void *alloc_tenured_cell(struct alloc *alloc, struct alloc_class *k) {
+  struct alloc_chunk *c = k->chunks;
+  void *ret;
+  if ( k->free_list != 0 ) {
+    ret = k->free_list;
+    k->free_list = *cell_link(ret);
+  } else {
+    if ( c == 0 || c->tail == c->len ) {
+      c = new_alloc_chunk(alloc, k);
+    }
+    ret = c->table + (size_t)c->tail++ * c->size;
   }
-  if ( ! elem_eq(frame, list_value(a), list_value(b)) ) {
-    return 0;
+  memset(ret, 0, k->size);
+  return ret;
+}
+
+// the same for an old cell, under the same conditions as alloc_tenured_cell
+void *alloc_tenured_bytes(struct alloc *alloc, size_t n) {
+  if ( n > ALLOC_BYTES_MAX ) {
+    return NEW_ARRAY(char, n);
   }
-  return list_eq(frame, list_value(a), list_value(b)); 
+  return alloc_tenured_cell(alloc, alloc_bytes_class(alloc, n));
 }
 
-int map_submap_eq(struct elem *frame, struct elem *a, struct elem *b) {
-  if ( map_is_empty(a) ) {
-    return 1;
+void alloc_owners_add(struct elem ***owners, uint32_t *len, uint32_t *cap, struct elem *e) {
+  if ( *len == *cap ) {
+    *cap = *cap ? *cap * 2 : 64;
+    *owners = (struct elem **)realloc(*owners, *cap * sizeof(struct elem *));
   }
-  struct elem *key = a->mval.key;
-  struct elem *value = a->mval.value;
-  return elem_eq(frame, map_get(frame, b, key), value) && map_submap_eq(frame, map_next(a), b);
+  (*owners)[(*len)++] = e;
 }
 
-int map_eq(struct elem *frame, struct elem *a, struct elem *b) {
-  return map_submap_eq(frame, a, b) && map_submap_eq(frame, b, a);
+/*
+ * Young cells that own memory outside the heap are listed as they are
+ * made, so a minor collection frees what the dead ones own without
+ * walking the nursery. What they own counts towards the next collection.
+ */
+void alloc_young_owner(struct alloc *alloc, struct elem *e) {
+  struct alloc_tlab *t = alloc_tlab(alloc);
+  alloc_owners_add(&t->owners, &t->owners_len, &t->owners_cap, e);
+  __atomic_add_fetch(&alloc->since_collect, owned_cells(e), __ATOMIC_RELAXED);
 }
 
-int ival_eq(struct elem *frame, struct elem *a, struct elem *b) {
-  return a->ival.value == b->ival.value;
+struct elem *alloc_elem(struct elem *alloc_elem) {
+  struct alloc *alloc = alloc_elem->aval.alloc;
+  return (struct elem *)alloc_cell(alloc, &alloc->classes[ALLOC_CLASS_CELL]);
 }
 
-int sval_eq(struct elem *frame, struct elem *a, struct elem *b) {
-  int i;
-  if ( a->sval.len != b->sval.len ) {
-    return 0;
-  }
-  for(i=0;i<a->sval.len;++i) {
-    if (a->sval.str[i] != b->sval.str[i]) {
-      return 0;
-    }
-  }
-  return 1;
+struct elem *alloc_tenured_elem(struct elem *alloc_elem) {
+  struct alloc *alloc = alloc_elem->aval.alloc;
+  struct elem *ret;
+  pthread_mutex_lock(&alloc->lock);
+  ret = (struct elem *)alloc_tenured_cell(alloc, &alloc->classes[ALLOC_CLASS_CELL]);
+  pthread_mutex_unlock(&alloc->lock);
+  return ret;
 }
 
-int elem_eq(struct elem *frame, struct elem *a, struct elem *b) {
-  if ( a == b ) {
-    return 1;
+// a pair is only its two fields, the type is in the tag of pointers to it
+struct elem *alloc_pair(struct elem *alloc_elem, uintptr_t tag, struct elem *value, struct elem *next) {
+  struct alloc *alloc = alloc_elem->aval.alloc;
+  struct elem_list *p = (struct elem_list *)alloc_cell(alloc, &alloc->classes[ALLOC_CLASS_PAIR]);
+  p->value = value;
+  p->next = next;
+  return (struct elem *)((uintptr_t)p | tag);
+}
+
+/*
+ * The write barrier. An old cell that is changed to point at young cells
+ * must be recorded so the next minor collection treats it as a root. The
+ * flag makes repeat calls cheap until then, and is set under the lock so
+ * two threads changing one cell record it once.
+ */
+void alloc_remember(struct alloc *alloc, struct elem *e) {
+  struct alloc_chunk *c;
+  if ( __atomic_load_n(&e->flags, __ATOMIC_RELAXED) & ELEM_FLAG_REMEMBERED ) {
+    return;
   }
-  if ( a->type != b->type ) {
-    return 0;
+  c = alloc_chunk_of(alloc, e);
+  if ( c == 0 || c->young ) {
+    return;
   }
-  switch(a->type) {
-  case ELEM_TYPE_NIL:
-    return 0;
-  case ELEM_TYPE_INT:
-    return ival_eq(frame, a, b);
-  case ELEM_TYPE_LIST:
-    return list_eq(frame, a, b);
-  case ELEM_TYPE_SYM:
-  case ELEM_TYPE_IDENT:
-  case ELEM_TYPE_STRING:
-    return sval_eq(frame, a, b);
-  case ELEM_TYPE_ERROR:
-    return 0;
-  case ELEM_TYPE_SET:
-    return set_eq(frame, a, b);
-  case ELEM_TYPE_MAP:
-    return map_eq(frame, a, b);
-  case ELEM_TYPE_FN:
-    return 0;
-  default:
-    abort(); // invalid type
+  pthread_mutex_lock(&alloc->lock);
+  if ( ! (__atomic_fetch_or(&e->flags, ELEM_FLAG_REMEMBERED, __ATOMIC_RELAXED) & ELEM_FLAG_REMEMBERED) ) {
+    if ( alloc->remembered_len == alloc->remembered_cap ) {
+      alloc->remembered_cap = alloc->remembered_cap ? alloc->remembered_cap * 2 : 64;
+      alloc->remembered = (struct elem **)realloc(alloc->remembered, 
+        alloc->remembered_cap * sizeof(struct elem *));
+    }
+    alloc->remembered[alloc->remembered_len++] = e;
   }
-  return 0;
+  pthread_mutex_unlock(&alloc->lock);
 }
 
-struct elem *map_get(struct elem *frame, struct elem *m, struct elem *k) {
-  while(! map_is_empty(m)) {
-    if ( elem_eq(frame, k, map_key(m)) ) {
-      return map_value(m);
-    }
-    m = map_next(m);
+struct mark_stack {
+  uint32_t len;
+  uint32_t tail;
+  struct elem **table;
+};
+
+void mark_stack_push(struct mark_stack *s, struct elem *e) {
+  if ( s->tail == s->len ) {
+    s->len = s->len ? s->len * 2 : 256;
+    s->table = (struct elem **)realloc(s->table, s->len * sizeof(struct elem *));
   }
-  return nil();
+  s->table[s->tail++] = e;
 }
 
-struct elem *map_set(
-  struct elem *frame, 
-  struct elem *m, 
-  struct elem *k, 
-  struct elem *v
-) {
-  return alloc_map(frame, m, k, v);
+typedef struct elem *(alloc_visit)(struct alloc *alloc, struct mark_stack *s, struct elem *e);
+
+// passes each cell e points to through visit, storing back what it returns
+void alloc_trace(struct alloc *alloc, struct mark_stack *s, struct elem *e, alloc_visit *visit) {
+  struct elem_list *p;
+  struct frame *f;
+  uint32_t i;
+  if ( is_pair(e) ) {
+    p = pair_of(e);
+    p->value = visit(alloc, s, p->value);
+    p->next = visit(alloc, s, p->next);
+    return;
+  }
+  switch(e->type) {
+  case ELEM_TYPE_MAP:
+  case ELEM_TYPE_SET:
+    e->mval.root = visit(alloc, s, e->mval.root);
+    break;
+  case ELEM_TYPE_MAP_NODE:
+    for(i=0;i<e->nval.len;++i) {
+      e->nval.slots[i] = visit(alloc, s, e->nval.slots[i]);
+    }
+    break;
+  case ELEM_TYPE_FRAME:
+    f = e->frval.frame;
+    f->lhs = visit(alloc, s, f->lhs);
+    f->rhs = visit(alloc, s, f->rhs);
+    f->parent = visit(alloc, s, f->parent);
+    f->env = visit(alloc, s, f->env);
+    f->ext = visit(alloc, s, f->ext);
+    break;
+  case ELEM_TYPE_CODE:
+    for(i=0;i<e->cval.code->nconsts;++i) {
+      e->cval.code->consts[i] = visit(alloc, s, e->cval.code->consts[i]);
+    }
+    for(i=0;i<2*e->cval.code->ncaches;++i) {
+      e->cval.code->caches[i] = visit(alloc, s, e->cval.code->caches[i]);
+    }
+    break;
+  case ELEM_TYPE_VECTOR:
+    for(i=0;e->vval.kind==VECTOR_ELEMS&&i<e->vval.len;++i) {
+      e->vval.items[i] = visit(alloc, s, e->vval.items[i]);
+    }
+    break;
+  case ELEM_TYPE_PVEC:
+    e->pval.root = visit(alloc, s, e->pval.root);
+    e->pval.tail = visit(alloc, s, e->pval.tail);
+    break;
+  case ELEM_TYPE_PVEC_NODE:
+    for(i=0;i<e->pnval.len;++i) {
+      e->pnval.slots[i] = visit(alloc, s, e->pnval.slots[i]);
+    }
+    break;
+  case ELEM_TYPE_ERROR:
+    e->eval.map = visit(alloc, s, e->eval.map);
+    break;
+  case ELEM_TYPE_STRING:
+    if ( e->flags & ELEM_FLAG_ROPE ) {
+      e->rval.left = visit(alloc, s, e->rval.left);
+      e->rval.right = visit(alloc, s, e->rval.right);
+    } else {
+      e->sval.owner = visit(alloc, s, e->sval.owner);
+    }
+    break;
+  case ELEM_TYPE_FN:
+    e->fval.args = visit(alloc, s, e->fval.args);
+    e->fval.expr = visit(alloc, s, e->fval.expr);
+    break;
+  }
 }
 
-struct elem *list_add(
-  struct elem *frame,
-  struct elem *l,
-  struct elem *v
-) {
-  return alloc_list(frame, l, v);
+// the bytes a cell moved out of the nursery owns follow it to the old generation
+void *alloc_move_bytes(struct alloc *alloc, void *p, size_t n) {
+  void *ret;
+  if ( n > ALLOC_BYTES_MAX ) {
+    return p;
+  }
+  ret = alloc_tenured_cell(alloc, alloc_bytes_class(alloc, n));
+  memcpy(ret, p, n);
+  alloc->promoted++;
+  return ret;
 }
 
-struct elem *set_add(
-  struct elem *frame,
-  struct elem *s,
-  struct elem *v
-) {
-  if ( ! set_contains(frame, s, v) ) {
-    return alloc_set(frame, s, v);
-  } else {
-    return s;
+void alloc_evacuate_bytes(struct alloc *alloc, struct elem *e) {
+  switch(e->type) {
+  case ELEM_TYPE_MAP_NODE:
+    e->nval.slots = (struct elem **)alloc_move_bytes(alloc, e->nval.slots, (size_t)e->nval.len * sizeof(struct elem *));
+    break;
+  case ELEM_TYPE_IDENT:
+  case ELEM_TYPE_STRING:
+    if ( ! (e->flags & (ELEM_FLAG_BORROWED | ELEM_FLAG_ROPE)) ) {
+      e->sval.str = (char *)alloc_move_bytes(alloc, e->sval.str, e->sval.len);
+    }
+    break;
   }
 }
 
-struct elem* trim_map(struct elem *frame, struct elem* m) {
-  struct elem *r  = empty_map();
-  struct elem *k;
-
-  while( ! map_is_empty(m) ) {
-    k = map_key(m);
-    if ( ! map_contains_key(frame, r, k) ) {
-      r = map_set(frame, r, k, map_value(m));
+// copies a young cell to the old generation and leaves its new address behind
+struct elem *alloc_evacuate(struct alloc *alloc, struct mark_stack *s, struct elem *e) {
+  struct alloc_chunk *c;
+  struct elem_list *p, *q;
+  struct elem *ret;
+  if ( e == 0 || is_immediate(e) ) {
+    return e;
+  }
+  c = alloc_chunk_of(alloc, e);
+  if ( c == 0 || ! c->young ) {
+    return e;
+  }
+  if ( is_pair(e) ) {
+    p = pair_of(e);
+    if ( p->value == ELEM_FORWARD ) {
+      return p->next;
+    }
+    q = (struct elem_list *)alloc_tenured_cell(alloc, &alloc->classes[ALLOC_CLASS_PAIR]);
+    *q = *p;
+    ret = (struct elem *)((uintptr_t)q | ((uintptr_t)e & ELEM_TAG_MASK));
+    p->value = ELEM_FORWARD;
+    p->next = ret;
+  } else {
+    if ( e->type == ELEM_TYPE_FORWARD ) {
+      return e->forward;
     }
-    m = map_next(m);
+    ret = (struct elem *)alloc_tenured_cell(alloc, &alloc->classes[ALLOC_CLASS_CELL]);
+    *ret = *e;
+    e->type = ELEM_TYPE_FORWARD;
+    e->forward = ret;
+    alloc_evacuate_bytes(alloc, ret);
+    alloc->promoted += owned_cells(ret);
   }
+  alloc->promoted++;
+  alloc->stats.promoted++;
+  mark_stack_push(s, ret);
+  return ret;
+}
 
-  return r;
+// sets e's mark bit in its chunk's bitmap, returning 0 if it was already set
+int alloc_set_mark(struct alloc_chunk *c, struct elem *e) {
+  uint32_t i = (((uintptr_t)e & ~(uintptr_t)ELEM_TAG_MASK) - (uintptr_t)c->table) / c->size;
+  uint64_t bit = 1ull << (i % 64);
+  if ( c->marks[i / 64] & bit ) {
+    return 0;
+  }
+  c->marks[i / 64] |= bit;
+  return 1;
 }
 
-struct elem* env_set(struct elem *frame, struct elem *key, struct elem *value) {
-  struct elem* env = map_get(frame, frame, sym_env());
-  env = map_set(frame, env, key, value);
-  return map_set(frame, frame, sym_env(), env);
+struct elem *mark_push(struct alloc *alloc, struct mark_stack *s, struct elem *e) {
+  struct alloc_chunk *c;
+  if ( e == 0 || is_immediate(e) ) {
+    return e;
+  }
+  c = alloc_chunk_of(alloc, e);
+  if ( c != 0 && ! c->young && alloc_set_mark(c, e) ) {
+    mark_stack_push(s, e);
+  }
+  return e;
 }
 
-struct elem* env_get(struct elem *frame, struct elem *key) {
-  struct elem* env = map_get(frame, frame, sym_env());
-  return map_get(frame, env, key);
+void alloc_mark(struct alloc *alloc, struct elem *root) {
+  struct mark_stack s = { 0, 0, 0 };
+  mark_push(alloc, &s, root);
+  while( s.tail > 0 ) {
+    alloc_trace(alloc, &s, s.table[--s.tail], mark_push);
+  }
+  FREE_ARRAY(s.table);
 }
 
-struct elem* frame_set(struct elem *frame, struct elem *key, struct elem *value) {
-  return map_set(frame, frame, key, value);
+/*
+ * Unmarked cells go back on their class's free list, marks are cleared.
+ * The byte classes are never marked, what a dead cell owns is put back
+ * on their free lists as the cell is freed.
+ */
+uint64_t alloc_sweep(struct alloc *alloc) {
+  struct alloc_class *k;
+  struct alloc_chunk *c;
+  struct elem *e;
+  uint64_t live = 0;
+  int i, j;
+  for(j=0;j<ALLOC_CLASS_BYTES;++j) {
+    k = alloc->classes + j;
+    k->free_list = 0;
+    for(c=k->chunks;c!=0;c=c->next) {
+      for(i=c->tail-1;i>=0;--i) {
+        if ( c->marks[i / 64] & (1ull << (i % 64)) ) {
+          live++;
+          continue;
+        }
+        e = (struct elem *)(c->table + (size_t)i * c->size);
+        if ( j == ALLOC_CLASS_CELL && e->type != ELEM_TYPE_FREE ) {
+          free_cell(alloc, e);
+          e->type = ELEM_TYPE_FREE;
+        }
+        *cell_link(e) = k->free_list;
+        k->free_list = e;
+      }
+      memset(c->marks, 0, sizeof(c->marks));
+    }
+  }
+  return live;
 }
 
-struct elem* frame_get(struct elem *frame, struct elem *key) {
-  return map_get(frame, frame, key);
+// listed owners the copy did not reach are dead, the copies of the rest own what they did
+void alloc_free_owners(struct alloc *alloc, struct elem **owners, uint32_t len) {
+  uint32_t i;
+  for(i=0;i<len;++i) {
+    if ( owners[i]->type != ELEM_TYPE_FORWARD ) {
+      free_cell(alloc, owners[i]);
+    }
+  }
 }
 
-struct elem* new_child_frame(struct elem* frame, 
-                             struct elem *e) {
-  struct elem* nf = empty_map();
-  nf = map_set(frame, nf, sym_parent(), frame);
-  nf = map_set(frame, nf, sym_env(), frame_get(frame, sym_env()));
-  nf = map_set(frame, nf, sym_lhs(), empty_list());
-  nf = map_set(frame, nf, sym_rhs(), e);
-  nf = map_set(frame, nf, sym_alloc(), frame_get(frame, sym_alloc()));
-  return nf;
+void alloc_reset_nursery(struct alloc *alloc) {
+  struct alloc_chunk *c, *next;
+  struct alloc_tlab *t;
+  struct alloc_class *k;
+  uint32_t j;
+  for(t=&alloc->tlab;t!=0;t=t->next) {
+    alloc_free_owners(alloc, t->owners, t->owners_len);
+    t->owners_len = 0;
+  }
+  alloc_free_owners(alloc, alloc->owners, alloc->owners_len);
+  alloc->owners_len = 0;
+  for(j=0;j<ALLOC_CLASSES;++j) {
+    k = alloc->classes + j;
+    for(c=k->nursery;c!=0;c=next) {
+      next = c->next;
+      alloc->stats.capacity -= c->len;
+      if ( alloc->spare_count < ALLOC_NURSERY_SPARE ) {
+        c->next = alloc->spare;
+        alloc->spare = c;
+        alloc->spare_count++;
+      } else {
+        alloc_chunk_set_remove(alloc, c);
+        alloc->stats.bytes -= ALLOC_CHUNK_BYTES;
+        free(c);
+      }
+    }
+    k->nursery = 0;
+  }
+  for(t=&alloc->tlab;t!=0;t=t->next) {
+    memset(t->chunks, 0, sizeof(t->chunks));
+  }
 }
 
-struct elem *new_error(struct elem *frame, char *str) {
-  struct elem *e = frame_alloc_elem(frame);
-  struct elem *m = empty_map();
+struct frame *frame_of(struct elem *frame) {
+  return frame->frval.frame;
+}
 
-  m = map_set(frame, m, sym_msg(), new_string(frame, str));
-  m = map_set(frame, m, sym_frame(), frame);
-  
-  e->type = ELEM_TYPE_ERROR;
-  e->eval.map = m;
-  
-  return e;
+struct alloc *frame_alloc(struct elem *frame) {
+  return frame_of(frame)->alloc->aval.alloc;
 }
 
-struct elem *list_reverse(struct elem *frame, struct elem *l) {
-  struct elem *r = empty_list();
-  while( ! list_is_empty(l) ) {
-    r = list_add(frame, r, list_value(l));
-    l = list_next(l);
+// frames are updated in place, so one must be remembered before it is changed
+void frame_remember(struct elem *frame) {
+  if ( ! (__atomic_load_n(&frame->flags, __ATOMIC_RELAXED) & ELEM_FLAG_REMEMBERED) ) {
+    alloc_remember(frame_alloc(frame), frame);
   }
-  return r;
 }
 
-struct elem *frame_error(struct elem *frame, struct elem *error) {
-  abort();
+void frame_collect_stats(struct alloc *alloc, uint64_t start, uint64_t *total, uint64_t *max) {
+  uint64_t pause = now_ns() - start;
+  alloc->stats.collections++;
+  *total += pause;
+  if ( pause > *max ) {
+    *max = pause;
+  }
 }
 
-struct elem *frame_call(
-  struct elem *frame, 
-  struct elem *fn, 
-  struct elem *args
-) {
-  if ( fn->fval.fn != 0 ) {
-    struct elem *child_frame = new_child_frame(frame, args);
-    return fn->fval.fn(child_frame);
-  } else {
-    struct elem *child_frame = new_child_frame(frame, fn->fval.expr);
-    struct elem *fn_args = fn->fval.args;
-    while( ! list_is_empty(args) && ! list_is_empty(fn_args) ) {
-      env_set(child_frame, list_value(args), list_value(fn_args));
-      args = list_next(args);
-      fn_args = list_next(fn_args);
+// a collection is due, or another thread has stopped the world for one
+int alloc_collect_due(struct alloc *alloc) {
+  return __atomic_load_n(&alloc->since_collect, __ATOMIC_RELAXED) >= alloc->threshold
+    || __atomic_load_n(&alloc->collecting, __ATOMIC_RELAXED);
+}
+
+/*
+ * Waits for every other thread attached to alloc to reach a safepoint or
+ * park, returning 1 with the world stopped. If another thread got there
+ * first this one waits out its collection instead, with *frame as a root,
+ * and returns 0.
+ */
+int alloc_stop_world(struct alloc *alloc, struct elem **frame) {
+  struct alloc_tlab *t = alloc_tlab(alloc);
+  pthread_mutex_lock(&alloc->lock);
+  if ( alloc->collecting ) {
+    t->frame = *frame;
+    alloc->active--;
+    pthread_cond_broadcast(&alloc->cond);
+    while( alloc->collecting ) {
+      pthread_cond_wait(&alloc->cond, &alloc->lock);
     }
-    return child_frame;
+    alloc->active++;
+    *frame = t->frame;
+    t->frame = 0;
+    pthread_mutex_unlock(&alloc->lock);
+    return 0;
   }
+  __atomic_store_n(&alloc->collecting, 1, __ATOMIC_RELAXED);
+  while( alloc->active > 1 ) {
+    pthread_cond_wait(&alloc->cond, &alloc->lock);
+  }
+  pthread_mutex_unlock(&alloc->lock);
+  return 1;
 }
 
-struct elem *frame_eval(struct elem *frame) 
-{
-  struct elem *lhs, *rhs, *value, *fn, *parent, *args, *parent_lhs;
+void alloc_start_world(struct alloc *alloc) {
+  pthread_mutex_lock(&alloc->lock);
+  __atomic_store_n(&alloc->collecting, 0, __ATOMIC_RELAXED);
+  pthread_cond_broadcast(&alloc->cond);
+  pthread_mutex_unlock(&alloc->lock);
+}
 
-  while(1) {
+// a thread about to block stops counting towards stopping the world, its roots stay roots
+void alloc_park(struct alloc *alloc) {
+  pthread_mutex_lock(&alloc->lock);
+  alloc->active--;
+  pthread_cond_broadcast(&alloc->cond);
+  pthread_mutex_unlock(&alloc->lock);
+}
 
-    rhs = frame_get(frame, sym_rhs());
+void alloc_unpark(struct alloc *alloc) {
+  pthread_mutex_lock(&alloc->lock);
+  while( alloc->collecting ) {
+    pthread_cond_wait(&alloc->cond, &alloc->lock);
+  }
+  alloc->active++;
+  pthread_mutex_unlock(&alloc->lock);
+}
 
-    if ( ! is_list(rhs) ) {
-      frame = frame_set(frame, sym_lhs(), rhs);
-      frame = frame_set(frame, sym_rhs(), empty_list());
-      continue;
-    }
-    
-    lhs = frame_get(frame, sym_lhs());
-    if ( list_is_empty(rhs) ) {
+// a tlab for another thread to allocate in alloc with, it becomes the thread's own once TLAB is set
+struct alloc_tlab *alloc_attach(struct alloc *alloc) {
+  struct alloc_tlab *t = NEW(struct alloc_tlab);
+  t->alloc = alloc;
+  pthread_mutex_lock(&alloc->lock);
+  while( alloc->collecting ) {
+    pthread_cond_wait(&alloc->cond, &alloc->lock);
+  }
+  t->next = alloc->tlab.next;
+  alloc->tlab.next = t;
+  alloc->active++;
+  pthread_mutex_unlock(&alloc->lock);
+  return t;
+}
 
-      if ( is_list(lhs) ) {
-        if ( ! list_is_empty(lhs) ) {
-          lhs = list_reverse(frame, lhs);
-          fn = list_value(lhs);
-          args = list_next(lhs);
-          if ( ! is_fn(fn) ) {
-            return frame_error(frame, new_error(frame, "Expected function"));
-          }
-          frame = frame_call(frame, fn, args);
-          continue;
-        }
-      }
+// the thread must hold no young cells by then, what it allocated stays in the alloc
+void alloc_detach(struct alloc_tlab *t) {
+  struct alloc *alloc = t->alloc;
+  struct alloc_tlab **p;
+  struct frame *f;
+  uint32_t i;
+  pthread_mutex_lock(&alloc->lock);
+  for(p=&alloc->tlab.next;*p!=t;p=&(*p)->next) {
+  }
+  *p = t->next;
+  for(i=0;i<t->owners_len;++i) {
+    alloc_owners_add(&alloc->owners, &alloc->owners_len, &alloc->owners_cap, t->owners[i]);
+  }
+  FREE_ARRAY(t->owners);
+  alloc->stats.allocated += t->allocated;
+  alloc->stats.safepoints += t->safepoints;
+  while( t->frame_pool != 0 ) {
+    f = t->frame_pool;
+    t->frame_pool = f->next;
+    f->next = alloc->frame_pool;
+    __atomic_store_n(&alloc->frame_pool, f, __ATOMIC_RELAXED);
+  }
+  alloc->active--;
+  pthread_cond_broadcast(&alloc->cond);
+  pthread_mutex_unlock(&alloc->lock);
+  FREE(t);
+}
 
-      // return from current frame
-      parent = frame_get(frame, sym_parent());
-      if ( is_nil(parent) ) {
-        return frame_get(frame, sym_lhs());
+/*
+ * Minor collection, with the world stopped. Young cells reachable from
+ * the frame, the frames of parked threads, the ranges each thread pushed
+ * on its roots and the remembered old cells are copied to the old
+ * generation, and the whole nursery is then free.
+ */
+struct elem *alloc_collect_young(struct alloc *alloc, struct elem *frame) {
+  struct mark_stack s = { 0, 0, 0 };
+  struct alloc_roots *roots;
+  struct alloc_tlab *t;
+  uint64_t start = now_ns(), promoted = alloc->promoted;
+  uint32_t i;
+  frame = alloc_evacuate(alloc, &s, frame);
+  for(t=&alloc->tlab;t!=0;t=t->next) {
+    t->frame = alloc_evacuate(alloc, &s, t->frame);
+    for(roots=t->roots;roots!=0;roots=roots->next) {
+      for(i=0;i<roots->len;++i) {
+        roots->table[i] = alloc_evacuate(alloc, &s, roots->table[i]);
       }
-
-      parent_lhs = frame_get(parent, sym_lhs());
-      parent_lhs = list_add(parent, parent_lhs, lhs);
-      frame      = frame_set(parent, sym_lhs(), parent_lhs);
-      continue;
     }
+  }
+  for(i=0;i<alloc->remembered_len;++i) {
+    alloc_trace(alloc, &s, alloc->remembered[i], alloc_evacuate);
+    alloc->remembered[i]->flags &= ~ELEM_FLAG_REMEMBERED;
+  }
+  alloc->remembered_len = 0;
+  while( s.tail > 0 ) {
+    alloc_trace(alloc, &s, s.table[--s.tail], alloc_evacuate);
+  }
+  FREE_ARRAY(s.table);
+  alloc_reset_nursery(alloc);
+  // no thread is looking a chunk up now
+  alloc_chunk_set_free_retired(alloc->chunk_set);
+  alloc->stats.live += alloc->promoted - promoted;
+  __atomic_store_n(&alloc->since_collect, 0, __ATOMIC_RELAXED);
+  alloc->stats.minor_collections++;
+  frame_collect_stats(alloc, start, &alloc->stats.minor_pause_ns, &alloc->stats.max_minor_pause_ns);
+  return frame;
+}
 
-    value = list_value(rhs);
-    rhs = list_next(rhs);
-    
-    if ( is_list(value) ) {
-      frame = frame_set(frame, sym_rhs(), rhs); 
-      frame = new_child_frame(frame, value);
-      continue;
-    }
-    
-    if ( is_ident(value) ) {
-      value = env_get(frame, to_sym(frame, value));
+/*
+ * Full collection: a minor collection to empty the nursery, then mark
+ * and sweep of the old generation from the same roots.
+ */
+struct elem *alloc_collect_full(struct alloc *alloc, struct elem *frame) {
+  struct alloc_roots *roots;
+  struct alloc_tlab *t;
+  uint64_t start;
+  uint32_t i;
+  frame = alloc_collect_young(alloc, frame);
+  start = now_ns();
+  alloc_mark(alloc, frame);
+  alloc_mark(alloc, alloc->root);
+  for(t=&alloc->tlab;t!=0;t=t->next) {
+    alloc_mark(alloc, t->frame);
+    for(roots=t->roots;roots!=0;roots=roots->next) {
+      for(i=0;i<roots->len;++i) {
+        alloc_mark(alloc, roots->table[i]);
+      }
     }
-    
-    lhs = list_add(frame, lhs, value);
-    frame = frame_set(frame, sym_lhs(), lhs);
-    frame = frame_set(frame, sym_rhs(), rhs);
   }
+  alloc->stats.live = alloc_sweep(alloc);
+  alloc->promoted = 0;
+  alloc->major_threshold = alloc->stats.live < ALLOC_MIN_THRESHOLD ? ALLOC_MIN_THRESHOLD : alloc->stats.live;
+  frame_collect_stats(alloc, start, &alloc->stats.pause_ns, &alloc->stats.max_pause_ns);
+  return frame;
 }
 
-void elem_print(struct elem *frame, FILE *out, struct elem *l);
+/*
+ * Cells move, so these return the frame's new address, and must only be
+ * called where no other young cells are held in C locals.
+ */
+struct elem *frame_collect_young(struct elem *frame) {
+  struct alloc *alloc = frame_alloc(frame);
+  while( ! alloc_stop_world(alloc, &frame) ) {
+  }
+  frame = alloc_collect_young(alloc, frame);
+  alloc_start_world(alloc);
+  return frame;
+}
 
-void list_print(struct elem *frame, FILE *out, struct elem *l) {
-  int first = 1;
-  fprintf(out, "(");
-  while(! list_is_empty(l)) {
-    if ( first ) {
-      first = 0;
-    } else {
-      fprintf(out, " ");
-    }
-    elem_print(frame, out, list_value(l));
-    l = list_next(l);
+struct elem *frame_collect(struct elem *frame) {
+  struct alloc *alloc = frame_alloc(frame);
+  while( ! alloc_stop_world(alloc, &frame) ) {
   }
-  fprintf(out, ")");
+  frame = alloc_collect_full(alloc, frame);
+  alloc_start_world(alloc);
+  return frame;
 }
 
-void set_print(struct elem *frame, FILE *out, struct elem *l) {
-  fprintf(out, "#{");
-  int first = 1;
-  while(! set_is_empty(l)) {
-    if ( first ) {
-      first = 0;
-    } else {
-      fprintf(out, " ");
-    }
-    elem_print(frame, out, set_value(l));
-    l = set_next(l);
+/*
+ * A minor collection, or a full one once as much has been promoted as was
+ * live after the last. Nothing is left to do if another thread collected
+ * while this one waited.
+ */
+struct elem *frame_collect_due(struct elem *frame) {
+  struct alloc *alloc = frame_alloc(frame);
+  if ( ! alloc_stop_world(alloc, &frame) ) {
+    return frame;
+  }
+  if ( alloc->promoted >= alloc->major_threshold ) {
+    frame = alloc_collect_full(alloc, frame);
+  } else if ( alloc->since_collect >= alloc->threshold ) {
+    frame = alloc_collect_young(alloc, frame);
   }
-  fprintf(out, "}");
+  alloc_start_world(alloc);
+  return frame;
 }
 
-void map_print(struct elem *frame, FILE *out, struct elem *l) {
-  int first = 1;
-  fprintf(out, "{");
-  while(! map_is_empty(l)) {
-    if ( first ) {
-      first = 0;
-    } else {
-      fprintf(out, " ");
-    }
-    elem_print(frame, out, map_key(l));
-    fprintf(out, " ");
-    elem_print(frame, out, map_value(l));
-    l = map_next(l);
+struct elem *frame_safepoint(struct elem *frame) {
+  struct alloc *alloc = frame_alloc(frame);
+  alloc_tlab(alloc)->safepoints++;
+  if ( alloc_collect_due(alloc) ) {
+    frame = frame_collect_due(frame);
   }
-  fprintf(out, "}");
+  return frame;
 }
 
-void sval_print(struct elem *frame, FILE *out, struct elem *s) {
-  fprintf(out, "%s", s->sval.str);
+// cells in the table are roots until popped, and are updated if they move
+void frame_push_roots(struct elem *frame, struct alloc_roots *roots) {
+  struct alloc_tlab *t = alloc_tlab(frame_alloc(frame));
+  roots->next = t->roots;
+  t->roots = roots;
 }
 
-void string_print(struct elem *frame, FILE *out, struct elem *s) {
-  fprintf(out, "\"");
-  sval_print(frame, out, s);
-  fprintf(out, "\"");
+void frame_pop_roots(struct elem *frame, struct alloc_roots *roots) {
+  alloc_tlab(frame_alloc(frame))->roots = roots->next;
 }
 
-void ident_print(struct elem *frame, FILE *out, struct elem *s) {
-  sval_print(frame, out, s);
+// where println writes, stdout unless the thread has been given a stream
+FILE *frame_out(struct elem *frame) {
+  FILE *out = alloc_tlab(frame_alloc(frame))->out;
+  return out != 0 ? out : stdout;
 }
 
-void error_print(struct elem *frame, FILE *out, struct elem *s) {
-  fprintf(out, "<err:");
-  elem_print(frame, out, s->eval.map);
-  fprintf(out, ">");
+void frame_alloc_stats(struct elem *frame, struct alloc_stats *stats) {
+  struct alloc *alloc = frame_alloc(frame);
+  struct alloc_tlab *t;
+  pthread_mutex_lock(&alloc->lock);
+  *stats = alloc->stats;
+  for(t=&alloc->tlab;t!=0;t=t->next) {
+    stats->allocated += t->allocated;
+    stats->safepoints += t->safepoints;
+  }
+  pthread_mutex_unlock(&alloc->lock);
 }
 
-void sym_print(struct elem *frame, FILE *out, struct elem *s) {
-  fprintf(out, ":");
-  sval_print(frame, out, s);
+struct elem *frame_alloc_elem(struct elem *frame) {
+  return alloc_elem(frame_of(frame)->alloc);
 }
 
-void fn_print(struct elem *frame, FILE *out, struct elem *e) {
-  fprintf(out, "<fn:%p>", e->fval.fn);
+// ints are immediate, so making one never allocates; i must be a fixnum
+struct elem *new_int(struct elem *frame, int64_t i) {
+  return ELEM_FIXNUM(i);
 }
 
-struct elem *elem_read(struct elem *frame);
-struct elem *map_read(struct elem *frame);
-struct elem *list_read(struct elem *frame);
-struct elem *string_read(struct elem *frame);
-struct elem *ident_read(struct elem *frame);
-struct elem *symbol_read(struct elem *frame);
+/*
+ * Bigints hold ints outside the fixnum range as a sign and a magnitude
+ * of 64 bit limbs, least significant first and with no leading zero
+ * limb. Results that fit a fixnum are always made fixnums, so the two
+ * never overlap and equal ints are equal as elems.
+ *
+ * The mag_ functions work on bare magnitudes. Their results go to limbs
+ * the caller provides, long enough for any result.
+ */
+#define KARATSUBA_LIMBS 32
+
+int mag_cmp(const uint64_t *a, uint32_t alen, const uint64_t *b, uint32_t blen) {
+  if ( alen != blen ) {
+    return alen < blen ? -1 : 1;
+  }
+  while( alen-- > 0 ) {
+    if ( a[alen] != b[alen] ) {
+      return a[alen] < b[alen] ? -1 : 1;
+    }
+  }
+  return 0;
+}
 
-struct elem *reader_set_expr(struct elem *frame, struct elem *expr) {
-  return frame_set(frame, sym_expr(), expr);
+uint32_t mag_trim(const uint64_t *a, uint32_t len) {
+  while( len > 0 && a[len - 1] == 0 ) {
+    len--;
+  }
+  return len;
 }
 
-struct elem *reader_get_expr(struct elem *frame) {
-  return frame_get(frame, sym_expr());
+// r = a + b, r has room for max(alen, blen) + 1 limbs
+uint32_t mag_add(uint64_t *r, const uint64_t *a, uint32_t alen, const uint64_t *b, uint32_t blen) {
+  uint64_t carry = 0, x, y;
+  uint32_t i, len = alen > blen ? alen : blen;
+  for(i=0;i<len;++i) {
+    x = i < alen ? a[i] : 0;
+    y = i < blen ? b[i] : 0;
+    x += carry;
+    carry = x < carry;
+    r[i] = x + y;
+    carry += r[i] < y;
+  }
+  r[len] = carry;
+  return mag_trim(r, len + 1);
 }
 
-struct elem *reader_set_error(struct elem *frame, struct elem *err) {
-  return frame_set(frame, sym_error(), err);
+// r = a - b for a >= b, r has room for alen limbs
+uint32_t mag_sub(uint64_t *r, const uint64_t *a, uint32_t alen, const uint64_t *b, uint32_t blen) {
+  uint64_t borrow = 0, x, y;
+  uint32_t i;
+  for(i=0;i<alen;++i) {
+    x = a[i];
+    y = (i < blen ? b[i] : 0) + borrow;
+    borrow = y < borrow || x < y;
+    r[i] = x - y;
+  }
+  return mag_trim(r, alen);
 }
 
-struct elem *reader_get_error(struct elem *frame) {
-  return frame_get(frame, sym_error());
+// r += a, where the sum fits in rlen limbs
+void mag_add_in(uint64_t *r, uint32_t rlen, const uint64_t *a, uint32_t alen) {
+  uint64_t carry = 0, x;
+  uint32_t i;
+  for(i=0;i<rlen&&(i<alen||carry!=0);++i) {
+    x = r[i] + carry;
+    carry = x < carry;
+    if ( i < alen ) {
+      x += a[i];
+      carry += x < a[i];
+    }
+    r[i] = x;
+  }
 }
 
-struct elem *reader_set_curr_char(struct elem *frame, struct elem *c) {
-  return frame_set(frame, sym_curr_char(), c);
+// r -= a, where r >= a
+void mag_sub_in(uint64_t *r, uint32_t rlen, const uint64_t *a, uint32_t alen) {
+  uint64_t borrow = 0, y;
+  uint32_t i;
+  for(i=0;i<rlen&&(i<alen||borrow!=0);++i) {
+    y = (i < alen ? a[i] : 0) + borrow;
+    borrow = y < borrow || r[i] < y;
+    r[i] -= y;
+  }
 }
 
-struct elem *reader_get_curr_char(struct elem *frame) {
-  return frame_get(frame, sym_curr_char());
+// r = a * b, r has room for alen + blen limbs
+void mag_mul_school(uint64_t *r, const uint64_t *a, uint32_t alen, const uint64_t *b, uint32_t blen) {
+  unsigned __int128 t;
+  uint64_t carry;
+  uint32_t i, j;
+  memset(r, 0, (size_t)(alen + blen) * sizeof(uint64_t));
+  for(i=0;i<alen;++i) {
+    carry = 0;
+    for(j=0;j<blen;++j) {
+      t = (unsigned __int128)a[i] * b[j] + r[i + j] + carry;
+      r[i + j] = (uint64_t)t;
+      carry = (uint64_t)(t >> 64);
+    }
+    r[i + blen] = carry;
+  }
 }
 
-struct elem *reader_set_pos(struct elem *frame, struct elem *e) {
-  return frame_set(frame, sym_pos(), e);
+/*
+ * Karatsuba splits both factors at m limbs, a = a1 B^m + a0, and makes
+ * do with three products of half the size: a0 b0, a1 b1 and
+ * (a0 + a1)(b0 + b1), from which the middle term is the difference.
+ * A factor more than twice as long as the other is cut into slices of
+ * the shorter one's length first.
+ */
+void mag_mul(uint64_t *r, const uint64_t *a, uint32_t alen, const uint64_t *b, uint32_t blen) {
+  const uint64_t *t;
+  uint64_t *sa, *sb, *z1;
+  uint32_t i, m, n, salen, sblen, z1len;
+  if ( alen < blen ) {
+    t = a, a = b, b = t;
+    n = alen, alen = blen, blen = n;
+  }
+  if ( blen < KARATSUBA_LIMBS ) {
+    mag_mul_school(r, a, alen, b, blen);
+    return;
+  }
+  if ( alen >= 2 * blen ) {
+    memset(r, 0, (size_t)(alen + blen) * sizeof(uint64_t));
+    z1 = NEW_ARRAY(uint64_t, 2 * blen);
+    for(i=0;i<alen;i+=blen) {
+      n = alen - i < blen ? alen - i : blen;
+      mag_mul(z1, a + i, n, b, blen);
+      mag_add_in(r + i, alen + blen - i, z1, n + blen);
+    }
+    FREE_ARRAY(z1);
+    return;
+  }
+  m = blen / 2;
+  sa = NEW_ARRAY(uint64_t, alen - m + 1);
+  sb = NEW_ARRAY(uint64_t, blen - m + 1);
+  salen = mag_add(sa, a, mag_trim(a, m), a + m, alen - m);
+  sblen = mag_add(sb, b, mag_trim(b, m), b + m, blen - m);
+  z1 = NEW_ARRAY(uint64_t, salen + sblen + 1);
+  mag_mul(z1, sa, salen, sb, sblen);
+  z1len = mag_trim(z1, salen + sblen);
+  mag_mul(r, a, m, b, m);
+  mag_mul(r + 2 * m, a + m, alen - m, b + m, blen - m);
+  mag_sub_in(z1, z1len, r, 2 * m);
+  mag_sub_in(z1, z1len, r + 2 * m, alen + blen - 2 * m);
+  mag_add_in(r + m, alen + blen - m, z1, mag_trim(z1, z1len));
+  FREE_ARRAY(sa);
+  FREE_ARRAY(sb);
+  FREE_ARRAY(z1);
 }
 
-struct elem *reader_get_pos(struct elem *frame) {
-  return frame_get(frame, sym_pos());
+// q = a / d, returning the remainder; q has room for alen limbs
+uint64_t mag_divmod_small(uint64_t *q, const uint64_t *a, uint32_t alen, uint64_t d) {
+  unsigned __int128 t;
+  uint64_t rem = 0;
+  while( alen-- > 0 ) {
+    t = ((unsigned __int128)rem << 64) | a[alen];
+    q[alen] = (uint64_t)(t / d);
+    rem = (uint64_t)(t % d);
+  }
+  return rem;
 }
 
-struct elem *reader_set_input(struct elem *frame, struct elem *e) {
-  return frame_set(frame, sym_input(), e);
+/*
+ * Long division (Knuth's algorithm D) for divisors of two limbs or more.
+ * Both are shifted so the divisor's top limb has its high bit set, which
+ * makes each estimated quotient limb at most two too large. q has room
+ * for alen - blen + 1 limbs and r for blen.
+ */
+void mag_divmod(uint64_t *q, uint64_t *r, const uint64_t *a, uint32_t alen, const uint64_t *b, uint32_t blen) {
+  int s = __builtin_clzll(b[blen - 1]), j;
+  uint64_t *un = NEW_ARRAY(uint64_t, alen + 1), *vn = NEW_ARRAY(uint64_t, blen);
+  unsigned __int128 num, qhat, rhat, p;
+  uint64_t k, lo, top;
+  uint32_t i;
+
+  for(i=blen-1;i>0;--i) {
+    vn[i] = (b[i] << s) | (s ? b[i - 1] >> (64 - s) : 0);
+  }
+  vn[0] = b[0] << s;
+  un[alen] = s ? a[alen - 1] >> (64 - s) : 0;
+  for(i=alen-1;i>0;--i) {
+    un[i] = (a[i] << s) | (s ? a[i - 1] >> (64 - s) : 0);
+  }
+  un[0] = a[0] << s;
+
+  for(j=alen-blen;j>=0;--j) {
+    num = ((unsigned __int128)un[j + blen] << 64) | un[j + blen - 1];
+    qhat = num / vn[blen - 1];
+    rhat = num % vn[blen - 1];
+    while( (qhat >> 64) != 0 || qhat * vn[blen - 2] > ((rhat << 64) | un[j + blen - 2]) ) {
+      qhat--;
+      rhat += vn[blen - 1];
+      if ( (rhat >> 64) != 0 ) {
+        break;
+      }
+    }
+    k = 0;
+    for(i=0;i<blen;++i) {
+      p = qhat * vn[i] + k;
+      k = (uint64_t)(p >> 64);
+      lo = (uint64_t)p;
+      k += un[i + j] < lo;
+      un[i + j] -= lo;
+    }
+    top = un[j + blen];
+    un[j + blen] = top - k;
+    if ( top < k ) {
+      // the estimate was one too large, add the divisor back
+      qhat--;
+      k = 0;
+      for(i=0;i<blen;++i) {
+        p = (unsigned __int128)un[i + j] + vn[i] + k;
+        un[i + j] = (uint64_t)p;
+        k = (uint64_t)(p >> 64);
+      }
+      un[j + blen] += k;
+    }
+    q[j] = (uint64_t)qhat;
+  }
+  for(i=0;i<blen;++i) {
+    r[i] = (un[i] >> s) | (s ? un[i + 1] << (64 - s) : 0);
+  }
+  FREE_ARRAY(un);
+  FREE_ARRAY(vn);
 }
 
-struct elem *reader_get_input(struct elem *frame) {
-  return frame_get(frame, sym_input());
+/*
+ * An int in the middle of arithmetic. A fixnum's magnitude is kept in
+ * small, so making one from an elem never allocates; limbs of a bigint
+ * are borrowed from its cell until a result owns limbs of its own.
+ */
+struct num {
+  int       sign;
+  uint32_t  len;
+  uint64_t *limbs;
+  uint64_t  small;
+  int       owned;
+};
+
+const uint64_t *num_limbs(const struct num *x) {
+  return x->limbs != 0 ? x->limbs : &x->small;
 }
 
-int reader_has_error(struct elem *frame) {
-  return frame_get(frame, sym_error()) != nil();
+void num_int(struct num *x, int64_t v) {
+  memset(x, 0, sizeof(*x));
+  x->sign = v < 0 ? -1 : v > 0;
+  x->small = v < 0 ? -(uint64_t)v : (uint64_t)v;
+  x->len = v != 0;
 }
 
-struct elem *int_leq(struct elem *frame, struct elem *a, struct elem *b) {
-  ERROR_UNLESS_IS_TYPE(frame, a, ELEM_TYPE_INT);
-  ERROR_UNLESS_IS_TYPE(frame, b, ELEM_TYPE_INT);
-  if ( int_value(a) < int_value(b) ) {
-    return true_value();
-  } else {
-    return nil();
+// 0 unless e is an int
+int num_of(struct elem *e, struct num *x) {
+  if ( is_fixnum(e) ) {
+    num_int(x, int_value(e));
+    return 1;
+  }
+  if ( ! is_type(e, ELEM_TYPE_BIGINT) ) {
+    return 0;
   }
+  memset(x, 0, sizeof(*x));
+  x->sign = e->bval.sign;
+  x->len = e->bval.len;
+  x->limbs = e->bval.limbs;
+  return 1;
 }
 
-struct elem *string_char_at(struct elem *frame, struct elem *s, struct elem *p) {
-  ERROR_UNLESS_IS_TYPE(frame, s, ELEM_TYPE_STRING);
-  ERROR_UNLESS_IS_TYPE(frame, p, ELEM_TYPE_INT);
-  if ( p->ival.value < s->sval.len ) {
-    return new_int(frame, s->sval.str[p->ival.value]);
-  } else {
-    return new_error(frame, "Position exceeds length of string");
+void num_free(struct num *x) {
+  if ( x->owned ) {
+    FREE_ARRAY(x->limbs);
   }
+  x->owned = 0;
+  x->limbs = 0;
 }
 
-struct elem *string_size(struct elem *frame, struct elem *s) {
-  ERROR_UNLESS_IS_TYPE(frame, s, ELEM_TYPE_STRING);
-  return new_int(frame, s->sval.len);
+// x takes limbs as its own
+void num_take(struct num *x, int sign, uint64_t *limbs, uint32_t len) {
+  memset(x, 0, sizeof(*x));
+  x->len = mag_trim(limbs, len);
+  x->sign = x->len != 0 ? sign : 0;
+  x->limbs = limbs;
+  x->owned = 1;
 }
 
-struct elem *int_plus(struct elem *frame, struct elem *a, struct elem *b) {
-  ERROR_UNLESS_IS_TYPE(frame, a, ELEM_TYPE_INT);
-  ERROR_UNLESS_IS_TYPE(frame, b, ELEM_TYPE_INT);
-  return new_int(frame, a->ival.value + b->ival.value);
+void num_copy(struct num *r, const struct num *a, int sign) {
+  uint64_t *limbs = NEW_ARRAY(uint64_t, a->len + 1);
+  memcpy(limbs, num_limbs(a), (size_t)a->len * sizeof(uint64_t));
+  num_take(r, sign, limbs, a->len);
 }
 
-struct elem* reader_next_char(struct elem *frame) {
-  struct elem *pos = reader_get_pos(frame);
-  struct elem *input = reader_get_input(frame);
-  if ( is_true(int_leq(frame, pos, string_size(frame, input))) ) {
-    pos = int_plus(frame, pos, new_int(frame, 1));
-    frame = reader_set_pos(frame, pos);
-    frame = reader_set_curr_char(frame, string_char_at(frame, input, pos));
+// r = a + b with b's sign taken as bsign, which subtracts when it is flipped
+void num_add(struct num *r, const struct num *a, const struct num *b, int bsign) {
+  uint64_t *limbs;
+  int c;
+  if ( b->sign == 0 ) {
+    num_copy(r, a, a->sign);
+    return;
+  }
+  if ( a->sign == 0 ) {
+    num_copy(r, b, bsign);
+    return;
+  }
+  limbs = NEW_ARRAY(uint64_t, (a->len > b->len ? a->len : b->len) + 1);
+  if ( a->sign == bsign ) {
+    num_take(r, a->sign, limbs, mag_add(limbs, num_limbs(a), a->len, num_limbs(b), b->len));
+    return;
+  }
+  c = mag_cmp(num_limbs(a), a->len, num_limbs(b), b->len);
+  if ( c >= 0 ) {
+    num_take(r, a->sign, limbs, mag_sub(limbs, num_limbs(a), a->len, num_limbs(b), b->len));
   } else {
-    frame = reader_set_error(frame, new_error(frame, "End of string encountered while reading"));
+    num_take(r, bsign, limbs, mag_sub(limbs, num_limbs(b), b->len, num_limbs(a), a->len));
   }
-  return frame;
 }
-                           
 
-struct elem *string_read(struct elem *frame) {
-  char buf[4096];
-  int  tail = 0;
-  int  len = sizeof(buf);
-  frame = reader_next_char(frame);
+void num_mul(struct num *r, const struct num *a, const struct num *b) {
+  uint64_t *limbs = NEW_ARRAY(uint64_t, a->len + b->len + 1);
+  if ( a->sign != 0 && b->sign != 0 ) {
+    mag_mul(limbs, num_limbs(a), a->len, num_limbs(b), b->len);
+  }
+  num_take(r, a->sign * b->sign, limbs, a->len + b->len);
+}
 
-  while( int_value(reader_get_curr_char(frame)) != '"' && tail < len ) {
-    buf[tail++] = int_value(reader_get_curr_char(frame));
-    frame = reader_next_char(frame);
+// q and m get the quotient truncated towards zero and the remainder, b is not zero
+void num_divmod(struct num *q, struct num *m, const struct num *a, const struct num *b) {
+  uint64_t *ql, *ml;
+  if ( mag_cmp(num_limbs(a), a->len, num_limbs(b), b->len) < 0 ) {
+    num_take(q, 0, NEW_ARRAY(uint64_t, 1), 0);
+    num_copy(m, a, a->sign);
+    return;
+  }
+  ql = NEW_ARRAY(uint64_t, a->len - b->len + 1);
+  ml = NEW_ARRAY(uint64_t, b->len);
+  if ( b->len == 1 ) {
+    ml[0] = mag_divmod_small(ql, num_limbs(a), a->len, num_limbs(b)[0]);
+  } else {
+    mag_divmod(ql, ml, num_limbs(a), a->len, num_limbs(b), b->len);
   }
-  buf[tail] = 0;
-  frame = reader_next_char(frame);
+  num_take(q, a->sign * b->sign, ql, a->len - b->len + 1);
+  num_take(m, a->sign, ml, b->len);
+}
 
-  return reader_set_expr(frame, new_string(frame, buf));
+int num_cmp(const struct num *a, const struct num *b) {
+  int c;
+  if ( a->sign != b->sign ) {
+    return a->sign < b->sign ? -1 : 1;
+  }
+  c = mag_cmp(num_limbs(a), a->len, num_limbs(b), b->len);
+  return a->sign < 0 ? -c : c;
 }
 
-int is_ident_char(int c) {
-  if ( ( c > 'A' && c < 'Z' ) || ( c > 'a' && c < 'z' ) ) {
-    return 1;
+// the int x holds, as a fixnum if it fits, which uses up x
+struct elem *num_elem(struct elem *frame, struct num *x) {
+  const uint64_t *l = num_limbs(x);
+  struct num copy;
+  struct elem *e;
+  if ( x->len == 0 ) {
+    num_free(x);
+    return ELEM_FIXNUM(0);
   }
-  switch(c) {
-  case '_':
-  case '-':
-  case '?':
-  case '!':
-    return 1;
+  if ( x->len == 1 && l[0] <= (x->sign > 0 ? (uint64_t)FIXNUM_MAX : -(uint64_t)FIXNUM_MIN) ) {
+    e = ELEM_FIXNUM(x->sign > 0 ? (int64_t)l[0] : -(int64_t)l[0]);
+    num_free(x);
+    return e;
   }
-  return 0;
+  if ( ! x->owned ) {
+    num_copy(&copy, x, x->sign);
+    x = &copy;
+  }
+  e = frame_alloc_elem(frame);
+  e->bval.sign = x->sign;
+  e->bval.len = x->len;
+  e->bval.limbs = x->limbs;
+  e->type = ELEM_TYPE_BIGINT;
+  alloc_young_owner(frame_alloc(frame), e);
+  return e;
 }
 
-int is_sym_char(int c) {
-  if ( ( c > 'A' && c < 'Z' ) || ( c > 'a' && c < 'z' ) ) {
-    return 1;
-  }
-  switch(c) {
-  case '_':
-  case '-':
-  case '?':
-  case '!':
-    return 1;
-  }
-  return 0;
+/*
+ * A vector owns the array it is made from. Its kind follows from its
+ * items, ints when they are all fixnums, so equal vectors are always
+ * stored alike.
+ */
+struct elem *new_vector(struct elem *frame, uint32_t kind, void *items, uint32_t len) {
+  struct elem *e = frame_alloc_elem(frame);
+  e->vval.kind = kind;
+  e->vval.len = len;
+  e->vval.items = (struct elem **)items;
+  e->type = ELEM_TYPE_VECTOR;
+  alloc_young_owner(frame_alloc(frame), e);
+  return e;
 }
 
-struct elem *ident_read(struct elem *frame) {
-  char buf[4096];
-  int  tail = 0;
-  int  len = sizeof(buf);
-  while( is_ident_char(int_value(reader_get_curr_char(frame))) && tail < len ) {
-    buf[tail++] = int_value(reader_get_curr_char(frame));
-    frame = reader_next_char(frame);
+// a vector of len items, which it takes over, as ints if it can be
+struct elem *vector_of(struct elem *frame, struct elem **items, uint32_t len) {
+  int64_t *ints;
+  uint32_t i;
+  for(i=0;i<len&&is_fixnum(items[i]);++i);
+  if ( i < len ) {
+    return new_vector(frame, VECTOR_ELEMS, items, len);
   }
-  buf[tail] = 0;
+  ints = NEW_ARRAY(int64_t, len + 1);
+  for(i=0;i<len;++i) {
+    ints[i] = int_value(items[i]);
+  }
+  FREE_ARRAY(items);
+  return new_vector(frame, VECTOR_INTS, ints, len);
+}
 
-  return reader_set_expr(frame, new_ident(frame, buf));
+struct elem *vector_item(struct elem *v, uint32_t i) {
+  return v->vval.kind == VECTOR_INTS ? ELEM_FIXNUM(v->vval.ints[i]) : v->vval.items[i];
 }
 
-struct elem *sym_read(struct elem *frame) {
-  char buf[4096];
-  int  tail = 0;
-  int  len = sizeof(buf);
-  frame = reader_next_char(frame);
+/*
+ * Persistent vectors change by copying the nodes on the path to what
+ * changes and sharing the rest, so an old version stays as it was.
+ * Concatenation merges the right edge of one tree with the left edge
+ * of the other a level at a time. The nodes meeting at each level have
+ * their slots shared out again. That happens only as far as needed to
+ * keep them within PVEC_EXTRAS of the fewest nodes that could hold
+ * them, which keeps lookups in a relaxed node to a step or two past
+ * where a strict one would look.
+ */
+#define PVEC_BITS    5
+#define PVEC_WIDTH   32
+#define PVEC_EXTRAS  2
+#define PVEC_MAX_SHIFT 60
+
+int is_pvec(struct elem *e) {
+  return is_type(e, ELEM_TYPE_PVEC);
+}
 
-  while( ! is_sym_char(int_value(reader_get_curr_char(frame))) && tail < len ) {
-    buf[tail++] = int_value(reader_get_curr_char(frame));
-    frame = reader_next_char(frame);
-  }
-  buf[tail] = 0;
-  frame = reader_next_char(frame);
+struct elem *new_pvec(struct elem *frame, uint32_t count, uint32_t shift, struct elem *root, struct elem *tail) {
+  struct elem *e = frame_alloc_elem(frame);
+  e->pval.count = count;
+  e->pval.shift = shift;
+  e->pval.root = root;
+  e->pval.tail = tail;
+  e->type = ELEM_TYPE_PVEC;
+  return e;
+}
 
-  return reader_set_expr(frame, new_sym(frame, buf));
+struct elem *new_pvec_node(struct elem *frame, struct elem **slots, uint32_t len, uint32_t *sizes) {
+  struct elem *e = frame_alloc_elem(frame);
+  e->pnval.len = len;
+  e->pnval.slots = slots;
+  e->pnval.sizes = sizes;
+  e->type = ELEM_TYPE_PVEC_NODE;
+  alloc_young_owner(frame_alloc(frame), e);
+  return e;
 }
 
-struct elem *is_space(struct elem *frame, struct elem *c) {
-  if ( int_value(c) == ' ' || int_value(c) == '\n' || int_value(c) == '\t' ) {
-    return true_value();
-  } else {
-    return false_value();
-  }
+uint32_t pvec_tail_len(struct elem *v) {
+  return is_nil(v->pval.tail) ? 0 : v->pval.tail->pnval.len;
 }
 
-struct elem *reader_skip_whitespace(struct elem *frame) {
-  while( is_true(is_space(frame, reader_get_curr_char(frame))) ) {
-    frame = reader_next_char(frame);
+// the number of items under n, at shift
+uint64_t pvec_node_count(struct elem *n, uint32_t shift) {
+  uint64_t count = 0;
+  while( shift > 0 && n->pnval.sizes == 0 ) {
+    count += (uint64_t)(n->pnval.len - 1) << shift;
+    n = n->pnval.slots[n->pnval.len - 1];
+    shift -= PVEC_BITS;
   }
-  return frame;
+  return count + (shift > 0 ? n->pnval.sizes[n->pnval.len - 1] : n->pnval.len);
 }
 
-struct elem *map_read(struct elem *frame) {
-  struct elem* map = empty_map();
-  struct elem* key, *value;
-  
-  frame = reader_skip_whitespace(frame);
-
-  while(! reader_has_error(frame) ) {
-    switch(int_value(reader_get_curr_char(frame))) {
-    case '}':
-      frame = reader_next_char(frame);
-      frame = reader_set_expr(frame, map);
-      return frame;
-    default:
-      frame = elem_read(frame);
-      key = reader_get_expr(frame);
-      frame = elem_read(frame);
-      value = reader_get_expr(frame);
-      map_set(frame, map, key, value);
+// the sizes a node at shift over slots needs, or 0 when it is strict
+uint32_t *pvec_node_sizes(struct elem **slots, uint32_t len, uint32_t shift) {
+  uint32_t *sizes, i;
+  uint64_t at = 0;
+  for(i=0;shift>0&&i+1<len;++i) {
+    if ( pvec_node_count(slots[i], shift - PVEC_BITS) != (uint64_t)1 << shift ) {
       break;
     }
   }
+  if ( shift == 0 || i + 1 >= len ) {
+    return 0;
+  }
+  sizes = NEW_ARRAY(uint32_t, len);
+  for(i=0;i<len;++i) {
+    at += pvec_node_count(slots[i], shift - PVEC_BITS);
+    sizes[i] = at;
+  }
+  return sizes;
+}
 
-  return frame;
+// a node at shift over len slots, which it takes over
+struct elem *pvec_node_make(struct elem *frame, struct elem **slots, uint32_t len, uint32_t shift) {
+  return new_pvec_node(frame, slots, len, pvec_node_sizes(slots, len, shift));
 }
 
-struct elem *list_read(struct elem *frame) {
-  struct elem* list = empty_list();
-  struct elem *value;
-  
-  frame = reader_next_char(frame);
-  frame = reader_skip_whitespace(frame);
+// which child of n at shift holds item *i, leaving *i as its index there
+uint32_t pvec_child_index(struct elem *n, uint32_t shift, uint64_t *i) {
+  uint64_t idx = *i >> shift;
+  if ( n->pnval.sizes == 0 ) {
+    *i -= idx << shift;
+    return idx;
+  }
+  while( n->pnval.sizes[idx] <= *i ) {
+    idx++;
+  }
+  *i -= idx > 0 ? n->pnval.sizes[idx - 1] : 0;
+  return idx;
+}
 
-  while(! reader_has_error(frame) ) {
-    switch(int_value(reader_get_curr_char(frame))) {
-    case ')':
-      frame = reader_next_char(frame);
-      frame = reader_set_expr(frame, list_reverse(frame, list));
-      return frame;
-    default:
-      frame = elem_read(frame);
-      value = reader_get_expr(frame);
-      list = list_add(frame, list, value);
-      break;
-    }
+// the slots from item i on in the leaf holding it, *len of them
+struct elem **pvec_chunk(struct elem *v, uint32_t i, uint32_t *len) {
+  uint32_t offset = v->pval.count - pvec_tail_len(v), shift;
+  struct elem *n = v->pval.root;
+  uint64_t j = i;
+  if ( i >= offset ) {
+    *len = v->pval.count - i;
+    return v->pval.tail->pnval.slots + (i - offset);
   }
+  for(shift=v->pval.shift;shift>0;shift-=PVEC_BITS) {
+    n = n->pnval.slots[pvec_child_index(n, shift, &j)];
+  }
+  *len = n->pnval.len - j;
+  return n->pnval.slots + j;
+}
 
-  return frame;
+struct elem *pvec_item(struct elem *v, uint32_t i) {
+  uint32_t len;
+  return *pvec_chunk(v, i, &len);
 }
 
+struct elem **pvec_slots_copy(struct elem *n, uint32_t len) {
+  struct elem **slots = NEW_ARRAY(struct elem *, len);
+  memcpy(slots, n->pnval.slots, (size_t)(n->pnval.len < len ? n->pnval.len : len) * sizeof(struct elem *));
+  return slots;
+}
 
-struct elem *elem_read(struct elem *frame) {
-  frame = reader_skip_whitespace(frame);
-  int c = int_value(reader_get_curr_char(frame));
+// n with child idx, which may be one past its last, set to child
+struct elem *pvec_node_with(struct elem *frame, struct elem *n, uint32_t shift, uint32_t idx, struct elem *child) {
+  uint32_t len = idx < n->pnval.len ? n->pnval.len : idx + 1;
+  struct elem **slots = pvec_slots_copy(n, len);
+  slots[idx] = child;
+  return pvec_node_make(frame, slots, len, shift);
+}
 
-  switch(c) {
-  case '{':
-    return map_read(frame);
-  case '(':
-    return list_read(frame);
-  case '"':
-    return string_read(frame);
-  case ':':
-    return sym_read(frame);
+// a path of nodes down from shift with only leaf at its end
+struct elem *pvec_path(struct elem *frame, uint32_t shift, struct elem *leaf) {
+  struct elem **slots;
+  for(;shift>0;shift-=PVEC_BITS) {
+    slots = NEW_ARRAY(struct elem *, 1);
+    slots[0] = leaf;
+    leaf = new_pvec_node(frame, slots, 1, 0);
   }
+  return leaf;
+}
 
-  if ( is_ident_char(c) ) {
-    return ident_read(frame);
+// the tree under n with leaf added at its end, or 0 when it has no room
+struct elem *pvec_push_leaf(struct elem *frame, struct elem *n, uint32_t shift, struct elem *leaf) {
+  struct elem *child;
+  if ( shift > PVEC_BITS ) {
+    child = pvec_push_leaf(frame, n->pnval.slots[n->pnval.len - 1], shift - PVEC_BITS, leaf);
+    if ( child != 0 ) {
+      return pvec_node_with(frame, n, shift, n->pnval.len - 1, child);
+    }
+  }
+  if ( n->pnval.len == PVEC_WIDTH ) {
+    return 0;
   }
+  return pvec_node_with(frame, n, shift, n->pnval.len, pvec_path(frame, shift - PVEC_BITS, leaf));
+}
 
-  return reader_set_error(frame, new_error(frame, "Symbol not recognised."));
+// adds leaf at the end of the tree at *root and *shift
+void pvec_push_tail(struct elem *frame, struct elem **root, uint32_t *shift, struct elem *leaf) {
+  struct elem **slots, *n = 0;
+  if ( is_nil(*root) ) {
+    *root = leaf;
+    *shift = 0;
+    return;
+  }
+  if ( *shift > 0 ) {
+    n = pvec_push_leaf(frame, *root, *shift, leaf);
+  }
+  if ( n == 0 ) {
+    slots = NEW_ARRAY(struct elem *, 2);
+    slots[0] = *root;
+    slots[1] = pvec_path(frame, *shift, leaf);
+    *shift += PVEC_BITS;
+    n = pvec_node_make(frame, slots, 2, *shift);
+  }
+  *root = n;
 }
 
-struct elem *reader_new_frame(struct elem *frame, char *expr) {
-  struct elem* pos = new_int(frame, 0);
-  struct elem* input = new_string(frame, expr);
-  frame = reader_set_input(frame, input);
-  frame = reader_set_pos(frame, pos);
-  frame = reader_set_curr_char(frame, string_char_at(frame, input, pos));
-  return frame;
+struct elem *pvec_conj(struct elem *frame, struct elem *v, struct elem *x) {
+  uint32_t len = pvec_tail_len(v), shift = v->pval.shift;
+  struct elem *root = v->pval.root, **slots;
+  if ( len == PVEC_WIDTH ) {
+    pvec_push_tail(frame, &root, &shift, v->pval.tail);
+    len = 0;
+  }
+  slots = len > 0 ? pvec_slots_copy(v->pval.tail, len + 1) : NEW_ARRAY(struct elem *, 1);
+  slots[len] = x;
+  return new_pvec(frame, v->pval.count + 1, shift, root, new_pvec_node(frame, slots, len + 1, 0));
 }
 
-void elem_print(struct elem *frame, FILE *out, struct elem *e) {
-  switch(e->type) {
-  case ELEM_TYPE_NIL:
-    fprintf(out, "nil");
-    break;
-  case ELEM_TYPE_INT:
-    fprintf(out, "%d", e->ival.value);
-    break;
-  case ELEM_TYPE_LIST:
-    list_print(frame, out, e);
-    break;
-  case ELEM_TYPE_STRING:
-    string_print(frame, out, e);
-    break;
-  case ELEM_TYPE_IDENT:
-    ident_print(frame, out, e);
-    break;
-  case ELEM_TYPE_ERROR:
-    error_print(frame, out, e);
-    break;
-  case ELEM_TYPE_SYM:
-    sym_print(frame, out, e);
-    break;
-  case ELEM_TYPE_SET:
-    set_print(frame, out, e);
-    break;
-  case ELEM_TYPE_MAP:
-    map_print(frame, out, trim_map(frame, e));
-    break;
-  case ELEM_TYPE_FN:
-    fn_print(frame, out, e);
-    break;
-  case ELEM_TYPE_ALLOC:
-    fprintf(out, "<alloc:%p>", e->aval.alloc);
-    break;
-  default:
-    abort(); // invalid type
+struct elem *pvec_node_set(struct elem *frame, struct elem *n, uint32_t shift, uint64_t i, struct elem *x) {
+  struct elem **slots = pvec_slots_copy(n, n->pnval.len);
+  uint32_t *sizes = 0, idx;
+  if ( shift == 0 ) {
+    slots[i] = x;
+    return new_pvec_node(frame, slots, n->pnval.len, 0);
+  }
+  idx = pvec_child_index(n, shift, &i);
+  slots[idx] = pvec_node_set(frame, n->pnval.slots[idx], shift - PVEC_BITS, i, x);
+  if ( n->pnval.sizes != 0 ) {
+    sizes = NEW_ARRAY(uint32_t, n->pnval.len);
+    memcpy(sizes, n->pnval.sizes, (size_t)n->pnval.len * sizeof(uint32_t));
   }
+  return new_pvec_node(frame, slots, n->pnval.len, sizes);
 }
 
-struct elem* return_value(struct elem *child_frame, struct elem *value) {
-  struct elem *parent_frame = frame_get(child_frame, sym_parent());
-  parent_frame = frame_set(parent_frame, sym_lhs(), value);
-  parent_frame = frame_set(parent_frame, sym_rhs(), empty_list());
-  return parent_frame;
+// v with item i, which is below its count, set to x
+struct elem *pvec_assoc(struct elem *frame, struct elem *v, uint32_t i, struct elem *x) {
+  uint32_t offset = v->pval.count - pvec_tail_len(v);
+  struct elem **slots;
+  if ( i >= offset ) {
+    slots = pvec_slots_copy(v->pval.tail, v->pval.tail->pnval.len);
+    slots[i - offset] = x;
+    return new_pvec(frame, v->pval.count, v->pval.shift, v->pval.root, new_pvec_node(frame, slots, v->pval.tail->pnval.len, 0));
+  }
+  return new_pvec(frame, v->pval.count, v->pval.shift, pvec_node_set(frame, v->pval.root, v->pval.shift, i, x), v->pval.tail);
 }
 
-struct elem* builtin_println(struct elem *frame) {
-  struct elem *rhs = frame_get(frame, sym_rhs());
-  int first = 1;
-  if ( is_list(rhs) ) {
-    while( ! list_is_empty(rhs) ) {
-      if ( first ) {
-        first = 0;
-      } else {
-        fprintf(stdout, " ");
+// the items from to to of the tree under n, with from below to, as a tree at the same shift
+struct elem *pvec_node_slice(struct elem *frame, struct elem *n, uint32_t shift, uint64_t from, uint64_t to) {
+  struct elem **slots, *child;
+  uint64_t last = to - 1;
+  uint32_t a, b, i;
+  if ( shift == 0 ) {
+    slots = NEW_ARRAY(struct elem *, to - from);
+    memcpy(slots, n->pnval.slots + from, (size_t)(to - from) * sizeof(struct elem *));
+    return new_pvec_node(frame, slots, to - from, 0);
+  }
+  a = pvec_child_index(n, shift, &from);
+  b = pvec_child_index(n, shift, &last);
+  slots = NEW_ARRAY(struct elem *, b - a + 1);
+  for(i=a;i<=b;++i) {
+    child = n->pnval.slots[i];
+    if ( (i == a && from > 0) || (i == b && last + 1 < pvec_node_count(child, shift - PVEC_BITS)) ) {
+      child = pvec_node_slice(frame, child, shift - PVEC_BITS, i == a ? from : 0, i == b ? last + 1 : pvec_node_count(child, shift - PVEC_BITS));
+    }
+    slots[i - a] = child;
+  }
+  return pvec_node_make(frame, slots, b - a + 1, shift);
+}
+
+// the items of v from start up to end
+struct elem *pvec_slice(struct elem *frame, struct elem *v, uint32_t start, uint32_t end) {
+  uint32_t offset = v->pval.count - pvec_tail_len(v), shift = 0, from;
+  struct elem *root = nil(), *tail = nil(), **slots;
+  if ( start < end && start < offset ) {
+    root = pvec_node_slice(frame, v->pval.root, v->pval.shift, start, end < offset ? end : offset);
+    shift = v->pval.shift;
+    while( shift > 0 && root->pnval.len == 1 ) {
+      root = root->pnval.slots[0];
+      shift -= PVEC_BITS;
+    }
+  }
+  from = start > offset ? start : offset;
+  if ( from < end ) {
+    slots = NEW_ARRAY(struct elem *, end - from);
+    memcpy(slots, v->pval.tail->pnval.slots + (from - offset), (size_t)(end - from) * sizeof(struct elem *));
+    tail = new_pvec_node(frame, slots, end - from, 0);
+  }
+  return new_pvec(frame, end - start, shift, root, tail);
+}
+
+/*
+ * Shares the slots of the n nodes in all, which sit at shift, out over
+ * as few nodes as keeps them within PVEC_EXTRAS of the fewest that
+ * could hold them; nodes that come out the same are kept as they were.
+ * Returns how many nodes all now holds.
+ */
+uint32_t pvec_rebalance(struct elem *frame, struct elem **all, uint32_t n, uint32_t shift) {
+  uint32_t counts[2 * PVEC_WIDTH], total = 0, opt, i, j, k, c, rest, m = n;
+  struct elem *out[2 * PVEC_WIDTH], **slots;
+  for(i=0;i<n;++i) {
+    counts[i] = all[i]->pnval.len;
+    total += counts[i];
+  }
+  opt = (total + PVEC_WIDTH - 1) / PVEC_WIDTH;
+  while( m > opt + PVEC_EXTRAS ) {
+    for(i=0;counts[i]>=PVEC_WIDTH-1;++i);
+    for(rest=counts[i];rest>0;++i) {
+      c = rest + counts[i + 1] < PVEC_WIDTH ? rest + counts[i + 1] : PVEC_WIDTH;
+      rest = rest + counts[i + 1] - c;
+      counts[i] = c;
+    }
+    memmove(counts + i, counts + i + 1, (size_t)(m - i - 1) * sizeof(uint32_t));
+    m--;
+  }
+  if ( m == n ) {
+    return n;
+  }
+  for(i=0,j=0,k=0;i<m;++i) {
+    if ( k == 0 && all[j]->pnval.len == counts[i] ) {
+      out[i] = all[j++];
+      continue;
+    }
+    slots = NEW_ARRAY(struct elem *, counts[i]);
+    for(c=0;c<counts[i];) {
+      rest = all[j]->pnval.len - k < counts[i] - c ? all[j]->pnval.len - k : counts[i] - c;
+      memcpy(slots + c, all[j]->pnval.slots + k, (size_t)rest * sizeof(struct elem *));
+      c += rest;
+      k += rest;
+      if ( k == all[j]->pnval.len ) {
+        j++;
+        k = 0;
       }
-      elem_print(frame, stdout, list_value(rhs));
-      rhs = list_next(rhs);
     }
+    out[i] = pvec_node_make(frame, slots, counts[i], shift);
+  }
+  memcpy(all, out, (size_t)m * sizeof(struct elem *));
+  return m;
+}
+
+/*
+ * Joins the trees L at ls and R at rs into one or two nodes at the
+ * larger of the shifts, put in out; returns how many.
+ */
+uint32_t pvec_merge(struct elem *frame, struct elem *L, uint32_t ls, struct elem *R, uint32_t rs, struct elem **out) {
+  struct elem *all[2 * PVEC_WIDTH], **slots;
+  uint32_t shift = ls > rs ? ls : rs, n = 0, i;
+  if ( shift == 0 ) {
+    out[0] = L;
+    out[1] = R;
+    return 2;
+  }
+  if ( ls == shift ) {
+    memcpy(all, L->pnval.slots, (size_t)(L->pnval.len - 1) * sizeof(struct elem *));
+    n = L->pnval.len - 1;
+    L = L->pnval.slots[n];
+    ls -= PVEC_BITS;
+  }
+  if ( rs == shift ) {
+    n += pvec_merge(frame, L, ls, R->pnval.slots[0], rs - PVEC_BITS, all + n);
+    memcpy(all + n, R->pnval.slots + 1, (size_t)(R->pnval.len - 1) * sizeof(struct elem *));
+    n += R->pnval.len - 1;
   } else {
-    elem_print(frame, stdout, rhs);
+    n += pvec_merge(frame, L, ls, R, rs, all + n);
   }
-  fprintf(stdout, "\n");
-  return return_value(frame, nil());
+  n = pvec_rebalance(frame, all, n, shift - PVEC_BITS);
+  for(i=0;i<n;i+=PVEC_WIDTH) {
+    slots = NEW_ARRAY(struct elem *, n - i < PVEC_WIDTH ? n - i : PVEC_WIDTH);
+    memcpy(slots, all + i, (size_t)(n - i < PVEC_WIDTH ? n - i : PVEC_WIDTH) * sizeof(struct elem *));
+    out[i / PVEC_WIDTH] = pvec_node_make(frame, slots, n - i < PVEC_WIDTH ? n - i : PVEC_WIDTH, shift);
+  }
+  return (n + PVEC_WIDTH - 1) / PVEC_WIDTH;
 }
 
-struct elem* elem_println(struct elem *frame, FILE *out, struct elem *expr) {
-  elem_print(frame, out, expr);
-  fprintf(out, "\n");
-  return frame;
+// a followed by b; their counts must sum to at most UINT32_MAX
+struct elem *pvec_concat(struct elem *frame, struct elem *a, struct elem *b) {
+  uint32_t shift = a->pval.shift, alen = pvec_tail_len(a), blen = pvec_tail_len(b), n;
+  struct elem *root = a->pval.root, *out[2], **slots;
+  if ( a->pval.count == 0 ) {
+    return b;
+  }
+  if ( b->pval.count == 0 ) {
+    return a;
+  }
+  if ( is_nil(b->pval.root) ) {
+    slots = NEW_ARRAY(struct elem *, alen + blen);
+    if ( alen > 0 ) {
+      memcpy(slots, a->pval.tail->pnval.slots, (size_t)alen * sizeof(struct elem *));
+    }
+    memcpy(slots + alen, b->pval.tail->pnval.slots, (size_t)blen * sizeof(struct elem *));
+    if ( alen + blen <= PVEC_WIDTH ) {
+      return new_pvec(frame, a->pval.count + blen, shift, root, new_pvec_node(frame, slots, alen + blen, 0));
+    }
+    pvec_push_tail(frame, &root, &shift, new_pvec_node(frame, slots, PVEC_WIDTH, 0));
+    slots = NEW_ARRAY(struct elem *, alen + blen - PVEC_WIDTH);
+    memcpy(slots, b->pval.tail->pnval.slots + (PVEC_WIDTH - alen), (size_t)(alen + blen - PVEC_WIDTH) * sizeof(struct elem *));
+    return new_pvec(frame, a->pval.count + blen, shift, root, new_pvec_node(frame, slots, alen + blen - PVEC_WIDTH, 0));
+  }
+  if ( alen > 0 ) {
+    pvec_push_tail(frame, &root, &shift, a->pval.tail);
+  }
+  n = pvec_merge(frame, root, shift, b->pval.root, b->pval.shift, out);
+  shift = shift > b->pval.shift ? shift : b->pval.shift;
+  if ( n == 2 ) {
+    slots = NEW_ARRAY(struct elem *, 2);
+    slots[0] = out[0];
+    slots[1] = out[1];
+    shift += PVEC_BITS;
+    out[0] = pvec_node_make(frame, slots, 2, shift);
+  }
+  root = out[0];
+  while( shift > 0 && root->pnval.len == 1 ) {
+    root = root->pnval.slots[0];
+    shift -= PVEC_BITS;
+  }
+  return new_pvec(frame, a->pval.count + b->pval.count, shift, root, b->pval.tail);
 }
 
-void p(struct elem *frame, struct elem *expr) {
-  elem_println(frame, stdout, expr);
+/*
+ * Collects items and then builds a vector from them in one go, filling
+ * each node once rather than copying a path for every item.
+ */
+struct pvec_builder {
+  struct elem **items;
+  uint32_t len;
+  uint32_t cap;
+};
+
+void pvec_builder_add(struct pvec_builder *b, struct elem *x) {
+  if ( b->len == b->cap ) {
+    b->cap = b->cap ? b->cap * 2 : PVEC_WIDTH;
+    b->items = realloc(b->items, (size_t)b->cap * sizeof(struct elem *));
+  }
+  b->items[b->len++] = x;
 }
 
-struct elem *reader_read(struct elem *frame, char *expr) {
-  frame = reader_new_frame(frame, expr);
-  frame = elem_read(frame);
-  if ( reader_has_error(frame) ) {
-    return reader_get_error(frame);
-  } else {
-    return reader_get_expr(frame);
+// the vector of what b holds; b is left empty
+struct elem *pvec_builder_finish(struct elem *frame, struct pvec_builder *b) {
+  uint32_t tail = b->len > 0 ? (b->len - 1) % PVEC_WIDTH + 1 : 0, n = (b->len - tail) / PVEC_WIDTH, shift = 0, i, len;
+  struct elem **nodes = NEW_ARRAY(struct elem *, n > 0 ? n : 1), **slots, *root = nil(), *last = nil(), *v;
+  for(i=0;i<n;++i) {
+    slots = NEW_ARRAY(struct elem *, PVEC_WIDTH);
+    memcpy(slots, b->items + (size_t)i * PVEC_WIDTH, PVEC_WIDTH * sizeof(struct elem *));
+    nodes[i] = new_pvec_node(frame, slots, PVEC_WIDTH, 0);
+  }
+  while( n > 1 ) {
+    shift += PVEC_BITS;
+    for(i=0;i<n;i+=PVEC_WIDTH) {
+      len = n - i < PVEC_WIDTH ? n - i : PVEC_WIDTH;
+      slots = NEW_ARRAY(struct elem *, len);
+      memcpy(slots, nodes + i, (size_t)len * sizeof(struct elem *));
+      nodes[i / PVEC_WIDTH] = new_pvec_node(frame, slots, len, 0);
+    }
+    n = (n + PVEC_WIDTH - 1) / PVEC_WIDTH;
+  }
+  if ( n == 1 ) {
+    root = nodes[0];
   }
+  if ( tail > 0 ) {
+    slots = NEW_ARRAY(struct elem *, tail);
+    memcpy(slots, b->items + (b->len - tail), (size_t)tail * sizeof(struct elem *));
+    last = new_pvec_node(frame, slots, tail, 0);
+  }
+  v = new_pvec(frame, b->len, shift, root, last);
+  free(nodes);
+  free(b->items);
+  b->items = 0;
+  b->len = b->cap = 0;
+  return v;
 }
 
-int test_parsing(char *expr) {
-  struct elem* root_frame = reader_new_frame(new_root_frame(), expr);
-  struct elem* frame = root_frame;
-  int status;
-  frame = elem_read(frame);
-  if ( reader_has_error(frame) ) {
-    status = 1;
-    elem_println(frame, stdout, reader_get_error(frame));
-  } else {
-    status = 0;
-    elem_println(frame, stdout, reader_get_expr(frame));
+struct elem *new_string_len(struct elem *frame, const char *s, size_t len, int type) {
+  struct elem *ret = frame_alloc_elem(frame);
+  ret->type = type;
+  ret->sval.len = len + 1;
+  ret->sval.str = (char *)alloc_bytes(frame_alloc(frame), len + 1);
+  memcpy(ret->sval.str, s, len);
+  if ( ret->sval.len > ALLOC_BYTES_MAX ) {
+    alloc_young_owner(frame_alloc(frame), ret);
   }
-  free_root_frame(root_frame);
-  return status;
+  return ret;
+}
 
+// the string stays in s, which must live as long as the frame's alloc
+struct elem *new_string_ref(struct elem *frame, const char *s, size_t len, int type) {
+  struct elem *ret = frame_alloc_elem(frame);
+  ret->type = type;
+  ret->flags = ELEM_FLAG_BORROWED;
+  ret->sval.len = len + 1;
+  ret->sval.str = (char *)s;
+  return ret;
 }
 
-int test_eval(char *expr) {
-  struct elem *root_frame = new_root_frame();
-  struct elem *reader_root = new_root_frame();
-  struct elem *frame = root_frame;
-  struct elem *env = empty_map();
-  frame = frame_set(frame, sym_rhs(), reader_read(reader_root, expr));
-  frame = frame_set(frame, sym_lhs(), empty_list());
-  env = map_set(frame, env, sym_println(), new_fn(frame, builtin_println));
-  frame = frame_set(frame, sym_env(), env);
-  frame = frame_eval(frame);
-  elem_println(frame, stdout, frame);
-  free_root_frame(root_frame);
-  free_root_frame(reader_root);
-  return 0;
+struct elem *new_string_like(struct elem *frame, char *s, int type) {
+  return new_string_len(frame, s, strlen(s), type);
 }
 
-int test_eval_1() {
-  printf("-----\n");
-  return test_eval("\"hello\"");
+struct elem *new_string(struct elem *frame, char *s) {
+  return new_string_like(frame, s, ELEM_TYPE_STRING);
 }
 
-int test_eval_2() {
-  printf("-----\n");
-  return test_eval("(println \"hello\")");
+struct elem *new_ident(struct elem *frame, char *s) {
+  return new_string_like(frame, s, ELEM_TYPE_IDENT);
 }
 
-int test_eval_3() {
-  printf("-----\n");
-  return test_eval("(println \"hello\" (println \"hello\" \"world\"))");
+char *c_str(struct elem *e) {
+  assert(is_type(e, ELEM_TYPE_STRING) || is_type(e, ELEM_TYPE_IDENT));
+  return e->sval.str;
 }
 
-int test_eval_4() {
-  printf("-----\n");
-  return test_eval("(println \"hello\" (println \"second\") (println \"hello\" \"world\"))");
+/*
+ * Strings are flat, their bytes in one run, or ropes joining two other
+ * strings. Slices of a flat string borrow its bytes, and of a rope share
+ * its subtrees, so neither copies. Joins keep ropes balanced like AVL
+ * trees, by rotating the nodes on the edge they join along, so lookups
+ * by index take log time. Two flat strings that are both short are
+ * copied into one instead, so ropes built up a little at a time do not
+ * end in leaves of a byte or two.
+ */
+#define ROPE_FLAT      64
+#define ROPE_MAX_DEPTH 64
+
+int is_string(struct elem *e) {
+  return is_type(e, ELEM_TYPE_STRING);
 }
 
-int test_reader_1() {
-  return test_parsing("\"hello\"");
+int is_rope(struct elem *s) {
+  return (s->flags & ELEM_FLAG_ROPE) != 0;
 }
 
-int test_reader_2() {
-  return test_parsing("(\"hello\")");
+uint32_t string_len(struct elem *s) {
+  return is_rope(s) ? s->rval.len : s->sval.len - 1;
 }
 
-int test_reader_3() {
-  return test_parsing("(\"hello\" \"world\")");
+uint32_t string_depth(struct elem *s) {
+  return is_rope(s) ? s->rval.depth : 0;
 }
 
-int main(int argc, char **argv) {
-  test_reader_1();
-  test_reader_2();
-  test_reader_3();
-
-  test_eval_1();
-  test_eval_2();
-  test_eval_3();
-  test_eval_4();
+// the len bytes of the flat string s from start, borrowed from the cell that owns them
+// short strings move when they are promoted, so are copied rather than borrowed from
+struct elem *string_slice_flat(struct elem *frame, struct elem *s, uint32_t start, uint32_t len) {
+  struct elem *ret;
+  if ( start == 0 && len == string_len(s) ) {
+    return s;
+  }
+  if ( ! (s->flags & ELEM_FLAG_BORROWED) && s->sval.len <= ALLOC_BYTES_MAX ) {
+    return new_string_len(frame, s->sval.str + start, len, ELEM_TYPE_STRING);
+  }
+  ret = frame_alloc_elem(frame);
+  ret->type = ELEM_TYPE_STRING;
+  ret->flags = ELEM_FLAG_BORROWED;
+  ret->sval.len = len + 1;
+  ret->sval.str = s->sval.str + start;
+  ret->sval.owner = (s->flags & ELEM_FLAG_BORROWED) ? s->sval.owner : s;
+  return ret;
+}
+
+struct elem *rope_node(struct elem *frame, struct elem *left, struct elem *right) {
+  struct elem *ret = frame_alloc_elem(frame);
+  uint32_t l = string_depth(left), r = string_depth(right);
+  ret->type = ELEM_TYPE_STRING;
+  ret->flags = ELEM_FLAG_ROPE;
+  ret->rval.len = string_len(left) + string_len(right);
+  ret->rval.depth = (l > r ? l : r) + 1;
+  ret->rval.left = left;
+  ret->rval.right = right;
+  return ret;
+}
+
+// (a (b c)) becomes ((a b) c)
+struct elem *rope_rotate_left(struct elem *frame, struct elem *n) {
+  struct elem *r = n->rval.right;
+  return rope_node(frame, rope_node(frame, n->rval.left, r->rval.left), r->rval.right);
+}
+
+// ((a b) c) becomes (a (b c))
+struct elem *rope_rotate_right(struct elem *frame, struct elem *n) {
+  struct elem *l = n->rval.left;
+  return rope_node(frame, l->rval.left, rope_node(frame, l->rval.right, n->rval.right));
+}
+
+struct elem *string_join(struct elem *frame, struct elem *a, struct elem *b);
+
+// a followed by b, with a deeper than b by more than one
+struct elem *rope_join_right(struct elem *frame, struct elem *a, struct elem *b) {
+  struct elem *l = a->rval.left, *c = a->rval.right, *t;
+  if ( string_depth(c) <= string_depth(b) + 1 ) {
+    t = string_join(frame, c, b);
+    if ( string_depth(t) <= string_depth(l) + 1 ) {
+      return rope_node(frame, l, t);
+    }
+    return rope_rotate_left(frame, rope_node(frame, l, rope_rotate_right(frame, t)));
+  }
+  t = rope_join_right(frame, c, b);
+  if ( string_depth(t) <= string_depth(l) + 1 ) {
+    return rope_node(frame, l, t);
+  }
+  return rope_rotate_left(frame, rope_node(frame, l, t));
+}
+
+// a followed by b, with b deeper than a by more than one
+struct elem *rope_join_left(struct elem *frame, struct elem *a, struct elem *b) {
+  struct elem *c = b->rval.left, *r = b->rval.right, *t;
+  if ( string_depth(c) <= string_depth(a) + 1 ) {
+    t = string_join(frame, a, c);
+    if ( string_depth(t) <= string_depth(r) + 1 ) {
+      return rope_node(frame, t, r);
+    }
+    return rope_rotate_right(frame, rope_node(frame, rope_rotate_left(frame, t), r));
+  }
+  t = rope_join_left(frame, a, c);
+  if ( string_depth(t) <= string_depth(r) + 1 ) {
+    return rope_node(frame, t, r);
+  }
+  return rope_rotate_right(frame, rope_node(frame, t, r));
+}
+
+// a followed by b; their lengths must sum to less than UINT32_MAX
+struct elem *string_join(struct elem *frame, struct elem *a, struct elem *b) {
+  uint32_t alen = string_len(a), blen = string_len(b), da = string_depth(a), db = string_depth(b);
+  struct elem *ret;
+  if ( alen == 0 || blen == 0 ) {
+    return alen == 0 ? b : a;
+  }
+  if ( da == 0 && db == 0 && alen + blen <= ROPE_FLAT ) {
+    ret = frame_alloc_elem(frame);
+    ret->type = ELEM_TYPE_STRING;
+    ret->sval.len = alen + blen + 1;
+    ret->sval.str = (char *)alloc_bytes(frame_alloc(frame), alen + blen + 1);
+    memcpy(ret->sval.str, a->sval.str, alen);
+    memcpy(ret->sval.str + alen, b->sval.str, blen);
+    return ret;
+  }
+  if ( da > db + 1 ) {
+    return rope_join_right(frame, a, b);
+  }
+  if ( db > da + 1 ) {
+    return rope_join_left(frame, a, b);
+  }
+  return rope_node(frame, a, b);
+}
+
+// the flat string holding byte *i of s, leaving *i as its index there
+struct elem *string_leaf(struct elem *s, uint32_t *i) {
+  while( is_rope(s) ) {
+    if ( *i < string_len(s->rval.left) ) {
+      s = s->rval.left;
+    } else {
+      *i -= string_len(s->rval.left);
+      s = s->rval.right;
+    }
+  }
+  return s;
+}
+
+// byte i of s, which must be below its length
+unsigned char string_byte_at(struct elem *s, uint32_t i) {
+  s = string_leaf(s, &i);
+  return s->sval.str[i];
+}
+
+// the bytes of s from start up to end
+struct elem *string_slice(struct elem *frame, struct elem *s, uint32_t start, uint32_t end) {
+  uint32_t mid;
+  if ( ! is_rope(s) ) {
+    return string_slice_flat(frame, s, start, end - start);
+  }
+  if ( start == 0 && end == s->rval.len ) {
+    return s;
+  }
+  mid = string_len(s->rval.left);
+  if ( end <= mid ) {
+    return string_slice(frame, s->rval.left, start, end);
+  }
+  if ( start >= mid ) {
+    return string_slice(frame, s->rval.right, start - mid, end - mid);
+  }
+  return string_join(frame, string_slice(frame, s->rval.left, start, mid), string_slice(frame, s->rval.right, 0, end - mid));
+}
+
+// walks the runs of bytes of a string in order
+struct string_iter {
+  struct elem *stack[ROPE_MAX_DEPTH + 1];
+  uint32_t     top;
+};
+
+void string_iter_init(struct string_iter *it, struct elem *s) {
+  it->stack[0] = s;
+  it->top = 1;
+}
+
+// starts at the run holding byte pos, which begins at *at
+void string_iter_init_at(struct string_iter *it, struct elem *s, uint32_t pos, uint32_t *at) {
+  it->top = 0;
+  *at = 0;
+  while( is_rope(s) ) {
+    if ( pos < string_len(s->rval.left) ) {
+      it->stack[it->top++] = s->rval.right;
+      s = s->rval.left;
+    } else {
+      pos -= string_len(s->rval.left);
+      *at += string_len(s->rval.left);
+      s = s->rval.right;
+    }
+  }
+  it->stack[it->top++] = s;
+}
+
+int string_iter_next(struct string_iter *it, const char **str, uint32_t *len) {
+  struct elem *s;
+  while( it->top > 0 ) {
+    s = it->stack[--it->top];
+    if ( is_rope(s) ) {
+      it->stack[it->top++] = s->rval.right;
+      it->stack[it->top++] = s->rval.left;
+    } else if ( s->sval.len > 1 ) {
+      *str = s->sval.str;
+      *len = s->sval.len - 1;
+      return 1;
+    }
+  }
   return 0;
 }
+
+// the bytes of s at pos are those of str
+int string_match_at(struct elem *s, uint32_t pos, const char *str, uint32_t len) {
+  struct elem *leaf;
+  uint32_t i, n;
+  while( len > 0 ) {
+    i = pos;
+    leaf = string_leaf(s, &i);
+    n = leaf->sval.len - 1 - i < len ? leaf->sval.len - 1 - i : len;
+    if ( memcmp(leaf->sval.str + i, str, n) != 0 ) {
+      return 0;
+    }
+    pos += n;
+    str += n;
+    len -= n;
+  }
+  return 1;
+}
+
+// where the len bytes of str next come in s at or after from, or -1
+int64_t string_index_of(struct elem *s, const char *str, uint32_t len, uint32_t from) {
+  struct string_iter it;
+  const char *run, *p;
+  uint32_t n, at, k;
+  if ( len == 0 ) {
+    return from;
+  }
+  string_iter_init_at(&it, s, from, &at);
+  while( string_iter_next(&it, &run, &n) ) {
+    for(k=from>at?from-at:0;k<n&&(p=memchr(run + k, str[0], n - k))!=0;k=p-run+1) {
+      if ( (uint64_t)at + (p - run) + len > string_len(s) ) {
+        return -1;
+      }
+      if ( (p - run) + len <= n ? memcmp(p, str, len) == 0 : string_match_at(s, at + (p - run), str, len) ) {
+        return at + (p - run);
+      }
+    }
+    at += n;
+  }
+  return -1;
+}
+
+// copies the bytes of s to out
+void string_copy(struct elem *s, char *out) {
+  struct string_iter it;
+  const char *run;
+  uint32_t n;
+  string_iter_init(&it, s);
+  while( string_iter_next(&it, &run, &n) ) {
+    memcpy(out, run, n);
+    out += n;
+  }
+}
+
+/*
+ * Symbols are interned in a single process wide table so that two symbols
+ * are equal exactly when they are the same cell. Interned symbols live
+ * outside of any alloc and are never collected.
+ *
+ * Instances on different threads share the table. Lookups take no lock:
+ * slots are filled with release stores and a grown table is published
+ * whole, so a reader sees either a symbol or an empty slot. A reader that
+ * misses takes the lock and looks again before adding. Tables that were
+ * grown out of stay allocated, since a reader may still be walking one.
+ */
+struct symbol_slots {
+  uint32_t len;
+  struct symbol_slots *old;
+  struct elem *table[];
+};
+
+struct symbol_table {
+  uint32_t count;
+  struct symbol_slots *slots;
+  pthread_mutex_t lock;
+};
+
+struct symbol_table SYMBOLS = { 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+// h is what hashing the bytes before s gave
+uint32_t str_hash_more(uint32_t h, const char *s, uint32_t len) {
+  uint32_t i;
+  for(i=0;i<len;++i) {
+    h = (h ^ (unsigned char)s[i]) * 16777619u;
+  }
+  return h;
+}
+
+uint32_t str_hash(const char *s, uint32_t len) {
+  return str_hash_more(2166136261u, s, len);
+}
+
+void symbol_slots_insert(struct symbol_slots *slots, struct elem *sym) {
+  uint32_t i = sym->sval.hash & (slots->len - 1);
+  while( slots->table[i] != 0 ) {
+    i = (i + 1) & (slots->len - 1);
+  }
+  __atomic_store_n(&slots->table[i], sym, __ATOMIC_RELEASE);
+}
+
+struct elem *symbol_slots_find(struct symbol_slots *slots, const char *s, uint32_t len, uint32_t hash) {
+  struct elem *sym;
+  uint32_t i;
+  for(i=hash & (slots->len - 1);;i=(i + 1) & (slots->len - 1)) {
+    sym = __atomic_load_n(&slots->table[i], __ATOMIC_ACQUIRE);
+    if ( sym == 0 ) {
+      return 0;
+    }
+    if ( sym->sval.hash == hash && sym->sval.len == len + 1 && memcmp(sym->sval.str, s, len) == 0 ) {
+      return sym;
+    }
+  }
+}
+
+// called with the lock held
+void symbol_table_grow() {
+  struct symbol_slots *old = SYMBOLS.slots, *slots;
+  uint32_t len = old ? old->len * 2 : 256, i;
+  slots = calloc(sizeof(struct symbol_slots) + len * sizeof(struct elem *), 1);
+  slots->len = len;
+  slots->old = old;
+  for(i=0;old!=0&&i<old->len;++i) {
+    if ( old->table[i] != 0 ) {
+      symbol_slots_insert(slots, old->table[i]);
+    }
+  }
+  __atomic_store_n(&SYMBOLS.slots, slots, __ATOMIC_RELEASE);
+}
+
+// the first call hashes the builtin symbols and enters them
+struct symbol_slots *symbol_table_ready() {
+  struct symbol_slots *slots = __atomic_load_n(&SYMBOLS.slots, __ATOMIC_ACQUIRE);
+  struct elem **b;
+  if ( slots != 0 ) {
+    return slots;
+  }
+  pthread_mutex_lock(&SYMBOLS.lock);
+  if ( SYMBOLS.slots == 0 ) {
+    for(b=BUILTIN_SYMS;*b!=0;++b) {
+      (*b)->sval.hash = str_hash((*b)->sval.str, (*b)->sval.len - 1);
+    }
+    symbol_table_grow();
+    for(b=BUILTIN_SYMS;*b!=0;++b) {
+      symbol_slots_insert(SYMBOLS.slots, *b);
+      SYMBOLS.count++;
+    }
+  }
+  slots = SYMBOLS.slots;
+  pthread_mutex_unlock(&SYMBOLS.lock);
+  return slots;
+}
+
+struct elem *intern_len(const char *s, uint32_t len) {
+  uint32_t hash = str_hash(s, len);
+  struct elem *sym = symbol_slots_find(symbol_table_ready(), s, len, hash);
+
+  if ( sym != 0 ) {
+    return sym;
+  }
+
+  pthread_mutex_lock(&SYMBOLS.lock);
+  sym = symbol_slots_find(SYMBOLS.slots, s, len, hash);
+  if ( sym == 0 ) {
+    if ( 2 * (SYMBOLS.count + 1) > SYMBOLS.slots->len ) {
+      symbol_table_grow();
+    }
+    sym = NEW(struct elem);
+    sym->type = ELEM_TYPE_SYM;
+    sym->sval.len = len + 1;
+    sym->sval.hash = hash;
+    sym->sval.str = NEW_ARRAY(char, len + 1);
+    memcpy(sym->sval.str, s, len);
+    symbol_slots_insert(SYMBOLS.slots, sym);
+    SYMBOLS.count++;
+  }
+  pthread_mutex_unlock(&SYMBOLS.lock);
+  return sym;
+}
+
+struct elem *intern(char *s) {
+  return intern_len(s, strlen(s));
+}
+
+int is_builtin_sym(struct elem *sym) {
+  struct elem **b;
+  for(b=BUILTIN_SYMS;*b!=0;++b) {
+    if ( *b == sym ) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// only once no instance is running
+void free_symbol_table() {
+  struct symbol_slots *slots = SYMBOLS.slots, *old;
+  struct elem *sym;
+  uint32_t i;
+  for(i=0;slots!=0&&i<slots->len;++i) {
+    sym = slots->table[i];
+    if ( sym != 0 && ! is_builtin_sym(sym) ) {
+      FREE_ARRAY(sym->sval.str);
+      FREE(sym);
+    }
+  }
+  while( slots != 0 ) {
+    old = slots->old;
+    FREE(slots);
+    slots = old;
+  }
+  SYMBOLS.count = 0;
+  SYMBOLS.slots = 0;
+}
+
+struct elem *new_sym(struct elem *frame, char *s) {
+  return intern(s);
+}
+
+/*
+ * Functions are allocated old. They usually live as long as the env they
+ * are bound in, and they key the compiled code cache by address, which
+ * must not change under it.
+ */
+struct elem *new_fn(struct elem *frame, fn *fn) {
+  struct elem *ret = alloc_tenured_elem(frame_of(frame)->alloc);
+  ret->type = ELEM_TYPE_FN;
+  ret->fval.fn = fn;
+  return ret;
+}
+
+// natives skip the child frame and argument list a builtin call makes
+struct elem *new_native(struct elem *frame, native *native) {
+  struct elem *ret = new_fn(frame, 0);
+  ret->flags = ELEM_FLAG_NATIVE;
+  ret->fval.native = native;
+  return ret;
+}
+
+/*
+ * Frames hold the interpreter registers in a struct frame rather than a
+ * map, and are updated in place. Slots other than the registers go into
+ * the ext map, so frame_get and frame_set still accept any key.
+ */
+struct elem *init_frame(struct elem *a, struct elem *ret) {
+  struct alloc *alloc = a->aval.alloc;
+  struct alloc_tlab *t = alloc_tlab(alloc);
+  struct frame *f;
+  // collections free frames to the alloc, a thread takes them all at once
+  if ( t->frame_pool == 0 && __atomic_load_n(&alloc->frame_pool, __ATOMIC_RELAXED) != 0 ) {
+    pthread_mutex_lock(&alloc->lock);
+    t->frame_pool = alloc->frame_pool;
+    __atomic_store_n(&alloc->frame_pool, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&alloc->lock);
+  }
+  if ( t->frame_pool != 0 ) {
+    f = t->frame_pool;
+    t->frame_pool = f->next;
+  } else {
+    f = NEW(struct frame);
+  }
+  f->lhs = empty_list();
+  f->rhs = nil();
+  f->parent = nil();
+  f->env = nil();
+  f->alloc = a;
+  f->ext = empty_map();
+  f->next = 0;
+  ret->type = ELEM_TYPE_FRAME;
+  ret->frval.frame = f;
+  return ret;
+}
+
+struct elem *new_frame(struct elem *a) {
+  struct elem *ret = init_frame(a, alloc_elem(a));
+  alloc_young_owner(a->aval.alloc, ret);
+  return ret;
+}
+
+struct elem *new_user_fn(struct elem *frame, struct elem *args, struct elem *expr) {
+  struct elem *ret = alloc_tenured_elem(frame_of(frame)->alloc);
+  ret->type = ELEM_TYPE_FN;
+  ret->fval.fn = 0;
+  ret->fval.args = args;
+  ret->fval.expr = expr;
+  alloc_remember(frame_alloc(frame), ret);
+  return ret;
+}
+
+// C callers hold on to the root frame, so it starts out old and never moves
+struct elem *new_root_frame() {
+  struct elem *a = new_alloc_elem();
+  struct elem *f = init_frame(a, alloc_tenured_elem(a));
+  a->aval.alloc->root = f;
+  alloc_remember(a->aval.alloc, f);
+  return f;
+}
+
+void free_root_frame(struct elem *frame) {
+  free_alloc_elem(frame_of(frame)->alloc);
+}
+
+// identifiers from the reader already carry their symbol
+struct elem *to_sym(struct elem *frame, struct elem *ident) {
+  if ( ident->sval.sym != 0 ) {
+    return ident->sval.sym;
+  }
+  return intern_len(ident->sval.str, ident->sval.len - 1);
+}
+
+struct elem *alloc_list(
+  struct elem *frame, 
+  struct elem *l, 
+  struct elem *v
+) {
+  return alloc_pair(frame_of(frame)->alloc, ELEM_TAG_LIST, v, l);
+}
+
+int list_contains(struct elem *frame, struct elem *s, struct elem *x) {
+  if ( list_is_empty(s) ) {
+    return 0;
+  }
+  if ( elem_eq(frame, list_value(s), x) ) {
+    return 1;
+  }
+  return list_contains(frame, list_next(s), x);
+}
+
+struct elem **map_find(struct elem *frame, struct elem *m, struct elem *k);
+
+int map_contains_key(struct elem *frame, struct elem *m, struct elem *x) {
+  return map_find(frame, m, x) != 0;
+}
+
+int set_contains(struct elem *frame, struct elem *s, struct elem *x) {
+  return map_find(frame, s, x) != 0;
+}
+
+int list_sublist_eq(struct elem *frame, struct elem *a, struct elem *b) {
+  if ( a == b ) {
+    return 1;
+  }
+  if ( list_is_empty(a) ) {
+    return 0;
+  }
+  if ( list_is_empty(b) ) {
+    return 1;
+  }
+  if ( ! elem_eq(frame, list_value(a), list_value(b)) ) {
+    return 0;
+  }
+  return list_sublist_eq(frame, list_next(a), list_next(b));
+}
+
+int list_eq(struct elem *frame, struct elem *a, struct elem *b) {
+  if ( a == b ) {
+    return 1;
+  }
+  if ( list_is_empty(a) ) {
+    return 0;
+  }
+  if ( list_is_empty(b) ) {
+    return 0;
+  }
+  if ( ! elem_eq(frame, list_value(a), list_value(b)) ) {
+    return 0;
+  }
+  return list_eq(frame, list_next(a), list_next(b)); 
+}
+
+struct map_iter {
+  int depth;
+  struct elem *nodes[9];
+  uint32_t pos[9];
+  struct elem *key;
+  struct elem *value;
+};
+
+void map_iter_init(struct map_iter *it, struct elem *m) {
+  it->depth = map_root(m) != 0 ? 0 : -1;
+  it->nodes[0] = map_root(m);
+  it->pos[0] = 0;
+}
+
+/*
+ * Walks the trie depth first, leaving the next entry in key and value.
+ * Inline entries come before sub nodes in each node's slots. A small
+ * map's list is walked in place, newest entry first.
+ */
+int map_iter_next(struct map_iter *it) {
+  struct elem *n;
+  uint32_t data_len;
+  while( it->depth >= 0 ) {
+    n = it->nodes[it->depth];
+    if ( elem_type(n) == ELEM_TYPE_LIST ) {
+      if ( list_is_empty(n) ) {
+        it->depth--;
+        continue;
+      }
+      it->key = list_value(n);
+      it->value = list_value(list_next(n));
+      it->nodes[it->depth] = list_next(list_next(n));
+      return 1;
+    }
+    data_len = n->nval.datamap != 0 || n->nval.nodemap != 0 
+      ? 2 * __builtin_popcount(n->nval.datamap) : n->nval.len;
+    if ( it->pos[it->depth] < data_len ) {
+      it->key = n->nval.slots[it->pos[it->depth]];
+      it->value = n->nval.slots[it->pos[it->depth] + 1];
+      it->pos[it->depth] += 2;
+      return 1;
+    }
+    if ( it->pos[it->depth] < n->nval.len ) {
+      it->nodes[it->depth + 1] = n->nval.slots[it->pos[it->depth]++];
+      it->pos[++it->depth] = 0;
+      continue;
+    }
+    it->depth--;
+  }
+  return 0;
+}
+
+int map_submap_eq(struct elem *frame, struct elem *a, struct elem *b) {
+  struct map_iter it;
+  struct elem **v;
+  map_iter_init(&it, a);
+  while( map_iter_next(&it) ) {
+    v = map_find(frame, b, it.key);
+    if ( v == 0 || ! elem_eq(frame, *v, it.value) ) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/*
+ * A cached hash of 0 is one not computed yet, so a computed 0 is kept as
+ * 1. Cells may be read by pcall's threads at once, and two of them can
+ * fill the same cache, both with the same value.
+ */
+uint32_t elem_cache_hash(uint32_t *cache, uint32_t h) {
+  h = h != 0 ? h : 1;
+  __atomic_store_n(cache, h, __ATOMIC_RELAXED);
+  return h;
+}
+
+uint32_t elem_cached_hash(uint32_t *cache) {
+  return __atomic_load_n(cache, __ATOMIC_RELAXED);
+}
+
+// equal cells hash the same, so two hashes already cached and different settle it
+int hashes_differ(uint32_t a, uint32_t b) {
+  return a != 0 && b != 0 && a != b;
+}
+
+int map_eq(struct elem *frame, struct elem *a, struct elem *b) {
+  if ( map_root(a) == map_root(b) ) {
+    return 1;
+  }
+  if ( map_count(a) != map_count(b) || hashes_differ(elem_cached_hash(&a->hash), elem_cached_hash(&b->hash)) ) {
+    return 0;
+  }
+  return map_submap_eq(frame, a, b);
+}
+
+int set_subset_eq(struct elem *frame, struct elem *a, struct elem *b) {
+  struct map_iter it;
+  if ( a == b ) {
+    return 1;
+  }
+  if ( set_count(a) > set_count(b) ) {
+    return 0;
+  }
+  map_iter_init(&it, a);
+  while( map_iter_next(&it) ) {
+    if ( ! set_contains(frame, b, it.key) ) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+int set_eq(struct elem *frame, struct elem *a, struct elem *b) {
+  if ( map_root(a) == map_root(b) ) {
+    return 1;
+  }
+  if ( set_count(a) != set_count(b) || hashes_differ(elem_cached_hash(&a->hash), elem_cached_hash(&b->hash)) ) {
+    return 0;
+  }
+  return set_subset_eq(frame, a, b);
+}
+
+int ival_eq(struct elem *frame, struct elem *a, struct elem *b) {
+  return int_value(a) == int_value(b);
+}
+
+// a vector of ints never equals one of elems, which holds something else
+int vval_eq(struct elem *frame, struct elem *a, struct elem *b) {
+  uint32_t i;
+  if ( a->vval.kind != b->vval.kind || a->vval.len != b->vval.len || hashes_differ(elem_cached_hash(&a->hash), elem_cached_hash(&b->hash)) ) {
+    return 0;
+  }
+  if ( a->vval.kind == VECTOR_INTS ) {
+    return memcmp(a->vval.ints, b->vval.ints, (size_t)a->vval.len * sizeof(int64_t)) == 0;
+  }
+  for(i=0;i<a->vval.len;++i) {
+    if ( ! elem_eq(frame, a->vval.items[i], b->vval.items[i]) ) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// trees of equal vectors may be cut up differently, so walk the leaves
+int pval_eq(struct elem *frame, struct elem *a, struct elem *b) {
+  uint32_t i = 0, alen = 0, blen = 0, len;
+  struct elem **as = 0, **bs = 0;
+  if ( a->pval.count != b->pval.count || hashes_differ(elem_cached_hash(&a->hash), elem_cached_hash(&b->hash)) ) {
+    return 0;
+  }
+  while( i < a->pval.count ) {
+    if ( alen == 0 ) {
+      as = pvec_chunk(a, i, &alen);
+    }
+    if ( blen == 0 ) {
+      bs = pvec_chunk(b, i, &blen);
+    }
+    for(len=alen<blen?alen:blen;len>0;--len,--alen,--blen,++i) {
+      if ( ! elem_eq(frame, *as++, *bs++) ) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+int bval_eq(struct elem *frame, struct elem *a, struct elem *b) {
+  return a->bval.sign == b->bval.sign && a->bval.len == b->bval.len && memcmp(a->bval.limbs, b->bval.limbs, (size_t)a->bval.len * sizeof(uint64_t)) == 0;
+}
+
+uint32_t *string_hash_cache(struct elem *s) {
+  return is_rope(s) ? &s->hash : &s->sval.hash;
+}
+
+// ropes cut up alike or not, compared a run at a time
+int rope_eq(struct elem *a, struct elem *b) {
+  struct string_iter ai, bi;
+  const char *as = 0, *bs = 0;
+  uint32_t alen = 0, blen = 0, n;
+  string_iter_init(&ai, a);
+  string_iter_init(&bi, b);
+  for(;;) {
+    if ( alen == 0 && ! string_iter_next(&ai, &as, &alen) ) {
+      return 1;
+    }
+    if ( blen == 0 ) {
+      string_iter_next(&bi, &bs, &blen);
+    }
+    n = alen < blen ? alen : blen;
+    if ( memcmp(as, bs, n) != 0 ) {
+      return 0;
+    }
+    as += n;
+    bs += n;
+    alen -= n;
+    blen -= n;
+  }
+}
+
+// borrowed strings are not NUL terminated, so compare len - 1 bytes
+int sval_eq(struct elem *frame, struct elem *a, struct elem *b) {
+  if ( string_len(a) != string_len(b) || hashes_differ(elem_cached_hash(string_hash_cache(a)), elem_cached_hash(string_hash_cache(b))) ) {
+    return 0;
+  }
+  if ( is_rope(a) || is_rope(b) ) {
+    return rope_eq(a, b);
+  }
+  return memcmp(a->sval.str, b->sval.str, a->sval.len - 1) == 0;
+}
+
+int elem_eq(struct elem *frame, struct elem *a, struct elem *b) {
+  if ( a == b ) {
+    return 1;
+  }
+  if ( elem_type(a) != elem_type(b) ) {
+    return 0;
+  }
+  switch(elem_type(a)) {
+  case ELEM_TYPE_NIL:
+    return 0;
+  case ELEM_TYPE_INT:
+    return ival_eq(frame, a, b);
+  case ELEM_TYPE_BIGINT:
+    return bval_eq(frame, a, b);
+  case ELEM_TYPE_VECTOR:
+    return vval_eq(frame, a, b);
+  case ELEM_TYPE_PVEC:
+    return pval_eq(frame, a, b);
+  case ELEM_TYPE_LIST:
+    return list_eq(frame, a, b);
+  case ELEM_TYPE_SYM:
+    return 0; // interned, so only equal when identical
+  case ELEM_TYPE_IDENT:
+  case ELEM_TYPE_STRING:
+    return sval_eq(frame, a, b);
+  case ELEM_TYPE_ERROR:
+    return 0;
+  case ELEM_TYPE_SET:
+    return set_eq(frame, a, b);
+  case ELEM_TYPE_MAP:
+    return map_eq(frame, a, b);
+  case ELEM_TYPE_FN:
+  case ELEM_TYPE_FRAME:
+  case ELEM_TYPE_CODE:
+    return 0;
+  default:
+    abort(); // invalid type
+  }
+  return 0;
+}
+
+/*
+ * Maps are persistent hash array mapped tries (CHAMP layout). A node's
+ * slots hold popcount(datamap) inline key/value pairs followed by
+ * popcount(nodemap) sub nodes. Once the 32 bit hash is used up, keys that
+ * still collide share a node with no bitmaps and only key/value pairs.
+ * Small maps, which most frames are, skip the trie: up to MAP_FLAT_MAX
+ * entries sit in a list of keys and values, newest first, and one more
+ * turns the list into a trie.
+ */
+#define MAP_BITS      5
+#define MAP_MASK      31
+#define MAP_MAX_SHIFT 30
+#define MAP_FLAT_MAX  8
+
+uint32_t mix_hash(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdull;
+  x ^= x >> 33;
+  return (uint32_t)x;
+}
+
+/*
+ * Cells that are only equal to themselves hash by identity. Cells move
+ * when they are promoted, so rather than the address this is a number
+ * handed out on first use and kept in the header, which moves with them.
+ */
+uint32_t elem_identity_hash(struct elem *e) {
+  static __thread uint32_t next_hash = 0; // per thread, hashes need not be unique
+  uint32_t h = __atomic_load_n(&e->hash, __ATOMIC_RELAXED), unset = 0;
+  if ( h != 0 ) {
+    return h;
+  }
+  // pcall's threads may race to number a shared cell, and all must agree
+  h = mix_hash(++next_hash) | 1;
+  if ( ! __atomic_compare_exchange_n(&e->hash, &unset, h, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED) ) {
+    return unset;
+  }
+  return h;
+}
+
+/*
+ * Strings, sets and maps never change once made, so their hash is worked
+ * out on first use and kept in the cell. Pairs have no header to keep one
+ * in and are hashed afresh.
+ */
+uint32_t elem_hash(struct elem *frame, struct elem *e) {
+  uint32_t h, i, len;
+  struct elem **items;
+  struct map_iter it;
+  struct string_iter sit;
+  const char *run;
+  switch(elem_type(e)) {
+  case ELEM_TYPE_NIL:
+  case ELEM_TYPE_TRUE:
+  case ELEM_TYPE_FALSE:
+    return mix_hash(elem_type(e));
+  case ELEM_TYPE_INT:
+    return mix_hash(int_value(e));
+  case ELEM_TYPE_BIGINT:
+    h = ELEM_TYPE_BIGINT ^ e->bval.sign;
+    for(i=0;i<e->bval.len;++i) {
+      h = h * 31 + mix_hash(e->bval.limbs[i]);
+    }
+    return h;
+  case ELEM_TYPE_VECTOR:
+    if ( (h = elem_cached_hash(&e->hash)) != 0 ) {
+      return h;
+    }
+    h = ELEM_TYPE_VECTOR;
+    for(i=0;i<e->vval.len;++i) {
+      h = h * 31 + elem_hash(frame, vector_item(e, i));
+    }
+    return elem_cache_hash(&e->hash, h);
+  case ELEM_TYPE_PVEC:
+    if ( (h = elem_cached_hash(&e->hash)) != 0 ) {
+      return h;
+    }
+    h = ELEM_TYPE_PVEC;
+    for(i=0;i<e->pval.count;) {
+      items = pvec_chunk(e, i, &len);
+      for(i+=len;len>0;--len) {
+        h = h * 31 + elem_hash(frame, *items++);
+      }
+    }
+    return elem_cache_hash(&e->hash, h);
+  case ELEM_TYPE_SYM:
+    symbol_table_ready(); // hashes the builtin symbols
+    return e->sval.hash;
+  case ELEM_TYPE_IDENT:
+  case ELEM_TYPE_STRING:
+    if ( (h = elem_cached_hash(string_hash_cache(e))) != 0 ) {
+      return h;
+    }
+    h = 2166136261u;
+    string_iter_init(&sit, e);
+    while( string_iter_next(&sit, &run, &len) ) {
+      h = str_hash_more(h, run, len);
+    }
+    return elem_cache_hash(string_hash_cache(e), h ^ e->type);
+  case ELEM_TYPE_LIST:
+    h = ELEM_TYPE_LIST;
+    while( ! list_is_empty(e) ) {
+      h = h * 31 + elem_hash(frame, list_value(e));
+      e = list_next(e);
+    }
+    return h;
+  case ELEM_TYPE_SET:
+    if ( ! is_immediate(e) && (h = elem_cached_hash(&e->hash)) != 0 ) {
+      return h;
+    }
+    h = ELEM_TYPE_SET;
+    map_iter_init(&it, e);
+    while( map_iter_next(&it) ) {
+      h += mix_hash(elem_hash(frame, it.key));
+    }
+    return is_immediate(e) ? h : elem_cache_hash(&e->hash, h);
+  case ELEM_TYPE_MAP:
+    if ( ! is_immediate(e) && (h = elem_cached_hash(&e->hash)) != 0 ) {
+      return h;
+    }
+    h = ELEM_TYPE_MAP;
+    map_iter_init(&it, e);
+    while( map_iter_next(&it) ) {
+      h += mix_hash(elem_hash(frame, it.key)) ^ elem_hash(frame, it.value);
+    }
+    return is_immediate(e) ? h : elem_cache_hash(&e->hash, h);
+  default:
+    return elem_identity_hash(e);
+  }
+}
+
+int is_collision_node(struct elem *n) {
+  return n->nval.datamap == 0 && n->nval.nodemap == 0;
+}
+
+uint32_t map_node_data_index(struct elem *n, uint32_t bit) {
+  return 2 * __builtin_popcount(n->nval.datamap & (bit - 1));
+}
+
+uint32_t map_node_node_index(struct elem *n, uint32_t bit) {
+  return 2 * __builtin_popcount(n->nval.datamap) + __builtin_popcount(n->nval.nodemap & (bit - 1));
+}
+
+/*
+ * The pair holding k in a small map's list, or the empty list. Fixnums
+ * and symbols are only equal to themselves, so those are looked for by
+ * address alone.
+ */
+struct elem *map_list_find(struct elem *frame, struct elem *l, struct elem *k) {
+  if ( is_fixnum(k) || elem_type(k) == ELEM_TYPE_SYM ) {
+    while( ! list_is_empty(l) && list_value(l) != k ) {
+      l = list_next(list_next(l));
+    }
+    return l;
+  }
+  while( ! list_is_empty(l) && ! elem_eq(frame, list_value(l), k) ) {
+    l = list_next(list_next(l));
+  }
+  return l;
+}
+
+struct elem **map_find(struct elem *frame, struct elem *m, struct elem *k) {
+  struct elem *n = map_root(m);
+  uint32_t hash, shift = 0, bit, i;
+  if ( n != 0 && is_pair(n) ) {
+    n = map_list_find(frame, n, k);
+    return list_is_empty(n) ? 0 : &pair_of(list_next(n))->value;
+  }
+  hash = elem_hash(frame, k);
+  while( n != 0 ) {
+    if ( shift > MAP_MAX_SHIFT ) {
+      for(i=0;i<n->nval.len;i+=2) {
+        if ( elem_eq(frame, n->nval.slots[i], k) ) {
+          return n->nval.slots + i + 1;
+        }
+      }
+      return 0;
+    }
+    bit = 1u << ((hash >> shift) & MAP_MASK);
+    if ( n->nval.datamap & bit ) {
+      i = map_node_data_index(n, bit);
+      if ( elem_eq(frame, n->nval.slots[i], k) ) {
+        return n->nval.slots + i + 1;
+      }
+      return 0;
+    }
+    if ( n->nval.nodemap & bit ) {
+      n = n->nval.slots[map_node_node_index(n, bit)];
+      shift += MAP_BITS;
+      continue;
+    }
+    return 0;
+  }
+  return 0;
+}
+
+struct elem *map_get(struct elem *frame, struct elem *m, struct elem *k) {
+  struct elem **v = map_find(frame, m, k);
+  return v != 0 ? *v : nil();
+}
+
+struct elem *new_map_node(struct elem *a, uint32_t datamap, uint32_t nodemap, uint32_t len) {
+  struct elem *n = alloc_elem(a);
+  n->type = ELEM_TYPE_MAP_NODE;
+  n->nval.datamap = datamap;
+  n->nval.nodemap = nodemap;
+  n->nval.len = len;
+  n->nval.slots = (struct elem **)alloc_bytes(a->aval.alloc, (size_t)len * sizeof(struct elem *));
+  if ( (size_t)len * sizeof(struct elem *) > ALLOC_BYTES_MAX ) {
+    alloc_young_owner(a->aval.alloc, n);
+  }
+  return n;
+}
+
+struct elem *map_node_copy(struct elem *a, struct elem *n) {
+  struct elem *r = new_map_node(a, n->nval.datamap, n->nval.nodemap, n->nval.len);
+  memcpy(r->nval.slots, n->nval.slots, n->nval.len * sizeof(struct elem *));
+  return r;
+}
+
+struct elem *map_node_merge(
+  struct elem *a, 
+  struct elem *k1, struct elem *v1, uint32_t h1, 
+  struct elem *k2, struct elem *v2, uint32_t h2, 
+  uint32_t shift
+) {
+  struct elem *n;
+  uint32_t b1, b2;
+  if ( shift > MAP_MAX_SHIFT ) {
+    n = new_map_node(a, 0, 0, 4);
+    n->nval.slots[0] = k1;
+    n->nval.slots[1] = v1;
+    n->nval.slots[2] = k2;
+    n->nval.slots[3] = v2;
+    return n;
+  }
+  b1 = (h1 >> shift) & MAP_MASK;
+  b2 = (h2 >> shift) & MAP_MASK;
+  if ( b1 == b2 ) {
+    n = new_map_node(a, 0, 1u << b1, 1);
+    n->nval.slots[0] = map_node_merge(a, k1, v1, h1, k2, v2, h2, shift + MAP_BITS);
+    return n;
+  }
+  n = new_map_node(a, (1u << b1) | (1u << b2), 0, 4);
+  if ( b1 < b2 ) {
+    n->nval.slots[0] = k1;
+    n->nval.slots[1] = v1;
+    n->nval.slots[2] = k2;
+    n->nval.slots[3] = v2;
+  } else {
+    n->nval.slots[0] = k2;
+    n->nval.slots[1] = v2;
+    n->nval.slots[2] = k1;
+    n->nval.slots[3] = v1;
+  }
+  return n;
+}
+
+struct elem *map_node_set(
+  struct elem *a, 
+  struct elem *frame,
+  struct elem *n, 
+  struct elem *k, 
+  struct elem *v, 
+  uint32_t hash, 
+  uint32_t shift,
+  int *added
+) {
+  struct elem *r, *child, *sub;
+  uint32_t bit, i, j;
+
+  if ( shift > MAP_MAX_SHIFT ) {
+    for(i=0;i<n->nval.len;i+=2) {
+      if ( elem_eq(frame, n->nval.slots[i], k) ) {
+        if ( n->nval.slots[i + 1] == v ) {
+          return n;
+        }
+        r = map_node_copy(a, n);
+        r->nval.slots[i + 1] = v;
+        return r;
+      }
+    }
+    r = new_map_node(a, 0, 0, n->nval.len + 2);
+    memcpy(r->nval.slots, n->nval.slots, n->nval.len * sizeof(struct elem *));
+    r->nval.slots[n->nval.len] = k;
+    r->nval.slots[n->nval.len + 1] = v;
+    *added = 1;
+    return r;
+  }
+
+  bit = 1u << ((hash >> shift) & MAP_MASK);
+
+  if ( n->nval.datamap & bit ) {
+    i = map_node_data_index(n, bit);
+    if ( elem_eq(frame, n->nval.slots[i], k) ) {
+      if ( n->nval.slots[i + 1] == v ) {
+        return n;
+      }
+      r = map_node_copy(a, n);
+      r->nval.slots[i + 1] = v;
+      return r;
+    }
+    // push the existing entry down into a sub node with the new one
+    sub = map_node_merge(a, 
+      n->nval.slots[i], n->nval.slots[i + 1], elem_hash(frame, n->nval.slots[i]),
+      k, v, hash, shift + MAP_BITS);
+    r = new_map_node(a, n->nval.datamap & ~bit, n->nval.nodemap | bit, n->nval.len - 1);
+    j = map_node_node_index(r, bit);
+    memcpy(r->nval.slots, n->nval.slots, i * sizeof(struct elem *));
+    memcpy(r->nval.slots + i, n->nval.slots + i + 2, (j - i) * sizeof(struct elem *));
+    r->nval.slots[j] = sub;
+    memcpy(r->nval.slots + j + 1, n->nval.slots + j + 2, (r->nval.len - j - 1) * sizeof(struct elem *));
+    *added = 1;
+    return r;
+  }
+
+  if ( n->nval.nodemap & bit ) {
+    j = map_node_node_index(n, bit);
+    child = n->nval.slots[j];
+    sub = map_node_set(a, frame, child, k, v, hash, shift + MAP_BITS, added);
+    if ( sub == child ) {
+      return n;
+    }
+    r = map_node_copy(a, n);
+    r->nval.slots[j] = sub;
+    return r;
+  }
+
+  i = map_node_data_index(n, bit);
+  r = new_map_node(a, n->nval.datamap | bit, n->nval.nodemap, n->nval.len + 2);
+  memcpy(r->nval.slots, n->nval.slots, i * sizeof(struct elem *));
+  r->nval.slots[i] = k;
+  r->nval.slots[i + 1] = v;
+  memcpy(r->nval.slots + i + 2, n->nval.slots + i, (n->nval.len - i) * sizeof(struct elem *));
+  *added = 1;
+  return r;
+}
+
+/*
+ * The trie of the len / 2 keys and values in kv, no two keys equal, made
+ * as one node with sub nodes only where hash bits meet.
+ */
+struct elem *map_build(struct elem *a, struct elem *frame, struct elem **kv, uint32_t len) {
+  struct elem *r, *subs[32];
+  uint32_t hashes[MAP_FLAT_MAX + 1], first[32], seen = 0, shared = 0, pending = 0, bits, bit, b, i, j;
+  int added;
+  assert(len <= 2 * (MAP_FLAT_MAX + 1));
+  for(i=0;i<len;i+=2) {
+    hashes[i / 2] = elem_hash(frame, kv[i]);
+    bit = 1u << (hashes[i / 2] & MAP_MASK);
+    shared |= seen & bit;
+    seen |= bit;
+  }
+  r = new_map_node(a, seen & ~shared, shared, 2 * __builtin_popcount(seen & ~shared) + __builtin_popcount(shared));
+  for(i=0;i<len;i+=2) {
+    b = hashes[i / 2] & MAP_MASK;
+    bit = 1u << b;
+    if ( ! (shared & bit) ) {
+      j = map_node_data_index(r, bit);
+      r->nval.slots[j] = kv[i];
+      r->nval.slots[j + 1] = kv[i + 1];
+    } else if ( ! (pending & bit) ) {
+      first[b] = i;
+      subs[b] = 0;
+      pending |= bit;
+    } else if ( subs[b] == 0 ) {
+      j = first[b];
+      subs[b] = map_node_merge(a, kv[j], kv[j + 1], hashes[j / 2], kv[i], kv[i + 1], hashes[i / 2], MAP_BITS);
+    } else {
+      subs[b] = map_node_set(a, frame, subs[b], kv[i], kv[i + 1], hashes[i / 2], MAP_BITS, &added);
+    }
+  }
+  for(bits=shared;bits!=0;bits&=bits-1) {
+    r->nval.slots[map_node_node_index(r, bits & -bits)] = subs[__builtin_ctz(bits)];
+  }
+  return r;
+}
+
+// the trie of a small map's list, with k set to v as well unless k is 0
+struct elem *map_list_promote(struct elem *a, struct elem *frame, struct elem *l, struct elem *k, struct elem *v) {
+  struct elem *kv[2 * (MAP_FLAT_MAX + 1)];
+  uint32_t len = 0;
+  for(;!list_is_empty(l);l=list_next(l)) {
+    assert(len < 2 * MAP_FLAT_MAX);
+    kv[len++] = list_value(l);
+  }
+  if ( k != 0 ) {
+    kv[len++] = k;
+    kv[len++] = v;
+  }
+  return map_build(a, frame, kv, len);
+}
+
+// a copy of a small map's list, with the key in pair at given v
+struct elem *map_list_replace(struct elem *a, struct elem *l, struct elem *at, struct elem *v) {
+  struct elem *items[2 * MAP_FLAT_MAX], *r;
+  uint32_t n = 0;
+  r = alloc_pair(a, ELEM_TAG_LIST, list_value(at), 
+    alloc_pair(a, ELEM_TAG_LIST, v, list_next(list_next(at))));
+  for(;l!=at;l=list_next(l)) {
+    items[n++] = list_value(l);
+  }
+  while( n > 0 ) {
+    r = alloc_pair(a, ELEM_TAG_LIST, items[--n], r);
+  }
+  return r;
+}
+
+struct elem *alloc_map_set(
+  struct elem *a, 
+  struct elem *frame, 
+  struct elem *m, 
+  struct elem *k, 
+  struct elem *v
+) {
+  struct elem *ret, *root = map_root(m), *at;
+  int added = 0;
+
+  if ( root == 0 || is_pair(root) ) {
+    at = root != 0 ? map_list_find(frame, root, k) : ELEM_EMPTY_LIST;
+    if ( ! list_is_empty(at) ) {
+      if ( list_value(list_next(at)) == v ) {
+        return m;
+      }
+      root = map_list_replace(a, root, at, v);
+    } else if ( map_count(m) < MAP_FLAT_MAX ) {
+      root = alloc_pair(a, ELEM_TAG_LIST, k, 
+        alloc_pair(a, ELEM_TAG_LIST, v, root != 0 ? root : ELEM_EMPTY_LIST));
+      added = 1;
+    } else {
+      root = map_list_promote(a, frame, root, k, v);
+      added = 1;
+    }
+  } else {
+    root = map_node_set(a, frame, root, k, v, elem_hash(frame, k), 0, &added);
+    if ( root == m->mval.root ) {
+      return m;
+    }
+  }
+
+  ret = alloc_elem(a);
+  ret->type = elem_type(m);
+  ret->mval.root = root;
+  ret->mval.count = map_count(m) + added;
+  return ret;
+}
+
+struct elem *map_set(
+  struct elem *frame, 
+  struct elem *m, 
+  struct elem *k, 
+  struct elem *v
+) {
+  return alloc_map_set(frame_of(frame)->alloc, frame, m, k, v);
+}
+
+struct elem *list_add(
+  struct elem *frame,
+  struct elem *l,
+  struct elem *v
+) {
+  return alloc_list(frame, l, v);
+}
+
+/*
+ * Set algebra works on the tries directly. Both sides hash the same way,
+ * so only entries under the same bit of nodes at the same depth can be
+ * equal, and a subtree that only one side has is kept or dropped whole.
+ * A data entry facing a sub node is handled as a node holding just that
+ * entry, which lives on the C stack and is never kept.
+ */
+#define SET_UNION        0
+#define SET_INTERSECTION 1
+#define SET_DIFFERENCE   2
+
+struct map_node_builder {
+  uint32_t datamap;
+  uint32_t nodemap;
+  uint32_t ndata;
+  uint32_t nnodes;
+  struct elem *data[2 * (MAP_MASK + 1)];
+  struct elem *nodes[MAP_MASK + 1];
+};
+
+void map_builder_data(struct map_node_builder *t, uint32_t bit, struct elem *k, struct elem *v) {
+  t->datamap |= bit;
+  t->data[t->ndata++] = k;
+  t->data[t->ndata++] = v;
+}
+
+// a node left with one entry moves up into its parent as data
+void map_builder_node(struct map_node_builder *t, uint32_t bit, struct elem *n) {
+  if ( n == 0 ) {
+    return;
+  }
+  if ( n->nval.nodemap == 0 && n->nval.len == 2 ) {
+    map_builder_data(t, bit, n->nval.slots[0], n->nval.slots[1]);
+    return;
+  }
+  t->nodemap |= bit;
+  t->nodes[t->nnodes++] = n;
+}
+
+// x itself if the builder holds what x does, so unchanged subtrees stay shared
+struct elem *map_builder_build(struct elem *a, struct map_node_builder *t, struct elem *x) {
+  struct elem *n;
+  if ( t->ndata == 0 && t->nnodes == 0 ) {
+    return 0;
+  }
+  if ( t->datamap == x->nval.datamap && t->nodemap == x->nval.nodemap 
+    && memcmp(x->nval.slots, t->data, t->ndata * sizeof(struct elem *)) == 0 
+    && memcmp(x->nval.slots + t->ndata, t->nodes, t->nnodes * sizeof(struct elem *)) == 0 ) {
+    return x;
+  }
+  n = new_map_node(a, t->datamap, t->nodemap, t->ndata + t->nnodes);
+  memcpy(n->nval.slots, t->data, t->ndata * sizeof(struct elem *));
+  memcpy(n->nval.slots + t->ndata, t->nodes, t->nnodes * sizeof(struct elem *));
+  return n;
+}
+
+int map_node_has_key(struct elem *frame, struct elem *n, struct elem *k) {
+  uint32_t i;
+  for(i=0;i<n->nval.len;i+=2) {
+    if ( elem_eq(frame, n->nval.slots[i], k) ) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// whether the collision entry of side x at i goes into the combined node
+int map_collision_keeps(struct elem *frame, struct elem *x, struct elem *y, uint32_t i, int from_y, int op) {
+  if ( from_y ) {
+    return op == SET_UNION && ! map_node_has_key(frame, y, x->nval.slots[i]);
+  }
+  return op == SET_UNION || map_node_has_key(frame, y, x->nval.slots[i]) == (op == SET_INTERSECTION);
+}
+
+/*
+ * Past the last level of hash bits nodes are short lists of colliding keys.
+ * The entries are counted before the node is made, so its slots are asked
+ * for at the length they keep.
+ */
+struct elem *map_collision_combine(
+  struct elem *a, struct elem *frame, struct elem *x, struct elem *y, int op, uint32_t *common
+) {
+  struct elem *n;
+  uint32_t i, len = 0;
+  for(i=0;i<x->nval.len;i+=2) {
+    *common += map_node_has_key(frame, y, x->nval.slots[i]);
+    len += 2 * map_collision_keeps(frame, x, y, i, 0, op);
+  }
+  for(i=0;op==SET_UNION&&i<y->nval.len;i+=2) {
+    len += 2 * map_collision_keeps(frame, y, x, i, 1, op);
+  }
+  if ( len == x->nval.len ) {
+    return x;
+  }
+  if ( len == 0 ) {
+    return 0;
+  }
+  n = new_map_node(a, 0, 0, len);
+  len = 0;
+  for(i=0;i<x->nval.len;i+=2) {
+    if ( map_collision_keeps(frame, x, y, i, 0, op) ) {
+      n->nval.slots[len++] = x->nval.slots[i];
+      n->nval.slots[len++] = x->nval.slots[i + 1];
+    }
+  }
+  for(i=0;op==SET_UNION&&i<y->nval.len;i+=2) {
+    if ( map_collision_keeps(frame, y, x, i, 1, op) ) {
+      n->nval.slots[len++] = y->nval.slots[i];
+      n->nval.slots[len++] = y->nval.slots[i + 1];
+    }
+  }
+  return n;
+}
+
+struct elem *map_node_combine(
+  struct elem *a, struct elem *frame, struct elem *x, struct elem *y, 
+  uint32_t shift, int op, uint32_t *common
+);
+
+// combines a data entry with the sub node facing it on the other side
+struct elem *map_node_combine_data(
+  struct elem *a, struct elem *frame, struct elem *k, struct elem *v, struct elem *n,
+  int data_is_x, uint32_t shift, int op, uint32_t *common
+) {
+  struct elem single, *slots[2] = { k, v };
+  single.nval.datamap = shift > MAP_MAX_SHIFT ? 0 : 1u << ((elem_hash(frame, k) >> shift) & MAP_MASK);
+  single.nval.nodemap = 0;
+  single.nval.len = 2;
+  single.nval.slots = slots;
+  if ( data_is_x ) {
+    return map_node_combine(a, frame, &single, n, shift, op, common);
+  }
+  return map_node_combine(a, frame, n, &single, shift, op, common);
+}
+
+struct elem *map_node_combine(
+  struct elem *a, struct elem *frame, struct elem *x, struct elem *y, 
+  uint32_t shift, int op, uint32_t *common
+) {
+  struct map_node_builder t;
+  struct elem *kx = 0, *vx = 0, *ky = 0, *vy = 0, *nx = 0, *ny = 0;
+  uint32_t bits, bit, i;
+  int eq;
+
+  if ( shift > MAP_MAX_SHIFT ) {
+    return map_collision_combine(a, frame, x, y, op, common);
+  }
+  t.datamap = t.nodemap = t.ndata = t.nnodes = 0;
+  bits = x->nval.datamap | x->nval.nodemap | y->nval.datamap | y->nval.nodemap;
+  while( bits != 0 ) {
+    bit = bits & -bits;
+    bits &= bits - 1;
+    if ( x->nval.datamap & bit ) {
+      i = map_node_data_index(x, bit);
+      kx = x->nval.slots[i];
+      vx = x->nval.slots[i + 1];
+    } else if ( x->nval.nodemap & bit ) {
+      nx = x->nval.slots[map_node_node_index(x, bit)];
+    }
+    if ( y->nval.datamap & bit ) {
+      i = map_node_data_index(y, bit);
+      ky = y->nval.slots[i];
+      vy = y->nval.slots[i + 1];
+    } else if ( y->nval.nodemap & bit ) {
+      ny = y->nval.slots[map_node_node_index(y, bit)];
+    }
+
+    if ( ! ((x->nval.datamap | x->nval.nodemap) & bit) ) {
+      if ( op == SET_UNION ) {
+        if ( ny != 0 ) {
+          map_builder_node(&t, bit, ny);
+        } else {
+          map_builder_data(&t, bit, ky, vy);
+        }
+      }
+    } else if ( ! ((y->nval.datamap | y->nval.nodemap) & bit) ) {
+      if ( op != SET_INTERSECTION ) {
+        if ( nx != 0 ) {
+          map_builder_node(&t, bit, nx);
+        } else {
+          map_builder_data(&t, bit, kx, vx);
+        }
+      }
+    } else if ( nx != 0 && ny != 0 ) {
+      map_builder_node(&t, bit, map_node_combine(a, frame, nx, ny, shift + MAP_BITS, op, common));
+    } else if ( nx != 0 ) {
+      map_builder_node(&t, bit, 
+        map_node_combine_data(a, frame, ky, vy, nx, 0, shift + MAP_BITS, op, common));
+    } else if ( ny != 0 ) {
+      map_builder_node(&t, bit, 
+        map_node_combine_data(a, frame, kx, vx, ny, 1, shift + MAP_BITS, op, common));
+    } else {
+      eq = elem_eq(frame, kx, ky);
+      *common += eq;
+      if ( eq ? op != SET_DIFFERENCE : op == SET_DIFFERENCE ) {
+        map_builder_data(&t, bit, kx, vx);
+      } else if ( op == SET_UNION ) {
+        map_builder_node(&t, bit, map_node_merge(a, 
+          kx, vx, elem_hash(frame, kx), ky, vy, elem_hash(frame, ky), shift + MAP_BITS));
+      }
+    }
+    nx = ny = 0;
+  }
+  return map_builder_build(a, &t, x);
+}
+
+struct elem *set_combine(struct elem *frame, struct elem *x, struct elem *y, int op) {
+  struct elem *a = frame_of(frame)->alloc, *root, *rx = map_root(x), *ry = map_root(y), *ret;
+  uint32_t common = 0, count;
+  if ( rx == 0 || ry == 0 ) {
+    if ( op == SET_INTERSECTION ) {
+      return empty_set();
+    }
+    return op == SET_UNION && rx == 0 ? y : x;
+  }
+  // small sets combine as tries
+  rx = is_pair(rx) ? map_list_promote(a, frame, rx, 0, 0) : rx;
+  ry = is_pair(ry) ? map_list_promote(a, frame, ry, 0, 0) : ry;
+  root = map_node_combine(a, frame, rx, ry, 0, op, &common);
+  if ( root == rx ) {
+    return x;
+  }
+  if ( root == 0 ) {
+    return empty_set();
+  }
+  switch(op) {
+  case SET_UNION:
+    count = set_count(x) + set_count(y) - common;
+    break;
+  case SET_INTERSECTION:
+    count = common;
+    break;
+  default:
+    count = set_count(x) - common;
+  }
+  ret = frame_alloc_elem(frame);
+  ret->type = ELEM_TYPE_SET;
+  ret->mval.root = root;
+  ret->mval.count = count;
+  return ret;
+}
+
+// sets are maps from each member to true, on the same trie
+struct elem *set_add(
+  struct elem *frame,
+  struct elem *s,
+  struct elem *v
+) {
+  return map_set(frame, s, v, true_value());
+}
+
+struct elem *set_union(struct elem *frame, struct elem *a, struct elem *b) {
+  return set_combine(frame, a, b, SET_UNION);
+}
+
+struct elem *set_intersection(struct elem *frame, struct elem *a, struct elem *b) {
+  return set_combine(frame, a, b, SET_INTERSECTION);
+}
+
+struct elem *set_difference(struct elem *frame, struct elem *a, struct elem *b) {
+  return set_combine(frame, a, b, SET_DIFFERENCE);
+}
+
+struct elem* env_set(struct elem *frame, struct elem *key, struct elem *value) {
+  struct frame *f = frame_of(frame);
+  frame_remember(frame);
+  f->env = map_set(frame, f->env, key, value);
+  return frame;
+}
+
+struct elem* env_get(struct elem *frame, struct elem *key) {
+  return map_get(frame, frame_of(frame)->env, key);
+}
+
+struct elem* frame_set(struct elem *frame, struct elem *key, struct elem *value) {
+  struct frame *f = frame_of(frame);
+  frame_remember(frame);
+  if ( key == sym_lhs() ) {
+    f->lhs = value;
+  } else if ( key == sym_rhs() ) {
+    f->rhs = value;
+  } else if ( key == sym_parent() ) {
+    f->parent = value;
+  } else if ( key == sym_env() ) {
+    f->env = value;
+  } else if ( key == sym_alloc() ) {
+    f->alloc = value;
+  } else {
+    f->ext = map_set(frame, f->ext, key, value);
+  }
+  return frame;
+}
+
+struct elem* frame_get(struct elem *frame, struct elem *key) {
+  struct frame *f = frame_of(frame);
+  if ( key == sym_lhs() ) {
+    return f->lhs;
+  } else if ( key == sym_rhs() ) {
+    return f->rhs;
+  } else if ( key == sym_parent() ) {
+    return f->parent;
+  } else if ( key == sym_env() ) {
+    return f->env;
+  } else if ( key == sym_alloc() ) {
+    return f->alloc;
+  }
+  return map_get(frame, f->ext, key);
+}
+
+// a map holding the registers and ext slots, for code that wants a value
+struct elem *frame_to_map(struct elem *frame) {
+  struct frame *f = frame_of(frame);
+  struct elem *m = f->ext;
+  m = map_set(frame, m, sym_lhs(), f->lhs);
+  m = map_set(frame, m, sym_rhs(), f->rhs);
+  m = map_set(frame, m, sym_parent(), f->parent);
+  m = map_set(frame, m, sym_env(), f->env);
+  m = map_set(frame, m, sym_alloc(), f->alloc);
+  return m;
+}
+
+struct elem* new_child_frame(struct elem* frame, 
+                             struct elem *e) {
+  struct elem* nf = new_frame(frame_of(frame)->alloc);
+  struct frame *f = frame_of(nf);
+  f->parent = frame;
+  f->env = frame_of(frame)->env;
+  f->lhs = empty_list();
+  f->rhs = e;
+  return nf;
+}
+
+struct elem *new_error(struct elem *frame, char *str) {
+  struct elem *e = frame_alloc_elem(frame);
+  struct elem *m = empty_map();
+
+  m = map_set(frame, m, sym_msg(), new_string(frame, str));
+  m = map_set(frame, m, sym_frame(), frame);
+  
+  e->type = ELEM_TYPE_ERROR;
+  e->eval.map = m;
+  
+  return e;
+}
+
+struct elem *list_reverse(struct elem *frame, struct elem *l) {
+  struct elem *r = empty_list();
+  while( ! list_is_empty(l) ) {
+    r = list_add(frame, r, list_value(l));
+    l = list_next(l);
+  }
+  return r;
+}
+
+struct elem *frame_error(struct elem *frame, struct elem *error) {
+  abort();
+}
+
+/*
+ * Hands value to the frame waiting on this one. A frame without a parent
+ * keeps the value in lhs and sets rhs to nil, which ends frame_eval.
+ */
+struct elem *frame_return(struct elem *frame, struct elem *value) {
+  struct elem *parent = frame_of(frame)->parent;
+  if ( is_nil(parent) ) {
+    frame_remember(frame);
+    frame_of(frame)->lhs = value;
+    frame_of(frame)->rhs = nil();
+    return frame;
+  }
+  frame_remember(parent);
+  frame_of(parent)->lhs = list_add(parent, frame_of(parent)->lhs, value);
+  return parent;
+}
+
+#define NATIVE_STACK_ARGS 16
+
+struct elem *native_apply(struct elem *frame, struct elem *fn, struct elem *args) {
+  struct elem *stack[NATIVE_STACK_ARGS], **argv = stack, *l, *value;
+  uint32_t n = 0, i;
+  for(l=args;!list_is_empty(l);l=list_next(l)) {
+    n++;
+  }
+  if ( n > NATIVE_STACK_ARGS ) {
+    argv = NEW_ARRAY(struct elem *, n);
+  }
+  for(i=0,l=args;i<n;++i,l=list_next(l)) {
+    argv[i] = list_value(l);
+  }
+  value = fn->fval.native(frame, argv, n);
+  if ( argv != stack ) {
+    FREE_ARRAY(argv);
+  }
+  return value;
+}
+
+// user functions see the root frame's env plus their arguments
+struct elem *global_env(struct elem *frame) {
+  return frame_of(frame_alloc(frame)->root)->env;
+}
+
+struct elem *frame_call(
+  struct elem *frame, 
+  struct elem *fn, 
+  struct elem *args
+) {
+  if ( fn->flags & ELEM_FLAG_NATIVE ) {
+    return frame_return(frame, native_apply(frame, fn, args));
+  } else if ( fn->fval.fn != 0 ) {
+    struct elem *child_frame = new_child_frame(frame, args);
+    return fn->fval.fn(child_frame);
+  } else {
+    /*
+     * The body takes over the calling frame's place, returning to its
+     * parent. The caller has nothing left to do, so unless it is the root
+     * frame it is reused in place and tail calls run in constant space.
+     */
+    struct elem *child_frame = frame;
+    struct elem *fn_args = fn->fval.args;
+    struct elem *env = global_env(frame);
+    if ( frame == frame_alloc(frame)->root ) {
+      child_frame = new_frame(frame_of(frame)->alloc);
+      frame_of(child_frame)->parent = frame_of(frame)->parent;
+    }
+    frame_remember(child_frame);
+    frame_of(child_frame)->lhs = empty_list();
+    frame_of(child_frame)->rhs = fn->fval.expr;
+    frame_of(child_frame)->ext = empty_map();
+    while( ! list_is_empty(args) && ! list_is_empty(fn_args) ) {
+      env = map_set(frame, env, to_sym(frame, list_value(fn_args)), list_value(args));
+      args = list_next(args);
+      fn_args = list_next(fn_args);
+    }
+    frame_of(child_frame)->env = env;
+    return child_frame;
+  }
+}
+
+/*
+ * (if test then else) is the one special form. While the test is being
+ * evaluated the frame's lhs holds IF_PENDING under it, and once it has a
+ * value the frame goes on to evaluate the chosen branch in its own place.
+ */
+struct elem IF_PENDING = {
+  .type       = ELEM_TYPE_SYM,
+  .sval.len   = sizeof("if"),
+  .sval.str   = (char *)"if"
+};
+
+int is_if_form(struct elem *frame, struct elem *head) {
+  return is_ident(head) && to_sym(frame, head) == sym_if();
+}
+
+int is_if_pending(struct elem *lhs) {
+  return ! list_is_empty(lhs) && ! list_is_empty(list_next(lhs)) 
+    && list_value(list_next(lhs)) == &IF_PENDING;
+}
+
+struct elem *frame_if(struct elem *frame, struct elem *test, struct elem *branches) {
+  if ( ! is_true(test) && ! list_is_empty(branches) ) {
+    branches = list_next(branches);
+  }
+  if ( list_is_empty(branches) ) {
+    return frame_return(frame, nil());
+  }
+  frame_remember(frame);
+  frame_of(frame)->lhs = empty_list();
+  frame_of(frame)->rhs = list_value(branches);
+  return frame;
+}
+
+int is_pcall_form(struct elem *frame, struct elem *head) {
+  return is_ident(head) && to_sym(frame, head) == sym_pcall();
+}
+
+/*
+ * (pcall f a b ...) is a call whose arguments are evaluated at the same
+ * time. Each argument that is itself a call becomes a task on a work
+ * stealing pool: the calling thread pushes its tasks on the bottom of its
+ * own deque and works through them from there while the pool's threads
+ * steal from the top of every deque. A task evaluates in the caller's
+ * alloc, on a tlab of the thread running it, against the caller's env,
+ * which nothing changes until the join. The env, the arguments and their
+ * values are roots of the caller while it waits, so collections started
+ * by any task move them along. What a task prints is held back and
+ * written out in argument order after the join, so the output is the same
+ * as from a plain call.
+ */
+#define POOL_DEQUES  64
+#define POOL_THREADS 32
+
+struct join {
+  pthread_mutex_t lock;
+  pthread_cond_t  done;
+  uint32_t        pending;
+  uint32_t        n;
+  struct elem    *alloc; // the caller's, which tasks allocate in
+  struct alloc_roots roots; // the caller's frame, its env, then n args and n values
+};
+
+struct task {
+  struct join *join;
+  uint32_t     index;
+  char        *out;
+  size_t       out_len;
+};
+
+struct deque {
+  pthread_mutex_t lock;
+  struct task   **table;
+  uint32_t        cap;
+  uint32_t        head; // thieves take from here
+  uint32_t        tail; // the owner pushes and pops here
+  int             in_use;
+};
+
+struct pool {
+  pthread_mutex_t lock;
+  pthread_cond_t  wake;
+  struct deque   *deques[POOL_DEQUES];
+  uint32_t        ndeques;
+  uint32_t        queued;
+  uint32_t        sleeping;
+  uint32_t        nthreads;
+  int             started;
+  int             stop;
+  pthread_t       threads[POOL_THREADS];
+};
+
+struct pool POOL = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+// the deque of this thread's tasks, held while it is inside a pcall
+__thread struct deque *POOL_DEQUE = 0;
+__thread uint32_t POOL_DEPTH = 0;
+
+// called with the pool lock held, 0 once every deque is taken
+struct deque *pool_take_deque() {
+  struct deque *d;
+  uint32_t i;
+  for(i=0;i<POOL.ndeques;++i) {
+    if ( ! POOL.deques[i]->in_use ) {
+      POOL.deques[i]->in_use = 1;
+      return POOL.deques[i];
+    }
+  }
+  if ( POOL.ndeques == POOL_DEQUES ) {
+    return 0;
+  }
+  d = NEW(struct deque);
+  pthread_mutex_init(&d->lock, 0);
+  d->in_use = 1;
+  POOL.deques[POOL.ndeques] = d;
+  __atomic_store_n(&POOL.ndeques, POOL.ndeques + 1, __ATOMIC_RELEASE);
+  return d;
+}
+
+void deque_push(struct deque *d, struct task *t) {
+  pthread_mutex_lock(&d->lock);
+  if ( d->tail == d->cap && d->head > 0 ) {
+    memmove(d->table, d->table + d->head, (d->tail - d->head) * sizeof(struct task *));
+    d->tail -= d->head;
+    d->head = 0;
+  }
+  if ( d->tail == d->cap ) {
+    d->cap = d->cap ? d->cap * 2 : 64;
+    d->table = (struct task **)realloc(d->table, d->cap * sizeof(struct task *));
+  }
+  d->table[d->tail++] = t;
+  pthread_mutex_unlock(&d->lock);
+}
+
+struct task *deque_take(struct deque *d, int steal) {
+  struct task *t = 0;
+  pthread_mutex_lock(&d->lock);
+  if ( d->head < d->tail ) {
+    t = steal ? d->table[d->head++] : d->table[--d->tail];
+    if ( d->head == d->tail ) {
+      d->head = d->tail = 0;
+    }
+    __atomic_sub_fetch(&POOL.queued, 1, __ATOMIC_SEQ_CST);
+  }
+  pthread_mutex_unlock(&d->lock);
+  return t;
+}
+
+void pool_push(struct task *t) {
+  deque_push(POOL_DEQUE, t);
+  __atomic_add_fetch(&POOL.queued, 1, __ATOMIC_SEQ_CST);
+  if ( __atomic_load_n(&POOL.sleeping, __ATOMIC_SEQ_CST) != 0 ) {
+    pthread_mutex_lock(&POOL.lock);
+    pthread_cond_signal(&POOL.wake);
+    pthread_mutex_unlock(&POOL.lock);
+  }
+}
+
+// tries every other thread's deque once, from a different one each time
+struct task *pool_steal() {
+  static __thread uint32_t next = 0;
+  uint32_t n = __atomic_load_n(&POOL.ndeques, __ATOMIC_ACQUIRE), i;
+  struct deque *d;
+  struct task *t;
+  for(i=0;i<n;++i) {
+    d = POOL.deques[(next + i) % n];
+    if ( d != POOL_DEQUE && (t = deque_take(d, 1)) != 0 ) {
+      next = (next + i + 1) % n;
+      return t;
+    }
+  }
+  return 0;
+}
+
+// own is set when the thread is already running in the task's alloc
+void task_run(struct task *t, int own) {
+  struct join *join = t->join;
+  struct alloc *alloc = join->alloc->aval.alloc;
+  struct alloc_tlab *saved = TLAB, *tlab = own ? alloc_tlab(alloc) : alloc_attach(alloc);
+  struct elem **table = join->roots.table, *frame;
+  FILE *out;
+  TLAB = tlab;
+  out = tlab->out;
+  tlab->out = open_memstream(&t->out, &t->out_len);
+  frame = new_frame(join->alloc);
+  frame_of(frame)->env = table[1];
+  frame_of(frame)->rhs = table[2 + t->index];
+  table[2 + join->n + t->index] = frame_eval(frame);
+  fclose(tlab->out);
+  tlab->out = out;
+  TLAB = saved;
+  if ( ! own ) {
+    alloc_detach(tlab);
+  }
+  pthread_mutex_lock(&join->lock);
+  if ( --join->pending == 0 ) {
+    pthread_cond_signal(&join->done);
+  }
+  pthread_mutex_unlock(&join->lock);
+}
+
+void *pool_main(void *arg) {
+  struct task *t;
+  pthread_mutex_lock(&POOL.lock);
+  POOL_DEQUE = pool_take_deque();
+  POOL_DEPTH = 1; // keeps its deque for good
+  pthread_mutex_unlock(&POOL.lock);
+  while( 1 ) {
+    if ( (t = pool_steal()) != 0 ) {
+      task_run(t, 0);
+      continue;
+    }
+    pthread_mutex_lock(&POOL.lock);
+    __atomic_add_fetch(&POOL.sleeping, 1, __ATOMIC_SEQ_CST);
+    while( __atomic_load_n(&POOL.queued, __ATOMIC_SEQ_CST) == 0 && ! POOL.stop ) {
+      pthread_cond_wait(&POOL.wake, &POOL.lock);
+    }
+    __atomic_sub_fetch(&POOL.sleeping, 1, __ATOMIC_SEQ_CST);
+    if ( POOL.stop ) {
+      pthread_mutex_unlock(&POOL.lock);
+      return 0;
+    }
+    pthread_mutex_unlock(&POOL.lock);
+  }
+}
+
+// starts threads until there are as many as asked, the callers of pcall make one more
+void pool_start(int threads) {
+  pthread_mutex_lock(&POOL.lock);
+  POOL.stop = 0;
+  while( POOL.nthreads < threads && POOL.nthreads < POOL_THREADS ) {
+    if ( pthread_create(&POOL.threads[POOL.nthreads], 0, pool_main, 0) != 0 ) {
+      break;
+    }
+    POOL.nthreads++;
+  }
+  __atomic_store_n(&POOL.started, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&POOL.lock);
+}
+
+// only once no pcall is running
+void pool_stop() {
+  uint32_t i;
+  pthread_mutex_lock(&POOL.lock);
+  POOL.stop = 1;
+  pthread_cond_broadcast(&POOL.wake);
+  pthread_mutex_unlock(&POOL.lock);
+  for(i=0;i<POOL.nthreads;++i) {
+    pthread_join(POOL.threads[i], 0);
+  }
+  for(i=0;i<POOL.ndeques;++i) {
+    pthread_mutex_destroy(&POOL.deques[i]->lock);
+    FREE_ARRAY(POOL.deques[i]->table);
+    FREE(POOL.deques[i]);
+  }
+  POOL.ndeques = 0;
+  POOL.nthreads = 0;
+  POOL.started = 0;
+}
+
+/*
+ * Runs this thread's own tasks while there are any, then waits for the
+ * stolen ones, parked so their collections need not wait for it.
+ */
+void pool_join(struct join *join) {
+  struct alloc *alloc = join->alloc->aval.alloc;
+  struct task *t;
+  while( (t = deque_take(POOL_DEQUE, 0)) != 0 ) {
+    task_run(t, t->join->alloc == join->alloc);
+  }
+  alloc_park(alloc);
+  pthread_mutex_lock(&join->lock);
+  while( join->pending > 0 ) {
+    pthread_cond_wait(&join->done, &join->lock);
+  }
+  pthread_mutex_unlock(&join->lock);
+  alloc_unpark(alloc);
+}
+
+/*
+ * Evaluates the arguments of (pcall ...) and leaves them in lhs for the
+ * call, as if each had been returned to the frame in turn. With fewer
+ * than two calls among them, or no deque to spare, the arguments are left
+ * in rhs to be evaluated as usual.
+ */
+struct elem *frame_pcall(struct elem *frame, struct elem *exprs) {
+  struct frame *f = frame_of(frame);
+  struct elem *lhs = empty_list(), *e, *value, **table;
+  struct task *tasks;
+  struct join join;
+  FILE *out;
+  uint32_t i, n = 0, calls = 0;
+
+  for(e=exprs;!list_is_empty(e);e=list_next(e)) {
+    n++;
+    calls += is_list(list_value(e)) && ! list_is_empty(list_value(e));
+  }
+  if ( calls < 2 ) {
+    f->rhs = exprs;
+    return frame;
+  }
+  if ( ! __atomic_load_n(&POOL.started, __ATOMIC_ACQUIRE) ) {
+    pool_start(sysconf(_SC_NPROCESSORS_ONLN) - 1);
+  }
+  if ( POOL_DEPTH++ == 0 ) {
+    pthread_mutex_lock(&POOL.lock);
+    POOL_DEQUE = pool_take_deque();
+    pthread_mutex_unlock(&POOL.lock);
+  }
+  if ( POOL_DEQUE == 0 ) {
+    POOL_DEPTH--;
+    f->rhs = exprs;
+    return frame;
+  }
+
+  pthread_mutex_init(&join.lock, 0);
+  pthread_cond_init(&join.done, 0);
+  join.pending = calls;
+  join.n = n;
+  join.alloc = f->alloc;
+  join.roots.len = 2 + 2 * n;
+  join.roots.table = table = NEW_ARRAY(struct elem *, join.roots.len);
+  table[0] = frame;
+  table[1] = f->env;
+  tasks = NEW_ARRAY(struct task, n);
+  for(i=0,e=exprs;i<n;++i,e=list_next(e)) {
+    value = list_value(e);
+    table[2 + i] = value;
+    if ( ! is_list(value) || list_is_empty(value) ) {
+      table[2 + n + i] = is_ident(value) ? env_get(frame, to_sym(frame, value)) : value;
+    }
+  }
+  frame_push_roots(frame, &join.roots);
+  for(i=0;i<n;++i) {
+    if ( is_list(table[2 + i]) && ! list_is_empty(table[2 + i]) ) {
+      tasks[i].join = &join;
+      tasks[i].index = i;
+      pool_push(&tasks[i]);
+    }
+  }
+  pool_join(&join);
+  frame = table[0];
+
+  out = frame_out(frame);
+  for(i=0;i<n;++i) {
+    if ( tasks[i].out != 0 ) {
+      fwrite(tasks[i].out, 1, tasks[i].out_len, out);
+      free(tasks[i].out);
+    }
+    lhs = list_add(frame, lhs, table[2 + n + i]);
+  }
+  frame_pop_roots(frame, &join.roots);
+  FREE_ARRAY(table);
+  if ( --POOL_DEPTH == 0 ) {
+    pthread_mutex_lock(&POOL.lock);
+    POOL_DEQUE->in_use = 0;
+    POOL_DEQUE = 0;
+    pthread_mutex_unlock(&POOL.lock);
+  }
+  FREE_ARRAY(tasks);
+  pthread_cond_destroy(&join.done);
+  pthread_mutex_destroy(&join.lock);
+
+  frame_remember(frame);
+  f->lhs = lhs;
+  f->rhs = empty_list();
+  return frame;
+}
+
+struct elem *frame_eval(struct elem *frame) 
+{
+  struct elem *lhs, *rhs, *value, *fn, *args;
+  struct frame *f;
+
+  while(1) {
+
+    frame = frame_safepoint(frame);
+    frame_remember(frame);
+    f = frame_of(frame);
+    rhs = f->rhs;
+
+    if ( is_nil(rhs) ) {
+      return f->lhs;
+    }
+
+    if ( ! is_list(rhs) ) {
+      if ( is_ident(rhs) ) {
+        rhs = env_get(frame, to_sym(frame, rhs));
+      }
+      frame = frame_return(frame, rhs);
+      continue;
+    }
+    
+    lhs = f->lhs;
+    if ( is_if_pending(lhs) ) {
+      frame = frame_if(frame, list_value(lhs), rhs);
+      continue;
+    }
+
+    if ( list_is_empty(rhs) ) {
+
+      if ( ! list_is_empty(lhs) ) {
+        lhs = list_reverse(frame, lhs);
+        fn = list_value(lhs);
+        args = list_next(lhs);
+        if ( ! is_fn(fn) ) {
+          return frame_error(frame, new_error(frame, "Expected function"));
+        }
+        frame = frame_call(frame, fn, args);
+        continue;
+      }
+
+      frame = frame_return(frame, lhs);
+      continue;
+    }
+
+    value = list_value(rhs);
+    rhs = list_next(rhs);
+
+    if ( list_is_empty(lhs) && is_if_form(frame, value) ) {
+      if ( list_is_empty(rhs) ) {
+        frame = frame_return(frame, nil());
+        continue;
+      }
+      f->lhs = list_add(frame, lhs, &IF_PENDING);
+      f->rhs = rhs;
+      continue;
+    }
+
+    if ( list_is_empty(lhs) && is_pcall_form(frame, value) ) {
+      if ( list_is_empty(rhs) ) {
+        frame = frame_return(frame, nil());
+        continue;
+      }
+      frame = frame_pcall(frame, rhs);
+      continue;
+    }
+    
+    if ( is_list(value) ) {
+      f->rhs = rhs;
+      frame = new_child_frame(frame, value);
+      continue;
+    }
+    
+    if ( is_ident(value) ) {
+      value = env_get(frame, to_sym(frame, value));
+    }
+    
+    f->lhs = list_add(frame, lhs, value);
+    f->rhs = rhs;
+  }
+}
+
+/*
+ * Bytecode compiler and register VM. Every instruction is an opcode word
+ * followed by its operands. Registers are numbered from the base of the
+ * current activation and a function's parameters are its first registers.
+ *
+ *   CONST    dst k      r[dst] = consts[k]
+ *   LOCAL    dst i      r[dst] = r[i]
+ *   GLOBAL   dst k c    r[dst] = the env's value for the symbol consts[k]
+ *   CALL     dst f n c  r[dst] = r[f] applied to r[f+1] .. r[f+n]
+ *   TAILCALL f n c      replace this activation with r[f] applied to args
+ *   RETURN   src        return r[src] to the caller
+ *   JUMP     to         continue at ops[to]
+ *   JUMPIFNOT src to    continue at ops[to] unless r[src] is true
+ *
+ * Each call site c caches the last user function it called along with
+ * that function's code, so a monomorphic call skips the code lookup. Each
+ * global load caches the env it last looked in and the value it found;
+ * envs are immutable, so the same env always gives the same value.
+ *
+ * frame_eval remains the reference evaluator and the two must agree.
+ */
+#define OP_CONST    0
+#define OP_LOCAL    1
+#define OP_GLOBAL   2
+#define OP_CALL     3
+#define OP_TAILCALL 4
+#define OP_RETURN   5
+#define OP_JUMP     6
+#define OP_JUMPIFNOT 7
+
+struct compiler {
+  struct elem *frame;
+  struct elem *params;
+  uint32_t nparams;
+  uint32_t top;
+  uint32_t nregs;
+  uint32_t len;
+  uint32_t cap;
+  uint32_t *ops;
+  uint32_t nconsts;
+  uint32_t consts_cap;
+  struct elem **consts;
+  uint32_t ncaches;
+};
+
+void emit(struct compiler *c, uint32_t word) {
+  if ( c->len == c->cap ) {
+    c->cap = c->cap ? c->cap * 2 : 32;
+    c->ops = (uint32_t *)realloc(c->ops, c->cap * sizeof(uint32_t));
+  }
+  c->ops[c->len++] = word;
+}
+
+uint32_t compiler_const(struct compiler *c, struct elem *e) {
+  uint32_t i;
+  for(i=0;i<c->nconsts;++i) {
+    if ( c->consts[i] == e ) {
+      return i;
+    }
+  }
+  if ( c->nconsts == c->consts_cap ) {
+    c->consts_cap = c->consts_cap ? c->consts_cap * 2 : 8;
+    c->consts = (struct elem **)realloc(c->consts, c->consts_cap * sizeof(struct elem *));
+  }
+  c->consts[c->nconsts] = e;
+  return c->nconsts++;
+}
+
+int compiler_param(struct compiler *c, struct elem *sym) {
+  struct elem *p = c->params;
+  int i = 0;
+  while( ! list_is_empty(p) ) {
+    if ( to_sym(c->frame, list_value(p)) == sym ) {
+      return i;
+    }
+    p = list_next(p);
+    i++;
+  }
+  return -1;
+}
+
+uint32_t compiler_reg(struct compiler *c) {
+  uint32_t r = c->top++;
+  if ( c->top > c->nregs ) {
+    c->nregs = c->top;
+  }
+  return r;
+}
+
+void compile_expr(struct compiler *c, struct elem *expr, uint32_t dst, int tail);
+
+// both branches are in tail position when the if is
+void compile_if(struct compiler *c, struct elem *expr, uint32_t dst, int tail) {
+  uint32_t jump_else, jump_end;
+  expr = list_next(expr);
+  if ( list_is_empty(expr) ) {
+    compile_expr(c, nil(), dst, tail);
+    return;
+  }
+  compile_expr(c, list_value(expr), dst, 0);
+  expr = list_next(expr);
+  emit(c, OP_JUMPIFNOT);
+  emit(c, dst);
+  jump_else = c->len;
+  emit(c, 0);
+  compile_expr(c, list_is_empty(expr) ? nil() : list_value(expr), dst, tail);
+  emit(c, OP_JUMP);
+  jump_end = c->len;
+  emit(c, 0);
+  c->ops[jump_else] = c->len;
+  if ( ! list_is_empty(expr) ) {
+    expr = list_next(expr);
+  }
+  compile_expr(c, list_is_empty(expr) ? nil() : list_value(expr), dst, tail);
+  c->ops[jump_end] = c->len;
+}
+
+void compile_expr(struct compiler *c, struct elem *expr, uint32_t dst, int tail) {
+  struct elem *sym;
+  uint32_t base, n = 0;
+  int i;
+
+  if ( is_list(expr) && ! list_is_empty(expr) && is_if_form(c->frame, list_value(expr)) ) {
+    compile_if(c, expr, dst, tail);
+    return;
+  }
+
+  // the VM evaluates pcall's arguments in turn, which gives the same values
+  if ( is_list(expr) && ! list_is_empty(expr) && is_pcall_form(c->frame, list_value(expr)) ) {
+    expr = list_next(expr);
+    compile_expr(c, list_is_empty(expr) ? nil() : expr, dst, tail);
+    return;
+  }
+
+  if ( is_list(expr) && ! list_is_empty(expr) ) {
+    base = c->top;
+    while( ! list_is_empty(expr) ) {
+      compile_expr(c, list_value(expr), compiler_reg(c), 0);
+      expr = list_next(expr);
+      n++;
+    }
+    if ( tail ) {
+      emit(c, OP_TAILCALL);
+    } else {
+      emit(c, OP_CALL);
+      emit(c, dst);
+    }
+    emit(c, base);
+    emit(c, n - 1);
+    emit(c, c->ncaches++);
+    c->top = base;
+    return;
+  }
+
+  if ( is_ident(expr) ) {
+    sym = to_sym(c->frame, expr);
+    i = compiler_param(c, sym);
+    if ( i >= 0 ) {
+      emit(c, OP_LOCAL);
+      emit(c, dst);
+      emit(c, i);
+    } else {
+      emit(c, OP_GLOBAL);
+      emit(c, dst);
+      emit(c, compiler_const(c, sym));
+      emit(c, c->ncaches++);
+    }
+    return;
+  }
+
+  emit(c, OP_CONST);
+  emit(c, dst);
+  emit(c, compiler_const(c, expr));
+}
+
+struct elem *compile(struct elem *frame, struct elem *params, struct elem *expr) {
+  struct compiler c;
+  struct elem *ret;
+  struct code *code;
+  struct elem *p;
+  uint32_t r;
+
+  memset(&c, 0, sizeof(c));
+  c.frame = frame;
+  c.params = params;
+  for(p=params;!list_is_empty(p);p=list_next(p)) {
+    c.nparams++;
+  }
+  c.top = c.nregs = c.nparams;
+
+  r = compiler_reg(&c);
+  compile_expr(&c, expr, r, 1);
+  emit(&c, OP_RETURN);
+  emit(&c, r);
+
+  code = NEW(struct code);
+  code->nparams = c.nparams;
+  code->nregs = c.nregs;
+  code->len = c.len;
+  code->ops = c.ops;
+  code->nconsts = c.nconsts;
+  code->consts = c.consts;
+  code->ncaches = c.ncaches;
+  code->caches = NEW_ARRAY(struct elem *, 2 * c.ncaches + 1);
+  for(r=0;r<2*c.ncaches;++r) {
+    code->caches[r] = nil();
+  }
+
+  ret = frame_alloc_elem(frame);
+  ret->type = ELEM_TYPE_CODE;
+  ret->cval.code = code;
+  alloc_young_owner(frame_alloc(frame), ret);
+  return ret;
+}
+
+// compiled user functions are cached on the root frame
+struct elem *fn_code(struct elem *frame, struct elem *fn) {
+  struct elem *root = frame_alloc(frame)->root;
+  struct elem *cache = frame_get(root, sym_code());
+  struct elem *code;
+  if ( is_nil(cache) ) {
+    cache = empty_map();
+  }
+  code = map_get(frame, cache, fn);
+  if ( is_nil(code) ) {
+    code = compile(frame, fn->fval.args, fn->fval.expr);
+    frame_set(root, sym_code(), map_set(frame, cache, fn, code));
+  }
+  return code;
+}
+
+struct elem *vm_cached_code(struct elem *frame, struct elem *code, uint32_t c, struct elem *fn) {
+  struct code *k = code->cval.code;
+  if ( k->caches[2 * c] != fn ) {
+    k->caches[2 * c] = fn;
+    k->caches[2 * c + 1] = fn_code(frame, fn);
+    alloc_remember(frame_alloc(frame), code);
+  }
+  return k->caches[2 * c + 1];
+}
+
+#define VM_INITIAL_REGS 256
+#define VM_INITIAL_ACTS 64
+
+struct vm_activation {
+  uint32_t *ip;
+  uint32_t base;
+  uint32_t dst;
+};
+
+struct vm {
+  struct elem *frame;
+  struct elem **regs;
+  uint32_t regs_len;
+  struct elem **codes;
+  struct vm_activation *acts;
+  uint32_t acts_len;
+  uint32_t depth;
+  struct alloc_roots reg_roots;
+  struct alloc_roots code_roots;
+  struct alloc_roots frame_roots;
+  struct elem *initial_regs[VM_INITIAL_REGS];
+  struct elem *initial_codes[VM_INITIAL_ACTS];
+  struct vm_activation initial_acts[VM_INITIAL_ACTS];
+};
+
+// starts out on the C stack and moves to the heap if it outgrows it
+void *vm_grow(void *table, void *initial, uint32_t old_len, uint32_t new_len, size_t size) {
+  void *ret;
+  if ( table == initial ) {
+    ret = malloc(new_len * size);
+    memcpy(ret, table, old_len * size);
+    return ret;
+  }
+  return realloc(table, new_len * size);
+}
+
+void vm_reserve(struct vm *vm, uint32_t len) {
+  uint32_t new_len = vm->regs_len;
+  if ( len > vm->regs_len ) {
+    while( len > new_len ) {
+      new_len *= 2;
+    }
+    vm->regs = (struct elem **)vm_grow(vm->regs, vm->initial_regs, vm->regs_len, new_len, sizeof(struct elem *));
+    vm->regs_len = new_len;
+    vm->reg_roots.table = vm->regs;
+  }
+}
+
+void vm_clear(struct vm *vm, uint32_t from, uint32_t to) {
+  while( from < to ) {
+    vm->regs[from++] = nil();
+  }
+}
+
+void vm_push(struct vm *vm, struct elem *code, uint32_t base, uint32_t dst, uint32_t nargs) {
+  struct code *k = code->cval.code;
+  if ( vm->depth == vm->acts_len ) {
+    vm->acts = (struct vm_activation *)vm_grow(vm->acts, vm->initial_acts, 
+      vm->acts_len, vm->acts_len * 2, sizeof(struct vm_activation));
+    vm->codes = (struct elem **)vm_grow(vm->codes, vm->initial_codes, 
+      vm->acts_len, vm->acts_len * 2, sizeof(struct elem *));
+    vm->acts_len *= 2;
+    vm->code_roots.table = vm->codes;
+  }
+  vm_reserve(vm, base + k->nregs);
+  vm_clear(vm, base + (nargs < k->nparams ? nargs : k->nparams), base + k->nregs);
+  vm->codes[vm->depth] = code;
+  vm->acts[vm->depth].ip = k->ops;
+  vm->acts[vm->depth].base = base;
+  vm->acts[vm->depth].dst = dst;
+  vm->depth++;
+}
+
+
+// builtins expect frames, so give them a detached call site to return to
+struct elem *vm_call_builtin(struct elem *frame, struct elem *fn, struct elem **args, uint32_t n) {
+  struct elem *site = new_frame(frame_of(frame)->alloc);
+  struct elem *list = empty_list();
+  frame_of(site)->env = frame_of(frame)->env;
+  while( n > 0 ) {
+    list = list_add(frame, list, args[--n]);
+  }
+  return frame_eval(fn->fval.fn(new_child_frame(site, list)));
+}
+
+struct elem *vm_eval(struct elem *frame, struct elem *code) {
+  static void *dispatch[] = {
+    &&op_const, &&op_local, &&op_global, &&op_call, &&op_tailcall, &&op_return,
+    &&op_jump, &&op_jumpifnot
+  };
+  struct alloc *alloc = frame_alloc(frame);
+  struct alloc_tlab *tlab = alloc_tlab(alloc);
+  struct vm vm;
+  struct code *k;
+  struct elem **r, *fn, *value;
+  uint32_t *ip, a, b, n, c;
+
+  vm.frame = frame;
+  vm.regs = vm.reg_roots.table = vm.initial_regs;
+  vm.regs_len = VM_INITIAL_REGS;
+  vm.codes = vm.code_roots.table = vm.initial_codes;
+  vm.acts = vm.initial_acts;
+  vm.acts_len = VM_INITIAL_ACTS;
+  vm.depth = 0;
+  vm.frame_roots.table = &vm.frame;
+  vm.frame_roots.len = 1;
+  vm.reg_roots.len = vm.code_roots.len = 0;
+  vm.reg_roots.next = &vm.code_roots;
+  vm.code_roots.next = &vm.frame_roots;
+  vm.frame_roots.next = tlab->roots;
+  tlab->roots = &vm.reg_roots;
+  vm_push(&vm, code, 0, 0, 0);
+
+#define VM_LOAD()                                       \
+  k = vm.codes[vm.depth - 1]->cval.code;                \
+  ip = vm.acts[vm.depth - 1].ip;                        \
+  r = vm.regs + vm.acts[vm.depth - 1].base;
+#define VM_DISPATCH() goto *dispatch[*ip++]
+#define VM_SAFEPOINT()                                  \
+  vm.reg_roots.len = (r - vm.regs) + k->nregs;          \
+  vm.code_roots.len = vm.depth;                         \
+  if ( alloc_collect_due(alloc) ) {                     \
+    frame_collect_due(frame);                           \
+    frame = vm.frame;                                   \
+  }
+
+  VM_LOAD();
+  VM_DISPATCH();
+
+op_const:
+  r[ip[0]] = k->consts[ip[1]];
+  ip += 2;
+  VM_DISPATCH();
+
+op_local:
+  r[ip[0]] = r[ip[1]];
+  ip += 2;
+  VM_DISPATCH();
+
+op_global:
+  c = 2 * ip[2];
+  if ( k->caches[c] != frame_of(frame)->env ) {
+    k->caches[c] = frame_of(frame)->env;
+    k->caches[c + 1] = env_get(frame, k->consts[ip[1]]);
+    alloc_remember(alloc, vm.codes[vm.depth - 1]);
+  }
+  r[ip[0]] = k->caches[c + 1];
+  ip += 3;
+  VM_DISPATCH();
+
+op_call:
+  a = ip[0];
+  b = ip[1];
+  n = ip[2];
+  c = ip[3];
+  ip += 4;
+  fn = r[b];
+  // a native returns without running any code that could loop, so it needs no safepoint
+  if ( is_fn(fn) && (fn->flags & ELEM_FLAG_NATIVE) ) {
+    r[a] = fn->fval.native(frame, r + b + 1, n);
+    VM_DISPATCH();
+  }
+  vm.acts[vm.depth - 1].ip = ip;
+  VM_SAFEPOINT();
+  fn = r[b];
+  if ( ! is_fn(fn) ) {
+    return frame_error(frame, new_error(frame, "Expected function"));
+  }
+  if ( fn->fval.fn != 0 ) {
+    r[a] = vm_call_builtin(frame, fn, r + b + 1, n);
+    frame = vm.frame;
+    VM_DISPATCH();
+  }
+  a += vm.acts[vm.depth - 1].base;
+  vm_push(&vm, vm_cached_code(frame, vm.codes[vm.depth - 1], c, fn), vm.acts[vm.depth - 1].base + b + 1, a, n);
+  VM_LOAD();
+  VM_DISPATCH();
+
+op_tailcall:
+  b = ip[0];
+  n = ip[1];
+  c = ip[2];
+  vm.acts[vm.depth - 1].ip = ip + 3;
+  VM_SAFEPOINT();
+  fn = r[b];
+  if ( ! is_fn(fn) ) {
+    return frame_error(frame, new_error(frame, "Expected function"));
+  }
+  if ( fn->flags & ELEM_FLAG_NATIVE ) {
+    value = fn->fval.native(frame, r + b + 1, n);
+    goto do_return;
+  }
+  if ( fn->fval.fn != 0 ) {
+    value = vm_call_builtin(frame, fn, r + b + 1, n);
+    frame = vm.frame;
+    goto do_return;
+  }
+  memmove(r, r + b + 1, n * sizeof(struct elem *));
+  a = vm.acts[vm.depth - 1].dst;
+  vm.depth--;
+  vm_push(&vm, vm_cached_code(frame, vm.codes[vm.depth], c, fn), vm.acts[vm.depth].base, a, n);
+  VM_LOAD();
+  VM_DISPATCH();
+
+op_jump:
+  ip = k->ops + ip[0];
+  VM_DISPATCH();
+
+op_jumpifnot:
+  ip = is_true(r[ip[0]]) ? ip + 2 : k->ops + ip[1];
+  VM_DISPATCH();
+
+op_return:
+  value = r[ip[0]];
+do_return:
+  a = vm.acts[--vm.depth].dst;
+  if ( vm.depth == 0 ) {
+    tlab->roots = vm.frame_roots.next;
+    if ( vm.regs != vm.initial_regs ) {
+      FREE_ARRAY(vm.regs);
+    }
+    if ( vm.acts != vm.initial_acts ) {
+      FREE_ARRAY(vm.codes);
+      FREE_ARRAY(vm.acts);
+    }
+    return value;
+  }
+  vm.regs[a] = value;
+  VM_LOAD();
+  VM_DISPATCH();
+
+#undef VM_LOAD
+#undef VM_DISPATCH
+#undef VM_SAFEPOINT
+}
+
+/*
+ * The printer writes into a buffer of its own. With no FILE or file
+ * descriptor to write to, the buffer grows to hold the whole output.
+ * Otherwise it grows to PRINTER_CHUNK and is then written out each time
+ * it fills, and longer runs of bytes go straight out. Printing allocates
+ * nothing in the heap, and written counts every byte printed.
+ */
+#define PRINTER_CHUNK 65536
+
+void printer_init(struct printer *p) {
+  p->buf = 0;
+  p->len = 0;
+  p->cap = 0;
+  p->written = 0;
+  p->file = 0;
+  p->fd = -1;
+  p->error = 0;
+}
+
+void printer_init_fd(struct printer *p, int fd) {
+  printer_init(p);
+  p->fd = fd;
+}
+
+void printer_init_file(struct printer *p, FILE *file) {
+  printer_init(p);
+  p->file = file;
+}
+
+void printer_free(struct printer *p) {
+  FREE_ARRAY(p->buf);
+  p->buf = 0;
+}
+
+int printer_has_sink(struct printer *p) {
+  return p->file != 0 || p->fd >= 0;
+}
+
+void printer_out(struct printer *p, const char *s, size_t n) {
+  ssize_t w;
+  if ( p->file != 0 ) {
+    if ( fwrite(s, 1, n, p->file) != n ) {
+      p->error = 1;
+    }
+    return;
+  }
+  while( n > 0 && ! p->error ) {
+    w = write(p->fd, s, n);
+    if ( w < 0 && errno == EINTR ) {
+      continue;
+    }
+    if ( w <= 0 ) {
+      p->error = 1;
+    } else {
+      s += w;
+      n -= w;
+    }
+  }
+}
+
+// writes out what is buffered, -1 once any write has failed
+int printer_flush(struct printer *p) {
+  if ( printer_has_sink(p) ) {
+    printer_out(p, p->buf, p->len);
+    p->len = 0;
+  }
+  return p->error ? -1 : 0;
+}
+
+void printer_grow(struct printer *p, size_t n) {
+  if ( printer_has_sink(p) && p->len + n > PRINTER_CHUNK ) {
+    printer_flush(p);
+  }
+  while( p->len + n > p->cap ) {
+    p->cap = p->cap ? p->cap * 2 : 256;
+  }
+  p->buf = realloc(p->buf, p->cap);
+}
+
+/*
+ * Room for n more bytes at the end of the buffer, written out first if
+ * that would take it past a chunk. Writers fill it in place and hand
+ * back where they stopped to printer_commit.
+ */
+char *printer_reserve(struct printer *p, size_t n) {
+  if ( p->len + n > p->cap ) {
+    printer_grow(p, n);
+  }
+  return p->buf + p->len;
+}
+
+void printer_commit(struct printer *p, char *end) {
+  p->written += end - (p->buf + p->len);
+  p->len = end - p->buf;
+}
+
+void printer_write(struct printer *p, const char *s, size_t n) {
+  if ( n >= PRINTER_CHUNK && printer_has_sink(p) ) {
+    printer_flush(p);
+    printer_out(p, s, n);
+  } else {
+    memcpy(printer_reserve(p, n), s, n);
+    p->len += n;
+  }
+  p->written += n;
+}
+
+void printer_putc(struct printer *p, char c) {
+  *printer_reserve(p, 1) = c;
+  p->len++;
+  p->written++;
+}
+
+void printer_puts(struct printer *p, const char *s) {
+  printer_write(p, s, strlen(s));
+}
+
+size_t elem_write(struct printer *p, struct elem *e);
+
+// digits are counted first so they can go straight into the buffer
+void int_write(struct printer *p, int64_t i) {
+  uint64_t u = i < 0 ? -(uint64_t)i : (uint64_t)i, t;
+  char *o = printer_reserve(p, 20), *end;
+  uint32_t n = 1;
+  for(t=u;t>=10;t/=10) {
+    n++;
+  }
+  if ( i < 0 ) {
+    *o++ = '-';
+  }
+  end = o + n;
+  do {
+    *--end = '0' + u % 10;
+    u /= 10;
+  } while( u != 0 );
+  printer_commit(p, o + n);
+}
+
+/*
+ * Prints by peeling off 19 decimal digits at a time from the bottom,
+ * dividing a copy of the limbs by 10^19 until it is used up.
+ */
+#define BIGINT_DIGITS 19
+#define BIGINT_CHUNK  10000000000000000000ull
+
+void bigint_write(struct printer *p, struct elem *e) {
+  uint32_t len = e->bval.len, n = 0, i;
+  uint64_t *q = NEW_ARRAY(uint64_t, len), *chunks = NEW_ARRAY(uint64_t, len * 2 + 1);
+  char tmp[BIGINT_DIGITS];
+  memcpy(q, e->bval.limbs, (size_t)len * sizeof(uint64_t));
+  while( len > 0 ) {
+    chunks[n++] = mag_divmod_small(q, q, len, BIGINT_CHUNK);
+    len = mag_trim(q, len);
+  }
+  if ( e->bval.sign < 0 ) {
+    printer_putc(p, '-');
+  }
+  // the top chunk goes unpadded and the rest take up all 19 digits
+  for(i=BIGINT_DIGITS;i>0&&chunks[n-1]!=0;--i) {
+    tmp[i - 1] = '0' + chunks[n - 1] % 10;
+    chunks[n - 1] /= 10;
+  }
+  printer_write(p, tmp + i, BIGINT_DIGITS - i);
+  while( --n > 0 ) {
+    for(i=BIGINT_DIGITS;i>0;--i) {
+      tmp[i - 1] = '0' + chunks[n - 1] % 10;
+      chunks[n - 1] /= 10;
+    }
+    printer_write(p, tmp, BIGINT_DIGITS);
+  }
+  FREE_ARRAY(q);
+  FREE_ARRAY(chunks);
+}
+
+void vector_write(struct printer *p, struct elem *v) {
+  uint32_t i;
+  printer_putc(p, '[');
+  for(i=0;i<v->vval.len;++i) {
+    if ( i > 0 ) {
+      printer_putc(p, ' ');
+    }
+    if ( v->vval.kind == VECTOR_INTS ) {
+      int_write(p, v->vval.ints[i]);
+    } else {
+      elem_write(p, v->vval.items[i]);
+    }
+  }
+  printer_putc(p, ']');
+}
+
+void pvec_write(struct printer *p, struct elem *v) {
+  struct elem **items;
+  uint32_t i, len;
+  printer_write(p, "#[", 2);
+  for(i=0;i<v->pval.count;) {
+    items = pvec_chunk(v, i, &len);
+    for(;len>0;--len,++i) {
+      if ( i > 0 ) {
+        printer_putc(p, ' ');
+      }
+      elem_write(p, *items++);
+    }
+  }
+  printer_putc(p, ']');
+}
+
+// opaque cells print as their kind and address
+void pointer_write(struct printer *p, const char *kind, void *ptr) {
+  char tmp[64];
+  printer_write(p, tmp, snprintf(tmp, sizeof(tmp), "<%s:%p>", kind, ptr));
+}
+
+void list_write(struct printer *p, struct elem *l) {
+  int first = 1;
+  printer_putc(p, '(');
+  while(! list_is_empty(l)) {
+    if ( first ) {
+      first = 0;
+    } else {
+      printer_putc(p, ' ');
+    }
+    elem_write(p, list_value(l));
+    l = list_next(l);
+  }
+  printer_putc(p, ')');
+}
+
+void set_write(struct printer *p, struct elem *l) {
+  int first = 1;
+  struct map_iter it;
+  printer_write(p, "#{", 2);
+  map_iter_init(&it, l);
+  while( map_iter_next(&it) ) {
+    if ( first ) {
+      first = 0;
+    } else {
+      printer_putc(p, ' ');
+    }
+    elem_write(p, it.key);
+  }
+  printer_putc(p, '}');
+}
+
+// a map holds each key once, so walking its trie needs no deduplication
+void map_write(struct printer *p, struct elem *l) {
+  int first = 1;
+  struct map_iter it;
+  printer_putc(p, '{');
+  map_iter_init(&it, l);
+  while( map_iter_next(&it) ) {
+    if ( first ) {
+      first = 0;
+    } else {
+      printer_putc(p, ' ');
+    }
+    elem_write(p, it.key);
+    printer_putc(p, ' ');
+    elem_write(p, it.value);
+  }
+  printer_putc(p, '}');
+}
+
+// an ident prints from the symbol it names, whose bytes are shared and so likely cached
+void sval_write(struct printer *p, struct elem *s) {
+  s = s->sval.sym != 0 ? s->sval.sym : s;
+  printer_write(p, s->sval.str, s->sval.len - 1);
+}
+
+// whether any byte of w is b, for the bytes of b spread over a word
+#define WORD_ONES  0x0101010101010101ull
+#define WORD_HIGHS 0x8080808080808080ull
+
+int word_has_byte(uint64_t w, uint64_t b) {
+  w ^= b;
+  return ((w - WORD_ONES) & ~w & WORD_HIGHS) != 0;
+}
+
+/*
+ * Copies n bytes of run to o with quotes and backslashes escaped, eight
+ * at a time while none of the eight needs it.
+ */
+char *string_escape(char *o, const char *run, uint32_t n) {
+  const char *c = run, *end = run + n;
+  uint64_t w;
+  while( c < end ) {
+    for(;end-c>=8;c+=8,o+=8) {
+      memcpy(&w, c, 8);
+      if ( word_has_byte(w, '"' * WORD_ONES) || word_has_byte(w, '\\' * WORD_ONES) ) {
+        break;
+      }
+      memcpy(o, &w, 8);
+    }
+    if ( c < end ) {
+      if ( *c == '"' || *c == '\\' ) {
+        *o++ = '\\';
+      }
+      *o++ = *c++;
+    }
+  }
+  return o;
+}
+
+/*
+ * Quotes and backslashes are escaped so that the reader gets the string
+ * back. Runs are escaped straight into the buffer, half a chunk at a
+ * time since escaping can double them, and a short flat string goes in
+ * with its quotes in one go.
+ */
+void string_write(struct printer *p, struct elem *s) {
+  struct string_iter it;
+  const char *run;
+  char *o;
+  uint32_t len, n;
+  if ( ! is_rope(s) && s->sval.len <= PRINTER_CHUNK / 2 ) {
+    o = printer_reserve(p, 2 * (size_t)s->sval.len);
+    *o++ = '"';
+    o = string_escape(o, s->sval.str, s->sval.len - 1);
+    *o++ = '"';
+    printer_commit(p, o);
+    return;
+  }
+  printer_putc(p, '"');
+  string_iter_init(&it, s);
+  while( string_iter_next(&it, &run, &len) ) {
+    for(;len>0;run+=n,len-=n) {
+      n = len < PRINTER_CHUNK / 2 ? len : PRINTER_CHUNK / 2;
+      printer_commit(p, string_escape(printer_reserve(p, 2 * (size_t)n), run, n));
+    }
+  }
+  printer_putc(p, '"');
+}
+
+void error_write(struct printer *p, struct elem *s) {
+  printer_write(p, "<err:", 5);
+  elem_write(p, s->eval.map);
+  printer_putc(p, '>');
+}
+
+void sym_write(struct printer *p, struct elem *s) {
+  char *o = printer_reserve(p, s->sval.len);
+  *o = ':';
+  memcpy(o + 1, s->sval.str, s->sval.len - 1);
+  printer_commit(p, o + s->sval.len);
+}
+
+// returns the number of bytes printed
+size_t elem_write(struct printer *p, struct elem *e) {
+  size_t start = p->written;
+  switch(elem_type(e)) {
+  case ELEM_TYPE_NIL:
+    printer_write(p, "nil", 3);
+    break;
+  case ELEM_TYPE_TRUE:
+    printer_write(p, "true", 4);
+    break;
+  case ELEM_TYPE_FALSE:
+    printer_write(p, "false", 5);
+    break;
+  case ELEM_TYPE_INT:
+    int_write(p, int_value(e));
+    break;
+  case ELEM_TYPE_BIGINT:
+    bigint_write(p, e);
+    break;
+  case ELEM_TYPE_VECTOR:
+    vector_write(p, e);
+    break;
+  case ELEM_TYPE_PVEC:
+    pvec_write(p, e);
+    break;
+  case ELEM_TYPE_LIST:
+    list_write(p, e);
+    break;
+  case ELEM_TYPE_STRING:
+    string_write(p, e);
+    break;
+  case ELEM_TYPE_IDENT:
+    sval_write(p, e);
+    break;
+  case ELEM_TYPE_ERROR:
+    error_write(p, e);
+    break;
+  case ELEM_TYPE_SYM:
+    sym_write(p, e);
+    break;
+  case ELEM_TYPE_SET:
+    set_write(p, e);
+    break;
+  case ELEM_TYPE_MAP:
+    map_write(p, e);
+    break;
+  case ELEM_TYPE_FN:
+    pointer_write(p, "fn", e->fval.fn);
+    break;
+  case ELEM_TYPE_ALLOC:
+    pointer_write(p, "alloc", e->aval.alloc);
+    break;
+  case ELEM_TYPE_FRAME:
+    pointer_write(p, "frame", e->frval.frame);
+    break;
+  case ELEM_TYPE_CODE:
+    pointer_write(p, "code", e->cval.code);
+    break;
+  default:
+    abort(); // invalid type
+  }
+  return p->written - start;
+}
+
+// the FILE sees one write for the whole element
+void elem_print(struct elem *frame, FILE *out, struct elem *e) {
+  struct printer p;
+  printer_init_file(&p, out);
+  elem_write(&p, e);
+  printer_flush(&p);
+  printer_free(&p);
+}
+
+/*
+ * The reader scans its input in place through a struct reader cursor.
+ * Tokens are copied straight from the input into the cells that hold
+ * them, so reading allocates nothing but the cells of the result.
+ *
+ * A streaming reader owns a buffer that it refills from a FILE or a file
+ * descriptor. Refilling drops everything before the token being read, so
+ * the buffer only grows for tokens longer than a chunk.
+ */
+#define READER_EOF   (-1)
+#define READER_CHUNK 65536
+
+void reader_init(struct reader *r, struct elem *frame, const char *input, size_t len) {
+  r->input = input;
+  r->len = len;
+  r->pos = 0;
+  r->frame = frame;
+  r->error = 0;
+  r->buf = 0;
+  r->cap = 0;
+  r->file = 0;
+  r->fd = -1;
+  r->eof = 1;
+  r->borrow = 0;
+}
+
+void reader_init_fd(struct reader *r, struct elem *frame, int fd) {
+  reader_init(r, frame, 0, 0);
+  r->cap = READER_CHUNK;
+  r->buf = NEW_ARRAY(char, r->cap);
+  r->input = r->buf;
+  r->fd = fd;
+  r->eof = 0;
+}
+
+void reader_init_file(struct reader *r, struct elem *frame, FILE *file) {
+  reader_init_fd(r, frame, -1);
+  r->file = file;
+}
+
+void reader_free(struct reader *r) {
+  FREE_ARRAY(r->buf);
+  r->buf = 0;
+}
+
+struct elem *reader_fail(struct reader *r, char *msg) {
+  if ( r->error == 0 ) {
+    r->error = new_error(r->frame, msg);
+  }
+  return r->error;
+}
+
+/*
+ * Reads more input, keeping the buffer from *start onwards. *start and
+ * pos move down with the kept bytes. Returns 0 at the end of the input.
+ */
+int reader_more(struct reader *r, size_t *start) {
+  ssize_t n;
+  if ( r->eof ) {
+    return 0;
+  }
+  memmove(r->buf, r->buf + *start, r->len - *start);
+  r->len -= *start;
+  r->pos -= *start;
+  *start = 0;
+  if ( r->len == r->cap ) {
+    r->cap *= 2;
+    r->buf = realloc(r->buf, r->cap);
+    r->input = r->buf;
+  }
+  if ( r->file != 0 ) {
+    n = fread(r->buf + r->len, 1, r->cap - r->len, r->file);
+    if ( n == 0 && ferror(r->file) ) {
+      n = -1;
+    }
+  } else {
+    do {
+      n = read(r->fd, r->buf + r->len, r->cap - r->len);
+    } while( n < 0 && errno == EINTR );
+  }
+  if ( n <= 0 ) {
+    r->eof = 1;
+    if ( n < 0 ) {
+      reader_fail(r, "Error reading input");
+    }
+    return 0;
+  }
+  r->len += n;
+  return 1;
+}
+
+int reader_peek(struct reader *r) {
+  size_t start = r->pos;
+  if ( r->pos < r->len || reader_more(r, &start) ) {
+    return (unsigned char)r->input[r->pos];
+  }
+  return READER_EOF;
+}
+
+int is_space(int c) {
+  return c == ' ' || c == '\n' || c == '\t';
+}
+
+// numbers are read as identifiers that turn out to be numeric
+int is_ident_char(int c) {
+  if ( ( c >= 'A' && c <= 'Z' ) || ( c >= 'a' && c <= 'z' ) || ( c >= '0' && c <= '9' ) ) {
+    return 1;
+  }
+  switch(c) {
+  case '_':
+  case '-':
+  case '?':
+  case '!':
+  case '+':
+  case '*':
+  case '/':
+  case '<':
+  case '=':
+  case '>':
+    return 1;
+  }
+  return 0;
+}
+
+int is_sym_char(int c) {
+  if ( ( c >= 'A' && c <= 'Z' ) || ( c >= 'a' && c <= 'z' ) || ( c >= '0' && c <= '9' ) ) {
+    return 1;
+  }
+  switch(c) {
+  case '_':
+  case '-':
+  case '?':
+  case '!':
+    return 1;
+  }
+  return 0;
+}
+
+void reader_skip_whitespace(struct reader *r) {
+  while( is_space(reader_peek(r)) ) {
+    r->pos++;
+  }
+}
+
+// advances pos past the characters accepted by pred, keeping start
+void reader_scan(struct reader *r, size_t *start, int (*pred)(int)) {
+  do {
+    while( r->pos < r->len && pred((unsigned char)r->input[r->pos]) ) {
+      r->pos++;
+    }
+  } while( r->pos == r->len && reader_more(r, start) );
+}
+
+struct elem *reader_token(struct reader *r, size_t start, size_t end, int type) {
+  if ( r->borrow ) {
+    return new_string_ref(r->frame, r->input + start, end - start, type);
+  }
+  return new_string_len(r->frame, r->input + start, end - start, type);
+}
+
+// each escape makes one byte, so its length is known before it is unescaped
+struct elem *string_unescape(struct elem *frame, const char *s, size_t len) {
+  struct elem *ret = frame_alloc_elem(frame);
+  char *out;
+  size_t i, n = 0;
+  for(i=0;i<len;++i,++n) {
+    i += s[i] == '\\';
+  }
+  out = (char *)alloc_bytes(frame_alloc(frame), n + 1);
+  n = 0;
+  for(i=0;i<len;++i) {
+    if ( s[i] != '\\' ) {
+      out[n++] = s[i];
+      continue;
+    }
+    switch(s[++i]) {
+    case 'n':
+      out[n++] = '\n';
+      break;
+    case 't':
+      out[n++] = '\t';
+      break;
+    default:
+      out[n++] = s[i];
+      break;
+    }
+  }
+  ret->type = ELEM_TYPE_STRING;
+  ret->sval.len = n + 1;
+  ret->sval.str = out;
+  if ( ret->sval.len > ALLOC_BYTES_MAX ) {
+    alloc_young_owner(frame_alloc(frame), ret);
+  }
+  return ret;
+}
+
+/*
+ * Finds the closing quote with memchr, skipping quotes escaped by an odd
+ * run of backslashes. Strings without escapes are taken from the input
+ * as they are.
+ */
+struct elem *string_read(struct reader *r) {
+  size_t start = ++r->pos, end, i;
+  const char *q;
+  while( 1 ) {
+    q = memchr(r->input + r->pos, '"', r->len - r->pos);
+    if ( q == 0 ) {
+      r->pos = r->len;
+      if ( ! reader_more(r, &start) ) {
+        return reader_fail(r, "End of string encountered while reading");
+      }
+      continue;
+    }
+    end = q - r->input;
+    r->pos = end + 1;
+    for(i=end;i>start && r->input[i-1]=='\\';--i);
+    if ( (end - i) % 2 == 0 ) {
+      break;
+    }
+  }
+  if ( memchr(r->input + start, '\\', end - start) != 0 ) {
+    return string_unescape(r->frame, r->input + start, end - start);
+  }
+  return reader_token(r, start, end, ELEM_TYPE_STRING);
+}
+
+// a digit, or a sign then a digit, starts a number
+int is_number(const char *s, size_t len) {
+  size_t i = len > 1 && (s[0] == '-' || s[0] == '+') ? 1 : 0;
+  return i < len && s[i] >= '0' && s[i] <= '9';
+}
+
+// digits that do not fit a fixnum, taken 19 at a time into limbs
+struct elem *bigint_read(struct reader *r, const char *s, size_t len, int sign) {
+  uint64_t *limbs = NEW_ARRAY(uint64_t, len / BIGINT_DIGITS + 2), chunk, scale, carry;
+  unsigned __int128 t;
+  uint32_t n = 0, j;
+  size_t i = 0, k;
+  struct num x;
+  while( i < len ) {
+    chunk = 0;
+    scale = 1;
+    for(k=0;k<BIGINT_DIGITS&&i<len;++k,++i) {
+      chunk = chunk * 10 + (s[i] - '0');
+      scale *= 10;
+    }
+    carry = chunk;
+    for(j=0;j<n;++j) {
+      t = (unsigned __int128)limbs[j] * scale + carry;
+      limbs[j] = (uint64_t)t;
+      carry = (uint64_t)(t >> 64);
+    }
+    if ( carry != 0 ) {
+      limbs[n++] = carry;
+    }
+  }
+  num_take(&x, sign, limbs, n);
+  return num_elem(r->frame, &x);
+}
+
+struct elem *int_read(struct reader *r, size_t start) {
+  const char *s = r->input + start;
+  size_t len = r->pos - start, i = s[0] == '-' || s[0] == '+', first = i;
+  uint64_t u = 0, limit = s[0] == '-' ? -(uint64_t)FIXNUM_MIN : FIXNUM_MAX;
+  int big = 0;
+  for(;i<len;++i) {
+    if ( s[i] < '0' || s[i] > '9' ) {
+      return reader_fail(r, "Malformed number");
+    }
+    if ( big || u > (limit - (s[i] - '0')) / 10 ) {
+      big = 1;
+      continue;
+    }
+    u = u * 10 + (s[i] - '0');
+  }
+  if ( big ) {
+    return bigint_read(r, s + first, len - first, s[0] == '-' ? -1 : 1);
+  }
+  return new_int(r->frame, s[0] == '-' ? -(int64_t)u : (int64_t)u);
+}
+
+struct elem *ident_read(struct reader *r) {
+  size_t start = r->pos;
+  struct elem *ident;
+  reader_scan(r, &start, is_ident_char);
+  if ( is_number(r->input + start, r->pos - start) ) {
+    return int_read(r, start);
+  }
+  ident = reader_token(r, start, r->pos, ELEM_TYPE_IDENT);
+  ident->sval.sym = intern_len(r->input + start, r->pos - start);
+  return ident;
+}
+
+struct elem *sym_read(struct reader *r) {
+  size_t start = ++r->pos;
+  reader_scan(r, &start, is_sym_char);
+  return intern_len(r->input + start, r->pos - start);
+}
+
+struct elem *map_read(struct reader *r) {
+  struct elem *map = empty_map();
+  struct elem *key, *value;
+
+  r->pos++;
+  while( r->error == 0 ) {
+    reader_skip_whitespace(r);
+    switch(reader_peek(r)) {
+    case '}':
+      r->pos++;
+      return map;
+    case READER_EOF:
+      return reader_fail(r, "End of string encountered while reading");
+    }
+    key = elem_read(r);
+    value = elem_read(r);
+    if ( r->error == 0 ) {
+      map = map_set(r->frame, map, key, value);
+    }
+  }
+  return r->error;
+}
+
+// the # has been read, the { of #{a b} is next
+struct elem *set_read(struct reader *r) {
+  struct elem *set = empty_set();
+  struct elem *value;
+
+  if ( reader_peek(r) != '{' ) {
+    return reader_fail(r, "Expected { or [ after #");
+  }
+  r->pos++;
+  while( r->error == 0 ) {
+    reader_skip_whitespace(r);
+    switch(reader_peek(r)) {
+    case '}':
+      r->pos++;
+      return set;
+    case READER_EOF:
+      return reader_fail(r, "End of string encountered while reading");
+    }
+    value = elem_read(r);
+    if ( r->error == 0 ) {
+      set = set_add(r->frame, set, value);
+    }
+  }
+  return r->error;
+}
+
+// cells are linked front to back, they are not visible until returned
+struct elem *list_read(struct reader *r) {
+  struct elem *list = empty_list();
+  struct elem **tail = &list;
+  struct elem *value;
+
+  r->pos++;
+  while( r->error == 0 ) {
+    reader_skip_whitespace(r);
+    switch(reader_peek(r)) {
+    case ')':
+      r->pos++;
+      return list;
+    case READER_EOF:
+      return reader_fail(r, "End of string encountered while reading");
+    }
+    value = elem_read(r);
+    if ( r->error == 0 ) {
+      *tail = alloc_list(r->frame, empty_list(), value);
+      tail = &pair_of(*tail)->next;
+    }
+  }
+  return r->error;
+}
+
+// items gather in an array that becomes the vector's own
+struct elem *vector_read(struct reader *r) {
+  struct elem **items = 0;
+  struct elem *value;
+  uint32_t len = 0, cap = 0;
+
+  r->pos++;
+  while( r->error == 0 ) {
+    reader_skip_whitespace(r);
+    switch(reader_peek(r)) {
+    case ']':
+      r->pos++;
+      return vector_of(r->frame, items != 0 ? items : NEW_ARRAY(struct elem *, 1), len);
+    case READER_EOF:
+      FREE_ARRAY(items);
+      return reader_fail(r, "End of string encountered while reading");
+    }
+    value = elem_read(r);
+    if ( r->error == 0 ) {
+      if ( len == cap ) {
+        cap = cap ? cap * 2 : 8;
+        items = (struct elem **)realloc(items, cap * sizeof(struct elem *));
+      }
+      items[len++] = value;
+    }
+  }
+  FREE_ARRAY(items);
+  return r->error;
+}
+
+struct elem *pvec_read(struct reader *r) {
+  struct pvec_builder b = { 0, 0, 0 };
+  struct elem *value;
+
+  r->pos++;
+  while( r->error == 0 ) {
+    reader_skip_whitespace(r);
+    switch(reader_peek(r)) {
+    case ']':
+      r->pos++;
+      return pvec_builder_finish(r->frame, &b);
+    case READER_EOF:
+      FREE_ARRAY(b.items);
+      return reader_fail(r, "End of string encountered while reading");
+    }
+    value = elem_read(r);
+    if ( r->error == 0 ) {
+      pvec_builder_add(&b, value);
+    }
+  }
+  FREE_ARRAY(b.items);
+  return r->error;
+}
+
+struct elem *elem_read(struct reader *r) {
+  int c;
+  reader_skip_whitespace(r);
+  c = reader_peek(r);
+
+  switch(c) {
+  case '{':
+    return map_read(r);
+  case '#':
+    r->pos++;
+    return reader_peek(r) == '[' ? pvec_read(r) : set_read(r);
+  case '(':
+    return list_read(r);
+  case '[':
+    return vector_read(r);
+  case '"':
+    return string_read(r);
+  case ':':
+    return sym_read(r);
+  }
+
+  if ( is_ident_char(c) ) {
+    return ident_read(r);
+  }
+
+  return reader_fail(r, "Symbol not recognised.");
+}
+
+struct elem *reader_read_buf(struct elem *frame, const char *input, size_t len) {
+  struct reader r;
+  struct elem *value;
+  reader_init(&r, frame, input, len);
+  value = elem_read(&r);
+  if ( r.error != 0 ) {
+    return r.error;
+  }
+  return value;
+}
+
+struct elem *reader_read(struct elem *frame, char *expr) {
+  return reader_read_buf(frame, expr, strlen(expr));
+}
+
+// the next top level form, 0 once the input is used up
+struct elem *reader_next(struct reader *r) {
+  if ( r->error != 0 ) {
+    return r->error;
+  }
+  reader_skip_whitespace(r);
+  if ( reader_peek(r) == READER_EOF ) {
+    return r->error;
+  }
+  return elem_read(r);
+}
+
+/*
+ * Reads and evaluates one top level form at a time in the reader's
+ * frame. A form is garbage once it has been evaluated, so memory stays
+ * bounded by the largest form rather than the size of the input.
+ */
+struct elem *frame_load(struct reader *r) {
+  struct elem *frame = r->frame;
+  struct elem *form, *value = nil();
+  while( (form = reader_next(r)) != 0 ) {
+    if ( is_type(form, ELEM_TYPE_ERROR) ) {
+      return form;
+    }
+    frame_set(frame, sym_rhs(), form);
+    frame_set(frame, sym_lhs(), empty_list());
+    value = frame_eval(frame);
+  }
+  return value;
+}
+
+/*
+ * Maps the file and reads it in place. Strings and identifiers borrow
+ * their text from the mapping, which stays mapped until the frame's
+ * alloc is freed.
+ */
+// borrowed strings point into mappings, which live as long as the alloc
+void alloc_add_mapping(struct alloc *alloc, void *addr, size_t len) {
+  struct alloc_mapping *m = NEW(struct alloc_mapping);
+  m->addr = addr;
+  m->len = len;
+  pthread_mutex_lock(&alloc->lock);
+  m->next = alloc->mappings;
+  alloc->mappings = m;
+  pthread_mutex_unlock(&alloc->lock);
+}
+
+// returns 0 with *error set if the file cannot be mapped, or with *len 0 if it is empty
+const char *frame_map_file(struct elem *frame, char *path, size_t *len, struct elem **error) {
+  struct stat st;
+  void *addr;
+  int fd = open(path, O_RDONLY);
+
+  *len = 0;
+  *error = 0;
+  if ( fd < 0 ) {
+    *error = new_error(frame, "Could not open file");
+    return 0;
+  }
+  if ( fstat(fd, &st) != 0 ) {
+    close(fd);
+    *error = new_error(frame, "Could not stat file");
+    return 0;
+  }
+  if ( st.st_size == 0 ) {
+    close(fd);
+    return 0;
+  }
+  addr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if ( addr == MAP_FAILED ) {
+    *error = new_error(frame, "Could not map file");
+    return 0;
+  }
+  madvise(addr, st.st_size, MADV_SEQUENTIAL);
+  alloc_add_mapping(frame_alloc(frame), addr, st.st_size);
+  *len = st.st_size;
+  return addr;
+}
+
+struct elem *frame_load_file(struct elem *frame, char *path) {
+  struct elem *error;
+  struct reader r;
+  size_t len;
+  const char *addr = frame_map_file(frame, path, &len, &error);
+
+  if ( addr == 0 ) {
+    return error != 0 ? error : nil();
+  }
+  reader_init(&r, frame, addr, len);
+  r.borrow = 1;
+  return frame_load(&r);
+}
+
+/*
+ * Snapshots are a binary form of a value that loads without parsing.
+ * After the magic comes one record for the value. Each record is a tag
+ * byte and its fields, which are varints, bytes or further records:
+ *
+ *   strings                  length, then the bytes
+ *   symbols                  a new one's name, afterwards its index
+ *   identifiers              their symbol
+ *   lists                    a run of n pairs, n values, then the tail
+ *   maps and sets            count, then the root trie node
+ *   trie nodes               datamap, nodemap, len, then the slots
+ *
+ * Cells and pairs are numbered apart, each in the order their records
+ * start, the pairs of a run before its values, and one met again is
+ * written as a reference to its number. Shared tails and trie nodes of
+ * persistent values are so only written once. Tries are stored node for
+ * node, which is possible because keys hash by content; cells that hash
+ * by identity carry their hash along. The snapshot ends in the number of
+ * cells and pairs as two 64 bit words, so the loader can take them all
+ * from the alloc in one go.
+ *
+ * Builtin functions and allocs only make sense in the process that made
+ * them, and a value holding one cannot be saved.
+ */
+#define SNAPSHOT_MAGIC      "LSNP\2"
+#define SNAPSHOT_MAGIC_LEN  5
+#define SNAPSHOT_TRAILER    16
+
+#define SNAPSHOT_NULL       0
+#define SNAPSHOT_NIL        1
+#define SNAPSHOT_TRUE       2
+#define SNAPSHOT_FALSE      3
+#define SNAPSHOT_INT        4
+#define SNAPSHOT_EMPTY_LIST 5
+#define SNAPSHOT_EMPTY_SET  6
+#define SNAPSHOT_EMPTY_MAP  7
+#define SNAPSHOT_REF        8
+#define SNAPSHOT_REF_PAIR   21
+#define SNAPSHOT_SYM_NEW    9
+#define SNAPSHOT_SYM        10
+#define SNAPSHOT_STRING     11
+#define SNAPSHOT_IDENT      12
+#define SNAPSHOT_LIST       13
+#define SNAPSHOT_MAP        14
+#define SNAPSHOT_SET        15
+#define SNAPSHOT_NODE       16
+#define SNAPSHOT_ERROR      17
+#define SNAPSHOT_FN         18
+#define SNAPSHOT_FRAME      19
+#define SNAPSHOT_CODE       20
+#define SNAPSHOT_BIGINT     22
+#define SNAPSHOT_VECTOR     23
+#define SNAPSHOT_PVEC       24
+#define SNAPSHOT_PVEC_NODE  25
+
+// ids by address, for the cells and symbols a snapshot has written so far
+struct snapshot_ids {
+  uintptr_t *keys;
+  uint32_t  *ids;
+  uint32_t   len;
+  uint32_t   count;
+};
+
+// the id of key plus one, 0 if it has none yet
+uint32_t snapshot_ids_find(struct snapshot_ids *t, uintptr_t key) {
+  uint32_t i;
+  if ( t->len == 0 ) {
+    return 0;
+  }
+  for(i=mix_hash(key)&(t->len-1);t->keys[i]!=0;i=(i+1)&(t->len-1)) {
+    if ( t->keys[i] == key ) {
+      return t->ids[i] + 1;
+    }
+  }
+  return 0;
+}
+
+void snapshot_ids_add(struct snapshot_ids *t, uintptr_t key, uint32_t id) {
+  uintptr_t *keys = t->keys;
+  uint32_t *ids = t->ids, len = t->len, i, j;
+  if ( 2 * (t->count + 1) > t->len ) {
+    t->len = len ? len * 2 : 1024;
+    t->keys = NEW_ARRAY(uintptr_t, t->len);
+    t->ids = NEW_ARRAY(uint32_t, t->len);
+    t->count = 0;
+    for(j=0;j<len;++j) {
+      if ( keys[j] != 0 ) {
+        snapshot_ids_add(t, keys[j], ids[j]);
+      }
+    }
+    FREE_ARRAY(keys);
+    FREE_ARRAY(ids);
+  }
+  for(i=mix_hash(key)&(t->len-1);t->keys[i]!=0;i=(i+1)&(t->len-1)) {
+  }
+  t->keys[i] = key;
+  t->ids[i] = id;
+  t->count++;
+}
+
+struct snapshot_writer {
+  struct printer     *p;
+  struct snapshot_ids cells;
+  struct snapshot_ids syms;
+  uint32_t            ncells;
+  uint32_t            npairs;
+  int                 error;
+};
+
+void snapshot_byte(struct snapshot_writer *w, uint8_t b) {
+  printer_putc(w->p, (char)b);
+}
+
+void snapshot_varint(struct snapshot_writer *w, uint64_t x) {
+  char tmp[10];
+  int n = 0;
+  do {
+    tmp[n] = x & 127;
+    x >>= 7;
+    tmp[n++] |= x != 0 ? 128 : 0;
+  } while( x != 0 );
+  printer_write(w->p, tmp, n);
+}
+
+void snapshot_bytes(struct snapshot_writer *w, const char *s, uint32_t len) {
+  snapshot_varint(w, len);
+  printer_write(w->p, s, len);
+}
+
+// ropes are written flat, a run at a time
+void snapshot_string(struct snapshot_writer *w, struct elem *s) {
+  struct string_iter it;
+  const char *run;
+  uint32_t len;
+  snapshot_varint(w, string_len(s));
+  string_iter_init(&it, s);
+  while( string_iter_next(&it, &run, &len) ) {
+    printer_write(w->p, run, len);
+  }
+}
+
+void snapshot_write_elem(struct snapshot_writer *w, struct elem *e);
+
+// a run of pairs up to the end of the list or the first one already written
+void snapshot_write_list(struct snapshot_writer *w, struct elem *e) {
+  struct elem *l;
+  uint32_t i, n = 0;
+  for(l=e;is_pair(l)&&(n==0||snapshot_ids_find(&w->cells, (uintptr_t)pair_of(l))==0);l=list_next(l)) {
+    snapshot_ids_add(&w->cells, (uintptr_t)pair_of(l), w->npairs++);
+    n++;
+  }
+  snapshot_byte(w, SNAPSHOT_LIST);
+  snapshot_varint(w, n);
+  for(i=0,l=e;i<n;++i,l=list_next(l)) {
+    snapshot_write_elem(w, list_value(l));
+  }
+  snapshot_write_elem(w, l);
+}
+
+void snapshot_write_elem(struct snapshot_writer *w, struct elem *e) {
+  struct code *k;
+  uint32_t id, i;
+  if ( w->error ) {
+    return;
+  }
+  if ( e == 0 ) {
+    snapshot_byte(w, SNAPSHOT_NULL);
+    return;
+  }
+  if ( is_immediate(e) ) {
+    switch(elem_type(e)) {
+    case ELEM_TYPE_NIL:
+      snapshot_byte(w, SNAPSHOT_NIL);
+      break;
+    case ELEM_TYPE_TRUE:
+      snapshot_byte(w, SNAPSHOT_TRUE);
+      break;
+    case ELEM_TYPE_FALSE:
+      snapshot_byte(w, SNAPSHOT_FALSE);
+      break;
+    case ELEM_TYPE_INT:
+      snapshot_byte(w, SNAPSHOT_INT);
+      snapshot_varint(w, ((uint64_t)int_value(e) << 1) ^ (uint64_t)(int_value(e) >> 63));
+      break;
+    case ELEM_TYPE_LIST:
+      snapshot_byte(w, SNAPSHOT_EMPTY_LIST);
+      break;
+    case ELEM_TYPE_SET:
+      snapshot_byte(w, SNAPSHOT_EMPTY_SET);
+      break;
+    case ELEM_TYPE_MAP:
+      snapshot_byte(w, SNAPSHOT_EMPTY_MAP);
+      break;
+    default:
+      w->error = 1;
+    }
+    return;
+  }
+  if ( elem_type(e) == ELEM_TYPE_SYM ) {
+    if ( (id = snapshot_ids_find(&w->syms, (uintptr_t)e)) != 0 ) {
+      snapshot_byte(w, SNAPSHOT_SYM);
+      snapshot_varint(w, id - 1);
+    } else {
+      snapshot_ids_add(&w->syms, (uintptr_t)e, w->syms.count);
+      snapshot_byte(w, SNAPSHOT_SYM_NEW);
+      snapshot_bytes(w, e->sval.str, e->sval.len - 1);
+    }
+    return;
+  }
+  if ( (id = snapshot_ids_find(&w->cells, (uintptr_t)e & ~(uintptr_t)ELEM_TAG_MASK)) != 0 ) {
+    snapshot_byte(w, is_pair(e) ? SNAPSHOT_REF_PAIR : SNAPSHOT_REF);
+    snapshot_varint(w, id - 1);
+    return;
+  }
+  if ( is_pair(e) ) {
+    snapshot_write_list(w, e);
+    return;
+  }
+  if ( e->type == ELEM_TYPE_ALLOC || (e->type == ELEM_TYPE_FN && e->fval.fn != 0) ) {
+    w->error = 1;
+    return;
+  }
+  snapshot_ids_add(&w->cells, (uintptr_t)e, w->ncells++);
+  switch(e->type) {
+  case ELEM_TYPE_STRING:
+    snapshot_byte(w, SNAPSHOT_STRING);
+    snapshot_string(w, e);
+    break;
+  case ELEM_TYPE_IDENT:
+    snapshot_byte(w, SNAPSHOT_IDENT);
+    snapshot_write_elem(w, to_sym(0, e));
+    break;
+  case ELEM_TYPE_MAP:
+  case ELEM_TYPE_SET:
+    snapshot_byte(w, e->type == ELEM_TYPE_MAP ? SNAPSHOT_MAP : SNAPSHOT_SET);
+    snapshot_varint(w, e->mval.count);
+    snapshot_write_elem(w, e->mval.root);
+    break;
+  case ELEM_TYPE_MAP_NODE:
+    snapshot_byte(w, SNAPSHOT_NODE);
+    snapshot_varint(w, e->nval.datamap);
+    snapshot_varint(w, e->nval.nodemap);
+    snapshot_varint(w, e->nval.len);
+    for(i=0;i<e->nval.len;++i) {
+      snapshot_write_elem(w, e->nval.slots[i]);
+    }
+    break;
+  case ELEM_TYPE_ERROR:
+    snapshot_byte(w, SNAPSHOT_ERROR);
+    snapshot_varint(w, elem_cached_hash(&e->hash));
+    snapshot_write_elem(w, e->eval.map);
+    break;
+  case ELEM_TYPE_FN:
+    snapshot_byte(w, SNAPSHOT_FN);
+    snapshot_varint(w, elem_cached_hash(&e->hash));
+    snapshot_write_elem(w, e->fval.args);
+    snapshot_write_elem(w, e->fval.expr);
+    break;
+  case ELEM_TYPE_FRAME:
+    snapshot_byte(w, SNAPSHOT_FRAME);
+    snapshot_varint(w, elem_cached_hash(&e->hash));
+    snapshot_write_elem(w, e->frval.frame->lhs);
+    snapshot_write_elem(w, e->frval.frame->rhs);
+    snapshot_write_elem(w, e->frval.frame->parent);
+    snapshot_write_elem(w, e->frval.frame->env);
+    snapshot_write_elem(w, e->frval.frame->ext);
+    break;
+  case ELEM_TYPE_BIGINT:
+    snapshot_byte(w, SNAPSHOT_BIGINT);
+    snapshot_varint(w, e->bval.sign < 0);
+    snapshot_varint(w, e->bval.len);
+    for(i=0;i<e->bval.len;++i) {
+      snapshot_varint(w, e->bval.limbs[i]);
+    }
+    break;
+  case ELEM_TYPE_VECTOR:
+    snapshot_byte(w, SNAPSHOT_VECTOR);
+    snapshot_varint(w, e->vval.kind);
+    snapshot_varint(w, e->vval.len);
+    for(i=0;i<e->vval.len;++i) {
+      if ( e->vval.kind == VECTOR_INTS ) {
+        snapshot_varint(w, ((uint64_t)e->vval.ints[i] << 1) ^ (uint64_t)(e->vval.ints[i] >> 63));
+      } else {
+        snapshot_write_elem(w, e->vval.items[i]);
+      }
+    }
+    break;
+  case ELEM_TYPE_PVEC:
+    snapshot_byte(w, SNAPSHOT_PVEC);
+    snapshot_varint(w, e->pval.count);
+    snapshot_varint(w, e->pval.shift);
+    snapshot_write_elem(w, e->pval.root);
+    snapshot_write_elem(w, e->pval.tail);
+    break;
+  case ELEM_TYPE_PVEC_NODE:
+    snapshot_byte(w, SNAPSHOT_PVEC_NODE);
+    snapshot_varint(w, e->pnval.len);
+    for(i=0;i<e->pnval.len;++i) {
+      snapshot_write_elem(w, e->pnval.slots[i]);
+    }
+    break;
+  case ELEM_TYPE_CODE:
+    k = e->cval.code;
+    snapshot_byte(w, SNAPSHOT_CODE);
+    snapshot_varint(w, elem_cached_hash(&e->hash));
+    snapshot_varint(w, k->nparams);
+    snapshot_varint(w, k->nregs);
+    snapshot_varint(w, k->len);
+    for(i=0;i<k->len;++i) {
+      snapshot_varint(w, k->ops[i]);
+    }
+    snapshot_varint(w, k->ncaches);
+    snapshot_varint(w, k->nconsts);
+    for(i=0;i<k->nconsts;++i) {
+      snapshot_write_elem(w, k->consts[i]);
+    }
+    break;
+  default:
+    w->error = 1;
+  }
+}
+
+void snapshot_u64(struct snapshot_writer *w, uint64_t x) {
+  int i;
+  for(i=0;i<8;++i) {
+    snapshot_byte(w, (uint8_t)(x >> (8 * i)));
+  }
+}
+
+// -1 if e holds something that cannot be saved or the printer failed, having printed part of it
+int snapshot_save(struct printer *p, struct elem *e) {
+  struct snapshot_writer w;
+  memset(&w, 0, sizeof(w));
+  w.p = p;
+  printer_write(p, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+  snapshot_write_elem(&w, e);
+  snapshot_u64(&w, w.ncells);
+  snapshot_u64(&w, w.npairs);
+  FREE_ARRAY(w.cells.keys);
+  FREE_ARRAY(w.cells.ids);
+  FREE_ARRAY(w.syms.keys);
+  FREE_ARRAY(w.syms.ids);
+  return w.error || p->error ? -1 : 0;
+}
+
+/*
+ * The cells or pairs of a snapshot fill fresh chunks in the order they
+ * are numbered, so a reference finds its cell from the number alone.
+ */
+struct snapshot_space {
+  struct alloc_chunk **chunks;
+  uint64_t count;
+  uint64_t next;
+  uint32_t per_chunk;
+  uint32_t size;
+  char    *cur;
+  char    *end;
+};
+
+struct snapshot_loader {
+  const uint8_t *buf;
+  size_t         len;
+  size_t         pos;
+  struct elem   *frame;
+  struct snapshot_space cells;
+  struct snapshot_space pairs;
+  struct elem  **syms;
+  uint32_t       nsyms;
+  uint32_t       syms_cap;
+  struct elem_list **run;
+  uint64_t       run_len;
+  uint64_t       run_cap;
+  int            check_hashes;
+  int            error;
+};
+
+uint64_t snapshot_read_varint(struct snapshot_loader *l) {
+  uint64_t x = 0;
+  uint8_t b;
+  int shift = 0;
+  do {
+    if ( l->pos == l->len || shift > 63 ) {
+      l->error = 1;
+      return 0;
+    }
+    b = l->buf[l->pos++];
+    x |= (uint64_t)(b & 127) << shift;
+    shift += 7;
+  } while( b & 128 );
+  return x;
+}
+
+// a length prefixed run of bytes, left where it is in the snapshot
+const char *snapshot_read_bytes(struct snapshot_loader *l, uint32_t *len) {
+  uint64_t n = snapshot_read_varint(l);
+  const char *s = (const char *)l->buf + l->pos;
+  if ( l->error || n > l->len - l->pos ) {
+    l->error = 1;
+    *len = 0;
+    return 0;
+  }
+  l->pos += n;
+  *len = n;
+  return s;
+}
+
+// must be called with the alloc locked, a chunk is zeroed when it is first taken from
+void snapshot_space_reserve(struct snapshot_space *s, struct alloc *alloc, struct alloc_class *k, uint64_t count) {
+  uint64_t i, n;
+  s->count = count;
+  s->size = k->size;
+  n = 0;
+  if ( count != 0 ) {
+    s->chunks = NEW_ARRAY(struct alloc_chunk *, 1);
+    s->chunks[0] = new_alloc_chunk(alloc, k);
+    s->per_chunk = s->chunks[0]->len;
+    n = (count + s->per_chunk - 1) / s->per_chunk;
+    s->chunks = (struct alloc_chunk **)realloc(s->chunks, n * sizeof(struct alloc_chunk *));
+  }
+  for(i=0;i<n;++i) {
+    if ( i != 0 ) {
+      s->chunks[i] = new_alloc_chunk(alloc, k);
+    }
+    // what the last chunk has left over stays with the alloc
+    s->chunks[i]->tail = i + 1 < n ? s->per_chunk : count - i * s->per_chunk;
+  }
+}
+
+void *snapshot_space_take(struct snapshot_space *s) {
+  void *ret;
+  if ( s->cur == s->end ) {
+    if ( s->next == s->count ) {
+      return 0;
+    }
+    s->cur = s->chunks[s->next / s->per_chunk]->table;
+    s->end = s->cur + (size_t)s->chunks[s->next / s->per_chunk]->tail * s->size;
+    memset(s->cur, 0, s->end - s->cur);
+  }
+  ret = s->cur;
+  s->cur += s->size;
+  s->next++;
+  return ret;
+}
+
+void *snapshot_space_at(struct snapshot_space *s, uint64_t id) {
+  if ( id >= s->next ) {
+    return 0;
+  }
+  return s->chunks[id / s->per_chunk]->table + (size_t)(id % s->per_chunk) * s->size;
+}
+
+// the next of the cells taken for the snapshot
+struct elem *snapshot_cell(struct snapshot_loader *l) {
+  struct elem *e = (struct elem *)snapshot_space_take(&l->cells);
+  if ( e == 0 ) {
+    l->error = 1;
+  }
+  return e;
+}
+
+struct elem *snapshot_read_elem(struct snapshot_loader *l);
+
+struct elem *snapshot_read_string(struct snapshot_loader *l) {
+  struct elem *e = snapshot_cell(l);
+  uint32_t len;
+  const char *s = snapshot_read_bytes(l, &len);
+  if ( e == 0 || s == 0 ) {
+    return nil();
+  }
+  e->flags = ELEM_FLAG_BORROWED;
+  e->sval.str = (char *)s;
+  e->sval.len = len + 1;
+  e->type = ELEM_TYPE_STRING;
+  return e;
+}
+
+// an identifier is written as its symbol, whose name it borrows
+struct elem *snapshot_read_ident(struct snapshot_loader *l) {
+  struct elem *e = snapshot_cell(l), *sym;
+  if ( e == 0 ) {
+    return nil();
+  }
+  sym = snapshot_read_elem(l);
+  if ( l->error || elem_type(sym) != ELEM_TYPE_SYM ) {
+    l->error = 1;
+    return nil();
+  }
+  e->flags = ELEM_FLAG_BORROWED;
+  e->sval.str = sym->sval.str;
+  e->sval.len = sym->sval.len;
+  e->sval.sym = sym;
+  e->type = ELEM_TYPE_IDENT;
+  return e;
+}
+
+/*
+ * The pairs of a run are numbered before the values, but only linked up
+ * once the values are read, so a pair with no next is still being read.
+ * The run ends in the empty list or a pair that has been read. Runs in
+ * progress keep their pairs on a stack, as they need not be next to
+ * each other.
+ */
+struct elem *snapshot_read_list(struct snapshot_loader *l) {
+  uint64_t n = snapshot_read_varint(l), base = l->run_len, i;
+  struct elem *tail;
+  struct elem_list *p;
+  if ( l->error || n == 0 || n > l->pairs.count - l->pairs.next ) {
+    l->error = 1;
+    return nil();
+  }
+  if ( base + n > l->run_cap ) {
+    l->run_cap = base + n > 2 * l->run_cap ? base + n : 2 * l->run_cap;
+    l->run = (struct elem_list **)realloc(l->run, l->run_cap * sizeof(struct elem_list *));
+  }
+  for(i=0;i<n;++i) {
+    l->run[base + i] = (struct elem_list *)snapshot_space_take(&l->pairs);
+  }
+  l->run_len += n;
+  for(i=0;i<n;++i) {
+    l->run[base + i]->value = snapshot_read_elem(l);
+  }
+  tail = snapshot_read_elem(l);
+  l->run_len = base;
+  if ( l->error || (tail != ELEM_EMPTY_LIST && ! is_pair(tail)) ) {
+    l->error = 1;
+    return nil();
+  }
+  for(i=n;i-->0;) {
+    p = l->run[base + i];
+    p->next = tail;
+    tail = (struct elem *)((uintptr_t)p | ELEM_TAG_LIST);
+  }
+  return tail;
+}
+
+struct elem *snapshot_read_node(struct snapshot_loader *l) {
+  struct elem *e = snapshot_cell(l);
+  uint32_t datamap = snapshot_read_varint(l), nodemap = snapshot_read_varint(l), i;
+  uint64_t len = snapshot_read_varint(l);
+  // each slot takes at least a byte, which bounds len before it is allocated
+  if ( e == 0 || l->error || len > l->len - l->pos ) {
+    l->error = 1;
+    return nil();
+  }
+  if ( (datamap & nodemap) != 0 || (datamap != 0 || nodemap != 0 ? len != 2 * __builtin_popcount(datamap) + __builtin_popcount(nodemap) : len == 0 || len % 2 != 0) ) {
+    l->error = 1;
+    return nil();
+  }
+  e->nval.datamap = datamap;
+  e->nval.nodemap = nodemap;
+  e->nval.len = len;
+  pthread_mutex_lock(&frame_alloc(l->frame)->lock);
+  e->nval.slots = (struct elem **)alloc_tenured_bytes(frame_alloc(l->frame), len * sizeof(struct elem *));
+  pthread_mutex_unlock(&frame_alloc(l->frame)->lock);
+  for(i=0;i<len;++i) {
+    e->nval.slots[i] = snapshot_read_elem(l);
+  }
+  // the slots after the entries hold sub nodes, which collision nodes have none of
+  for(i=2*__builtin_popcount(datamap);i<len&&nodemap!=0&&!l->error;++i) {
+    l->error = ! is_type(e->nval.slots[i], ELEM_TYPE_MAP_NODE);
+  }
+  e->type = ELEM_TYPE_MAP_NODE;
+  return e;
+}
+
+// a bigint that would fit a fixnum is corrupt, as one is never made
+struct elem *snapshot_read_bigint(struct snapshot_loader *l) {
+  struct elem *e = snapshot_cell(l);
+  uint64_t neg = snapshot_read_varint(l), len = snapshot_read_varint(l), *limbs;
+  uint32_t i;
+  if ( e == 0 || l->error || neg > 1 || len == 0 || len > l->len - l->pos ) {
+    l->error = 1;
+    return nil();
+  }
+  limbs = NEW_ARRAY(uint64_t, len);
+  for(i=0;i<len;++i) {
+    limbs[i] = snapshot_read_varint(l);
+  }
+  if ( limbs[len - 1] == 0 || (len == 1 && limbs[0] <= (neg ? -(uint64_t)FIXNUM_MIN : (uint64_t)FIXNUM_MAX)) ) {
+    l->error = 1;
+    FREE_ARRAY(limbs);
+    return nil();
+  }
+  e->bval.sign = neg ? -1 : 1;
+  e->bval.len = len;
+  e->bval.limbs = limbs;
+  e->type = ELEM_TYPE_BIGINT;
+  frame_alloc(l->frame)->promoted += owned_cells(e);
+  return e;
+}
+
+// so is a vector of elems that are all fixnums
+struct elem *snapshot_read_vector(struct snapshot_loader *l) {
+  struct elem *e = snapshot_cell(l);
+  uint64_t kind = snapshot_read_varint(l), len = snapshot_read_varint(l), x;
+  uint32_t i, fixnums = 0;
+  if ( e == 0 || l->error || kind > VECTOR_INTS || len > l->len - l->pos ) {
+    l->error = 1;
+    return nil();
+  }
+  e->vval.kind = kind;
+  e->vval.len = len;
+  e->vval.items = NEW_ARRAY(struct elem *, len + 1);
+  for(i=0;i<len;++i) {
+    if ( kind == VECTOR_INTS ) {
+      x = snapshot_read_varint(l);
+      x = (x >> 1) ^ -(x & 1);
+      if ( (int64_t)x < FIXNUM_MIN || (int64_t)x > FIXNUM_MAX ) {
+        l->error = 1;
+      }
+      e->vval.ints[i] = x;
+    } else {
+      e->vval.items[i] = snapshot_read_elem(l);
+      fixnums += is_fixnum(e->vval.items[i]);
+    }
+  }
+  if ( kind == VECTOR_ELEMS && fixnums == len ) {
+    l->error = 1;
+  }
+  e->type = ELEM_TYPE_VECTOR;
+  frame_alloc(l->frame)->promoted += owned_cells(e);
+  return e;
+}
+
+int is_pvec_node(struct elem *e) {
+  return is_type(e, ELEM_TYPE_PVEC_NODE);
+}
+
+// leaves never hold nodes, so the height shows down the leftmost path
+uint32_t pvec_node_shift(struct elem *n) {
+  uint32_t shift = 0;
+  for(;is_pvec_node(n->pnval.slots[0]);n=n->pnval.slots[0]) {
+    shift += PVEC_BITS;
+  }
+  return shift;
+}
+
+/*
+ * Sizes are not written but worked out again, as only nodes that could
+ * not be strict have them.
+ */
+struct elem *snapshot_read_pvec_node(struct snapshot_loader *l) {
+  struct elem *e = snapshot_cell(l), **slots;
+  uint64_t len = snapshot_read_varint(l), count = 0;
+  uint32_t i, shift = 0;
+  if ( e == 0 || l->error || len == 0 || len > PVEC_WIDTH ) {
+    l->error = 1;
+    return nil();
+  }
+  slots = NEW_ARRAY(struct elem *, len);
+  for(i=0;i<len;++i) {
+    slots[i] = snapshot_read_elem(l);
+  }
+  for(i=0;i<len&&!l->error;++i) {
+    l->error = slots[i] == 0;
+  }
+  if ( ! l->error && is_pvec_node(slots[0]) ) {
+    shift = pvec_node_shift(slots[0]) + PVEC_BITS;
+  }
+  for(i=0;i<len&&!l->error;++i) {
+    if ( shift > 0 ? shift > PVEC_MAX_SHIFT || ! is_pvec_node(slots[i]) || pvec_node_shift(slots[i]) != shift - PVEC_BITS : is_pvec_node(slots[i]) ) {
+      l->error = 1;
+    } else {
+      count += shift > 0 ? pvec_node_count(slots[i], shift - PVEC_BITS) : 1;
+    }
+  }
+  if ( l->error || count > UINT32_MAX ) {
+    l->error = 1;
+    FREE_ARRAY(slots);
+    return nil();
+  }
+  e->pnval.sizes = pvec_node_sizes(slots, len, shift);
+  e->pnval.slots = slots;
+  e->pnval.len = len;
+  e->type = ELEM_TYPE_PVEC_NODE;
+  frame_alloc(l->frame)->promoted += owned_cells(e);
+  return e;
+}
+
+struct elem *snapshot_read_pvec(struct snapshot_loader *l) {
+  struct elem *e = snapshot_cell(l), *root, *tail;
+  uint64_t count = snapshot_read_varint(l), shift = snapshot_read_varint(l), tree = 0;
+  if ( e == 0 ) {
+    return nil();
+  }
+  root = snapshot_read_elem(l);
+  tail = snapshot_read_elem(l);
+  if ( l->error || root == 0 || tail == 0 || (! is_nil(tail) && (! is_pvec_node(tail) || is_pvec_node(tail->pnval.slots[0]))) ) {
+    l->error = 1;
+    return nil();
+  }
+  if ( ! is_nil(root) ) {
+    if ( ! is_pvec_node(root) || pvec_node_shift(root) != shift ) {
+      l->error = 1;
+      return nil();
+    }
+    tree = pvec_node_count(root, shift);
+  } else if ( shift != 0 ) {
+    l->error = 1;
+    return nil();
+  }
+  if ( count != tree + (is_nil(tail) ? 0 : tail->pnval.len) || count > UINT32_MAX ) {
+    l->error = 1;
+    return nil();
+  }
+  e->pval.count = count;
+  e->pval.shift = shift;
+  e->pval.root = root;
+  e->pval.tail = tail;
+  e->type = ELEM_TYPE_PVEC;
+  return e;
+}
+
+/*
+ * The entries under a node, or -1 if collision nodes are found anywhere
+ * but below the last level or something else is found there. Only a
+ * checked load hashes the keys too, to make sure each sits where its hash
+ * puts it, prefix in the bits below shift.
+ */
+int64_t snapshot_check_node(struct snapshot_loader *l, struct elem *n, uint64_t prefix, uint32_t shift) {
+  uint32_t i = 0, bits, data = 2 * __builtin_popcount(n->nval.datamap);
+  uint64_t mask = shift < 32 ? ((uint64_t)2 << (shift + MAP_BITS - 1)) - 1 : UINT32_MAX;
+  int64_t count = __builtin_popcount(n->nval.datamap), sub;
+  if ( (shift > MAP_MAX_SHIFT) != is_collision_node(n) ) {
+    return -1;
+  }
+  if ( shift > MAP_MAX_SHIFT ) {
+    for(i=0;l->check_hashes&&i<n->nval.len;i+=2) {
+      if ( elem_hash(l->frame, n->nval.slots[i]) != prefix ) {
+        return -1;
+      }
+    }
+    return n->nval.len / 2;
+  }
+  for(bits=n->nval.datamap;l->check_hashes&&bits!=0;bits&=bits-1,i+=2) {
+    if ( (elem_hash(l->frame, n->nval.slots[i]) & mask) != ((prefix | (uint64_t)__builtin_ctz(bits) << shift) & mask) ) {
+      return -1;
+    }
+  }
+  for(bits=n->nval.nodemap;bits!=0;bits&=bits-1) {
+    sub = snapshot_check_node(l, n->nval.slots[data++], prefix | (uint64_t)__builtin_ctz(bits) << shift, shift + MAP_BITS);
+    if ( sub < 0 ) {
+      return -1;
+    }
+    count += sub;
+  }
+  return count;
+}
+
+/*
+ * The entries in a small map's list, or -1 if it ends on a key or holds
+ * more than MAP_FLAT_MAX. Only a checked load compares the keys too, to
+ * make sure none is there twice.
+ */
+int64_t snapshot_check_list(struct snapshot_loader *l, struct elem *root) {
+  struct elem *p, *q;
+  int64_t count = 0;
+  for(p=root;!list_is_empty(p);p=list_next(list_next(p))) {
+    if ( list_is_empty(list_next(p)) || ++count > MAP_FLAT_MAX ) {
+      return -1;
+    }
+    for(q=root;l->check_hashes&&q!=p;q=list_next(list_next(q))) {
+      if ( elem_eq(l->frame, list_value(q), list_value(p)) ) {
+        return -1;
+      }
+    }
+  }
+  return count;
+}
+
+// nodes can be shared between maps, but each map record checks the whole trie
+struct elem *snapshot_read_map(struct snapshot_loader *l, int type) {
+  struct elem *e = snapshot_cell(l), *root;
+  uint64_t count = snapshot_read_varint(l);
+  if ( e == 0 ) {
+    return nil();
+  }
+  root = snapshot_read_elem(l);
+  if ( l->error || (is_pair(root) ? snapshot_check_list(l, root) 
+      : is_type(root, ELEM_TYPE_MAP_NODE) ? snapshot_check_node(l, root, 0, 0) : -1) != (int64_t)count ) {
+    l->error = 1;
+    return nil();
+  }
+  e->mval.root = root;
+  e->mval.count = count;
+  e->type = type;
+  return e;
+}
+
+// code is the one place a null is kept, for consts it has not been given
+struct elem *snapshot_read_const(struct snapshot_loader *l) {
+  if ( ! l->error && l->pos < l->len && l->buf[l->pos] == SNAPSHOT_NULL ) {
+    l->pos++;
+    return 0;
+  }
+  return snapshot_read_elem(l);
+}
+
+struct elem *snapshot_read_code(struct snapshot_loader *l, struct elem *e) {
+  struct code *k;
+  uint64_t len;
+  uint32_t i;
+  k = NEW(struct code);
+  k->nparams = snapshot_read_varint(l);
+  k->nregs = snapshot_read_varint(l);
+  len = snapshot_read_varint(l);
+  if ( l->error || len > l->len - l->pos ) {
+    l->error = 1;
+    FREE(k);
+    return nil();
+  }
+  k->len = len;
+  k->ops = NEW_ARRAY(uint32_t, k->len + 1);
+  for(i=0;i<k->len;++i) {
+    k->ops[i] = snapshot_read_varint(l);
+  }
+  k->ncaches = snapshot_read_varint(l);
+  len = snapshot_read_varint(l);
+  if ( l->error || len > l->len - l->pos || k->ncaches > l->len ) {
+    l->error = 1;
+    FREE_ARRAY(k->ops);
+    FREE(k);
+    return nil();
+  }
+  k->nconsts = len;
+  k->consts = NEW_ARRAY(struct elem *, k->nconsts + 1);
+  k->caches = NEW_ARRAY(struct elem *, 2 * k->ncaches + 1);
+  for(i=0;i<2*k->ncaches;++i) {
+    k->caches[i] = nil();
+  }
+  e->cval.code = k;
+  for(i=0;i<k->nconsts;++i) {
+    k->consts[i] = snapshot_read_const(l);
+  }
+  e->type = ELEM_TYPE_CODE;
+  return e;
+}
+
+// what it returns is nil once the snapshot turns out corrupt
+struct elem *snapshot_read_elem(struct snapshot_loader *l) {
+  struct elem *e, *fields[5];
+  struct frame *f;
+  uint64_t x;
+  uint32_t len, i;
+  const char *s;
+  if ( l->error || l->pos == l->len ) {
+    l->error = 1;
+    return nil();
+  }
+  switch(l->buf[l->pos++]) {
+  case SNAPSHOT_NIL:
+    return nil();
+  case SNAPSHOT_TRUE:
+    return ELEM_TRUE;
+  case SNAPSHOT_FALSE:
+    return ELEM_FALSE;
+  case SNAPSHOT_INT:
+    x = snapshot_read_varint(l);
+    x = (x >> 1) ^ -(x & 1);
+    if ( (int64_t)x < FIXNUM_MIN || (int64_t)x > FIXNUM_MAX ) {
+      l->error = 1;
+      return nil();
+    }
+    return new_int(l->frame, (int64_t)x);
+  case SNAPSHOT_EMPTY_LIST:
+    return ELEM_EMPTY_LIST;
+  case SNAPSHOT_EMPTY_SET:
+    return ELEM_EMPTY_SET;
+  case SNAPSHOT_EMPTY_MAP:
+    return ELEM_EMPTY_MAP;
+  // a record still being read has no type or next yet, and is never referred to
+  case SNAPSHOT_REF:
+    if ( (e = (struct elem *)snapshot_space_at(&l->cells, snapshot_read_varint(l))) == 0 || e->type == ELEM_TYPE_NIL ) {
+      l->error = 1;
+      return nil();
+    }
+    return e;
+  case SNAPSHOT_REF_PAIR:
+    if ( (e = (struct elem *)snapshot_space_at(&l->pairs, snapshot_read_varint(l))) == 0 || ((struct elem_list *)e)->next == 0 ) {
+      l->error = 1;
+      return nil();
+    }
+    return (struct elem *)((uintptr_t)e | ELEM_TAG_LIST);
+  case SNAPSHOT_SYM_NEW:
+    s = snapshot_read_bytes(l, &len);
+    if ( s == 0 ) {
+      return nil();
+    }
+    if ( l->nsyms == l->syms_cap ) {
+      l->syms_cap = l->syms_cap ? l->syms_cap * 2 : 64;
+      l->syms = (struct elem **)realloc(l->syms, l->syms_cap * sizeof(struct elem *));
+    }
+    return l->syms[l->nsyms++] = intern_len(s, len);
+  case SNAPSHOT_SYM:
+    x = snapshot_read_varint(l);
+    if ( x >= l->nsyms ) {
+      l->error = 1;
+      return nil();
+    }
+    return l->syms[x];
+  case SNAPSHOT_STRING:
+    return snapshot_read_string(l);
+  case SNAPSHOT_IDENT:
+    return snapshot_read_ident(l);
+  case SNAPSHOT_LIST:
+    return snapshot_read_list(l);
+  case SNAPSHOT_MAP:
+    return snapshot_read_map(l, ELEM_TYPE_MAP);
+  case SNAPSHOT_SET:
+    return snapshot_read_map(l, ELEM_TYPE_SET);
+  case SNAPSHOT_NODE:
+    return snapshot_read_node(l);
+  case SNAPSHOT_BIGINT:
+    return snapshot_read_bigint(l);
+  case SNAPSHOT_VECTOR:
+    return snapshot_read_vector(l);
+  case SNAPSHOT_PVEC:
+    return snapshot_read_pvec(l);
+  case SNAPSHOT_PVEC_NODE:
+    return snapshot_read_pvec_node(l);
+  }
+  // the rest hash by identity and keep the hash they were saved with
+  l->pos--;
+  if ( (e = snapshot_cell(l)) == 0 ) {
+    return nil();
+  }
+  switch(l->buf[l->pos++]) {
+  case SNAPSHOT_ERROR:
+    e->hash = snapshot_read_varint(l);
+    e->eval.map = snapshot_read_elem(l);
+    e->type = ELEM_TYPE_ERROR;
+    return e;
+  case SNAPSHOT_FN:
+    e->hash = snapshot_read_varint(l);
+    e->fval.args = snapshot_read_elem(l);
+    e->fval.expr = snapshot_read_elem(l);
+    e->type = ELEM_TYPE_FN;
+    return e;
+  case SNAPSHOT_FRAME:
+    x = snapshot_read_varint(l);
+    for(i=0;i<5;++i) {
+      fields[i] = snapshot_read_elem(l);
+    }
+    init_frame(frame_of(l->frame)->alloc, e);
+    e->hash = x;
+    f = e->frval.frame;
+    f->lhs = fields[0];
+    f->rhs = fields[1];
+    f->parent = fields[2];
+    f->env = fields[3];
+    f->ext = fields[4];
+    return e;
+  case SNAPSHOT_CODE:
+    e->hash = snapshot_read_varint(l);
+    return snapshot_read_code(l, e);
+  }
+  l->error = 1;
+  return nil();
+}
+
+uint64_t snapshot_trailer_u64(const uint8_t *p) {
+  uint64_t x = 0;
+  int i;
+  for(i=0;i<8;++i) {
+    x |= (uint64_t)p[i] << (8 * i);
+  }
+  return x;
+}
+
+/*
+ * Takes every cell the snapshot needs from the old generation at once and
+ * fills them in a single pass over the records. No collection can run
+ * before this thread reaches a safepoint, so until then the cells need
+ * not be valid. Strings are borrowed from buf, which has to be a mapping
+ * of the alloc. Nothing loaded points at
+ * young cells, so no write barrier is needed, and they count towards the
+ * next full collection as if they had been promoted.
+ */
+struct elem *snapshot_load_mapped(struct elem *frame, const char *buf, size_t len, int check_hashes) {
+  struct alloc *alloc = frame_alloc(frame);
+  struct snapshot_loader l;
+  struct elem *value;
+  uint64_t ncells, npairs;
+
+  if ( len < SNAPSHOT_MAGIC_LEN + SNAPSHOT_TRAILER || memcmp(buf, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) != 0 ) {
+    return new_error(frame, "Not a snapshot");
+  }
+  memset(&l, 0, sizeof(l));
+  l.buf = (const uint8_t *)buf;
+  l.len = len - SNAPSHOT_TRAILER;
+  l.pos = SNAPSHOT_MAGIC_LEN;
+  l.frame = frame;
+  l.check_hashes = check_hashes;
+  ncells = snapshot_trailer_u64(l.buf + l.len);
+  npairs = snapshot_trailer_u64(l.buf + l.len + 8);
+  // every record takes at least a byte
+  if ( ncells > l.len || npairs > l.len ) {
+    return new_error(frame, "Corrupt snapshot");
+  }
+  pthread_mutex_lock(&alloc->lock);
+  snapshot_space_reserve(&l.cells, alloc, &alloc->classes[ALLOC_CLASS_CELL], ncells);
+  snapshot_space_reserve(&l.pairs, alloc, &alloc->classes[ALLOC_CLASS_PAIR], npairs);
+  alloc->promoted += ncells + npairs;
+  pthread_mutex_unlock(&alloc->lock);
+
+  value = snapshot_read_elem(&l);
+  if ( l.pos != l.len || l.cells.next != ncells || l.pairs.next != npairs ) {
+    l.error = 1;
+  }
+  // cells a corrupt snapshot left untouched are zeroed for the sweep, like the rest
+  while( snapshot_space_take(&l.cells) != 0 || snapshot_space_take(&l.pairs) != 0 ) {
+  }
+  FREE_ARRAY(l.cells.chunks);
+  FREE_ARRAY(l.pairs.chunks);
+  FREE_ARRAY(l.syms);
+  FREE_ARRAY(l.run);
+  // the cells are garbage for the next full collection if it is corrupt
+  return l.error ? new_error(frame, "Corrupt snapshot") : value;
+}
+
+/*
+ * Rather than a copy of each string, the snapshot is copied once to a
+ * mapping of its own that the strings borrow from.
+ */
+struct elem *snapshot_load_copy(struct elem *frame, const char *buf, size_t len, int check_hashes) {
+  void *addr;
+  if ( len == 0 ) {
+    return new_error(frame, "Not a snapshot");
+  }
+  addr = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if ( addr == MAP_FAILED ) {
+    return new_error(frame, "Could not map snapshot");
+  }
+  memcpy(addr, buf, len);
+  alloc_add_mapping(frame_alloc(frame), addr, len);
+  return snapshot_load_mapped(frame, addr, len, check_hashes);
+}
+
+struct elem *snapshot_load(struct elem *frame, const char *buf, size_t len) {
+  return snapshot_load_copy(frame, buf, len, 0);
+}
+
+/*
+ * Loads trust the tries of a snapshot to be laid out by hash, as only
+ * their shape is checked. For one that may not come from snapshot_save
+ * this hashes every key again as well.
+ */
+struct elem *snapshot_load_checked(struct elem *frame, const char *buf, size_t len) {
+  return snapshot_load_copy(frame, buf, len, 1);
+}
+
+// strings are borrowed from the mapped file, as with frame_load_file
+struct elem *frame_load_snapshot(struct elem *frame, char *path) {
+  struct elem *error;
+  size_t len;
+  const char *addr = frame_map_file(frame, path, &len, &error);
+
+  if ( addr == 0 ) {
+    return error != 0 ? error : new_error(frame, "Not a snapshot");
+  }
+  return snapshot_load_mapped(frame, addr, len, 0);
+}
+
+void *instance_main(void *arg) {
+  struct instance *in = arg;
+  struct reader r;
+  reader_init(&r, in->frame, in->input, in->len);
+  in->value = frame_load(&r);
+  reader_free(&r);
+  return 0;
+}
+
+/*
+ * Runs each instance's program on a thread of its own and waits for them
+ * all. Instances share nothing but the symbol table, so they run without
+ * waiting on each other. One that cannot get a thread runs on the caller's.
+ */
+void instances_run(struct instance *instances, int n) {
+  int i;
+  symbol_table_ready();
+  for(i=0;i<n;++i) {
+    instances[i].threaded = pthread_create(&instances[i].thread, 0, instance_main, &instances[i]) == 0;
+    if ( ! instances[i].threaded ) {
+      instance_main(&instances[i]);
+    }
+  }
+  for(i=0;i<n;++i) {
+    if ( instances[i].threaded ) {
+      pthread_join(instances[i].thread, 0);
+    }
+  }
+}
+
+// a builtin's value is the value of the frame that called it
+struct elem* return_value(struct elem *child_frame, struct elem *value) {
+  return frame_return(frame_of(child_frame)->parent, value);
+}
+
+struct elem* builtin_println(struct elem *frame) {
+  struct elem *rhs = frame_get(frame, sym_rhs());
+  struct printer p;
+  int first = 1;
+  printer_init_file(&p, frame_out(frame));
+  if ( is_list(rhs) ) {
+    while( ! list_is_empty(rhs) ) {
+      if ( first ) {
+        first = 0;
+      } else {
+        printer_putc(&p, ' ');
+      }
+      elem_write(&p, list_value(rhs));
+      rhs = list_next(rhs);
+    }
+  } else {
+    elem_write(&p, rhs);
+  }
+  printer_putc(&p, '\n');
+  printer_flush(&p);
+  printer_free(&p);
+  return return_value(frame, nil());
+}
+
+// the first argument of a builtin, nil when there is none
+struct elem *builtin_arg(struct elem *frame) {
+  struct elem *rhs = frame_get(frame, sym_rhs());
+  if ( ! is_list(rhs) || list_is_empty(rhs) ) {
+    return nil();
+  }
+  return list_value(rhs);
+}
+
+/*
+ * Arithmetic natives take any number of arguments. Their fast path works
+ * on the tagged words of fixnums, 2x+1 and 2y+1, where the machine's
+ * overflow check on the word is exactly the check that the result is
+ * still a fixnum. Anything else, an argument that is not a fixnum or a
+ * result that leaves the range, goes to arith_slow, which redoes the
+ * whole operation.
+ */
+#define ARITH_ADD 0
+#define ARITH_SUB 1
+#define ARITH_MUL 2
+#define ARITH_DIV 3
+#define ARITH_MOD 4
+
+/*
+ * Where the fixnum fast paths give up: on bigints, on results that
+ * overflow a fixnum and on errors. This works through the arguments as
+ * nums and makes a fixnum again of any result that fits one.
+ */
+struct elem *arith_slow(struct elem *frame, int op, struct elem **args, uint32_t n) {
+  struct num acc, x, r, m;
+  uint32_t i;
+  for(i=0;i<n;++i) {
+    if ( ! num_of(args[i], &x) ) {
+      return new_error(frame, "Type mismatch");
+    }
+  }
+  if ( (op == ARITH_SUB || op == ARITH_DIV) && n == 0 ) {
+    return new_error(frame, "Wrong number of arguments");
+  }
+  if ( op == ARITH_MOD && n != 2 ) {
+    return new_error(frame, "Wrong number of arguments");
+  }
+  for(i=n>1?1:0;(op==ARITH_DIV||op==ARITH_MOD)&&i<n;++i) {
+    if ( num_of(args[i], &x) && x.sign == 0 ) {
+      return new_error(frame, "Division by zero");
+    }
+  }
+  i = 0;
+  num_int(&acc, op == ARITH_MUL || op == ARITH_DIV);
+  if ( n > 1 && op != ARITH_ADD && op != ARITH_MUL ) {
+    num_of(args[i++], &acc);
+  }
+  for(;i<n;++i) {
+    num_of(args[i], &x);
+    switch(op) {
+    case ARITH_ADD:
+      num_add(&r, &acc, &x, x.sign);
+      break;
+    case ARITH_SUB:
+      num_add(&r, &acc, &x, -x.sign);
+      break;
+    case ARITH_MUL:
+      num_mul(&r, &acc, &x);
+      break;
+    case ARITH_DIV:
+      num_divmod(&r, &m, &acc, &x);
+      num_free(&m);
+      break;
+    default:
+      num_divmod(&m, &r, &acc, &x);
+      num_free(&m);
+      if ( r.sign != 0 && r.sign != x.sign ) {
+        m = r;
+        num_add(&r, &m, &x, x.sign);
+        num_free(&m);
+      }
+      break;
+    }
+    num_free(&acc);
+    acc = r;
+  }
+  return num_elem(frame, &acc);
+}
+
+struct elem *native_add(struct elem *frame, struct elem **args, uint32_t n) {
+  intptr_t acc = (intptr_t)ELEM_FIXNUM(0), x;
+  uint32_t i;
+  for(i=0;i<n;++i) {
+    if ( ! is_fixnum(args[i]) || __builtin_add_overflow(acc, (intptr_t)args[i] - 1, &x) ) {
+      return arith_slow(frame, ARITH_ADD, args, n);
+    }
+    acc = x;
+  }
+  return (struct elem *)acc;
+}
+
+// (- x) negates, (- x y z) is x - y - z
+struct elem *native_sub(struct elem *frame, struct elem **args, uint32_t n) {
+  intptr_t acc = (intptr_t)ELEM_FIXNUM(0), x;
+  uint32_t i = 0;
+  if ( n > 1 ) {
+    if ( ! is_fixnum(args[0]) ) {
+      return arith_slow(frame, ARITH_SUB, args, n);
+    }
+    acc = (intptr_t)args[i++];
+  }
+  if ( n == 0 ) {
+    return arith_slow(frame, ARITH_SUB, args, n);
+  }
+  for(;i<n;++i) {
+    if ( ! is_fixnum(args[i]) || __builtin_sub_overflow(acc, (intptr_t)args[i] - 1, &x) ) {
+      return arith_slow(frame, ARITH_SUB, args, n);
+    }
+    acc = x;
+  }
+  return (struct elem *)acc;
+}
+
+struct elem *native_mul(struct elem *frame, struct elem **args, uint32_t n) {
+  intptr_t acc = (intptr_t)ELEM_FIXNUM(1), x;
+  uint32_t i;
+  for(i=0;i<n;++i) {
+    if ( ! is_fixnum(args[i]) || __builtin_mul_overflow(acc >> 1, (intptr_t)args[i] - 1, &x) ) {
+      return arith_slow(frame, ARITH_MUL, args, n);
+    }
+    acc = x | ELEM_TAG_FIXNUM;
+  }
+  return (struct elem *)acc;
+}
+
+// division truncates towards zero, (/ x) is 1 / x
+struct elem *native_div(struct elem *frame, struct elem **args, uint32_t n) {
+  int64_t acc = 1, y;
+  uint32_t i = 0;
+  if ( n > 1 ) {
+    if ( ! is_fixnum(args[0]) ) {
+      return arith_slow(frame, ARITH_DIV, args, n);
+    }
+    acc = int_value(args[i++]);
+  }
+  if ( n == 0 ) {
+    return arith_slow(frame, ARITH_DIV, args, n);
+  }
+  for(;i<n;++i) {
+    if ( ! is_fixnum(args[i]) || (y = int_value(args[i])) == 0 || (acc == FIXNUM_MIN && y == -1) ) {
+      return arith_slow(frame, ARITH_DIV, args, n);
+    }
+    acc /= y;
+  }
+  return ELEM_FIXNUM(acc);
+}
+
+// the remainder of flooring division, which has the sign of the divisor
+struct elem *native_mod(struct elem *frame, struct elem **args, uint32_t n) {
+  int64_t x, y, m;
+  if ( n != 2 || ! is_fixnum(args[0]) || ! is_fixnum(args[1]) || (y = int_value(args[1])) == 0 ) {
+    return arith_slow(frame, ARITH_MOD, args, n);
+  }
+  x = int_value(args[0]);
+  m = x % y;
+  if ( m != 0 && (m < 0) != (y < 0) ) {
+    m += y;
+  }
+  return ELEM_FIXNUM(m);
+}
+
+// (dec x) is (- x 1), taking only the first argument
+struct elem *native_dec(struct elem *frame, struct elem **args, uint32_t n) {
+  struct elem *x[2] = { n > 0 ? args[0] : nil(), ELEM_FIXNUM(1) };
+  intptr_t r;
+  if ( ! is_fixnum(x[0]) || __builtin_sub_overflow((intptr_t)x[0], (intptr_t)2, &r) ) {
+    return arith_slow(frame, ARITH_SUB, x, 2);
+  }
+  return (struct elem *)r;
+}
+
+/*
+ * Comparisons hold between each argument and the next, so (< a b c) is
+ * a < b < c, and hold trivially for fewer than two. Tagged fixnums order
+ * the same way their values do.
+ */
+#define COMPARE_LT 0
+#define COMPARE_LE 1
+#define COMPARE_GE 2
+
+struct elem *compare_slow(struct elem *frame, struct elem **args, uint32_t n, int op) {
+  struct num a, b;
+  uint32_t i;
+  int c;
+  for(i=0;i<n;++i) {
+    if ( ! num_of(args[i], &a) ) {
+      return new_error(frame, "Type mismatch");
+    }
+  }
+  for(i=1;i<n;++i) {
+    num_of(args[i - 1], &a);
+    num_of(args[i], &b);
+    c = num_cmp(&a, &b);
+    if ( op == COMPARE_LT ? c >= 0 : op == COMPARE_LE ? c > 0 : c < 0 ) {
+      return false_value();
+    }
+  }
+  return true_value();
+}
+
+struct elem *native_compare(struct elem *frame, struct elem **args, uint32_t n, int op) {
+  uint32_t i;
+  intptr_t a, b;
+  for(i=0;i<n;++i) {
+    if ( ! is_fixnum(args[i]) ) {
+      return compare_slow(frame, args, n, op);
+    }
+  }
+  for(i=1;i<n;++i) {
+    a = (intptr_t)args[i - 1];
+    b = (intptr_t)args[i];
+    if ( op == COMPARE_LT ? a >= b : op == COMPARE_LE ? a > b : a < b ) {
+      return false_value();
+    }
+  }
+  return true_value();
+}
+
+struct elem *native_lt(struct elem *frame, struct elem **args, uint32_t n) {
+  return native_compare(frame, args, n, COMPARE_LT);
+}
+
+struct elem *native_le(struct elem *frame, struct elem **args, uint32_t n) {
+  return native_compare(frame, args, n, COMPARE_LE);
+}
+
+struct elem *native_ge(struct elem *frame, struct elem **args, uint32_t n) {
+  return native_compare(frame, args, n, COMPARE_GE);
+}
+
+// (zero? x) is true for the fixnum 0 and nil for anything else
+struct elem *native_is_zero(struct elem *frame, struct elem **args, uint32_t n) {
+  return n > 0 && args[0] == ELEM_FIXNUM(0) ? true_value() : nil();
+}
+
+// = takes values of any type and compares them with elem_eq
+struct elem *native_eq(struct elem *frame, struct elem **args, uint32_t n) {
+  uint32_t i;
+  for(i=1;i<n;++i) {
+    if ( args[i - 1] != args[i] && ( is_fixnum(args[i]) || ! elem_eq(frame, args[i - 1], args[i]) ) ) {
+      return false_value();
+    }
+  }
+  return true_value();
+}
+
+struct elem *env_add_arithmetic(struct elem *frame, struct elem *env) {
+  env = map_set(frame, env, intern("+"), new_native(frame, native_add));
+  env = map_set(frame, env, intern("-"), new_native(frame, native_sub));
+  env = map_set(frame, env, intern("*"), new_native(frame, native_mul));
+  env = map_set(frame, env, intern("/"), new_native(frame, native_div));
+  env = map_set(frame, env, intern("mod"), new_native(frame, native_mod));
+  env = map_set(frame, env, intern("dec"), new_native(frame, native_dec));
+  env = map_set(frame, env, intern("zero?"), new_native(frame, native_is_zero));
+  env = map_set(frame, env, intern("<"), new_native(frame, native_lt));
+  env = map_set(frame, env, intern("<="), new_native(frame, native_le));
+  env = map_set(frame, env, intern("="), new_native(frame, native_eq));
+  env = map_set(frame, env, intern(">="), new_native(frame, native_ge));
+  return env;
+}
+
+/*
+ * Bulk operations on int vectors run through kernels picked once for the
+ * machine, AVX2 where the CPU has it and plain loops otherwise. They work
+ * on the untagged int64s, every one in the fixnum range.
+ *
+ * Sums are kept exact without a check per item. Each lane adds up the
+ * low 32 bits and the high 32 bits of its items apart, as unsigned, and
+ * counts the negative ones, whose unsigned reading is 2^64 too large.
+ * A vector has fewer than 2^32 items, so no lane can overflow, and the
+ * total put together from the three is the exact sum in 128 bits.
+ */
+struct vector_kernels {
+  __int128 (*sum)(const int64_t *x, uint32_t n);
+  int      (*add)(int64_t *r, const int64_t *a, const int64_t *b, uint32_t n);
+  __int128 (*dot)(const int64_t *a, const int64_t *b, uint32_t n);
+  void     (*minmax)(const int64_t *x, uint32_t n, int64_t *min, int64_t *max);
+};
+
+// whether r is outside the fixnum range, where its top two bits differ
+int64_t fixnum_overflow(int64_t r) {
+  return (r ^ (int64_t)((uint64_t)r << 1)) < 0;
+}
+
+__int128 vector_sum_scalar(const int64_t *x, uint32_t n) {
+  __int128 total = 0;
+  uint32_t i;
+  for(i=0;i<n;++i) {
+    total += x[i];
+  }
+  return total;
+}
+
+// 0 unless some r[i] left the fixnum range
+int vector_add_scalar(int64_t *r, const int64_t *a, const int64_t *b, uint32_t n) {
+  int64_t bad = 0;
+  uint32_t i;
+  for(i=0;i<n;++i) {
+    r[i] = a[i] + b[i];
+    bad |= r[i] ^ (int64_t)((uint64_t)r[i] << 1);
+  }
+  return bad < 0;
+}
+
+__int128 vector_dot_scalar(const int64_t *a, const int64_t *b, uint32_t n) {
+  __int128 total = 0;
+  uint32_t i;
+  for(i=0;i<n;++i) {
+    total += (__int128)a[i] * b[i];
+  }
+  return total;
+}
+
+// n is at least 1
+void vector_minmax_scalar(const int64_t *x, uint32_t n, int64_t *min, int64_t *max) {
+  int64_t lo = x[0], hi = x[0];
+  uint32_t i;
+  for(i=1;i<n;++i) {
+    lo = x[i] < lo ? x[i] : lo;
+    hi = x[i] > hi ? x[i] : hi;
+  }
+  *min = lo;
+  *max = hi;
+}
+
+const struct vector_kernels vector_scalar_kernels = {
+  vector_sum_scalar, vector_add_scalar, vector_dot_scalar, vector_minmax_scalar
+};
+
+#if defined(__x86_64__)
+#define VECTOR_AVX2  __attribute__((target("avx2")))
+// items that dot multiplies in lanes at a time, once they fit in 32 bits
+#define VECTOR_BLOCK 256
+
+// the sum of lanes split as above
+VECTOR_AVX2 __int128 vector_lanes_total(__m256i lo, __m256i hi, __m256i neg) {
+  uint64_t l[4], h[4];
+  int64_t g[4];
+  __int128 total = 0;
+  int i;
+  _mm256_storeu_si256((__m256i *)l, lo);
+  _mm256_storeu_si256((__m256i *)h, hi);
+  _mm256_storeu_si256((__m256i *)g, neg);
+  for(i=0;i<4;++i) {
+    total += ((__int128)h[i] << 32) + l[i] + (__int128)g[i] * ((__int128)1 << 64);
+  }
+  return total;
+}
+
+// two sets of lanes, so neither waits on the other's adds
+VECTOR_AVX2 __int128 vector_sum_avx2(const int64_t *x, uint32_t n) {
+  const __m256i mask = _mm256_set1_epi64x(0xffffffff), zero = _mm256_setzero_si256();
+  __m256i lo0 = zero, hi0 = zero, neg0 = zero, lo1 = zero, hi1 = zero, neg1 = zero, v, w;
+  uint32_t i;
+  for(i=0;i+8<=n;i+=8) {
+    v = _mm256_loadu_si256((const __m256i *)(x + i));
+    w = _mm256_loadu_si256((const __m256i *)(x + i + 4));
+    lo0 = _mm256_add_epi64(lo0, _mm256_and_si256(v, mask));
+    hi0 = _mm256_add_epi64(hi0, _mm256_srli_epi64(v, 32));
+    neg0 = _mm256_add_epi64(neg0, _mm256_cmpgt_epi64(zero, v));
+    lo1 = _mm256_add_epi64(lo1, _mm256_and_si256(w, mask));
+    hi1 = _mm256_add_epi64(hi1, _mm256_srli_epi64(w, 32));
+    neg1 = _mm256_add_epi64(neg1, _mm256_cmpgt_epi64(zero, w));
+  }
+  return vector_lanes_total(_mm256_add_epi64(lo0, lo1), _mm256_add_epi64(hi0, hi1), _mm256_add_epi64(neg0, neg1)) 
+    + vector_sum_scalar(x + i, n - i);
+}
+
+VECTOR_AVX2 int vector_add_avx2(int64_t *r, const int64_t *a, const int64_t *b, uint32_t n) {
+  __m256i bad = _mm256_setzero_si256(), v;
+  uint32_t i;
+  for(i=0;i+4<=n;i+=4) {
+    v = _mm256_add_epi64(_mm256_loadu_si256((const __m256i *)(a + i)), _mm256_loadu_si256((const __m256i *)(b + i)));
+    bad = _mm256_or_si256(bad, _mm256_xor_si256(v, _mm256_slli_epi64(v, 1)));
+    _mm256_storeu_si256((__m256i *)(r + i), v);
+  }
+  return vector_add_scalar(r + i, a + i, b + i, n - i) | (_mm256_movemask_pd(_mm256_castsi256_pd(bad)) != 0);
+}
+
+/*
+ * AVX2 multiplies only 32 bit halves, so dot goes a block at a time. The
+ * products of a block are summed like items, in lanes of its own, while
+ * the same pass checks that every item fits in 32 bits, which keeps the
+ * products to 63. A block with wider items throws its lanes away and is
+ * multiplied again one item at a time in 128 bits.
+ */
+VECTOR_AVX2 __int128 vector_dot_avx2(const int64_t *a, const int64_t *b, uint32_t n) {
+  const __m256i mask = _mm256_set1_epi64x(0xffffffff), zero = _mm256_setzero_si256();
+  const __m256i bias = _mm256_set1_epi64x(0x80000000);
+  __m256i lo = zero, hi = zero, neg = zero, lo0, hi0, neg0, lo1, hi1, neg1, wide, x0, y0, x1, y1, p, q;
+  __int128 total = 0;
+  uint32_t i, j;
+  for(i=0;i+VECTOR_BLOCK<=n;i+=VECTOR_BLOCK) {
+    wide = lo0 = hi0 = neg0 = lo1 = hi1 = neg1 = zero;
+    for(j=i;j<i+VECTOR_BLOCK;j+=8) {
+      x0 = _mm256_loadu_si256((const __m256i *)(a + j));
+      y0 = _mm256_loadu_si256((const __m256i *)(b + j));
+      x1 = _mm256_loadu_si256((const __m256i *)(a + j + 4));
+      y1 = _mm256_loadu_si256((const __m256i *)(b + j + 4));
+      wide = _mm256_or_si256(wide, _mm256_or_si256(_mm256_add_epi64(x0, bias), _mm256_add_epi64(y0, bias)));
+      wide = _mm256_or_si256(wide, _mm256_or_si256(_mm256_add_epi64(x1, bias), _mm256_add_epi64(y1, bias)));
+      p = _mm256_mul_epi32(x0, y0);
+      q = _mm256_mul_epi32(x1, y1);
+      lo0 = _mm256_add_epi64(lo0, _mm256_and_si256(p, mask));
+      hi0 = _mm256_add_epi64(hi0, _mm256_srli_epi64(p, 32));
+      neg0 = _mm256_add_epi64(neg0, _mm256_cmpgt_epi64(zero, p));
+      lo1 = _mm256_add_epi64(lo1, _mm256_and_si256(q, mask));
+      hi1 = _mm256_add_epi64(hi1, _mm256_srli_epi64(q, 32));
+      neg1 = _mm256_add_epi64(neg1, _mm256_cmpgt_epi64(zero, q));
+    }
+    wide = _mm256_srli_epi64(wide, 32);
+    if ( ! _mm256_testz_si256(wide, wide) ) {
+      total += vector_dot_scalar(a + i, b + i, VECTOR_BLOCK);
+      continue;
+    }
+    lo = _mm256_add_epi64(lo, _mm256_add_epi64(lo0, lo1));
+    hi = _mm256_add_epi64(hi, _mm256_add_epi64(hi0, hi1));
+    neg = _mm256_add_epi64(neg, _mm256_add_epi64(neg0, neg1));
+  }
+  return total + vector_lanes_total(lo, hi, neg) + vector_dot_scalar(a + i, b + i, n - i);
+}
+
+/*
+ * Items are fixnums, so the difference of two cannot overflow, and a lane
+ * moves to an item by adding the difference where the compare says to.
+ * That is three single cycle ops where a blend is slower.
+ */
+VECTOR_AVX2 void vector_minmax_avx2(const int64_t *x, uint32_t n, int64_t *min, int64_t *max) {
+  __m256i lo0, hi0, lo1, hi1, v, w;
+  int64_t l[8], h[8], tl, th;
+  uint32_t i;
+  int k;
+  if ( n < 8 ) {
+    vector_minmax_scalar(x, n, min, max);
+    return;
+  }
+  lo0 = hi0 = _mm256_loadu_si256((const __m256i *)x);
+  lo1 = hi1 = _mm256_loadu_si256((const __m256i *)(x + 4));
+  for(i=8;i+8<=n;i+=8) {
+    v = _mm256_loadu_si256((const __m256i *)(x + i));
+    w = _mm256_loadu_si256((const __m256i *)(x + i + 4));
+    lo0 = _mm256_add_epi64(lo0, _mm256_and_si256(_mm256_sub_epi64(v, lo0), _mm256_cmpgt_epi64(lo0, v)));
+    hi0 = _mm256_add_epi64(hi0, _mm256_and_si256(_mm256_sub_epi64(v, hi0), _mm256_cmpgt_epi64(v, hi0)));
+    lo1 = _mm256_add_epi64(lo1, _mm256_and_si256(_mm256_sub_epi64(w, lo1), _mm256_cmpgt_epi64(lo1, w)));
+    hi1 = _mm256_add_epi64(hi1, _mm256_and_si256(_mm256_sub_epi64(w, hi1), _mm256_cmpgt_epi64(w, hi1)));
+  }
+  _mm256_storeu_si256((__m256i *)l, lo0);
+  _mm256_storeu_si256((__m256i *)(l + 4), lo1);
+  _mm256_storeu_si256((__m256i *)h, hi0);
+  _mm256_storeu_si256((__m256i *)(h + 4), hi1);
+  for(k=1;k<8;++k) {
+    l[0] = l[k] < l[0] ? l[k] : l[0];
+    h[0] = h[k] > h[0] ? h[k] : h[0];
+  }
+  if ( i < n ) {
+    vector_minmax_scalar(x + i, n - i, &tl, &th);
+    l[0] = tl < l[0] ? tl : l[0];
+    h[0] = th > h[0] ? th : h[0];
+  }
+  *min = l[0];
+  *max = h[0];
+}
+
+// each of these beats its plain loop in bench_vector, in the caches and out of them
+const struct vector_kernels vector_avx2_kernels = {
+  vector_sum_avx2, vector_add_avx2, vector_dot_avx2, vector_minmax_avx2
+};
+#endif
+
+const struct vector_kernels *vector_kernels() {
+  static const struct vector_kernels *kernels = 0;
+  const struct vector_kernels *k = __atomic_load_n(&kernels, __ATOMIC_RELAXED);
+  if ( k == 0 ) {
+    k = &vector_scalar_kernels;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if ( __builtin_cpu_supports("avx2") ) {
+      k = &vector_avx2_kernels;
+    }
+#endif
+    __atomic_store_n(&kernels, k, __ATOMIC_RELAXED);
+  }
+  return k;
+}
+
+// an exact result as a fixnum if it fits, otherwise as a bigint
+struct elem *int128_elem(struct elem *frame, __int128 v) {
+  unsigned __int128 u = v < 0 ? -(unsigned __int128)v : (unsigned __int128)v;
+  uint64_t *limbs;
+  struct num x;
+  if ( v >= FIXNUM_MIN && v <= FIXNUM_MAX ) {
+    return ELEM_FIXNUM((int64_t)v);
+  }
+  limbs = NEW_ARRAY(uint64_t, 2);
+  limbs[0] = (uint64_t)u;
+  limbs[1] = (uint64_t)(u >> 64);
+  num_take(&x, v < 0 ? -1 : 1, limbs, 2);
+  return num_elem(frame, &x);
+}
+
+int is_vector(struct elem *e) {
+  return is_type(e, ELEM_TYPE_VECTOR);
+}
+
+// the index x as a position in a vector of len items, or -1
+int64_t vector_index(struct elem *x, uint32_t len) {
+  if ( ! is_fixnum(x) || int_value(x) < 0 || int_value(x) > len ) {
+    return -1;
+  }
+  return int_value(x);
+}
+
+// (vector a b c) makes [a b c]
+struct elem *native_vector(struct elem *frame, struct elem **args, uint32_t n) {
+  struct elem **items = NEW_ARRAY(struct elem *, n + 1);
+  memcpy(items, args, (size_t)n * sizeof(struct elem *));
+  return vector_of(frame, items, n);
+}
+
+struct elem *native_length(struct elem *frame, struct elem **args, uint32_t n) {
+  if ( n != 1 ) {
+    return new_error(frame, "Wrong number of arguments");
+  }
+  if ( is_pvec(args[0]) ) {
+    return ELEM_FIXNUM(args[0]->pval.count);
+  }
+  if ( is_string(args[0]) ) {
+    return ELEM_FIXNUM(string_len(args[0]));
+  }
+  if ( ! is_vector(args[0]) ) {
+    return new_error(frame, "Type mismatch");
+  }
+  return ELEM_FIXNUM(args[0]->vval.len);
+}
+
+struct elem *native_nth(struct elem *frame, struct elem **args, uint32_t n) {
+  int64_t i;
+  if ( n != 2 ) {
+    return new_error(frame, "Wrong number of arguments");
+  }
+  if ( is_pvec(args[0]) ) {
+    i = vector_index(args[1], args[0]->pval.count);
+    if ( i < 0 || i == args[0]->pval.count ) {
+      return new_error(frame, is_fixnum(args[1]) ? "Index out of range" : "Type mismatch");
+    }
+    return pvec_item(args[0], i);
+  }
+  if ( is_string(args[0]) ) {
+    i = vector_index(args[1], string_len(args[0]));
+    if ( i < 0 || i == string_len(args[0]) ) {
+      return new_error(frame, is_fixnum(args[1]) ? "Index out of range" : "Type mismatch");
+    }
+    return string_slice(frame, args[0], i, i + 1);
+  }
+  if ( ! is_vector(args[0]) || ! is_fixnum(args[1]) ) {
+    return new_error(frame, "Type mismatch");
+  }
+  i = vector_index(args[1], args[0]->vval.len);
+  if ( i < 0 || i == args[0]->vval.len ) {
+    return new_error(frame, "Index out of range");
+  }
+  return vector_item(args[0], i);
+}
+
+// (slice v start end) copies the items from start up to end, or to the end of v
+struct elem *native_slice(struct elem *frame, struct elem **args, uint32_t n) {
+  struct elem *v = n > 0 ? args[0] : 0, **items;
+  int64_t start, end;
+  uint32_t i;
+  if ( n != 2 && n != 3 ) {
+    return new_error(frame, "Wrong number of arguments");
+  }
+  if ( ! is_vector(v) || ! is_fixnum(args[1]) || (n == 3 && ! is_fixnum(args[2])) ) {
+    return new_error(frame, "Type mismatch");
+  }
+  start = vector_index(args[1], v->vval.len);
+  end = n == 3 ? vector_index(args[2], v->vval.len) : v->vval.len;
+  if ( start < 0 || end < start ) {
+    return new_error(frame, "Index out of range");
+  }
+  if ( v->vval.kind == VECTOR_INTS ) {
+    items = (struct elem **)NEW_ARRAY(int64_t, end - start + 1);
+    memcpy(items, v->vval.ints + start, (size_t)(end - start) * sizeof(int64_t));
+    return new_vector(frame, VECTOR_INTS, items, end - start);
+  }
+  items = NEW_ARRAY(struct elem *, end - start + 1);
+  for(i=start;i<end;++i) {
+    items[i - start] = v->vval.items[i];
+  }
+  return vector_of(frame, items, end - start);
+}
+
+// persistent vectors are joined without copying, in log time
+struct elem *pvecs_concat(struct elem *frame, struct elem **args, uint32_t n) {
+  struct elem *v = args[0];
+  uint64_t len = 0;
+  uint32_t i;
+  for(i=0;i<n;++i) {
+    if ( ! is_pvec(args[i]) ) {
+      return new_error(frame, "Type mismatch");
+    }
+    len += args[i]->pval.count;
+  }
+  if ( len > UINT32_MAX ) {
+    return new_error(frame, "Index out of range");
+  }
+  for(i=1;i<n;++i) {
+    v = pvec_concat(frame, v, args[i]);
+  }
+  return v;
+}
+
+// strings are joined into ropes, sharing the strings joined
+struct elem *strings_concat(struct elem *frame, struct elem **args, uint32_t n) {
+  struct elem *s = args[0];
+  uint64_t len = 0;
+  uint32_t i;
+  for(i=0;i<n;++i) {
+    if ( ! is_string(args[i]) ) {
+      return new_error(frame, "Type mismatch");
+    }
+    len += string_len(args[i]);
+  }
+  if ( len >= UINT32_MAX ) {
+    return new_error(frame, "Index out of range");
+  }
+  for(i=1;i<n;++i) {
+    s = string_join(frame, s, args[i]);
+  }
+  return s;
+}
+
+struct elem *native_concat(struct elem *frame, struct elem **args, uint32_t n) {
+  struct elem **items;
+  uint64_t len = 0, at = 0;
+  uint32_t i, j, ints = 1;
+  if ( n > 0 && is_pvec(args[0]) ) {
+    return pvecs_concat(frame, args, n);
+  }
+  if ( n > 0 && is_string(args[0]) ) {
+    return strings_concat(frame, args, n);
+  }
+  for(i=0;i<n;++i) {
+    if ( ! is_vector(args[i]) ) {
+      return new_error(frame, "Type mismatch");
+    }
+    len += args[i]->vval.len;
+    ints &= args[i]->vval.kind == VECTOR_INTS;
+  }
+  if ( len > UINT32_MAX ) {
+    return new_error(frame, "Index out of range");
+  }
+  if ( ints ) {
+    items = (struct elem **)NEW_ARRAY(int64_t, len + 1);
+    for(i=0;i<n;at+=args[i]->vval.len,++i) {
+      memcpy((int64_t *)items + at, args[i]->vval.ints, (size_t)args[i]->vval.len * sizeof(int64_t));
+    }
+    return new_vector(frame, VECTOR_INTS, items, len);
+  }
+  items = NEW_ARRAY(struct elem *, len + 1);
+  for(i=0;i<n;++i) {
+    for(j=0;j<args[i]->vval.len;++j) {
+      items[at++] = vector_item(args[i], j);
+    }
+  }
+  return vector_of(frame, items, len);
+}
+
+// (pvec a b c) makes #[a b c]
+struct elem *native_pvec(struct elem *frame, struct elem **args, uint32_t n) {
+  struct pvec_builder b = { 0, 0, 0 };
+  uint32_t i;
+  for(i=0;i<n;++i) {
+    pvec_builder_add(&b, args[i]);
+  }
+  return pvec_builder_finish(frame, &b);
+}
+
+// (conj v x y) is v with x and then y added at its end
+struct elem *native_conj(struct elem *frame, struct elem **args, uint32_t n) {
+  struct elem *v = n > 0 ? args[0] : 0;
+  uint32_t i;
+  if ( n == 0 ) {
+    return new_error(frame, "Wrong number of arguments");
+  }
+  if ( ! is_pvec(v) ) {
+    return new_error(frame, "Type mismatch");
+  }
+  if ( v->pval.count > UINT32_MAX - (n - 1) ) {
+    return new_error(frame, "Index out of range");
+  }
+  for(i=1;i<n;++i) {
+    v = pvec_conj(frame, v, args[i]);
+  }
+  return v;
+}
+
+// (assoc v i x) is v with item i set to x, or x added when i is its length
+struct elem *native_assoc(struct elem *frame, struct elem **args, uint32_t n) {
+  struct elem *v = n > 0 ? args[0] : 0;
+  int64_t i;
+  if ( n != 3 ) {
+    return new_error(frame, "Wrong number of arguments");
+  }
+  if ( ! is_pvec(v) || ! is_fixnum(args[1]) ) {
+    return new_error(frame, "Type mismatch");
+  }
+  i = vector_index(args[1], v->pval.count);
+  if ( i < 0 || i == UINT32_MAX ) {
+    return new_error(frame, "Index out of range");
+  }
+  return i == v->pval.count ? pvec_conj(frame, v, args[2]) : pvec_assoc(frame, v, i, args[2]);
+}
+
+// (subvec v start end) shares the items from start up to end, or to the end of v
+struct elem *native_subvec(struct elem *frame, struct elem **args, uint32_t n) {
+  struct elem *v = n > 0 ? args[0] : 0;
+  int64_t start, end;
+  if ( n != 2 && n != 3 ) {
+    return new_error(frame, "Wrong number of arguments");
+  }
+  if ( ! is_pvec(v) || ! is_fixnum(args[1]) || (n == 3 && ! is_fixnum(args[2])) ) {
+    return new_error(frame, "Type mismatch");
+  }
+  start = vector_index(args[1], v->pval.count);
+  end = n == 3 ? vector_index(args[2], v->pval.count) : v->pval.count;
+  if ( start < 0 || end < start ) {
+    return new_error(frame, "Index out of range");
+  }
+  return pvec_slice(frame, v, start, end);
+}
+
+// the sum of a vector's items, which may be ints of any size
+struct elem *native_sum(struct elem *frame, struct elem **args, uint32_t n) {
+  struct elem *v = n > 0 ? args[0] : 0;
+  if ( n != 1 ) {
+    return new_error(frame, "Wrong number of arguments");
+  }
+  if ( ! is_vector(v) ) {
+    return new_error(frame, "Type mismatch");
+  }
+  if ( v->vval.kind == VECTOR_INTS ) {
+    return int128_elem(frame, vector_kernels()->sum(v->vval.ints, v->vval.len));
+  }
+  return arith_slow(frame, ARITH_ADD, v->vval.items, v->vval.len);
+}
+
+/*
+ * (map f v w) calls the native f on the items of v and w at each index,
+ * as far as the shortest vector goes. Adding int vectors goes through
+ * the kernel, unless a sum leaves the fixnum range.
+ */
+struct elem *native_map(struct elem *frame, struct elem **args, uint32_t n) {
+  struct elem *f = n > 0 ? args[0] : 0, **items, **at, *r;
+  uint32_t len = UINT32_MAX, i, j, ints = 1;
+  int64_t *sums;
+  if ( n < 2 ) {
+    return new_error(frame, "Wrong number of arguments");
+  }
+  if ( ! is_fn(f) || ! (f->flags & ELEM_FLAG_NATIVE) ) {
+    return new_error(frame, "Type mismatch");
+  }
+  for(i=1;i<n;++i) {
+    if ( ! is_vector(args[i]) ) {
+      return new_error(frame, "Type mismatch");
+    }
+    len = args[i]->vval.len < len ? args[i]->vval.len : len;
+    ints &= args[i]->vval.kind == VECTOR_INTS;
+  }
+  if ( f->fval.native == native_add && n == 3 && ints ) {
+    sums = NEW_ARRAY(int64_t, len + 1);
+    if ( ! vector_kernels()->add(sums, args[1]->vval.ints, args[2]->vval.ints, len) ) {
+      return new_vector(frame, VECTOR_INTS, sums, len);
+    }
+    FREE_ARRAY(sums);
+  }
+  items = NEW_ARRAY(struct elem *, len + 1);
+  at = NEW_ARRAY(struct elem *, n);
+  for(i=0;i<len;++i) {
+    for(j=1;j<n;++j) {
+      at[j - 1] = vector_item(args[j], i);
+    }
+    r = f->fval.native(frame, at, n - 1);
+    if ( is_type(r, ELEM_TYPE_ERROR) ) {
+      FREE_ARRAY(items);
+      FREE_ARRAY(at);
+      return r;
+    }
+    items[i] = r;
+  }
+  FREE_ARRAY(at);
+  return vector_of(frame, items, len);
+}
+
+struct elem *native_dot(struct elem *frame, struct elem **args, uint32_t n) {
+  struct num acc, x, y, p, r;
+  uint32_t i;
+  if ( n != 2 ) {
+    return new_error(frame, "Wrong number of arguments");
+  }
+  if ( ! is_vector(args[0]) || ! is_vector(args[1]) ) {
+    return new_error(frame, "Type mismatch");
+  }
+  if ( args[0]->vval.len != args[1]->vval.len ) {
+    return new_error(frame, "Length mismatch");
+  }
+  if ( args[0]->vval.kind == VECTOR_INTS && args[1]->vval.kind == VECTOR_INTS ) {
+    return int128_elem(frame, vector_kernels()->dot(args[0]->vval.ints, args[1]->vval.ints, args[0]->vval.len));
+  }
+  num_int(&acc, 0);
+  for(i=0;i<args[0]->vval.len;++i) {
+    if ( ! num_of(vector_item(args[0], i), &x) || ! num_of(vector_item(args[1], i), &y) ) {
+      num_free(&acc);
+      return new_error(frame, "Type mismatch");
+    }
+    num_mul(&p, &x, &y);
+    num_add(&r, &acc, &p, p.sign);
+    num_free(&p);
+    num_free(&acc);
+    acc = r;
+  }
+  return num_elem(frame, &acc);
+}
+
+/*
+ * (min v) is the least item of the vector v, and (min a b c) the least
+ * of its arguments. max is the same the other way round.
+ */
+struct elem *vector_extreme(struct elem *frame, struct elem **args, uint32_t n, int sign) {
+  struct elem *best;
+  struct num a, b;
+  int64_t min, max;
+  uint32_t i;
+  if ( n == 1 && is_vector(args[0]) ) {
+    if ( args[0]->vval.len == 0 ) {
+      return new_error(frame, "Empty vector");
+    }
+    if ( args[0]->vval.kind == VECTOR_INTS ) {
+      vector_kernels()->minmax(args[0]->vval.ints, args[0]->vval.len, &min, &max);
+      return ELEM_FIXNUM(sign < 0 ? min : max);
+    }
+    n = args[0]->vval.len;
+    args = args[0]->vval.items;
+  }
+  if ( n == 0 ) {
+    return new_error(frame, "Wrong number of arguments");
+  }
+  best = args[0];
+  for(i=0;i<n;++i) {
+    if ( ! num_of(args[i], &a) ) {
+      return new_error(frame, "Type mismatch");
+    }
+    num_of(best, &b);
+    if ( num_cmp(&a, &b) == sign ) {
+      best = args[i];
+    }
+  }
+  return best;
+}
+
+struct elem *native_min(struct elem *frame, struct elem **args, uint32_t n) {
+  return vector_extreme(frame, args, n, -1);
+}
+
+struct elem *native_max(struct elem *frame, struct elem **args, uint32_t n) {
+  return vector_extreme(frame, args, n, 1);
+}
+
+struct elem *env_add_vectors(struct elem *frame, struct elem *env) {
+  env = map_set(frame, env, intern("vector"), new_native(frame, native_vector));
+  env = map_set(frame, env, intern("length"), new_native(frame, native_length));
+  env = map_set(frame, env, intern("nth"), new_native(frame, native_nth));
+  env = map_set(frame, env, intern("slice"), new_native(frame, native_slice));
+  env = map_set(frame, env, intern("concat"), new_native(frame, native_concat));
+  env = map_set(frame, env, intern("sum"), new_native(frame, native_sum));
+  env = map_set(frame, env, intern("map"), new_native(frame, native_map));
+  env = map_set(frame, env, intern("dot"), new_native(frame, native_dot));
+  env = map_set(frame, env, intern("min"), new_native(frame, native_min));
+  env = map_set(frame, env, intern("max"), new_native(frame, native_max));
+  env = map_set(frame, env, intern("pvec"), new_native(frame, native_pvec));
+  env = map_set(frame, env, intern("conj"), new_native(frame, native_conj));
+  env = map_set(frame, env, intern("assoc"), new_native(frame, native_assoc));
+  env = map_set(frame, env, intern("subvec"), new_native(frame, native_subvec));
+  return env;
+}
+
+// (substring s start end) shares the bytes from start up to end, or to the end of s
+struct elem *native_substring(struct elem *frame, struct elem **args, uint32_t n) {
+  struct elem *s = n > 0 ? args[0] : 0;
+  int64_t start, end;
+  if ( n != 2 && n != 3 ) {
+    return new_error(frame, "Wrong number of arguments");
+  }
+  if ( ! is_string(s) || ! is_fixnum(args[1]) || (n == 3 && ! is_fixnum(args[2])) ) {
+    return new_error(frame, "Type mismatch");
+  }
+  start = vector_index(args[1], string_len(s));
+  end = n == 3 ? vector_index(args[2], string_len(s)) : string_len(s);
+  if ( start < 0 || end < start ) {
+    return new_error(frame, "Index out of range");
+  }
+  return string_slice(frame, s, start, end);
+}
+
+// the bytes of s to search for, copied out only when s is a rope
+const char *string_needle(struct elem *s, char **copy) {
+  *copy = 0;
+  if ( ! is_rope(s) ) {
+    return s->sval.str;
+  }
+  *copy = NEW_ARRAY(char, string_len(s) + 1);
+  string_copy(s, *copy);
+  return *copy;
+}
+
+// (index-of s t from) is where t next comes in s at or after from, or nil
+struct elem *native_index_of(struct elem *frame, struct elem **args, uint32_t n) {
+  const char *needle;
+  char *copy;
+  int64_t from, i;
+  if ( n != 2 && n != 3 ) {
+    return new_error(frame, "Wrong number of arguments");
+  }
+  if ( ! is_string(args[0]) || ! is_string(args[1]) || (n == 3 && ! is_fixnum(args[2])) ) {
+    return new_error(frame, "Type mismatch");
+  }
+  from = n == 3 ? vector_index(args[2], string_len(args[0])) : 0;
+  if ( from < 0 ) {
+    return new_error(frame, "Index out of range");
+  }
+  needle = string_needle(args[1], &copy);
+  i = string_index_of(args[0], needle, string_len(args[1]), from);
+  FREE_ARRAY(copy);
+  return i < 0 ? nil() : ELEM_FIXNUM(i);
+}
+
+// (split s sep) is the list of the parts of s between each sep, sharing its bytes
+struct elem *native_split(struct elem *frame, struct elem **args, uint32_t n) {
+  struct elem *list = empty_list(), **tail = &list;
+  uint32_t len, start = 0;
+  const char *needle;
+  char *copy;
+  int64_t i;
+  if ( n != 2 ) {
+    return new_error(frame, "Wrong number of arguments");
+  }
+  if ( ! is_string(args[0]) || ! is_string(args[1]) ) {
+    return new_error(frame, "Type mismatch");
+  }
+  if ( (len = string_len(args[1])) == 0 ) {
+    return new_error(frame, "Empty separator");
+  }
+  needle = string_needle(args[1], &copy);
+  do {
+    i = string_index_of(args[0], needle, len, start);
+    *tail = alloc_list(frame, empty_list(), string_slice(frame, args[0], start, i < 0 ? string_len(args[0]) : i));
+    tail = &pair_of(*tail)->next;
+    start = i + len;
+  } while( i >= 0 );
+  FREE_ARRAY(copy);
+  return list;
+}
+
+struct elem *env_add_strings(struct elem *frame, struct elem *env) {
+  env = map_set(frame, env, intern("substring"), new_native(frame, native_substring));
+  env = map_set(frame, env, intern("index-of"), new_native(frame, native_index_of));
+  env = map_set(frame, env, intern("split"), new_native(frame, native_split));
+  return env;
+}
+
+struct elem *env_add_builtins(struct elem *frame, struct elem *env) {
+  env = map_set(frame, env, sym_println(), new_fn(frame, builtin_println));
+  env = env_add_arithmetic(frame, env);
+  env = env_add_vectors(frame, env);
+  env = env_add_strings(frame, env);
+  return env;
+}
+
+struct elem* elem_println(struct elem *frame, FILE *out, struct elem *expr) {
+  struct printer p;
+  printer_init_file(&p, out);
+  elem_write(&p, expr);
+  printer_putc(&p, '\n');
+  printer_flush(&p);
+  printer_free(&p);
+  return frame;
+}
+
+void p(struct elem *frame, struct elem *expr) {
+  elem_println(frame, stdout, expr);
+}
+
+int test_parsing(char *expr) {
+  struct elem* root_frame = new_root_frame();
+  struct elem* value = reader_read(root_frame, expr);
+  int status = is_type(value, ELEM_TYPE_ERROR);
+  elem_println(root_frame, stdout, value);
+  free_root_frame(root_frame);
+  return status;
+}
+
+int test_eval(char *expr) {
+  struct elem *root_frame = new_root_frame();
+  struct elem *reader_root = new_root_frame();
+  struct elem *frame = root_frame;
+  struct elem *env = empty_map();
+  struct elem *value;
+  frame = frame_set(frame, sym_rhs(), reader_read(reader_root, expr));
+  frame = frame_set(frame, sym_lhs(), empty_list());
+  env = map_set(frame, env, sym_println(), new_fn(frame, builtin_println));
+  frame = frame_set(frame, sym_env(), env);
+  value = frame_eval(frame);
+  elem_println(frame, stdout, value);
+  free_root_frame(root_frame);
+  free_root_frame(reader_root);
+  return 0;
+}
+
+int test_gc_1() {
+  char expr[8192];
+  int  i, tail = 0, status = 0;
+  struct elem *root_frame = new_root_frame();
+  struct elem *reader_root = new_root_frame();
+  struct elem *frame = root_frame;
+  struct elem *env = empty_map();
+  struct alloc_stats stats;
+
+  printf("-----\n");
+  tail += sprintf(expr + tail, "(println");
+  for(i=0;i<1000;++i) {
+    tail += sprintf(expr + tail, " \"gc\"");
+  }
+  sprintf(expr + tail, ")");
+
+  frame = frame_set(frame, sym_rhs(), reader_read(reader_root, expr));
+  frame = frame_set(frame, sym_lhs(), empty_list());
+  env = map_set(frame, env, sym_println(), new_fn(frame, builtin_println));
+  frame = frame_set(frame, sym_env(), env);
+  // a small nursery, so the call fills it a few times over
+  frame_alloc(frame)->threshold = 256;
+  frame_eval(frame);
+
+  frame_alloc_stats(root_frame, &stats);
+  if ( stats.collections == 0 || stats.live >= stats.allocated ) {
+    status = 1;
+  }
+  printf("collections %lu, live %lu, allocated %lu, capacity %lu\n", 
+    stats.collections, stats.live, stats.allocated, stats.capacity);
+
+  free_root_frame(root_frame);
+  free_root_frame(reader_root);
+  return status;
+}
+
+// what small nodes and short strings own lives in the byte classes and moves with them
+int test_gc_2() {
+  struct elem *root_frame = new_root_frame();
+  struct alloc *alloc = frame_alloc(root_frame);
+  struct elem *m = empty_map(), *str, *v, *cells[2];
+  struct alloc_roots roots = { cells, 2, 0 };
+  struct alloc_chunk *c;
+  char text[16];
+  int i, status = 0;
+
+  printf("-----\n");
+  for(i=0;i<40;++i) {
+    sprintf(text, "value %d", i);
+    m = map_set(root_frame, m, new_int(root_frame, i), new_string(root_frame, text));
+  }
+  str = map_get(root_frame, m, new_int(root_frame, 7));
+  c = alloc_chunk_of(alloc, (struct elem *)str->sval.str);
+  // small sets combine as tries, and two members make a small node
+  v = set_union(root_frame, set_add(root_frame, empty_set(), str), set_add(root_frame, empty_set(), m));
+  if ( c == 0 || ! c->young || c->size != 16 || alloc_chunk_of(alloc, (struct elem *)v->mval.root->nval.slots) == 0 ) {
+    printf("short string or node slots not in a byte class\n");
+    status = 1;
+  }
+  if ( string_slice(root_frame, str, 1, 4)->flags & ELEM_FLAG_BORROWED ) {
+    printf("short string borrowed from\n");
+    status = 1;
+  }
+  cells[0] = m;
+  cells[1] = str;
+  frame_push_roots(root_frame, &roots);
+  frame_collect_young(root_frame);
+  m = cells[0];
+  str = cells[1];
+  c = alloc_chunk_of(alloc, (struct elem *)str->sval.str);
+  if ( c == 0 || c->young || c->size != 16 || strcmp(str->sval.str, "value 7") != 0 ) {
+    printf("short string bytes not moved with it\n");
+    status = 1;
+  }
+  for(i=0;i<40;++i) {
+    sprintf(text, "value %d", i);
+    if ( ! elem_eq(root_frame, map_get(root_frame, m, new_int(root_frame, i)), new_string(root_frame, text)) ) {
+      printf("map entry %d lost when promoted\n", i);
+      status = 1;
+    }
+  }
+  // once dead, the sweep puts their bytes back
+  cells[0] = cells[1] = nil();
+  frame_collect(root_frame);
+  frame_pop_roots(root_frame, &roots);
+  for(i=ALLOC_CLASS_BYTES;i<ALLOC_CLASSES;++i) {
+    if ( alloc->classes[i].chunks != 0 && alloc->classes[i].free_list == 0 ) {
+      printf("byte class of %u not swept\n", alloc->classes[i].size);
+      status = 1;
+    }
+  }
+  printf("%u byte classes, of up to %d bytes\n", ALLOC_CLASSES - ALLOC_CLASS_BYTES, ALLOC_BYTES_MAX);
+
+  free_root_frame(root_frame);
+  return status;
+}
+
+int test_intern_1() {
+  struct elem *root_frame = new_root_frame();
+  struct elem *expr = reader_read(root_frame, "(:rhs :foo rhs :foo)");
+  struct elem *a = list_value(expr);
+  struct elem *b = list_value(list_next(expr));
+  struct elem *c = list_value(list_next(list_next(expr)));
+  struct elem *d = list_value(list_next(list_next(list_next(expr))));
+  int status = 0;
+
+  elem_println(root_frame, stdout, expr);
+  if ( a != sym_rhs() || to_sym(root_frame, c) != sym_rhs() || b != d ) {
+    status = 1;
+  }
+  if ( new_sym(root_frame, "foo") != b || intern("println") != sym_println() ) {
+    status = 1;
+  }
+  free_root_frame(root_frame);
+  return status;
+}
+
+int test_map_1() {
+  struct elem *root_frame = new_root_frame();
+  struct elem *frame = root_frame;
+  struct elem *a = empty_map(), *b = empty_map(), *c, *v;
+  int i, n = 5000, status = 0;
+
+  for(i=0;i<n;++i) {
+    a = map_set(frame, a, new_int(frame, i), new_int(frame, i * 2));
+    b = map_set(frame, b, new_int(frame, n - i - 1), new_int(frame, (n - i - 1) * 2));
+  }
+  for(i=0;i<n;++i) {
+    v = map_get(frame, a, new_int(frame, i));
+    if ( ! is_type(v, ELEM_TYPE_INT) || int_value(v) != i * 2 ) {
+      status = 1;
+    }
+  }
+  c = map_set(frame, a, new_int(frame, 7), new_string(frame, "seven"));
+  if ( map_count(a) != n || map_count(c) != n || ! map_eq(frame, a, b) || map_eq(frame, a, c) ) {
+    status = 1;
+  }
+  if ( int_value(map_get(frame, a, new_int(frame, 7))) != 14 ) {
+    status = 1;
+  }
+  if ( map_contains_key(frame, a, new_int(frame, n)) ) {
+    status = 1;
+  }
+
+  // a small map's list, set again up to its limit and one past it
+  c = empty_map();
+  for(i=0;i<=MAP_FLAT_MAX;++i) {
+    c = map_set(frame, c, new_int(frame, i), new_int(frame, i));
+    c = map_set(frame, c, new_int(frame, i / 2), new_int(frame, -i));
+    c = map_set(frame, c, new_string(frame, "key"), new_int(frame, i));
+    if ( map_count(c) != i + 2 || int_value(map_get(frame, c, new_int(frame, i / 2))) != -i ) {
+      status = 1;
+    }
+    if ( int_value(map_get(frame, c, new_string(frame, "key"))) != i || map_contains_key(frame, c, new_int(frame, i + 1)) ) {
+      status = 1;
+    }
+  }
+
+  v = reader_read(root_frame, "{:a \"x\" :a \"y\"}");
+  elem_println(frame, stdout, v);
+  if ( map_count(v) != 1 ) {
+    status = 1;
+  }
+
+  v = reader_read(root_frame, "{{:a \"x\" :b #{:c}} :hit}");
+  c = reader_read(root_frame, "{:b #{:c} :a \"x\"}");
+  if ( map_get(frame, v, c) != reader_read(root_frame, ":hit") || elem_hash(frame, c) != elem_hash(frame, c) ) {
+    status = 1;
+  }
+  if ( ! is_nil(map_get(frame, v, reader_read(root_frame, "{:b #{:d} :a \"x\"}"))) ) {
+    status = 1;
+  }
+  free_root_frame(root_frame);
+  return status;
+}
+
+// the x that mix_hash takes to h, with hi in its top bits before the mix
+uint64_t test_unmix_hash(uint32_t h, uint64_t hi) {
+  uint64_t x = hi << 32 | h, inv = 0xff51afd7ed558ccdull;
+  int i;
+  for(i=0;i<5;++i) {
+    inv *= 2 - 0xff51afd7ed558ccdull * inv;
+  }
+  x ^= x >> 33;
+  x *= inv;
+  return x ^ x >> 33;
+}
+
+/*
+ * Bigints of one limb hash as their limb's mix does, so limbs that mix
+ * to one hash give keys that share all 32 bits of it and land in
+ * collision nodes. Combining those must leave nodes that free and move
+ * as the slots they were made with.
+ */
+int test_set_collisions() {
+  struct elem *root_frame = new_root_frame();
+  struct elem *frame = root_frame;
+  struct elem *keys[10], *cells[5];
+  struct alloc_roots key_roots = { keys, 10, 0 }, roots = { cells, 5, 0 };
+  char text[32];
+  uint64_t hi, x;
+  int i = 0, status = 0;
+
+  for(hi=1;i<10;++hi) {
+    if ( (x = test_unmix_hash(0x5eed, hi)) > (uint64_t)FIXNUM_MAX ) {
+      sprintf(text, "%llu", (unsigned long long)x);
+      keys[i++] = reader_read(root_frame, text);
+    }
+  }
+  cells[0] = cells[1] = empty_set();
+  for(i=0;i<5;++i) {
+    cells[0] = set_add(frame, cells[0], keys[i]);
+    cells[1] = set_add(frame, cells[1], keys[5 + i]);
+  }
+  if ( elem_hash(frame, keys[0]) != elem_hash(frame, keys[9]) ) {
+    printf("keys do not collide\n");
+    status = 1;
+  }
+  cells[2] = set_intersection(frame, cells[0], cells[1]);
+  cells[3] = set_union(frame, cells[0], set_add(frame, empty_set(), keys[5]));
+  cells[4] = set_difference(frame, set_union(frame, cells[0], cells[1]), cells[1]);
+  frame_push_roots(root_frame, &key_roots);
+  frame_push_roots(root_frame, &roots);
+  frame_collect_young(root_frame);
+  frame_collect_young(root_frame);
+  if ( set_count(cells[2]) != 0 || set_count(cells[3]) != 6 || ! set_eq(frame, cells[4], cells[0]) ) {
+    printf("colliding keys combined wrong\n");
+    status = 1;
+  }
+  if ( ! set_contains(frame, cells[3], keys[5]) || set_contains(frame, cells[4], keys[5]) ) {
+    status = 1;
+  }
+  frame_collect(root_frame);
+  frame_pop_roots(root_frame, &roots);
+  frame_pop_roots(root_frame, &key_roots);
+  free_root_frame(root_frame);
+  return status;
+}
+
+int test_set_1() {
+  struct elem *root_frame = new_root_frame();
+  struct elem *frame = root_frame;
+  struct elem *a = empty_set(), *b = empty_set(), *u, *x, *d, *v;
+  int i, n = 5000, status = 0;
+
+  for(i=0;i<n;++i) {
+    a = set_add(frame, a, new_int(frame, i));
+    a = set_add(frame, a, new_int(frame, i));
+    b = set_add(frame, b, new_int(frame, n + n / 2 - i - 1));
+  }
+  u = set_union(frame, a, b);
+  x = set_intersection(frame, a, b);
+  d = set_difference(frame, a, b);
+  if ( set_count(a) != n || set_count(u) != n + n / 2 || set_count(x) != n / 2 || set_count(d) != n / 2 ) {
+    status = 1;
+  }
+  if ( ! set_contains(frame, x, new_int(frame, n - 1)) || set_contains(frame, d, new_int(frame, n - 1)) ) {
+    status = 1;
+  }
+  if ( ! set_subset_eq(frame, x, a) || ! set_subset_eq(frame, d, a) || set_subset_eq(frame, a, x) ) {
+    status = 1;
+  }
+  if ( ! set_eq(frame, set_union(frame, x, d), a) || elem_hash(frame, set_union(frame, d, x)) != elem_hash(frame, a) ) {
+    status = 1;
+  }
+
+  v = reader_read(root_frame, "#{:a \"x\" :a #{:b} #{:b}}");
+  elem_println(frame, stdout, v);
+  if ( set_count(v) != 3 || ! set_contains(frame, v, reader_read(root_frame, "#{:b}")) ) {
+    status = 1;
+  }
+
+  // a small set's list against the trie its members combine into
+  u = set_union(frame, v, empty_set());
+  x = set_intersection(frame, v, v);
+  if ( ! set_eq(frame, x, v) || ! set_eq(frame, v, x) || elem_hash(frame, x) != elem_hash(frame, v) || set_count(x) != 3 ) {
+    status = 1;
+  }
+  if ( u != v || ! set_contains(frame, set_add(frame, x, reader_read(root_frame, ":a")), reader_read(root_frame, "#{:b}")) ) {
+    status = 1;
+  }
+  free_root_frame(root_frame);
+  return status | test_set_collisions();
+}
+
+int test_frame_1() {
+  struct elem *root_frame = new_root_frame();
+  struct elem *child = new_child_frame(root_frame, empty_list());
+  struct elem *m;
+  int status = 0;
+
+  frame_set(root_frame, sym_env(), empty_map());
+  frame_set(child, sym_expr(), new_string(child, "ext"));
+  m = frame_to_map(child);
+  elem_println(child, stdout, map_get(child, m, sym_expr()));
+  if ( frame_get(child, sym_parent()) != root_frame || map_get(child, m, sym_parent()) != root_frame ) {
+    status = 1;
+  }
+  if ( map_get(child, m, sym_lhs()) != empty_list() || map_count(m) != 6 ) {
+    status = 1;
+  }
+  if ( ! sval_eq(child, frame_get(child, sym_expr()), map_get(child, m, sym_expr())) ) {
+    status = 1;
+  }
+  free_root_frame(root_frame);
+  return status;
+}
+
+struct elem *test_vm_env(struct elem *frame, struct elem *reader_root) {
+  struct elem *env = env_add_builtins(frame, empty_map());
+  env = map_set(frame, env, intern("id"), new_user_fn(frame, 
+    reader_read(reader_root, "(x)"), reader_read(reader_root, "x")));
+  env = map_set(frame, env, intern("second"), new_user_fn(frame, 
+    reader_read(reader_root, "(a b)"), reader_read(reader_root, "b")));
+  env = map_set(frame, env, intern("pick"), new_user_fn(frame, 
+    reader_read(reader_root, "(a b)"), reader_read(reader_root, "(second b a)")));
+  env = map_set(frame, env, intern("chain"), new_user_fn(frame, 
+    reader_read(reader_root, "(x)"), reader_read(reader_root, "(id (id (id x)))")));
+  env = map_set(frame, env, intern("show"), new_user_fn(frame, 
+    reader_read(reader_root, "(x y)"), reader_read(reader_root, "(println x (id y))")));
+  env = map_set(frame, env, intern("three"), new_int(frame, 3));
+  env = map_set(frame, env, intern("count"), new_user_fn(frame, 
+    reader_read(reader_root, "(x)"), reader_read(reader_root, "(if (zero? x) :done (count (dec x)))")));
+  env = map_set(frame, env, intern("choose"), new_user_fn(frame, 
+    reader_read(reader_root, "(x)"), reader_read(reader_root, "(if x (id :yes) :no)")));
+  return env;
+}
+
+// runs each expression through frame_eval and the VM and compares results
+int test_vm_1() {
+  char *exprs[] = {
+    "\"hello\"",
+    ":sym",
+    "()",
+    "{:a \"b\"}",
+    "id",
+    "(id \"a\")",
+    "(second \"a\" \"b\")",
+    "(pick \"a\" \"b\")",
+    "(chain (pick :k :j))",
+    "(show \"vm\" (second (id :a) \"b\"))",
+    "(println (id \"x\") (chain (second \"a\" \"b\")))",
+    "(if :a \"t\" \"f\")",
+    "(if (zero? three) :z :nz)",
+    "(if (zero? (dec (dec (dec three)))) (id :z))",
+    "(if (zero? three) :z)",
+    "(if)",
+    "(id (if (choose ()) (count three)))",
+    "(choose (zero? three))",
+    "(second (count three) (if :a (chain :b)))",
+    "(+ 1 2 (* three -4))",
+    "(- 10 three 2)",
+    "(- three)",
+    "(/ -7 2)",
+    "(mod -7 2)",
+    "(if (< 1 2 three) (<= three 3 2) :no)",
+    "(= (+ three 1) 4 (- 8 4))",
+    "(>= (id 4611686018427387903) (+ -4611686018427387904 1))",
+    0
+  };
+  struct elem *root_frame = new_root_frame();
+  struct elem *reader_root = new_root_frame();
+  struct elem *frame = root_frame;
+  struct elem *expr, *a, *b;
+  struct alloc_roots roots = { &a, 1, 0 };
+  int i, status = 0;
+
+  printf("-----\n");
+  frame_set(frame, sym_env(), test_vm_env(frame, reader_root));
+  for(i=0;exprs[i]!=0;++i) {
+    expr = reader_read(reader_root, exprs[i]);
+    frame_set(frame, sym_rhs(), expr);
+    frame_set(frame, sym_lhs(), empty_list());
+    a = frame_eval(frame);
+    // collect at the VM's first call to check its registers are roots
+    frame_alloc(frame)->since_collect = frame_alloc(frame)->threshold;
+    frame_push_roots(frame, &roots);
+    b = vm_eval(frame, compile(frame, empty_list(), expr));
+    frame_pop_roots(frame, &roots);
+    elem_print(frame, stdout, a);
+    printf(" ");
+    elem_println(frame, stdout, b);
+    if ( ! elem_eq(frame, a, b) && ! ( is_nil(a) && is_nil(b) ) ) {
+      status = 1;
+    }
+  }
+  free_root_frame(root_frame);
+  free_root_frame(reader_root);
+  return status;
+}
+
+/*
+ * Checks Karatsuba against schoolbook multiplication, and that long
+ * division gives back a = q b + r with r < b, on limbs from a fixed
+ * sequence that is rich in all-ones and zero limbs, where carries and
+ * the quotient estimate go wrong most easily.
+ */
+uint64_t test_limb(uint64_t *x) {
+  *x ^= *x << 13;
+  *x ^= *x >> 7;
+  *x ^= *x << 17;
+  switch(*x % 4) {
+  case 0:
+    return ~0ull;
+  case 1:
+    return 0;
+  default:
+    return *x;
+  }
+}
+
+int test_bigint_1() {
+  uint32_t sizes[] = { 1, 2, 3, 31, 32, 33, 64, 100, 257 };
+  uint32_t n = sizeof(sizes) / sizeof(sizes[0]), i, j, k, alen, blen, qlen;
+  uint64_t seed = 88172645463325252ull, *a, *b, *r1, *r2, *q, *m;
+  int status = 0;
+
+  printf("-----\n");
+  for(i=0;i<n;++i) {
+    for(j=0;j<n;++j) {
+      alen = sizes[i];
+      blen = sizes[j];
+      a = NEW_ARRAY(uint64_t, alen);
+      b = NEW_ARRAY(uint64_t, blen);
+      for(k=0;k<alen;++k) {
+        a[k] = test_limb(&seed);
+      }
+      for(k=0;k<blen;++k) {
+        b[k] = test_limb(&seed);
+      }
+      a[alen - 1] |= 1;
+      b[blen - 1] |= 1ull << (seed % 64);
+      r1 = NEW_ARRAY(uint64_t, alen + blen);
+      r2 = NEW_ARRAY(uint64_t, alen + blen);
+      mag_mul(r1, a, alen, b, blen);
+      mag_mul_school(r2, a, alen, b, blen);
+      if ( memcmp(r1, r2, (size_t)(alen + blen) * sizeof(uint64_t)) != 0 ) {
+        printf("%u by %u limbs multiplied wrong\n", alen, blen);
+        status = 1;
+      }
+      if ( alen >= blen ) {
+        qlen = alen - blen + 1;
+        q = NEW_ARRAY(uint64_t, qlen);
+        m = NEW_ARRAY(uint64_t, blen);
+        if ( blen == 1 ) {
+          m[0] = mag_divmod_small(q, a, alen, b[0]);
+        } else {
+          mag_divmod(q, m, a, alen, b, blen);
+        }
+        mag_mul(r1, q, qlen, b, blen);
+        mag_add_in(r1, alen + 1 > qlen + blen ? qlen + blen : alen + 1, m, blen);
+        if ( mag_cmp(m, mag_trim(m, blen), b, blen) >= 0 || mag_cmp(r1, mag_trim(r1, qlen + blen), a, alen) != 0 ) {
+          printf("%u by %u limbs divided wrong\n", alen, blen);
+          status = 1;
+        }
+        FREE_ARRAY(q);
+        FREE_ARRAY(m);
+      }
+      FREE_ARRAY(a);
+      FREE_ARRAY(b);
+      FREE_ARRAY(r1);
+      FREE_ARRAY(r2);
+    }
+  }
+  printf("%u multiplications and divisions checked\n", n * n);
+  return status;
+}
+
+/*
+ * Vector builtins in both evaluators, then the machine's kernels checked
+ * against the plain loops on items near the fixnum bounds, with lengths
+ * that leave tails and blocks of narrow and wide items.
+ */
+int test_vector_1() {
+  char *exprs[] = {
+    "[1 2 [:a \"s\"] (x y) -4611686018427387904]",
+    "(vector 1 (+ 1 1) :c)",
+    "(nth [1 2 3] 1)",
+    "(nth [:a :b] 0)",
+    "(length [])",
+    "(slice [1 2 3 4] 1 3)",
+    "(slice [:a 2 3] 1)",
+    "(concat [1] [] [2 3])",
+    "(concat [1] [:b])",
+    "(sum [1 2 3])",
+    "(sum [])",
+    "(sum [4611686018427387903 4611686018427387903 4611686018427387903])",
+    "(sum [99999999999999999999 1])",
+    "(map + [1 2 3] [10 20 30 40])",
+    "(map + [4611686018427387903 1] [1 1])",
+    "(map - [1 2] [3 5])",
+    "(map * [1 2] [3 4] [5 6])",
+    "(dot [1 2 3] [4 5 6])",
+    "(dot [4611686018427387903 -4611686018427387904] [4611686018427387903 4611686018427387903])",
+    "(dot [99999999999999999999] [2])",
+    "(min [3 -1 2])",
+    "(max [3 -1 2 7 1 0])",
+    "(max [1 99999999999999999999 2])",
+    "(min 4 2 8)",
+    "(= [1 2] (vector 1 2))",
+    "(= [1 2] [1 :b])",
+    0
+  };
+  char *errors[] = {
+    "(nth [1] 1)",
+    "(nth [1] -1)",
+    "(slice [1 2] 2 1)",
+    "(dot [1] [1 2])",
+    "(min [])",
+    "(sum [:a])",
+    "(map + [:a] [1])",
+    "(map id [1])",
+    "(length :a)",
+    0
+  };
+  uint32_t lens[] = { 0, 1, 3, 4, 5, 255, 256, 257, 1000, 1031 };
+  uint64_t seed = 88172645463325252ull;
+  const struct vector_kernels *k = vector_kernels(), *s = &vector_scalar_kernels;
+  struct elem *root_frame = new_root_frame();
+  struct elem *reader_root = new_root_frame();
+  struct elem *frame = root_frame;
+  struct elem *expr, *a, *b;
+  int64_t *x, *y, *r1, *r2, min1, max1, min2, max2;
+  struct alloc_roots roots = { &a, 1, 0 };
+  uint32_t i, j, n;
+  int status = 0;
+
+  printf("-----\n");
+  frame_set(frame, sym_env(), test_vm_env(frame, reader_root));
+  for(i=0;exprs[i]!=0;++i) {
+    expr = reader_read(reader_root, exprs[i]);
+    frame_set(frame, sym_rhs(), expr);
+    frame_set(frame, sym_lhs(), empty_list());
+    a = frame_eval(frame);
+    // collect at the VM's first call, which moves the vectors a holds
+    frame_alloc(frame)->since_collect = frame_alloc(frame)->threshold;
+    frame_push_roots(frame, &roots);
+    b = vm_eval(frame, compile(frame, empty_list(), expr));
+    frame_pop_roots(frame, &roots);
+    elem_print(frame, stdout, a);
+    printf(" ");
+    elem_println(frame, stdout, b);
+    if ( ! elem_eq(frame, a, b) || is_type(a, ELEM_TYPE_ERROR) ) {
+      status = 1;
+    }
+  }
+  for(i=0;errors[i]!=0;++i) {
+    expr = reader_read(reader_root, errors[i]);
+    frame_set(frame, sym_rhs(), expr);
+    frame_set(frame, sym_lhs(), empty_list());
+    a = frame_eval(frame);
+    b = vm_eval(frame, compile(frame, empty_list(), expr));
+    if ( ! is_type(a, ELEM_TYPE_ERROR) || ! is_type(b, ELEM_TYPE_ERROR) ) {
+      printf("expected an error from %s\n", errors[i]);
+      status = 1;
+    }
+  }
+
+  for(i=0;i<sizeof(lens)/sizeof(lens[0]);++i) {
+    n = lens[i];
+    x = NEW_ARRAY(int64_t, n + 1);
+    y = NEW_ARRAY(int64_t, n + 1);
+    r1 = NEW_ARRAY(int64_t, n + 1);
+    r2 = NEW_ARRAY(int64_t, n + 1);
+    for(j=0;j<n;++j) {
+      x[j] = (int64_t)test_limb(&seed) >> (1 + (j < 300 ? 32 : seed % 40));
+      y[j] = j < 512 ? -x[j] / 3 : j % 7 == 0 ? FIXNUM_MIN : j % 5 == 0 ? FIXNUM_MAX : x[j];
+    }
+    if ( k->sum(x, n) != s->sum(x, n) || k->sum(y, n) != s->sum(y, n) || k->dot(x, y, n) != s->dot(x, y, n) || k->dot(x, x, n) != s->dot(x, x, n) ) {
+      printf("%u items summed wrong\n", n);
+      status = 1;
+    }
+    if ( k->add(r1, x, x, n) != s->add(r2, x, x, n) || k->add(r1, x, y, n) != s->add(r2, x, y, n) || memcmp(r1, r2, (size_t)n * sizeof(int64_t)) != 0 ) {
+      printf("%u items added wrong\n", n);
+      status = 1;
+    }
+    if ( n > 0 ) {
+      k->minmax(y, n, &min1, &max1);
+      s->minmax(y, n, &min2, &max2);
+      if ( min1 != min2 || max1 != max2 ) {
+        printf("%u items ordered wrong\n", n);
+        status = 1;
+      }
+    }
+    FREE_ARRAY(x);
+    FREE_ARRAY(y);
+    FREE_ARRAY(r1);
+    FREE_ARRAY(r2);
+  }
+  free_root_frame(root_frame);
+  free_root_frame(reader_root);
+  return status;
+}
+
+// the items under n at shift, with *bad set when its shape is wrong
+uint64_t test_pvec_node(struct elem *n, uint32_t shift, int *bad) {
+  uint64_t count = 0, c;
+  uint32_t i, strict = 1;
+  if ( ! is_pvec_node(n) || n->pnval.len == 0 || n->pnval.len > PVEC_WIDTH ) {
+    *bad = 1;
+    return 0;
+  }
+  if ( shift == 0 ) {
+    return n->pnval.len;
+  }
+  for(i=0;i<n->pnval.len;++i) {
+    c = test_pvec_node(n->pnval.slots[i], shift - PVEC_BITS, bad);
+    count += c;
+    strict &= i + 1 == n->pnval.len || c == (uint64_t)1 << shift;
+    if ( n->pnval.sizes != 0 && n->pnval.sizes[i] != count ) {
+      *bad = 1;
+    }
+  }
+  // only nodes that could not be strict have sizes
+  if ( strict != (n->pnval.sizes == 0) ) {
+    *bad = 1;
+  }
+  return count;
+}
+
+// v holds the len ints of ref, in a tree of the right shape
+int test_pvec_same(struct elem *v, int64_t *ref, uint32_t len) {
+  uint32_t i;
+  int bad = 0;
+  if ( ! is_pvec(v) || v->pval.count != len || pvec_tail_len(v) > PVEC_WIDTH ) {
+    return 0;
+  }
+  if ( ! is_nil(v->pval.tail) && test_pvec_node(v->pval.tail, 0, &bad) == 0 ) {
+    return 0;
+  }
+  if ( is_nil(v->pval.root) ? v->pval.shift != 0 : test_pvec_node(v->pval.root, v->pval.shift, &bad) + pvec_tail_len(v) != len ) {
+    return 0;
+  }
+  for(i=0;i<len&&!bad;++i) {
+    bad = pvec_item(v, i) != ELEM_FIXNUM(ref[i]);
+  }
+  return ! bad;
+}
+
+/*
+ * Persistent vector builtins in both evaluators, then trees built up by
+ * conj, assoc, subvec and concat checked against a plain array, item by
+ * item and for their shape.
+ */
+int test_pvec_1() {
+  char *exprs[] = {
+    "#[1 2 [3] :a \"s\"]",
+    "(pvec 1 (+ 1 1) :c)",
+    "(conj #[] 1 2 3)",
+    "(assoc #[1 2 3] 1 :b)",
+    "(assoc #[1] 1 2)",
+    "(subvec (pvec 1 2 3 4) 1 3)",
+    "(subvec #[:a :b] 1)",
+    "(concat #[1 2] #[] #[3])",
+    "(nth #[:a :b] 1)",
+    "(length (conj #[1 2] 3))",
+    "(= #[1 2] (conj (pvec 1) 2))",
+    "(= #[1 2] [1 2])",
+    0
+  };
+  char *errors[] = {
+    "(nth #[1] 1)",
+    "(nth #[1] :a)",
+    "(assoc #[1] 2 :a)",
+    "(subvec #[1 2] 2 1)",
+    "(concat #[1] [2])",
+    "(conj [1] 2)",
+    "(conj)",
+    0
+  };
+  uint32_t n = 20000, i, j, from, to, len;
+  uint64_t seed = 88172645463325252ull;
+  struct elem *root_frame = new_root_frame();
+  struct elem *reader_root = new_root_frame();
+  struct elem *frame = root_frame;
+  struct elem *expr, *a, *b, *v, *w;
+  struct alloc_roots roots = { &a, 1, 0 };
+  struct pvec_builder builder = { 0, 0, 0 };
+  int64_t *ref = NEW_ARRAY(int64_t, 2 * n), *cat = NEW_ARRAY(int64_t, 4 * n + 256), *rev = cat + 2 * n + 128;
+  struct printer p;
+  int status = 0;
+
+  printf("-----\n");
+  frame_set(frame, sym_env(), test_vm_env(frame, reader_root));
+  for(i=0;exprs[i]!=0;++i) {
+    expr = reader_read(reader_root, exprs[i]);
+    frame_set(frame, sym_rhs(), expr);
+    frame_set(frame, sym_lhs(), empty_list());
+    a = frame_eval(frame);
+    // collect at the VM's first call, which moves the trees a holds
+    frame_alloc(frame)->since_collect = frame_alloc(frame)->threshold;
+    frame_push_roots(frame, &roots);
+    b = vm_eval(frame, compile(frame, empty_list(), expr));
+    frame_pop_roots(frame, &roots);
+    elem_print(frame, stdout, a);
+    printf(" ");
+    elem_println(frame, stdout, b);
+    if ( ! elem_eq(frame, a, b) || is_type(a, ELEM_TYPE_ERROR) ) {
+      status = 1;
+    }
+  }
+  for(i=0;errors[i]!=0;++i) {
+    expr = reader_read(reader_root, errors[i]);
+    frame_set(frame, sym_rhs(), expr);
+    frame_set(frame, sym_lhs(), empty_list());
+    a = frame_eval(frame);
+    b = vm_eval(frame, compile(frame, empty_list(), expr));
+    if ( ! is_type(a, ELEM_TYPE_ERROR) || ! is_type(b, ELEM_TYPE_ERROR) ) {
+      printf("expected an error from %s\n", errors[i]);
+      status = 1;
+    }
+  }
+
+  // nothing below reaches a safepoint, so the trees stay where they are
+  v = new_pvec(frame, 0, 0, nil(), nil());
+  for(i=0;i<n;++i) {
+    ref[i] = i;
+    v = pvec_conj(frame, v, ELEM_FIXNUM(i));
+    pvec_builder_add(&builder, ELEM_FIXNUM(i));
+  }
+  w = pvec_builder_finish(frame, &builder);
+  if ( ! test_pvec_same(v, ref, n) || ! test_pvec_same(w, ref, n) || elem_hash(frame, v) != elem_hash(frame, w) ) {
+    printf("conj and the builder disagree\n");
+    status = 1;
+  }
+  for(i=0;i<1000;++i) {
+    j = test_limb(&seed) % n;
+    w = pvec_assoc(frame, v, j, ELEM_FIXNUM(-1));
+    ref[j] = -1;
+    if ( ! test_pvec_same(w, ref, n) ) {
+      printf("assoc at %u came out wrong\n", j);
+      status = 1;
+    }
+    ref[j] = j;
+  }
+  if ( ! test_pvec_same(v, ref, n) ) {
+    printf("assoc changed the vector it was given\n");
+    status = 1;
+  }
+  for(i=0;i<1000;++i) {
+    from = test_limb(&seed) % (n + 1);
+    to = from + test_limb(&seed) % (n + 1 - from);
+    if ( ! test_pvec_same(pvec_slice(frame, v, from, to), ref + from, to - from) ) {
+      printf("subvec %u to %u came out wrong\n", from, to);
+      status = 1;
+    }
+  }
+  for(i=0;i<300;++i) {
+    from = test_limb(&seed) % (n + 1);
+    to = from + test_limb(&seed) % (n + 1 - from);
+    j = test_limb(&seed) % (n + 1);
+    len = j + test_limb(&seed) % (n + 1 - j);
+    a = pvec_slice(frame, v, from, to);
+    b = pvec_slice(frame, v, j, len);
+    memcpy(cat, ref + from, (size_t)(to - from) * sizeof(int64_t));
+    memcpy(cat + (to - from), ref + j, (size_t)(len - j) * sizeof(int64_t));
+    if ( ! test_pvec_same(pvec_concat(frame, a, b), cat, to - from + len - j) ) {
+      printf("concat of %u to %u and %u to %u came out wrong\n", from, to, j, len);
+      status = 1;
+    }
+  }
+  // small pieces joined on at either end keep the tree shallow
+  a = new_pvec(frame, 0, 0, nil(), nil());
+  b = a;
+  for(i=0,len=0;len<2*n;++i) {
+    from = test_limb(&seed) % (n - 100);
+    to = from + 1 + test_limb(&seed) % 100;
+    w = pvec_slice(frame, v, from, to);
+    memcpy(cat + len, ref + from, (size_t)(to - from) * sizeof(int64_t));
+    memmove(rev + (to - from), rev, (size_t)len * sizeof(int64_t));
+    memcpy(rev, ref + from, (size_t)(to - from) * sizeof(int64_t));
+    len += to - from;
+    a = pvec_concat(frame, a, w);
+    b = pvec_concat(frame, w, b);
+  }
+  if ( ! test_pvec_same(a, cat, len) || ! test_pvec_same(b, rev, len) || a->pval.shift > 3 * PVEC_BITS || b->pval.shift > 3 * PVEC_BITS ) {
+    printf("%u pieces joined on came out wrong\n", i);
+    status = 1;
+  }
+  printer_init(&p);
+  if ( snapshot_save(&p, alloc_list(frame, empty_list(), a)) != 0 || ! test_pvec_same(list_value(snapshot_load(frame, p.buf, p.len)), cat, len) ) {
+    printf("joined vector loads back different\n");
+    status = 1;
+  }
+  printer_free(&p);
+  printf("%u pieces of up to 100 joined at height %u and %u\n", i, a->pval.shift / PVEC_BITS, b->pval.shift / PVEC_BITS);
+  FREE_ARRAY(ref);
+  FREE_ARRAY(cat);
+  free_root_frame(root_frame);
+  free_root_frame(reader_root);
+  return status;
+}
+
+// the leaves under s, with *bad set when its shape is wrong
+uint32_t test_rope_leaves(struct elem *s, int *bad) {
+  uint32_t l, r;
+  if ( ! is_rope(s) ) {
+    return 1;
+  }
+  l = string_depth(s->rval.left);
+  r = string_depth(s->rval.right);
+  if ( s->rval.depth != (l > r ? l : r) + 1 || l > r + 1 || r > l + 1 || s->rval.len != string_len(s->rval.left) + string_len(s->rval.right) ) {
+    *bad = 1;
+  }
+  if ( string_len(s->rval.left) == 0 || string_len(s->rval.right) == 0 ) {
+    *bad = 1;
+  }
+  return test_rope_leaves(s->rval.left, bad) + test_rope_leaves(s->rval.right, bad);
+}
+
+// s holds the len bytes of ref, in a balanced tree
+int test_rope_same(struct elem *frame, struct elem *s, const char *ref, uint32_t len) {
+  uint32_t leaves, i, h;
+  int bad = 0;
+  struct printer p;
+  if ( ! is_string(s) || string_len(s) != len ) {
+    return 0;
+  }
+  leaves = test_rope_leaves(s, &bad);
+  // an AVL tree over n leaves is under 1.5 log2(n + 2) high
+  for(h=0;((uint64_t)1<<h)<(uint64_t)leaves+2;++h);
+  if ( bad || 2 * string_depth(s) > 3 * h ) {
+    return 0;
+  }
+  for(i=0;i<len;i+=1+len/97) {
+    bad |= string_byte_at(s, i) != (unsigned char)ref[i];
+  }
+  if ( bad || elem_hash(frame, s) != (str_hash(ref, len) ^ ELEM_TYPE_STRING) ) {
+    return 0;
+  }
+  printer_init(&p);
+  string_write(&p, s);
+  bad = p.len < len + 2;
+  printer_free(&p);
+  return ! bad && sval_eq(frame, s, new_string_len(frame, ref, len, ELEM_TYPE_STRING));
+}
+
+/*
+ * String builtins in both evaluators, then ropes built up by joining
+ * pieces at either end and sliced at random, checked against the flat
+ * bytes. Slices have to keep the bytes they borrow alive on their own.
+ */
+int test_string_1() {
+  char *exprs[] = {
+    "(concat \"ab\" \"\" \"cd\")",
+    "(substring \"hello world\" 6)",
+    "(substring \"hello\" 1 3)",
+    "(index-of \"hello world\" \"o\")",
+    "(index-of \"hello world\" \"o\" 5)",
+    "(index-of \"hello\" \"z\")",
+    "(split \"a,b,,c\" \",\")",
+    "(split \"a::b\" \"::\")",
+    "(length (concat \"abc\" \"de\"))",
+    "(nth \"abc\" 1)",
+    "(= (concat \"ab\" \"c\") \"abc\")",
+    "(concat \"0123456789012345678901234567890123456789x\" \"y0123456789012345678901234567890123456789\")",
+    "(index-of (concat \"0123456789012345678901234567890123456789x\" \"y0123456789012345678901234567890123456789\") \"xy\")",
+    "(split (concat \"0123456789012345678901234567890123456789,\" \"0123456789012345678901234567890123456789\") \"9,0\")",
+    "(substring (concat \"0123456789012345678901234567890123456789\" \"abcdefghijklmnopqrstuvwxyzabcdefghijklmn\") 35 45)",
+    0
+  };
+  char *errors[] = {
+    "(substring \"ab\" 2 1)",
+    "(index-of \"ab\" :a)",
+    "(split \"ab\" \"\")",
+    "(concat \"a\" [1])",
+    "(nth \"ab\" 2)",
+    0
+  };
+  uint32_t n = 100000, i, from, to, len, k;
+  uint64_t seed = 88172645463325252ull;
+  struct elem *root_frame = new_root_frame();
+  struct elem *reader_root = new_root_frame();
+  struct elem *frame = root_frame;
+  struct elem *expr, *a, *b, *flat, *cells[2];
+  struct alloc_roots roots = { &a, 1, 0 }, kept = { cells, 2, 0 };
+  struct printer pr;
+  char *ref = NEW_ARRAY(char, 2 * n + 256), *rev = NEW_ARRAY(char, n + 256), *rot = NEW_ARRAY(char, n + 256);
+  const char *p;
+  int64_t at, want;
+  uint64_t since;
+  int status = 0;
+
+  printf("-----\n");
+  frame_set(frame, sym_env(), test_vm_env(frame, reader_root));
+  for(i=0;exprs[i]!=0;++i) {
+    expr = reader_read(reader_root, exprs[i]);
+    frame_set(frame, sym_rhs(), expr);
+    frame_set(frame, sym_lhs(), empty_list());
+    a = frame_eval(frame);
+    // collect at the VM's first call, which moves the ropes a holds
+    frame_alloc(frame)->since_collect = frame_alloc(frame)->threshold;
+    frame_push_roots(frame, &roots);
+    b = vm_eval(frame, compile(frame, empty_list(), expr));
+    frame_pop_roots(frame, &roots);
+    elem_print(frame, stdout, a);
+    printf(" ");
+    elem_println(frame, stdout, b);
+    if ( ! elem_eq(frame, a, b) || is_type(a, ELEM_TYPE_ERROR) ) {
+      status = 1;
+    }
+  }
+  for(i=0;errors[i]!=0;++i) {
+    expr = reader_read(reader_root, errors[i]);
+    frame_set(frame, sym_rhs(), expr);
+    frame_set(frame, sym_lhs(), empty_list());
+    a = frame_eval(frame);
+    b = vm_eval(frame, compile(frame, empty_list(), expr));
+    if ( ! is_type(a, ELEM_TYPE_ERROR) || ! is_type(b, ELEM_TYPE_ERROR) ) {
+      printf("expected an error from %s\n", errors[i]);
+      status = 1;
+    }
+  }
+
+  // NULs, quotes and backslashes among the bytes
+  for(i=0;i<n;++i) {
+    ref[i] = "ab\"\\\0xyz"[test_limb(&seed) % 8];
+  }
+  flat = new_string_len(frame, ref, n, ELEM_TYPE_STRING);
+  a = new_string_len(frame, "", 0, ELEM_TYPE_STRING);
+  b = a;
+  for(len=0;len<n;len+=to-from) {
+    from = test_limb(&seed) % (n - 200);
+    k = test_limb(&seed) % 4 == 0 ? 200 : 8;
+    to = from + 1 + test_limb(&seed) % k;
+    memmove(rev + (to - from), rev, len);
+    memcpy(rev, ref + from, to - from);
+    memcpy(ref + n + 128 + len, ref + from, to - from);
+    a = string_join(frame, a, string_slice(frame, flat, from, to));
+    b = string_join(frame, string_slice(frame, flat, from, to), b);
+  }
+  p = ref + n + 128;
+  if ( ! test_rope_same(frame, a, p, len) || ! test_rope_same(frame, b, rev, len) ) {
+    printf("ropes joined at either end came out wrong\n");
+    status = 1;
+  }
+  for(i=0;i<300;++i) {
+    from = test_limb(&seed) % (len + 1);
+    to = from + test_limb(&seed) % (len + 1 - from);
+    if ( ! test_rope_same(frame, string_slice(frame, a, from, to), p + from, to - from) ) {
+      printf("substring %u to %u came out wrong\n", from, to);
+      status = 1;
+    }
+    k = test_limb(&seed) % (len + 1);
+    memcpy(rot, p + k, len - k);
+    memcpy(rot + (len - k), p, k);
+    if ( ! test_rope_same(frame, string_join(frame, string_slice(frame, a, k, len), string_slice(frame, a, 0, k)), rot, len) ) {
+      printf("rotation by %u came out wrong\n", k);
+      status = 1;
+    }
+  }
+  for(i=0;i<3000;++i) {
+    k = 1 + test_limb(&seed) % 12;
+    from = test_limb(&seed) % (len - k);
+    to = test_limb(&seed) % len;
+    at = string_index_of(a, p + from, k, to);
+    for(want=to;want+k<=len&&memcmp(p + want, p + from, k)!=0;++want);
+    if ( at != (want + k <= len ? want : -1) ) {
+      printf("index-of %u bytes from %u found %ld, not %ld\n", k, to, at, want);
+      status = 1;
+    }
+  }
+
+  printer_init(&pr);
+  if ( snapshot_save(&pr, alloc_list(frame, empty_list(), a)) != 0 || ! test_rope_same(frame, list_value(snapshot_load(frame, pr.buf, pr.len)), p, len) ) {
+    printf("rope loads back different\n");
+    status = 1;
+  }
+  printer_free(&pr);
+  printf("%u bytes joined on at depth %u and %u\n", len, string_depth(a), string_depth(b));
+  // a string's bytes count towards the next collection, once
+  since = frame_alloc(frame)->since_collect;
+  flat = new_string_len(frame, p, len, ELEM_TYPE_STRING);
+  if ( frame_alloc(frame)->since_collect - since < len / sizeof(struct elem) ) {
+    printf("string bytes not counted towards a collection\n");
+    status = 1;
+  }
+  since = frame_alloc(frame)->since_collect;
+  string_slice(frame, flat, 1, len - 1);
+  if ( frame_alloc(frame)->since_collect - since >= len / sizeof(struct elem) ) {
+    printf("slice counted the bytes it borrows\n");
+    status = 1;
+  }
+  // only the slices are roots, the strings they borrow from have to stay
+  cells[0] = string_slice(frame, new_string_len(frame, p, len, ELEM_TYPE_STRING), 10, len - 10);
+  cells[1] = string_slice(frame, a, 1, len - 1);
+  a = b = flat = 0;
+  frame_push_roots(frame, &kept);
+  frame = frame_collect(frame);
+  frame = frame_collect(frame);
+  frame_pop_roots(frame, &kept);
+  if ( ! test_rope_same(frame, cells[0], p + 10, len - 20) || ! test_rope_same(frame, cells[1], p + 1, len - 2) ) {
+    printf("slices lost their bytes to a collection\n");
+    status = 1;
+  }
+  FREE_ARRAY(ref);
+  FREE_ARRAY(rev);
+  FREE_ARRAY(rot);
+  free_root_frame(root_frame);
+  free_root_frame(reader_root);
+  return status;
+}
+
+// arithmetic that fails gives an error from both evaluators, the rest agrees
+int test_arith_1() {
+  char *exprs[] = {
+    "(+ 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16 17 18 19 20)",
+    "(* 2147483648 2147483647)",
+    "(- (- 0 4611686018427387903) 1)",
+    "(+)",
+    "(*)",
+    "(= :a :a)",
+    "(= \"x\" \"y\")",
+    "(<)",
+    "(+ 4611686018427387903 1)",
+    "(- -4611686018427387904 1)",
+    "(* 2147483648 2147483648)",
+    "(/ -4611686018427387904 -1)",
+    "(- (+ 4611686018427387903 1) 1)",
+    "(- (* 99999999999999999999 99999999999999999999) 1)",
+    "(/ (* 340282366920938463463374607431768211457 12345678901234567890123) 12345678901234567890123)",
+    "(/ -100000000000000000000000 7)",
+    "(mod -100000000000000000000000 7)",
+    "(mod 100000000000000000000000 -7)",
+    "(mod 7 100000000000000000000000)",
+    "(mod (* 340282366920938463463374607431768211457 3) 340282366920938463463374607431768211457)",
+    "(< 1 99999999999999999999 (* 99999999999999999999 2))",
+    "(<= -99999999999999999999 -99999999999999999999 -1)",
+    "(>= 1 -99999999999999999999)",
+    "(= (+ 99999999999999999999 1) 100000000000000000000)",
+    "(dec -4611686018427387904)",
+    "(dec (dec 1))",
+    "(zero? (dec 1))",
+    "(zero? 1)",
+    "(zero? :a)",
+    "(zero? (- 99999999999999999999 99999999999999999999))",
+    0
+  };
+  char *errors[] = {
+    "(/ 99999999999999999999 0)",
+    "(+ 99999999999999999999 :a)",
+    "(< 99999999999999999999 :a)",
+    "(/ 1 0)",
+    "(mod 1 0)",
+    "(mod 1)",
+    "(-)",
+    "(+ 1 :a)",
+    "(< 1 \"2\")",
+    "(dec :a)",
+    "(dec)",
+    0
+  };
+  struct elem *root_frame = new_root_frame();
+  struct elem *reader_root = new_root_frame();
+  struct elem *frame = root_frame;
+  struct elem *expr, *a, *b;
+  int i, status = 0;
+
+  printf("-----\n");
+  frame_set(frame, sym_env(), test_vm_env(frame, reader_root));
+  for(i=0;exprs[i]!=0;++i) {
+    expr = reader_read(reader_root, exprs[i]);
+    frame_set(frame, sym_rhs(), expr);
+    frame_set(frame, sym_lhs(), empty_list());
+    a = frame_eval(frame);
+    b = vm_eval(frame, compile(frame, empty_list(), expr));
+    elem_print(frame, stdout, a);
+    printf(" ");
+    elem_println(frame, stdout, b);
+    if ( ! elem_eq(frame, a, b) ) {
+      status = 1;
+    }
+  }
+  for(i=0;errors[i]!=0;++i) {
+    expr = reader_read(reader_root, errors[i]);
+    frame_set(frame, sym_rhs(), expr);
+    frame_set(frame, sym_lhs(), empty_list());
+    a = frame_eval(frame);
+    b = vm_eval(frame, compile(frame, empty_list(), expr));
+    if ( ! is_type(a, ELEM_TYPE_ERROR) || ! is_type(b, ELEM_TYPE_ERROR) ) {
+      printf("expected an error from %s\n", errors[i]);
+      status = 1;
+    }
+  }
+  free_root_frame(root_frame);
+  free_root_frame(reader_root);
+  return status;
+}
+
+// a tail recursive loop must run in constant space in both evaluators
+int test_tail_1() {
+  struct elem *root_frame = new_root_frame();
+  struct elem *reader_root = new_root_frame();
+  struct elem *frame = root_frame;
+  struct elem *env, *expr, *a, *b;
+  struct alloc_stats stats;
+  uint64_t start, tree_ns, vm_ns;
+  int status = 0;
+
+  env = test_vm_env(frame, reader_root);
+  env = map_set(frame, env, intern("n"), new_int(frame, 10000000));
+  frame_set(frame, sym_env(), env);
+  expr = reader_read(reader_root, "(count n)");
+
+  start = now_ns();
+  frame_set(frame, sym_rhs(), expr);
+  frame_set(frame, sym_lhs(), empty_list());
+  a = frame_eval(frame);
+  tree_ns = now_ns() - start;
+  frame_alloc_stats(frame, &stats);
+  if ( stats.capacity > 64 * 1024 ) {
+    status = 1;
+  }
+
+  start = now_ns();
+  b = vm_eval(frame, compile(frame, empty_list(), expr));
+  vm_ns = now_ns() - start;
+  frame_alloc_stats(frame, &stats);
+  if ( stats.capacity > 64 * 1024 || a != intern("done") || b != a ) {
+    status = 1;
+  }
+
+  printf("-----\n10M tail calls: frame_eval %.2f s, vm %.2f s, capacity %lu cells\n",
+    tree_ns / 1e9, vm_ns / 1e9, stats.capacity);
+  free_root_frame(root_frame);
+  free_root_frame(reader_root);
+  return status;
+}
+
+// an instance whose env has the test functions and n bound to count
+struct elem *new_test_instance_frame(struct elem *reader_root, int n) {
+  struct elem *frame = new_root_frame();
+  struct elem *env = test_vm_env(frame, reader_root);
+  env = map_set(frame, env, intern("n"), new_int(frame, n));
+  frame_set(frame, sym_env(), env);
+  return frame;
+}
+
+// instances on their own threads each intern symbols and count down
+int test_instances_1() {
+  struct instance instances[4];
+  struct elem *reader_roots[4];
+  char text[4][64];
+  int i, status = 0;
+
+  printf("-----\n");
+  for(i=0;i<4;++i) {
+    snprintf(text[i], sizeof(text[i]), "(pick :instance-%c (count n)) (pick :done-%c :x)", 'a' + i, 'a' + i);
+    reader_roots[i] = new_root_frame();
+    instances[i].frame = new_test_instance_frame(reader_roots[i], 10000 * (i + 1));
+    instances[i].input = text[i];
+    instances[i].len = strlen(text[i]);
+  }
+  instances_run(instances, 4);
+  for(i=0;i<4;++i) {
+    snprintf(text[i], sizeof(text[i]), "done-%c", 'a' + i);
+    elem_println(instances[i].frame, stdout, instances[i].value);
+    if ( instances[i].value != intern(text[i]) ) {
+      status = 1;
+    }
+    free_root_frame(instances[i].frame);
+    free_root_frame(reader_roots[i]);
+  }
+  return status;
+}
+
+// pcall gives the values and output of a plain call, and the VM runs it as one
+int test_pcall_1() {
+  char *exprs[] = {
+    "(pcall second (count n) (id :x))",
+    "(pcall pick (pcall second (count n) (count n)) (count n))",
+    "(pcall second (show :a :b) (show :c (id :d)) (pcall show (show :e :f) (show :g :h)))",
+    "(pcall second (id :x))",
+    "(pcall)",
+    0
+  };
+  struct elem *reader_root = new_root_frame();
+  struct elem *frame = new_test_instance_frame(reader_root, 100000);
+  struct elem *expr, *a, *b;
+  struct alloc_roots roots = { &a, 1 };
+  struct alloc_stats stats;
+  uint64_t collections;
+  char *out[2];
+  size_t len[2];
+  int i, status = 0;
+
+  printf("-----\n");
+  pool_start(3);
+  for(i=0;exprs[i]!=0;++i) {
+    expr = reader_read(reader_root, exprs[i]);
+    frame_alloc(frame)->tlab.out = open_memstream(&out[0], &len[0]);
+    frame_set(frame, sym_rhs(), expr);
+    frame_set(frame, sym_lhs(), empty_list());
+    a = frame_eval(frame);
+    fclose(frame_alloc(frame)->tlab.out);
+    frame_alloc(frame)->tlab.out = open_memstream(&out[1], &len[1]);
+    frame_push_roots(frame, &roots);
+    b = vm_eval(frame, compile(frame, empty_list(), expr));
+    frame_pop_roots(frame, &roots);
+    fclose(frame_alloc(frame)->tlab.out);
+    frame_alloc(frame)->tlab.out = 0;
+    elem_println(frame, stdout, a);
+    if ( (! elem_eq(frame, a, b) && ! ( is_nil(a) && is_nil(b) )) || len[0] != len[1] || memcmp(out[0], out[1], len[0]) != 0 ) {
+      printf("%s differs from a plain call\n", exprs[i]);
+      status = 1;
+    }
+    free(out[0]);
+    free(out[1]);
+  }
+
+  // tasks count long enough to stop every thread for collections along the way
+  frame_alloc_stats(frame, &stats);
+  collections = stats.minor_collections;
+  frame_set(frame, sym_rhs(), reader_read(reader_root, exprs[1]));
+  frame_set(frame, sym_lhs(), empty_list());
+  a = frame_eval(frame);
+  frame_alloc_stats(frame, &stats);
+  if ( ! elem_eq(frame, a, reader_read(reader_root, ":done")) || stats.minor_collections == collections ) {
+    status = 1;
+  }
+  free_root_frame(frame);
+  free_root_frame(reader_root);
+  return status;
+}
+
+int test_eval_1() {
+  printf("-----\n");
+  return test_eval("\"hello\"");
+}
+
+int test_eval_2() {
+  printf("-----\n");
+  return test_eval("(println \"hello\")");
+}
+
+int test_eval_3() {
+  printf("-----\n");
+  return test_eval("(println \"hello\" (println \"hello\" \"world\"))");
+}
+
+int test_eval_4() {
+  printf("-----\n");
+  return test_eval("(println \"hello\" (println \"second\") (println \"hello\" \"world\"))");
+}
+
+int test_reader_1() {
+  return test_parsing("\"hello\"");
+}
+
+int test_reader_2() {
+  return test_parsing("(\"hello\")");
+}
+
+int test_reader_3() {
+  return test_parsing("(\"hello\" \"world\")");
+}
+
+int test_reader_4() {
+  return test_parsing(" ( name :sym {:a \"x\" :b ( )}\n\t\"\" ) ");
+}
+
+int test_reader_5() {
+  int status = 0;
+  struct elem *root_frame = new_root_frame();
+  char *bad[] = { "(a b", "{:a", "\"abc", "(a 1b)", "", "#(a)", "#[1 2", 0 };
+  char **s;
+  struct elem *e;
+  for(s=bad;*s!=0;++s) {
+    if ( ! is_type(reader_read(root_frame, *s), ELEM_TYPE_ERROR) ) {
+      printf("expected a read error for %s\n", *s);
+      status = 1;
+    }
+  }
+  e = reader_read(root_frame, "#(a)");
+  if ( ! is_type(e, ELEM_TYPE_ERROR) || ! elem_eq(root_frame, map_get(root_frame, e->eval.map, sym_msg()), new_string(root_frame, "Expected { or [ after #")) ) {
+    printf("wrong read error for #(a)\n");
+    status = 1;
+  }
+  // only the first len bytes are read
+  if ( ! is_type(reader_read_buf(root_frame, "(a) junk", 3), ELEM_TYPE_LIST) ) {
+    status = 1;
+  }
+  free_root_frame(root_frame);
+  return status;
+}
+
+// tokens longer than a chunk must come out of a stream the same as from memory
+int test_reader_6() {
+  int status = 0, forms = 0, i;
+  size_t len = 0, size = 3 * READER_CHUNK;
+  char *text = NEW_ARRAY(char, size + 64);
+  struct elem *root_frame = new_root_frame();
+  struct elem *a, *b;
+  struct reader mem, file, fd;
+  char path[] = "/tmp/lisp-test-XXXXXX";
+  int out = mkstemp(path);
+  FILE *in;
+
+  len += sprintf(text + len, "(a \"");
+  memset(text + len, 'x', READER_CHUNK + 10);
+  len += READER_CHUNK + 10;
+  len += sprintf(text + len, "\" :s) ");
+  memset(text + len, 'y', READER_CHUNK / 2);
+  len += READER_CHUNK / 2;
+  for(i=0;len<size;++i) {
+    len += sprintf(text + len, " {:k%c \"v\"} (b %s)", 'a' + i % 26, i % 3 ? "c" : "");
+  }
+  if ( write(out, text, len) != len ) {
+    status = 1;
+  }
+  close(out);
+  in = fopen(path, "r");
+  reader_init(&mem, root_frame, text, len);
+  reader_init_file(&file, root_frame, in);
+  reader_init_fd(&fd, root_frame, open(path, O_RDONLY));
+  unlink(path);
+  while( (a = reader_next(&mem)) != 0 ) {
+    forms++;
+    if ( is_type(a, ELEM_TYPE_ERROR) ) {
+      status = 1;
+      break;
+    }
+    b = reader_next(&file);
+    if ( b == 0 || ! elem_eq(root_frame, a, b) ) {
+      printf("stream form %d differs\n", forms);
+      status = 1;
+      break;
+    }
+    b = reader_next(&fd);
+    if ( b == 0 || ! elem_eq(root_frame, a, b) ) {
+      printf("fd form %d differs\n", forms);
+      status = 1;
+      break;
+    }
+  }
+  if ( reader_next(&file) != 0 || reader_next(&fd) != 0 || forms < 1000 ) {
+    status = 1;
+  }
+  printf("streamed %d forms\n", forms);
+
+  close(fd.fd);
+  reader_free(&file);
+  reader_free(&fd);
+  fclose(in);
+  FREE_ARRAY(text);
+  free_root_frame(root_frame);
+  return status;
+}
+
+// forms are garbage once evaluated, so the heap stays small
+int test_reader_7() {
+  int status = 0, i;
+  struct elem *root_frame = new_root_frame();
+  struct elem *reader_root = new_root_frame();
+  struct elem *value;
+  struct alloc_stats stats;
+  struct reader r;
+  FILE *tmp = tmpfile();
+
+  for(i=0;i<100000;++i) {
+    fprintf(tmp, "(chain (id \"line %d\"))\n", i);
+  }
+  rewind(tmp);
+
+  frame_set(root_frame, sym_env(), test_vm_env(root_frame, reader_root));
+  reader_init_file(&r, root_frame, tmp);
+  value = frame_load(&r);
+  frame_alloc_stats(root_frame, &stats);
+  printf("loaded: ");
+  elem_println(root_frame, stdout, value);
+  printf("allocated %lu, capacity %lu\n", stats.allocated, stats.capacity);
+  if ( ! is_type(value, ELEM_TYPE_STRING) || stats.capacity > 64 * 1024 ) {
+    status = 1;
+  }
+
+  reader_free(&r);
+  fclose(tmp);
+  free_root_frame(root_frame);
+  free_root_frame(reader_root);
+  return status;
+}
+
+// a mapped file's strings borrow from the mapping and survive collections
+int test_reader_8() {
+  int status = 0, i;
+  struct elem *root_frame = new_root_frame();
+  struct elem *reader_root = new_root_frame();
+  struct elem *value;
+  struct alloc_stats stats;
+  char path[] = "/tmp/lisp-test-XXXXXX";
+  FILE *out = fdopen(mkstemp(path), "w");
+
+  for(i=0;i<20000;++i) {
+    fprintf(out, "(chain (id \"line %d\"))\n", i);
+  }
+  fprintf(out, "(id \"last\")");
+  fclose(out);
+
+  frame_set(root_frame, sym_env(), test_vm_env(root_frame, reader_root));
+  value = frame_load_file(root_frame, path);
+  unlink(path);
+  frame_alloc_stats(root_frame, &stats);
+  printf("mapped: ");
+  elem_println(root_frame, stdout, value);
+  if ( ! is_type(value, ELEM_TYPE_STRING) || ! (value->flags & ELEM_FLAG_BORROWED) ) {
+    status = 1;
+  }
+  if ( ! sval_eq(root_frame, value, new_string(root_frame, "last")) || stats.collections == 0 ) {
+    status = 1;
+  }
+  if ( ! is_type(frame_load_file(root_frame, path), ELEM_TYPE_ERROR) ) {
+    status = 1;
+  }
+
+  free_root_frame(root_frame);
+  free_root_frame(reader_root);
+  return status;
+}
+
+// a multi MB JSON literal reads back whole, from memory, a stream and its own print
+int test_reader_9() {
+  int status = 0;
+  size_t i, len = 0, raw = 0, size = 3 << 20, printed_len;
+  char *json = NEW_ARRAY(char, size + 64);
+  char *text = NEW_ARRAY(char, 2 * size + 64);
+  char *printed;
+  char path[] = "/tmp/lisp-test-XXXXXX";
+  int fd = mkstemp(path);
+  struct elem *root_frame = new_root_frame();
+  struct elem *a, *b, *c;
+  struct reader r;
+  FILE *out;
+
+  for(i=0;raw<size;++i) {
+    raw += sprintf(json + raw, "{\"key\": \"v\\\\%zu\\\\\"},", i);
+  }
+  len += sprintf(text, "(blob \"");
+  for(i=0;i<raw;++i) {
+    if ( json[i] == '"' || json[i] == '\\' ) {
+      text[len++] = '\\';
+    }
+    text[len++] = json[i];
+  }
+  len += sprintf(text + len, "\")");
+
+  a = list_value(list_next(reader_read_buf(root_frame, text, len)));
+  if ( ! is_type(a, ELEM_TYPE_STRING) || a->sval.len != raw + 1 || memcmp(a->sval.str, json, raw) != 0 ) {
+    printf("json literal read wrong\n");
+    status = 1;
+  }
+
+  if ( write(fd, text, len) != len ) {
+    status = 1;
+  }
+  lseek(fd, 0, SEEK_SET);
+  unlink(path);
+  reader_init_fd(&r, root_frame, fd);
+  b = reader_next(&r);
+  if ( b == 0 || ! elem_eq(root_frame, list_value(list_next(b)), a) ) {
+    printf("streamed json literal differs\n");
+    status = 1;
+  }
+  reader_free(&r);
+  close(fd);
+
+  out = open_memstream(&printed, &printed_len);
+  elem_print(root_frame, out, a);
+  fclose(out);
+  c = reader_read_buf(root_frame, printed, printed_len);
+  if ( ! elem_eq(root_frame, a, c) ) {
+    printf("printed json literal differs\n");
+    status = 1;
+  }
+  printf("json literal of %zu bytes\n", raw);
+
+  free(printed);
+  FREE_ARRAY(json);
+  FREE_ARRAY(text);
+  free_root_frame(root_frame);
+  return status;
+}
+
+// buffer, FILE and fd printers print the same bytes, which read back to what was printed
+int test_reader_10() {
+  int status = 0;
+  char *bad[] = { "12x", "-1x", "99999999999999999999x", 0 };
+  char **s;
+  struct elem *root_frame = new_root_frame();
+  struct elem *a;
+  struct printer p;
+
+  a = reader_read(root_frame, "(0 12 -7 +3 - -x 4611686018427387903 -4611686018427387904)");
+  printer_init(&p);
+  elem_write(&p, a);
+  printer_putc(&p, 0);
+  printf("%s\n", p.buf);
+  if ( strcmp(p.buf, "(0 12 -7 3 - -x 4611686018427387903 -4611686018427387904)") != 0 ) {
+    status = 1;
+  }
+  if ( int_value(list_value(list_next(list_next(a)))) != -7 || ! is_type(list_value(list_next(list_next(list_next(list_next(a))))), ELEM_TYPE_IDENT) ) {
+    printf("numbers read wrong\n");
+    status = 1;
+  }
+
+  // past the fixnum range they are bigints, and back in it fixnums again
+  a = reader_read(root_frame, "(4611686018427387904 -4611686018427387905 18446744073709551616 -340282366920938463463374607431768211456 10000000000000000000000000000000000000 00004611686018427387903)");
+  p.len = 0;
+  elem_write(&p, a);
+  printer_putc(&p, 0);
+  printf("%s\n", p.buf);
+  if ( strcmp(p.buf, "(4611686018427387904 -4611686018427387905 18446744073709551616 -340282366920938463463374607431768211456 10000000000000000000000000000000000000 4611686018427387903)") != 0 ) {
+    status = 1;
+  }
+  if ( ! is_type(list_value(a), ELEM_TYPE_BIGINT) || ! is_fixnum(list_value(list_next(list_next(list_next(list_next(list_next(a))))))) ) {
+    printf("bigints read wrong\n");
+    status = 1;
+  }
+  for(s=bad;*s!=0;++s) {
+    if ( ! is_type(reader_read(root_frame, *s), ELEM_TYPE_ERROR) ) {
+      printf("expected a read error for %s\n", *s);
+      status = 1;
+    }
+  }
+  printer_free(&p);
+  free_root_frame(root_frame);
+  return status;
+}
+
+int test_printer_1() {
+  int status = 0, i, fd;
+  size_t len = 0, n, printed_len;
+  char path[] = "/tmp/lisp-test-XXXXXX";
+  char *text = NEW_ARRAY(char, 4 << 20), *printed, *back;
+  struct elem *root_frame = new_root_frame();
+  struct elem *a, *b;
+  struct printer p, q;
+  FILE *out;
+
+  printf("-----\n");
+  printer_init(&p);
+  n = elem_write(&p, reader_read(root_frame, "{:a :b :a :c}"));
+  if ( n != 7 || p.len != 7 || memcmp(p.buf, "{:a :c}", 7) != 0 ) {
+    printf("shadowed key printed\n");
+    status = 1;
+  }
+  printer_free(&p);
+
+  // escapes in a word of eight, in the bytes after the last word, and half a chunk on
+  printer_init(&p);
+  elem_write(&p, new_string(root_frame, "a\"cdefghijklmnop\\q\""));
+  memset(text, 'x', PRINTER_CHUNK);
+  text[PRINTER_CHUNK / 2] = '\\';
+  text[PRINTER_CHUNK] = 0;
+  n = elem_write(&p, new_string(root_frame, text));
+  if ( p.len != 24 + n || memcmp(p.buf, "\"a\\\"cdefghijklmnop\\\\q\\\"\"", 24) != 0 || n != PRINTER_CHUNK + 3 || p.buf[24 + PRINTER_CHUNK / 2 + 1] != '\\' ) {
+    printf("string escaped wrong\n");
+    status = 1;
+  }
+  printer_free(&p);
+
+  len += sprintf(text, "(");
+  for(i=0;i<50000;++i) {
+    len += sprintf(text + len, "(item-%c \"q\\\"%d\\\\\" {:k (x y) :s #{:t}} nil true false ())\n", 'a' + i % 26, i);
+  }
+  len += sprintf(text + len, ")");
+  a = reader_read_buf(root_frame, text, len);
+
+  printer_init(&p);
+  n = elem_write(&p, a);
+  out = open_memstream(&printed, &printed_len);
+  elem_print(root_frame, out, a);
+  fclose(out);
+  if ( n != p.len || printed_len != n || memcmp(printed, p.buf, n) != 0 ) {
+    printf("buffer and FILE printers differ\n");
+    status = 1;
+  }
+
+  fd = mkstemp(path);
+  unlink(path);
+  printer_init_fd(&q, fd);
+  elem_write(&q, a);
+  back = NEW_ARRAY(char, n);
+  if ( printer_flush(&q) != 0 || q.written != n || pread(fd, back, n, 0) != n || memcmp(back, p.buf, n) != 0 ) {
+    printf("fd printer differs\n");
+    status = 1;
+  }
+  printer_free(&q);
+  close(fd);
+
+  b = reader_read_buf(root_frame, p.buf, p.len);
+  if ( ! elem_eq(root_frame, a, b) ) {
+    printf("printed structure reads back different\n");
+    status = 1;
+  }
+  printf("printed %zu bytes\n", n);
+
+  printer_free(&p);
+  free(printed);
+  FREE_ARRAY(back);
+  FREE_ARRAY(text);
+  free_root_frame(root_frame);
+  return status;
+}
+
+int test_snapshot_1() {
+  int status = 0, i, fd;
+  size_t len = 0;
+  char path[] = "/tmp/lisp-test-XXXXXX";
+  char *text = NEW_ARRAY(char, 4 << 20), *corrupt;
+  struct elem *root_frame = new_root_frame();
+  struct elem *shared, *tail, *f, *l, *v, *a, *b;
+  struct printer p, q;
+  struct snapshot_writer w;
+  uint32_t h;
+
+  printf("-----\n");
+  shared = reader_read(root_frame, "{:k (x y) :s #{:t \"str\"}}");
+  tail = reader_read(root_frame, "(p q r -340282366920938463463374607431768211456 [1 -2] [:a [3] \"s\"] #[1 :b #[]])");
+  f = new_user_fn(root_frame, reader_read(root_frame, "(x)"), reader_read(root_frame, "x"));
+  v = alloc_list(root_frame, empty_list(), shared);
+  v = alloc_list(root_frame, v, alloc_list(root_frame, tail, new_string(root_frame, "s")));
+  v = alloc_list(root_frame, v, alloc_list(root_frame, tail, shared));
+  // fns and errors are only equal to themselves, so they are checked apart
+  l = alloc_list(root_frame, empty_list(), map_set(root_frame, empty_map(), f, intern(":v")));
+  l = alloc_list(root_frame, l, f);
+  l = alloc_list(root_frame, l, new_error(root_frame, "saved"));
+  a = alloc_list(root_frame, l, v);
+
+  printer_init(&p);
+  if ( snapshot_save(&p, a) != 0 ) {
+    printf("snapshot not saved\n");
+    status = 1;
+  }
+  b = snapshot_load(root_frame, p.buf, p.len);
+  if ( ! is_type(b, ELEM_TYPE_LIST) || ! elem_eq(root_frame, v, list_value(b)) ) {
+    printf("snapshot loads back different\n");
+    status = 1;
+  } else {
+    v = list_value(b);
+    l = list_next(b);
+    if ( list_value(list_value(v)) != list_value(list_next(list_next(v))) || list_next(list_value(v)) != list_next(list_value(list_next(v))) ) {
+      printf("shared structure loads back copied\n");
+      status = 1;
+    }
+    if ( ! is_type(list_value(l), ELEM_TYPE_ERROR) || ! elem_eq(root_frame, map_get(root_frame, list_value(l)->eval.map, sym_msg()), new_string(root_frame, "saved")) ) {
+      printf("error loads back different\n");
+      status = 1;
+    }
+    f = list_value(list_next(l));
+    if ( ! is_type(f, ELEM_TYPE_FN) || map_get(root_frame, list_value(list_next(list_next(l))), f) != intern(":v") ) {
+      printf("fn key not found after load\n");
+      status = 1;
+    }
+  }
+  if ( ! is_type(snapshot_load(root_frame, p.buf, p.len - 1), ELEM_TYPE_ERROR) ) {
+    printf("truncated snapshot loaded\n");
+    status = 1;
+  }
+  corrupt = NEW_ARRAY(char, p.len);
+  memcpy(corrupt, p.buf, p.len);
+  corrupt[p.len - SNAPSHOT_TRAILER - 1] = (char)0xff;
+  if ( ! is_type(snapshot_load(root_frame, corrupt, p.len), ELEM_TYPE_ERROR) ) {
+    printf("corrupt snapshot loaded\n");
+    status = 1;
+  }
+  FREE_ARRAY(corrupt);
+  printer_free(&p);
+
+  // (1 2) with its last value made a null, then nil, leaving an int for the tail
+  printer_init(&p);
+  snapshot_save(&p, reader_read(root_frame, "(1 2)"));
+  for(i=SNAPSHOT_NULL;i<=SNAPSHOT_NIL;++i) {
+    p.buf[SNAPSHOT_MAGIC_LEN + 4] = (char)i;
+    if ( ! is_type(snapshot_load(root_frame, p.buf, p.len), ELEM_TYPE_ERROR) ) {
+      printf("list of bad value or tail %d loaded\n", i);
+      status = 1;
+    }
+  }
+  printer_free(&p);
+
+  // hand made maps of one entry, with a key at the bit its hash gives or the next
+  h = elem_hash(root_frame, new_int(root_frame, 0)) & MAP_MASK;
+  for(i=0;i<7;++i) {
+    printer_init(&p);
+    memset(&w, 0, sizeof(w));
+    w.p = &p;
+    printer_write(&p, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+    snapshot_byte(&w, SNAPSHOT_MAP);
+    snapshot_varint(&w, i == 1 ? 2 : 1);
+    snapshot_byte(&w, SNAPSHOT_NODE);
+    switch(i) {
+    case 0: // as map_set would make it
+    case 1: // with the wrong count
+    case 2: // at the wrong bit
+      snapshot_varint(&w, 1u << (i == 2 ? (h + 1) & MAP_MASK : h));
+      snapshot_varint(&w, 0);
+      snapshot_varint(&w, 2);
+      snapshot_byte(&w, SNAPSHOT_INT);
+      snapshot_varint(&w, 0);
+      snapshot_byte(&w, i == 0 ? SNAPSHOT_TRUE : SNAPSHOT_FALSE);
+      break;
+    case 3: // a sub node that is not a node
+      snapshot_varint(&w, 0);
+      snapshot_varint(&w, 1u << h);
+      snapshot_varint(&w, 1);
+      snapshot_byte(&w, SNAPSHOT_TRUE);
+      break;
+    case 4: // a sub node that is itself
+      snapshot_varint(&w, 0);
+      snapshot_varint(&w, 1u << h);
+      snapshot_varint(&w, 1);
+      snapshot_byte(&w, SNAPSHOT_REF);
+      snapshot_varint(&w, 1);
+      break;
+    case 5: // a collision node at the top
+      snapshot_varint(&w, 0);
+      snapshot_varint(&w, 0);
+      snapshot_varint(&w, 2);
+      snapshot_byte(&w, SNAPSHOT_INT);
+      snapshot_varint(&w, 0);
+      snapshot_byte(&w, SNAPSHOT_TRUE);
+      break;
+    case 6: // a null value
+      snapshot_varint(&w, 1u << h);
+      snapshot_varint(&w, 0);
+      snapshot_varint(&w, 2);
+      snapshot_byte(&w, SNAPSHOT_INT);
+      snapshot_varint(&w, 0);
+      snapshot_byte(&w, SNAPSHOT_NULL);
+      break;
+    }
+    snapshot_u64(&w, 2);
+    snapshot_u64(&w, 0);
+    // only a checked load hashes the key to find it at the wrong bit
+    v = i == 2 ? snapshot_load_checked(root_frame, p.buf, p.len) : snapshot_load(root_frame, p.buf, p.len);
+    if ( i == 0 ? map_get(root_frame, v, new_int(root_frame, 0)) != true_value() : ! is_type(v, ELEM_TYPE_ERROR) ) {
+      printf("hand made map %d loads wrong\n", i);
+      status = 1;
+    }
+    printer_free(&p);
+  }
+
+  // hand made small maps, as map_set makes them, with a key twice, and ending on a key
+  for(i=0;i<3;++i) {
+    printer_init(&p);
+    memset(&w, 0, sizeof(w));
+    w.p = &p;
+    printer_write(&p, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+    snapshot_byte(&w, SNAPSHOT_MAP);
+    snapshot_varint(&w, i == 1 ? 2 : 1);
+    snapshot_byte(&w, SNAPSHOT_LIST);
+    snapshot_varint(&w, i == 0 ? 2 : i == 1 ? 4 : 3);
+    snapshot_byte(&w, SNAPSHOT_INT);
+    snapshot_varint(&w, 0);
+    snapshot_byte(&w, SNAPSHOT_TRUE);
+    if ( i > 0 ) {
+      snapshot_byte(&w, SNAPSHOT_INT);
+      snapshot_varint(&w, 0);
+    }
+    if ( i == 1 ) {
+      snapshot_byte(&w, SNAPSHOT_FALSE);
+    }
+    snapshot_byte(&w, SNAPSHOT_EMPTY_LIST);
+    snapshot_u64(&w, 1);
+    snapshot_u64(&w, i == 0 ? 2 : i == 1 ? 4 : 3);
+    // only a checked load compares the keys to find the one there twice
+    v = i == 1 ? snapshot_load_checked(root_frame, p.buf, p.len) : snapshot_load(root_frame, p.buf, p.len);
+    if ( i == 0 ? map_get(root_frame, v, new_int(root_frame, 0)) != true_value() : ! is_type(v, ELEM_TYPE_ERROR) ) {
+      printf("hand made small map %d loads wrong\n", i);
+      status = 1;
+    }
+    printer_free(&p);
+  }
+
+  // a list whose tail is its own pair
+  printer_init(&p);
+  memset(&w, 0, sizeof(w));
+  w.p = &p;
+  printer_write(&p, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+  snapshot_byte(&w, SNAPSHOT_LIST);
+  snapshot_varint(&w, 1);
+  snapshot_byte(&w, SNAPSHOT_TRUE);
+  snapshot_byte(&w, SNAPSHOT_REF_PAIR);
+  snapshot_varint(&w, 0);
+  snapshot_u64(&w, 0);
+  snapshot_u64(&w, 1);
+  if ( ! is_type(snapshot_load(root_frame, p.buf, p.len), ELEM_TYPE_ERROR) ) {
+    printf("list with a cycle loaded\n");
+    status = 1;
+  }
+  printer_free(&p);
+
+  // and a vector that holds itself
+  printer_init(&p);
+  memset(&w, 0, sizeof(w));
+  w.p = &p;
+  printer_write(&p, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+  snapshot_byte(&w, SNAPSHOT_VECTOR);
+  snapshot_varint(&w, VECTOR_ELEMS);
+  snapshot_varint(&w, 1);
+  snapshot_byte(&w, SNAPSHOT_REF);
+  snapshot_varint(&w, 0);
+  snapshot_u64(&w, 1);
+  snapshot_u64(&w, 0);
+  if ( ! is_type(snapshot_load(root_frame, p.buf, p.len), ELEM_TYPE_ERROR) ) {
+    printf("vector with a cycle loaded\n");
+    status = 1;
+  }
+  printer_free(&p);
+  // what the corrupt loads took has to sweep cleanly
+  frame_collect(root_frame);
+
+  printer_init(&p);
+  if ( snapshot_save(&p, alloc_list(root_frame, empty_list(), new_fn(root_frame, builtin_arg))) != -1 ) {
+    printf("builtin fn saved\n");
+    status = 1;
+  }
+  printer_free(&p);
+
+  len += sprintf(text, "(");
+  for(i=0;i<50000;++i) {
+    len += sprintf(text + len, "(item-%c \"q\\\"%d\\\\\" {:k (x y) :s #{:t}} nil true false ())\n", 'a' + i % 26, i);
+  }
+  len += sprintf(text + len, ")");
+  a = reader_read_buf(root_frame, text, len);
+  fd = mkstemp(path);
+  printer_init_fd(&q, fd);
+  if ( snapshot_save(&q, a) != 0 || printer_flush(&q) != 0 ) {
+    printf("snapshot not written\n");
+    status = 1;
+  }
+  close(fd);
+  b = frame_load_snapshot(root_frame, path);
+  unlink(path);
+  if ( ! elem_eq(root_frame, a, b) ) {
+    printf("snapshot file loads back different\n");
+    status = 1;
+  }
+  printf("snapshot of %zu text bytes is %zu bytes\n", len, q.written);
+
+  printer_free(&q);
+  FREE_ARRAY(text);
+  free_root_frame(root_frame);
+  return status;
+}
+
+// association list in the style of the old linked map, for comparison
+struct elem *alist_set(struct elem *frame, struct elem *l, struct elem *k, struct elem *v) {
+  return alloc_list(frame, l, alloc_list(frame, v, k));
+}
+
+struct elem *alist_get(struct elem *frame, struct elem *l, struct elem *k) {
+  while( ! list_is_empty(l) ) {
+    if ( elem_eq(frame, list_value(list_value(l)), k) ) {
+      return list_next(list_value(l));
+    }
+    l = list_next(l);
+  }
+  return nil();
+}
+
+void bench_map(int n) {
+  struct elem *root_frame = new_root_frame();
+  struct elem *frame = root_frame;
+  struct elem *m = empty_map(), *l = empty_list();
+  struct elem **keys = NEW_ARRAY(struct elem *, n);
+  int i, r, lookups = 100000, list_lookups = lookups, builds = n < lookups ? lookups / n : 1;
+  uint64_t start, map_set_ns, map_get_ns, list_set_ns, list_get_ns;
+
+  for(i=0;i<n;++i) {
+    keys[i] = new_int(frame, i);
+  }
+
+  // small maps are built over and over, so one build's first touches do not swamp them
+  start = now_ns();
+  for(r=0;r<builds;++r) {
+    m = empty_map();
+    for(i=0;i<n;++i) {
+      m = map_set(frame, m, keys[i], keys[i]);
+    }
+  }
+  map_set_ns = (now_ns() - start) / builds;
+  start = now_ns();
+  for(i=0;i<lookups;++i) {
+    map_get(frame, m, keys[(i * 7919) % n]);
+  }
+  map_get_ns = now_ns() - start;
+
+  if ( (uint64_t)list_lookups * n > 100000000 ) {
+    list_lookups = 100000000 / n;
+  }
+  start = now_ns();
+  for(r=0;r<builds;++r) {
+    l = empty_list();
+    for(i=0;i<n;++i) {
+      l = alist_set(frame, l, keys[i], keys[i]);
+    }
+  }
+  list_set_ns = (now_ns() - start) / builds;
+  start = now_ns();
+  for(i=0;i<list_lookups;++i) {
+    alist_get(frame, l, keys[(i * 7919) % n]);
+  }
+  list_get_ns = now_ns() - start;
+
+  printf("map %6d keys: hamt set %7.1f ns get %7.1f ns, list set %7.1f ns get %10.1f ns\n",
+    n, (double)map_set_ns / n, (double)map_get_ns / lookups,
+    (double)list_set_ns / n, (double)list_get_ns / list_lookups);
+
+  FREE_ARRAY(keys);
+  free_root_frame(root_frame);
+}
+
+void bench_frame_eval(int depth, int runs) {
+  char expr[8192];
+  int  i, tail = 0, saved, devnull;
+  struct elem *root_frame = new_root_frame();
+  struct elem *reader_root = new_root_frame();
+  struct elem *frame = root_frame;
+  struct elem *env = empty_map();
+  struct elem *value;
+  struct alloc_stats before, after;
+  uint64_t start, elapsed;
+
+  for(i=0;i<depth;++i) {
+    tail += sprintf(expr + tail, "(println ");
+  }
+  tail += sprintf(expr + tail, "\"x\"");
+  for(i=0;i<depth;++i) {
+    tail += sprintf(expr + tail, ")");
+  }
+  value = reader_read(reader_root, expr);
+  env = map_set(frame, env, sym_println(), new_fn(frame, builtin_println));
+  frame_set(frame, sym_env(), env);
+
+  fflush(stdout);
+  saved = dup(1);
+  devnull = open("/dev/null", O_WRONLY);
+  dup2(devnull, 1);
+
+  frame_alloc_stats(root_frame, &before);
+  start = now_ns();
+  for(i=0;i<runs;++i) {
+    frame = root_frame;
+    frame = frame_set(frame, sym_rhs(), value);
+    frame = frame_set(frame, sym_lhs(), empty_list());
+    frame_eval(frame);
+  }
+  elapsed = now_ns() - start;
+  frame_alloc_stats(root_frame, &after);
+
+  fflush(stdout);
+  dup2(saved, 1);
+  close(saved);
+  close(devnull);
+
+  printf("frame_eval println depth %d: %.2f cells/step, %.1f ns/step, %lu collections\n",
+    depth, 
+    (double)(after.allocated - before.allocated) / (after.safepoints - before.safepoints),
+    (double)elapsed / (after.safepoints - before.safepoints),
+    after.collections - before.collections);
+
+  free_root_frame(root_frame);
+  free_root_frame(reader_root);
+}
+
+void bench_vm(char *text, int runs) {
+  struct elem *root_frame = new_root_frame();
+  struct elem *reader_root = new_root_frame();
+  struct elem *frame = root_frame;
+  struct elem *expr, *code;
+  uint64_t start, tree_ns, vm_ns;
+  int i;
+
+  frame_set(frame, sym_env(), test_vm_env(frame, reader_root));
+  expr = reader_read(reader_root, text);
+
+  start = now_ns();
+  for(i=0;i<runs;++i) {
+    frame_set(frame, sym_rhs(), expr);
+    frame_set(frame, sym_lhs(), empty_list());
+    frame_eval(frame);
+  }
+  tree_ns = now_ns() - start;
+
+  code = compile(frame, empty_list(), expr);
+  start = now_ns();
+  for(i=0;i<runs;++i) {
+    vm_eval(frame, code);
+  }
+  vm_ns = now_ns() - start;
+
+  printf("%s: frame_eval %.1f ns, vm %.1f ns, %.1fx\n", text,
+    (double)tree_ns / runs, (double)vm_ns / runs, (double)tree_ns / vm_ns);
+
+  free_root_frame(root_frame);
+  free_root_frame(reader_root);
+}
+
+// a summing loop of three natives and a tail call per step, against C
+void bench_arith(int n) {
+  struct elem *root_frame = new_root_frame();
+  struct elem *reader_root = new_root_frame();
+  struct elem *frame = root_frame;
+  struct elem *env, *expr, *a, *b;
+  uint64_t start, tree_ns, vm_ns, c_ns;
+  volatile int64_t sum = 0;
+  int i;
+
+  env = test_vm_env(frame, reader_root);
+  env = map_set(frame, env, intern("sum"), new_user_fn(frame, reader_read(reader_root, "(n acc)"),
+    reader_read(reader_root, "(if (= n 0) acc (sum (- n 1) (+ acc n)))")));
+  env = map_set(frame, env, intern("n"), new_int(frame, n));
+  frame_set(frame, sym_env(), env);
+  expr = reader_read(reader_root, "(sum n 0)");
+
+  start = now_ns();
+  frame_set(frame, sym_rhs(), expr);
+  frame_set(frame, sym_lhs(), empty_list());
+  a = frame_eval(frame);
+  tree_ns = now_ns() - start;
+
+  start = now_ns();
+  b = vm_eval(frame, compile(frame, empty_list(), expr));
+  vm_ns = now_ns() - start;
+
+  start = now_ns();
+  for(i=n;i!=0;--i) {
+    sum += i;
+  }
+  c_ns = now_ns() - start;
+
+  printf("sum to %d: %s, frame_eval %.1f ns, vm %.1f ns, c %.1f ns per step\n", n,
+    a == b && int_value(b) == sum ? "same" : "different",
+    (double)tree_ns / n, (double)vm_ns / n, (double)c_ns / n);
+
+  free_root_frame(root_frame);
+  free_root_frame(reader_root);
+}
+
+/*
+ * Factorial of n by a tail recursive user fn, whose product soon leaves
+ * the fixnums; then the same product squared by Karatsuba and by the
+ * schoolbook method; then a sum whose accumulator starts past the
+ * fixnums, so each step is a bigint add.
+ */
+void bench_bigint(int n, int steps) {
+  struct elem *root_frame = new_root_frame();
+  struct elem *reader_root = new_root_frame();
+  struct elem *frame = root_frame;
+  struct elem *env, *a, *b;
+  uint64_t start, tree_ns, vm_ns, print_ns, kara_ns, school_ns, *r1, *r2;
+  struct printer p, q;
+  uint32_t len;
+
+  env = test_vm_env(frame, reader_root);
+  env = map_set(frame, env, intern("fact"), new_user_fn(frame, reader_read(reader_root, "(n acc)"),
+    reader_read(reader_root, "(if (= n 0) acc (fact (- n 1) (* acc n)))")));
+  env = map_set(frame, env, intern("sum"), new_user_fn(frame, reader_read(reader_root, "(n acc)"),
+    reader_read(reader_root, "(if (= n 0) acc (sum (- n 1) (+ acc n)))")));
+  env = map_set(frame, env, intern("n"), new_int(frame, n));
+  env = map_set(frame, env, intern("steps"), new_int(frame, steps));
+  frame_set(frame, sym_env(), env);
+
+  start = now_ns();
+  frame_set(frame, sym_rhs(), reader_read(reader_root, "(fact n 1)"));
+  frame_set(frame, sym_lhs(), empty_list());
+  a = frame_eval(frame);
+  tree_ns = now_ns() - start;
+  // a is not a root, so it is compared in print
+  printer_init(&q);
+  elem_write(&q, a);
+  start = now_ns();
+  b = vm_eval(frame, compile(frame, empty_list(), reader_read(reader_root, "(fact n 1)")));
+  vm_ns = now_ns() - start;
+
+  printer_init(&p);
+  start = now_ns();
+  elem_write(&p, b);
+  print_ns = now_ns() - start;
+
+  len = b->bval.len;
+  r1 = NEW_ARRAY(uint64_t, 2 * len);
+  r2 = NEW_ARRAY(uint64_t, 2 * len);
+  start = now_ns();
+  mag_mul(r1, b->bval.limbs, len, b->bval.limbs, len);
+  kara_ns = now_ns() - start;
+  start = now_ns();
+  mag_mul_school(r2, b->bval.limbs, len, b->bval.limbs, len);
+  school_ns = now_ns() - start;
+
+  printf("factorial %d: %zu digits, %s, frame_eval %.1f ms, vm %.1f ms, printing %.1f ms\n", n, p.written,
+    p.len == q.len && memcmp(p.buf, q.buf, p.len) == 0 ? "same" : "different", tree_ns / 1e6, vm_ns / 1e6, print_ns / 1e6);
+  printer_free(&p);
+  printer_free(&q);
+  printf("squaring it, %u limbs: karatsuba %.2f ms, schoolbook %.2f ms, %s\n", len, kara_ns / 1e6, school_ns / 1e6,
+    memcmp(r1, r2, (size_t)2 * len * sizeof(uint64_t)) == 0 ? "same" : "different");
+  FREE_ARRAY(r1);
+  FREE_ARRAY(r2);
+
+  start = now_ns();
+  a = vm_eval(frame, compile(frame, empty_list(), reader_read(reader_root, "(sum steps 100000000000000000000000000000)")));
+  vm_ns = now_ns() - start;
+  printf("bigint sum to %d: ", steps);
+  elem_print(frame, stdout, a);
+  printf(", vm %.1f ns per step\n", (double)vm_ns / steps);
+
+  free_root_frame(root_frame);
+  free_root_frame(reader_root);
+}
+
+// op 0 to 3 of kernels k on n items, reps times over
+void bench_vector_op(const struct vector_kernels *k, int op, int64_t *x, int64_t *y, int64_t *r, uint32_t n, int reps, __int128 *out) {
+  int64_t min, max;
+  for(;reps>0;--reps) {
+    switch(op) {
+    case 0:
+      *out += k->sum(x, n);
+      break;
+    case 1:
+      *out += k->add(r, x, y, n);
+      break;
+    case 2:
+      *out += k->dot(x, y, n);
+      break;
+    default:
+      k->minmax(x, n, &min, &max);
+      *out += max - min;
+    }
+  }
+}
+
+/*
+ * Bulk work over int vectors, through the machine's kernels and through
+ * the plain loops, as bytes read per second. Each is the best of five runs
+ * taking turns, once over items that stay in the caches and once over n,
+ * which is too big for them. The builtins are called directly, so the
+ * last line is the kernels and the result's allocation alone.
+ */
+void bench_vector(uint32_t n) {
+  struct elem *root_frame = new_root_frame();
+  struct elem *frame = root_frame;
+  const struct vector_kernels *kernels[2] = { vector_kernels(), &vector_scalar_kernels };
+  const char *names[2] = { kernels[0] == &vector_scalar_kernels ? "scalar" : "avx2", "scalar" };
+  int64_t *x = NEW_ARRAY(int64_t, n), *y = NEW_ARRAY(int64_t, n), *r = NEW_ARRAY(int64_t, n), min[2], max[2];
+  uint64_t seed = 88172645463325252ull, start, ns[2][4];
+  uint32_t sizes[2] = { 4096, n }, i, m;
+  double bytes[4] = { 8, 24, 16, 8 };
+  struct elem *args[3];
+  __int128 out = 0;
+  int k, op, run, reps;
+
+  for(i=0;i<n;++i) {
+    x[i] = (int64_t)test_limb(&seed) >> 34;
+    y[i] = (int64_t)(seed >> 40) - (1 << 23);
+    r[i] = i; // faults the pages in before they are timed
+  }
+  for(i=0;i<2;++i) {
+    m = sizes[i];
+    reps = m < n ? n / m : 1;
+    for(op=0;op<4;++op) {
+      ns[0][op] = ns[1][op] = UINT64_MAX;
+      for(run=0;run<5;++run) {
+        for(k=0;k<2;++k) {
+          start = now_ns();
+          bench_vector_op(kernels[k], op, x, y, r, m, reps, &out);
+          start = now_ns() - start;
+          ns[k][op] = start < ns[k][op] ? start : ns[k][op];
+        }
+      }
+    }
+    for(k=0;k<2;++k) {
+      printf("%u ints, %s: sum %.0f MB/s, map + %.0f MB/s, dot %.0f MB/s, min/max %.0f MB/s\n", m, names[k],
+        bytes[0] * m * reps * 1e3 / ns[k][0], bytes[1] * m * reps * 1e3 / ns[k][1],
+        bytes[2] * m * reps * 1e3 / ns[k][2], bytes[3] * m * reps * 1e3 / ns[k][3]);
+    }
+  }
+  for(k=0;k<2;++k) {
+    kernels[k]->minmax(x, n, &min[k], &max[k]);
+  }
+  printf("kernels %s\n", kernels[0]->sum(x, n) == vector_sum_scalar(x, n) && kernels[0]->dot(x, y, n) == vector_dot_scalar(x, y, n)
+    && min[0] == min[1] && max[0] == max[1] ? "agree" : "disagree");
+
+  args[0] = new_vector(frame, VECTOR_INTS, x, n);
+  args[1] = new_vector(frame, VECTOR_INTS, y, n);
+  start = now_ns();
+  args[2] = native_sum(frame, args, 1);
+  ns[0][0] = now_ns() - start;
+  args[2] = new_native(frame, native_add);
+  start = now_ns();
+  args[2] = native_map(frame, (struct elem *[]){ args[2], args[0], args[1] }, 3);
+  ns[0][1] = now_ns() - start;
+  printf("builtins: sum %.1f ms, map + %.1f ms with its new vector\n", ns[0][0] / 1e6, ns[0][1] / 1e6);
+
+  FREE_ARRAY(r);
+  free_root_frame(root_frame);
+}
+
+/*
+ * Persistent vector operations on n items against what an update costs
+ * when it copies a contiguous vector.
+ */
+void bench_pvec(uint32_t n, uint32_t ops) {
+  struct elem *root_frame = new_root_frame();
+  struct elem *frame = root_frame;
+  struct elem *v = new_pvec(frame, 0, 0, nil(), nil()), *w = v, **items = NEW_ARRAY(struct elem *, n), **copy = NEW_ARRAY(struct elem *, n);
+  struct pvec_builder b = { 0, 0, 0 };
+  uint64_t seed = 88172645463325252ull, start, ns[6], sum = 0;
+  uint32_t i, from, to;
+
+  start = now_ns();
+  for(i=0;i<n;++i) {
+    v = pvec_conj(frame, v, ELEM_FIXNUM(i));
+  }
+  ns[0] = now_ns() - start;
+  start = now_ns();
+  for(i=0;i<n;++i) {
+    pvec_builder_add(&b, ELEM_FIXNUM(i));
+  }
+  w = pvec_builder_finish(frame, &b);
+  ns[1] = now_ns() - start;
+  start = now_ns();
+  for(i=0;i<ops;++i) {
+    sum += int_value(pvec_item(v, test_limb(&seed) % n));
+  }
+  ns[2] = now_ns() - start;
+  start = now_ns();
+  for(i=0;i<ops;++i) {
+    w = pvec_assoc(frame, w, test_limb(&seed) % n, ELEM_FIXNUM(i));
+  }
+  ns[3] = now_ns() - start;
+  start = now_ns();
+  for(i=0;i<ops;++i) {
+    from = test_limb(&seed) % n;
+    to = from + test_limb(&seed) % (n - from);
+    sum += pvec_slice(frame, v, from, to)->pval.count;
+  }
+  ns[4] = now_ns() - start;
+  start = now_ns();
+  for(i=0;i<ops;++i) {
+    from = test_limb(&seed) % n;
+    to = test_limb(&seed) % n;
+    sum += pvec_concat(frame, pvec_slice(frame, v, 0, from), pvec_slice(frame, v, to, n))->pval.count;
+  }
+  ns[5] = now_ns() - start;
+  printf("pvec %u items: conj %.0f ns, built %.1f ns/item, nth %.0f ns, assoc %.0f ns, subvec %.0f ns, subvecs joined %.0f ns (%lu)\n",
+    n, (double)ns[0] / n, (double)ns[1] / n, (double)ns[2] / ops, (double)ns[3] / ops, (double)ns[4] / ops, (double)ns[5] / ops, sum);
+
+  for(i=0;i<n;++i) {
+    items[i] = ELEM_FIXNUM(i);
+  }
+  start = now_ns();
+  for(i=0;i<100;++i) {
+    memcpy(copy, items, (size_t)n * sizeof(struct elem *));
+    copy[test_limb(&seed) % n] = ELEM_FIXNUM(i);
+    sum += int_value(copy[test_limb(&seed) % n]);
+  }
+  ns[0] = now_ns() - start;
+  printf("copying the %u items for an update instead: %.0f ns (%lu)\n", n, (double)ns[0] / 100, sum);
+
+  FREE_ARRAY(items);
+  FREE_ARRAY(copy);
+  free_root_frame(root_frame);
+}
+
+/*
+ * A log buffer of size bytes split into lines and searched, the lines
+ * joined back up into a rope a line at a time, and the rope indexed and
+ * printed. Appending by copying the whole string is timed for a hundredth
+ * of the lines to compare with.
+ */
+void bench_string(size_t size) {
+  struct elem *root_frame = new_root_frame();
+  struct elem *frame = root_frame;
+  char *text = NEW_ARRAY(char, size + 128), *copy = 0, *grown;
+  struct elem *log, *lines, *l, *rope;
+  uint64_t seed = 88172645463325252ull, start, ns[6], sum = 0;
+  size_t len = 0, copied = 0;
+  uint32_t n = 0, i;
+  int64_t at;
+  struct printer p;
+
+  while( len < size ) {
+    len += sprintf(text + len, "2026-10-17 12:%02u:%02u host-%u GET /item/%u %u\n", n / 60 % 60, n % 60, n % 97, n, n % 50 == 0 ? 500 : 200);
+    n++;
+  }
+  log = new_string_len(frame, text, len, ELEM_TYPE_STRING);
+  start = now_ns();
+  lines = native_split(frame, (struct elem *[]){ log, new_string(frame, "\n") }, 2);
+  ns[0] = now_ns() - start;
+  start = now_ns();
+  for(at=0;(at=string_index_of(log, " 500", 4, at))>=0;++at) {
+    sum++;
+  }
+  ns[1] = now_ns() - start;
+  rope = new_string(frame, "");
+  start = now_ns();
+  for(l=lines;!list_is_empty(l);l=list_next(l)) {
+    rope = string_join(frame, rope, list_value(l));
+  }
+  ns[2] = now_ns() - start;
+  start = now_ns();
+  for(i=0;i<1000000;++i) {
+    sum += string_byte_at(rope, test_limb(&seed) % string_len(rope));
+  }
+  ns[3] = now_ns() - start;
+  printer_init(&p);
+  start = now_ns();
+  string_write(&p, rope);
+  ns[4] = now_ns() - start;
+  printer_free(&p);
+  start = now_ns();
+  for(l=lines,i=0;i<n/100;l=list_next(l),++i) {
+    grown = NEW_ARRAY(char, copied + string_len(list_value(l)) + 1);
+    memcpy(grown, copy ? copy : "", copied);
+    memcpy(grown + copied, list_value(l)->sval.str, string_len(list_value(l)));
+    copied += string_len(list_value(l));
+    FREE_ARRAY(copy);
+    copy = grown;
+  }
+  ns[5] = now_ns() - start;
+  printf("string %zu bytes, %u lines: split %.0f MB/s, index-of %.0f MB/s, appended %.0f ns/line at depth %u, nth %.0f ns, printed %.0f MB/s (%lu)\n",
+    len, n, len / (ns[0] / 1e3), len / (ns[1] / 1e3), (double)ns[2] / n, string_depth(rope), ns[3] / 1e6, len / (ns[4] / 1e3), sum);
+  printf("appending by copying instead: %.0f ns/line over the first %u lines\n", (double)ns[5] / (n / 100), n / 100);
+
+  FREE_ARRAY(copy);
+  FREE_ARRAY(text);
+  free_root_frame(root_frame);
+}
+
+// a list of about size bytes of small entries, for the reader, printer and snapshot benches
+char *bench_text(size_t size, size_t *len) {
+  static char *names[] = { "entry", "point", "value", "next-item", "ok?" };
+  char *text = NEW_ARRAY(char, size + 128);
+  size_t i;
+  *len = 0;
+  text[(*len)++] = '(';
+  for(i=0;*len<size;++i) {
+    *len += sprintf(text + *len, "(%s :key \"value %zu\" {:a %s :b \"c\"})\n", 
+      names[i % 5], i, names[(i / 5) % 5]);
+  }
+  text[(*len)++] = ')';
+  text[*len] = 0;
+  return text;
+}
+
+void bench_reader(size_t size) {
+  struct elem *root_frame = new_root_frame();
+  struct alloc_stats before, after;
+  size_t len, i, opens = 0;
+  char *text = bench_text(size, &len);
+  uint64_t start, read_ns, borrow_ns, scan_ns;
+  struct elem *value;
+  struct reader r;
+
+  start = now_ns();
+  for(i=0;i<len;++i) {
+    opens += text[i] == '(';
+  }
+  scan_ns = now_ns() - start;
+
+  frame_alloc_stats(root_frame, &before);
+  start = now_ns();
+  value = reader_read_buf(root_frame, text, len);
+  read_ns = now_ns() - start;
+  frame_alloc_stats(root_frame, &after);
+
+  reader_init(&r, root_frame, text, len);
+  r.borrow = 1;
+  start = now_ns();
+  elem_read(&r);
+  borrow_ns = now_ns() - start;
+
+  printf("reader %.1f MB: %s, %.1f MB/s, borrowed %.1f MB/s, %.2f cells/byte, byte scan %.1f MB/s (%zu lists)\n",
+    (double)len / 1e6, is_type(value, ELEM_TYPE_LIST) ? "list" : "error",
+    (double)len * 1e3 / read_ns, (double)len * 1e3 / borrow_ns,
+    (double)(after.allocated - before.allocated) / len,
+    (double)len * 1e3 / scan_ns, opens);
+
+  FREE_ARRAY(text);
+  free_root_frame(root_frame);
+}
+
+/*
+ * Reading size bytes of text, against loading a snapshot of what it reads
+ * from memory and from a mapped file.
+ */
+void bench_snapshot(size_t size) {
+  struct elem *root_frame = new_root_frame();
+  char path[] = "/tmp/lisp-bench-XXXXXX";
+  size_t len;
+  char *text = bench_text(size, &len);
+  uint64_t start, read_ns, load_ns, file_ns;
+  struct elem *value, *loaded, *mapped;
+  struct printer p;
+  int fd = mkstemp(path);
+
+
+  start = now_ns();
+  value = reader_read_buf(root_frame, text, len);
+  read_ns = now_ns() - start;
+
+  printer_init(&p);
+  snapshot_save(&p, value);
+  if ( write(fd, p.buf, p.len) != p.len ) {
+    printf("write failed\n");
+  }
+  close(fd);
+
+  start = now_ns();
+  loaded = snapshot_load(root_frame, p.buf, p.len);
+  load_ns = now_ns() - start;
+
+  start = now_ns();
+  mapped = frame_load_snapshot(root_frame, path);
+  file_ns = now_ns() - start;
+  unlink(path);
+
+  printf("snapshot %.1f MB of %.1f MB text: %s, read %.1f ms, load %.1f ms (%.1fx), mapped file %.1f ms (%.1fx)\n",
+    (double)p.len / 1e6, (double)len / 1e6,
+    elem_eq(root_frame, value, loaded) && elem_eq(root_frame, value, mapped) ? "same" : "different",
+    read_ns / 1e6, load_ns / 1e6, (double)read_ns / load_ns, file_ns / 1e6, (double)read_ns / file_ns);
+
+  printer_free(&p);
+  FREE_ARRAY(text);
+  free_root_frame(root_frame);
+}
+
+// printing a structure read from size bytes, against writing the same bytes out in one go
+void bench_print(size_t size) {
+  struct elem *root_frame = new_root_frame();
+  char path[] = "/tmp/lisp-bench-XXXXXX";
+  size_t len;
+  char *text = bench_text(size, &len);
+  uint64_t start, buf_ns, fd_ns, raw_ns;
+  struct elem *value;
+  struct printer p, q;
+  int fd = mkstemp(path);
+
+  unlink(path);
+  value = reader_read_buf(root_frame, text, len);
+
+  printer_init(&p);
+  start = now_ns();
+  elem_write(&p, value);
+  buf_ns = now_ns() - start;
+
+  printer_init_fd(&q, fd);
+  start = now_ns();
+  elem_write(&q, value);
+  printer_flush(&q);
+  fd_ns = now_ns() - start;
+
+  lseek(fd, 0, SEEK_SET);
+  start = now_ns();
+  if ( write(fd, p.buf, p.len) != p.len ) {
+    printf("write failed\n");
+  }
+  raw_ns = now_ns() - start;
+
+  printf("printer %.1f MB: buffer %.1f MB/s, fd %.1f MB/s, raw write %.1f MB/s\n",
+    (double)p.len / 1e6, (double)p.len * 1e3 / buf_ns, (double)q.written * 1e3 / fd_ns,
+    (double)p.len * 1e3 / raw_ns);
+
+  close(fd);
+  printer_free(&p);
+  printer_free(&q);
+  FREE_ARRAY(text);
+  free_root_frame(root_frame);
+}
+
+void bench_list(int n, int walks) {
+  struct elem *root_frame = new_root_frame();
+  struct elem *l = empty_list(), *p;
+  struct alloc_stats before, after;
+  uint64_t start, walk_ns, sum = 0;
+  int i;
+
+  frame_alloc_stats(root_frame, &before);
+  for(i=0;i<n;++i) {
+    l = alloc_list(root_frame, l, new_int(root_frame, i));
+  }
+  frame_alloc_stats(root_frame, &after);
+
+  start = now_ns();
+  for(i=0;i<walks;++i) {
+    for(p=l;!list_is_empty(p);p=list_next(p)) {
+      sum += int_value(list_value(p));
+    }
+  }
+  walk_ns = now_ns() - start;
+
+  printf("list %d conses: %.1f bytes/cons, walk %.2f ns/cons (sum %lu)\n",
+    n, (double)(after.bytes - before.bytes) / n,
+    (double)walk_ns / ((uint64_t)n * walks), sum);
+
+  free_root_frame(root_frame);
+}
+
+void bench_set(int n) {
+  struct elem *root_frame = new_root_frame();
+  struct elem *frame = root_frame;
+  struct elem *a = empty_set(), *b = empty_set(), *x, *u, *d;
+  uint64_t start, build_ns, inter_ns, union_ns, diff_ns;
+  int i;
+
+  start = now_ns();
+  for(i=0;i<n;++i) {
+    a = set_add(frame, a, new_int(frame, i));
+    b = set_add(frame, b, new_int(frame, i + n / 2));
+  }
+  build_ns = now_ns() - start;
+  start = now_ns();
+  x = set_intersection(frame, a, b);
+  inter_ns = now_ns() - start;
+  start = now_ns();
+  u = set_union(frame, a, b);
+  union_ns = now_ns() - start;
+  start = now_ns();
+  d = set_difference(frame, a, b);
+  diff_ns = now_ns() - start;
+
+  printf("set %d: add %.1f ns, intersection %.1f ms, union %.1f ms, difference %.1f ms (%u %u %u)\n",
+    n, (double)build_ns / (2.0 * n), inter_ns / 1e6, union_ns / 1e6, diff_ns / 1e6,
+    set_count(x), set_count(u), set_count(d));
+
+  free_root_frame(root_frame);
+}
+
+// maps keyed by maps that only differ in one entry, so unequal keys look alike
+void bench_struct_keys(int n, int width) {
+  struct elem *root_frame = new_root_frame();
+  struct elem *frame = root_frame;
+  struct elem *m = empty_map(), *k;
+  struct elem **keys = NEW_ARRAY(struct elem *, n);
+  struct elem **misses = NEW_ARRAY(struct elem *, n);
+  int i, j, lookups = 100000;
+  uint64_t start, hit_ns, miss_ns;
+
+  for(i=0;i<n;++i) {
+    keys[i] = misses[i] = empty_map();
+    for(j=0;j<width;++j) {
+      k = new_int(frame, j);
+      keys[i] = map_set(frame, keys[i], k, new_int(frame, j == 0 ? i : j));
+      misses[i] = map_set(frame, misses[i], k, new_int(frame, j == 0 ? i + n : j));
+    }
+    m = map_set(frame, m, keys[i], new_int(frame, i));
+  }
+
+  start = now_ns();
+  for(i=0;i<lookups;++i) {
+    map_get(frame, m, keys[(i * 7919) % n]);
+  }
+  hit_ns = now_ns() - start;
+  start = now_ns();
+  for(i=0;i<lookups;++i) {
+    map_get(frame, m, misses[(i * 7919) % n]);
+  }
+  miss_ns = now_ns() - start;
+
+  printf("map %d keys of %d entries: get hit %.1f ns miss %.1f ns\n",
+    n, width, (double)hit_ns / lookups, (double)miss_ns / lookups);
+
+  FREE_ARRAY(misses);
+  FREE_ARRAY(keys);
+  free_root_frame(root_frame);
+}
+
+// short lived cells with a little kept, as frame_eval churns through them
+void bench_alloc(int n) {
+  struct elem *root_frame = new_root_frame();
+  struct elem *m, *l;
+  struct alloc_stats before, after;
+  uint64_t start, elapsed;
+  int i, j;
+
+  frame_alloc_stats(root_frame, &before);
+  start = now_ns();
+  for(i=0;i<n;++i) {
+    l = empty_list();
+    for(j=0;j<4;++j) {
+      l = list_add(root_frame, l, new_int(root_frame, i + j));
+    }
+    m = map_set(root_frame, empty_map(), sym_lhs(), l);
+    m = map_set(root_frame, m, sym_rhs(), new_int(root_frame, i));
+    if ( i % 100 == 0 ) {
+      frame_set(root_frame, sym_lhs(), list_add(root_frame, frame_get(root_frame, sym_lhs()), m));
+    }
+    if ( i % 100000 == 0 ) {
+      frame_set(root_frame, sym_lhs(), empty_list());
+    }
+    frame_safepoint(root_frame);
+  }
+  elapsed = now_ns() - start;
+  frame_alloc_stats(root_frame, &after);
+
+  printf("alloc %d steps: %.1f M cells/s, %lu minor max %.1f us avg %.1f us, %lu full max %.1f us\n",
+    n, (double)(after.allocated - before.allocated) * 1e3 / elapsed,
+    after.minor_collections, after.max_minor_pause_ns / 1e3,
+    (double)after.minor_pause_ns / (after.minor_collections ? after.minor_collections : 1) / 1e3,
+    after.collections - after.minor_collections, after.max_pause_ns / 1e3);
+
+  free_root_frame(root_frame);
+}
+
+// the same script in k instances at once, for k up to one per core
+void bench_instances(int n) {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  struct instance *instances = NEW_ARRAY(struct instance, cores);
+  struct elem **reader_roots = NEW_ARRAY(struct elem *, cores);
+  uint64_t start, elapsed, one = 0;
+  int i, k;
+
+  for(k=1;;k=k*2<cores?k*2:cores) {
+    for(i=0;i<k;++i) {
+      reader_roots[i] = new_root_frame();
+      instances[i].frame = new_test_instance_frame(reader_roots[i], n);
+      instances[i].input = "(count n)";
+      instances[i].len = strlen(instances[i].input);
+    }
+    start = now_ns();
+    instances_run(instances, k);
+    elapsed = now_ns() - start;
+    if ( k == 1 ) {
+      one = elapsed;
+    }
+    printf("instances %2d x %d calls: %.2f s, %.2fx the throughput of one\n",
+      k, n, elapsed / 1e9, (double)k * one / elapsed);
+    for(i=0;i<k;++i) {
+      free_root_frame(instances[i].frame);
+      free_root_frame(reader_roots[i]);
+    }
+    if ( k == cores ) {
+      break;
+    }
+  }
+  FREE_ARRAY(reader_roots);
+  FREE_ARRAY(instances);
+}
+
+double bench_eval_ns(struct elem *frame, struct elem *expr, int runs) {
+  uint64_t start = now_ns();
+  int i;
+  for(i=0;i<runs;++i) {
+    frame_set(frame, sym_rhs(), expr);
+    frame_set(frame, sym_lhs(), empty_list());
+    frame_eval(frame);
+  }
+  return (double)(now_ns() - start) / runs;
+}
+
+// four long arguments, then two trivial ones for what a pcall costs
+void bench_pcall(int n, int runs) {
+  struct elem *reader_root = new_root_frame();
+  struct elem *frame = new_test_instance_frame(reader_root, n);
+  double plain, par, small_plain, small_par;
+
+  plain = bench_eval_ns(frame, reader_read(reader_root, "(second (count n) (count n) (count n) (count n))"), 1);
+  par = bench_eval_ns(frame, reader_read(reader_root, "(pcall second (count n) (count n) (count n) (count n))"), 1);
+  small_plain = bench_eval_ns(frame, reader_read(reader_root, "(second (id :a) (id :b))"), runs);
+  small_par = bench_eval_ns(frame, reader_read(reader_root, "(pcall second (id :a) (id :b))"), runs);
+
+  printf("pcall 4 x %d calls on %ld cores: %.1f ms, plain %.1f ms, %.2fx; trivial args %.1f us, plain %.1f us\n",
+    n, sysconf(_SC_NPROCESSORS_ONLN), par / 1e6, plain / 1e6, plain / par, small_par / 1e3, small_plain / 1e3);
+
+  free_root_frame(frame);
+  free_root_frame(reader_root);
+}
+
+int bench() {
+  bench_map(MAP_FLAT_MAX);
+  bench_map(10);
+  bench_map(1000);
+  bench_map(100000);
+  bench_set(1000000);
+  bench_struct_keys(10000, 64);
+  bench_frame_eval(20, 10000);
+  bench_vm("(chain (pick (id :a) (second :b :c)))", 1000000);
+  bench_arith(10000000);
+  bench_bigint(10000, 1000000);
+  bench_vector(10000000);
+  bench_pvec(1000000, 100000);
+  bench_string(50000000);
+  bench_reader(10000000);
+  bench_print(100000000);
+  bench_snapshot(10000000);
+  bench_list(1000000, 20);
+  bench_alloc(10000000);
+  bench_instances(1000000);
+  bench_pcall(1000000, 10000);
+  return 0;
+}
+
+// evaluates each form of a file, or streams them from stdin without one
+int run(char *path) {
+  struct elem *root_frame = new_root_frame();
+  struct elem *env = env_add_builtins(root_frame, empty_map());
+  struct elem *value;
+  struct reader r;
+  int status = 0;
+
+  frame_set(root_frame, sym_env(), env);
+  if ( path != 0 ) {
+    value = frame_load_file(root_frame, path);
+  } else {
+    reader_init_file(&r, root_frame, stdin);
+    value = frame_load(&r);
+    reader_free(&r);
+  }
+  if ( is_type(value, ELEM_TYPE_ERROR) ) {
+    elem_println(root_frame, stderr, value);
+    status = 1;
+  }
+  free_root_frame(root_frame);
+  return status;
+}
+
+int main(int argc, char **argv) {
+  int status = 0;
+
+  if ( argc > 1 && strcmp(argv[1], "run") == 0 ) {
+    status = run(argc > 2 ? argv[2] : 0);
+    pool_stop();
+    free_symbol_table();
+    return status;
+  }
+
+  if ( argc > 1 && strcmp(argv[1], "bench") == 0 ) {
+    status = bench();
+    pool_stop();
+    free_symbol_table();
+    return status;
+  }
+
+  status |= test_reader_1();
+  status |= test_reader_2();
+  status |= test_reader_3();
+  status |= test_reader_4();
+  status |= test_reader_5();
+  status |= test_reader_6();
+  status |= test_reader_7();
+  status |= test_reader_8();
+  status |= test_reader_9();
+  status |= test_reader_10();
+  status |= test_printer_1();
+  status |= test_snapshot_1();
+
+  status |= test_eval_1();
+  status |= test_eval_2();
+  status |= test_eval_3();
+  status |= test_eval_4();
+
+  status |= test_gc_1();
+  status |= test_gc_2();
+  status |= test_intern_1();
+  status |= test_map_1();
+  status |= test_set_1();
+  status |= test_frame_1();
+  status |= test_vm_1();
+  status |= test_arith_1();
+  status |= test_bigint_1();
+  status |= test_vector_1();
+  status |= test_pvec_1();
+  status |= test_string_1();
+  status |= test_tail_1();
+  status |= test_instances_1();
+  status |= test_pcall_1();
+
+  pool_stop();
+  free_symbol_table();
+  return status;
+}
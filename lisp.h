@@ -1,16 +1,16 @@
 #ifndef LISP_H
 #define LIST_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
 
 #define ELEM_TYPE_NIL        0
 #define ELEM_TYPE_TRUE       1
 #define ELEM_TYPE_FALSE      2
 
 #define ELEM_TYPE_INT        3
-typedef struct elem_int {
-  uint32_t value;
-} elem_int_t;
 
 #define ELEM_TYPE_LIST       4
 #define ELEM_TYPE_SET        5
@@ -22,9 +22,32 @@ struct elem_list {
 #define ELEM_TYPE_STRING     6
 #define ELEM_TYPE_SYM        7
 #define ELEM_TYPE_IDENT      8
+/*
+ * len counts the bytes and one more. A string that borrows its bytes
+ * from another string's keeps the cell that owns them in owner, which
+ * keeps them alive; strings borrowed from outside the heap have none.
+ */
 struct elem_string {
   uint32_t len;
+  uint32_t hash;
   char  *str;
+  union {
+    struct elem *sym;
+    struct elem *owner;
+  };
+};
+
+/*
+ * A string cell flagged ELEM_FLAG_ROPE holds the bytes of left followed
+ * by those of right, both strings. len counts just the bytes, depth is
+ * the height of the tree below and the hash is kept in the header. The
+ * two sides never differ in depth by more than one.
+ */
+struct elem_rope {
+  uint32_t     len;
+  uint32_t     depth;
+  struct elem *left;
+  struct elem *right;
 };
 
 #define ELEM_TYPE_ERROR      9
@@ -34,47 +57,343 @@ struct elem_error {
 
 #define ELEM_TYPE_MAP        10
 struct elem_map {
-  struct elem *key;
-  struct elem *value;
-  struct elem *next;
+  struct elem *root;
+  uint32_t count;
+};
+
+#define ELEM_TYPE_MAP_NODE   13
+struct elem_map_node {
+  uint32_t datamap;
+  uint32_t nodemap;
+  uint32_t len;
+  struct elem **slots;
 };
 
 #define ELEM_TYPE_FN         11
 typedef struct elem *(fn)(struct elem *frame);
+// a builtin flagged ELEM_FLAG_NATIVE, called with its arguments in an array
+typedef struct elem *(native)(struct elem *frame, struct elem **args, uint32_t n);
 
 struct elem_fn {
-  fn          *fn;
+  union {
+    fn        *fn;
+    native    *native;
+  };
   struct elem *args;
   struct elem *expr;
 };
 
 #define ELEM_TYPE_ALLOC      12
-struct alloc {
+/*
+ * Cells live in chunks of ALLOC_CHUNK_BYTES, aligned to that size so the
+ * chunk of a cell is its address masked down. A chunk holds cells of one
+ * size class and keeps their mark bits in a bitmap at its start. List
+ * pairs are 16 bytes, every other cell is a 32 byte struct elem.
+ *
+ * The byte classes, of 16 to ALLOC_BYTES_MAX bytes, hold what small map
+ * nodes and short strings own: slot arrays of up to 16 slots and string
+ * bytes. These are not cells but belong to the one that points at them,
+ * and are moved and freed along with it.
+ *
+ * New cells are bumped off young chunks, the nursery, and the ones still
+ * reachable at a minor collection are copied into the old chunks, which
+ * are only collected by a full mark and sweep.
+ *
+ * Several threads can allocate in one alloc. Each bumps cells off young
+ * chunks of its own, held in its tlab along with its roots, and takes the
+ * lock only to get a fresh chunk. A collection stops every thread at a
+ * safepoint first.
+ */
+#define ALLOC_CHUNK_BYTES    (1 << 16)
+#define ALLOC_CLASS_PAIR     0
+#define ALLOC_CLASS_CELL     1
+#define ALLOC_CLASS_BYTES    2 // the first byte class, each twice the last
+#define ALLOC_CLASSES        6
+#define ALLOC_BYTES_MAX      128
+
+struct alloc_chunk {
+  uint32_t size;
   uint32_t len;
   uint32_t tail;
-  struct elem *table;
-  struct elem *free_list;
+  uint32_t young;
+  char    *table;
+  struct alloc_chunk *next;
+  uint64_t marks[ALLOC_CHUNK_BYTES / 16 / 64];
+};
+
+struct alloc_class {
+  uint32_t size;
+  struct alloc_chunk *chunks;
+  struct alloc_chunk *nursery;
+  void    *free_list;
+};
+
+struct alloc_stats {
+  uint64_t collections;
+  uint64_t pause_ns;
+  uint64_t max_pause_ns;
+  uint64_t minor_collections;
+  uint64_t minor_pause_ns;
+  uint64_t max_minor_pause_ns;
+  uint64_t promoted;
+  uint64_t live;
+  uint64_t capacity;
+  uint64_t bytes;
+  uint64_t allocated;
+  uint64_t safepoints;
+};
+
+struct alloc_mapping {
+  void  *addr;
+  size_t len;
+  struct alloc_mapping *next;
+};
+
+struct alloc_roots {
+  struct elem **table;
+  uint32_t len;
+  struct alloc_roots *next;
+};
+
+// chunks by address, kept until the next collection once grown out of
+struct alloc_chunk_set {
+  uint32_t len;
+  struct alloc_chunk_set *retired;
+  struct alloc_chunk *table[];
+};
+
+// what one thread allocating in an alloc keeps to itself
+struct alloc_tlab {
+  struct alloc *alloc;
+  struct alloc_chunk *chunks[ALLOC_CLASSES];
+  uint32_t limits[ALLOC_CLASSES]; // how far into its chunk it has counted
+  struct elem **owners; // its young cells that own memory outside the heap
+  uint32_t owners_len;
+  uint32_t owners_cap;
+  struct alloc_roots *roots;
+  struct frame *frame_pool;
+  struct elem *frame; // where a parked thread is, moved along by collections
+  FILE    *out;
+  uint64_t allocated;
+  uint64_t safepoints;
+  struct alloc_tlab *next;
+};
+
+struct alloc {
+  struct alloc_class classes[ALLOC_CLASSES];
+  struct alloc_chunk_set *chunk_set;
+  uint32_t chunk_count;
+  struct alloc_chunk *spare;
+  uint32_t spare_count;
+  struct elem **remembered;
+  uint32_t remembered_len;
+  uint32_t remembered_cap;
+  struct elem **owners; // the owners of threads that detached
+  uint32_t owners_len;
+  uint32_t owners_cap;
+  struct alloc_tlab tlab; // the owning thread's, at the head of all attached
+  struct alloc_mapping *mappings;
+  struct frame *frame_pool;
+  struct elem *root;
+  pthread_mutex_t lock;
+  pthread_cond_t  cond;
+  uint32_t active;
+  int      collecting;
+  uint64_t threshold;
+  uint64_t since_collect;
+  uint64_t major_threshold;
+  uint64_t promoted;
+  struct alloc_stats stats;
 };
 
 struct elem_alloc {
   struct alloc* alloc;
 };
 
+#define ELEM_TYPE_FRAME      14
+struct frame {
+  struct elem *lhs;
+  struct elem *rhs;
+  struct elem *parent;
+  struct elem *env;
+  struct elem *alloc;
+  struct elem *ext;
+  struct frame *next;
+};
+
+struct elem_frame {
+  struct frame *frame;
+};
+
+#define ELEM_TYPE_CODE       15
+struct code {
+  uint32_t nparams;
+  uint32_t nregs;
+  uint32_t len;
+  uint32_t nconsts;
+  uint32_t ncaches;
+  uint32_t *ops;
+  struct elem **consts;
+  struct elem **caches;
+};
+
+struct elem_code {
+  struct code *code;
+};
+
+#define ELEM_TYPE_BIGINT     16
+// an int outside the fixnum range, as sign and magnitude, least significant limb first
+struct elem_bigint {
+  int32_t   sign;
+  uint32_t  len;
+  uint64_t *limbs;
+};
+
+#define ELEM_TYPE_VECTOR     17
+/*
+ * A vector holds its items in one array. When every item is a fixnum
+ * they are kept as plain int64s, which bulk arithmetic works on directly.
+ */
+#define VECTOR_ELEMS         0
+#define VECTOR_INTS          1
+struct elem_vector {
+  uint32_t kind;
+  uint32_t len;
+  union {
+    struct elem **items;
+    int64_t      *ints;
+  };
+};
+
+#define ELEM_TYPE_PVEC       18
+#define ELEM_TYPE_PVEC_NODE  19
+/*
+ * A persistent vector is a relaxed radix balanced tree of nodes with up
+ * to 32 slots, and a tail of up to 32 items after it, which conj adds to
+ * until it fills up and goes into the tree as a leaf. shift is five times
+ * the root's height, leaves being at 0. Inner nodes without sizes are
+ * strict, every child but the last holding as many items as fit, and are
+ * indexed by shifting; relaxed ones keep the running count of items up
+ * to each child. An empty root or tail is nil.
+ */
+struct elem_pvec {
+  uint32_t     count;
+  uint32_t     shift;
+  struct elem *root;
+  struct elem *tail;
+};
+
+struct elem_pvec_node {
+  uint32_t      len;
+  uint32_t     *sizes;
+  struct elem **slots;
+};
+
+/*
+ * An interpreter instance is a root frame and everything allocated from
+ * it. The caller makes the frame, sets up its env and frees it once the
+ * instance has run; value stays valid until the frame is used again.
+ */
+struct instance {
+  struct elem *frame;
+  const char  *input;
+  size_t       len;
+  struct elem *value;
+  pthread_t    thread;
+  int          threaded;
+};
+
+struct reader {
+  const char  *input;
+  size_t       len;
+  size_t       pos;
+  struct elem *frame;
+  struct elem *error;
+  char        *buf;
+  size_t       cap;
+  FILE        *file;
+  int          fd;
+  int          eof;
+  int          borrow;
+};
+
+// the cell's string points into memory it does not own
+#define ELEM_FLAG_BORROWED   1
+// the old cell is on its alloc's remembered list
+#define ELEM_FLAG_REMEMBERED 2
+// the builtin fn is a native
+#define ELEM_FLAG_NATIVE     4
+// the string is a rope
+#define ELEM_FLAG_ROPE       8
+
+// with neither file nor fd set, the buffer holds everything printed
+struct printer {
+  char        *buf;
+  size_t       len;
+  size_t       cap;
+  size_t       written;
+  FILE        *file;
+  int          fd;
+  int          error;
+};
+
 struct elem {
-  uint32_t        type;
+  uint16_t        type;
+  uint16_t        flags;
+  uint32_t        hash;
   union {
-    struct elem_list   lval;
-    struct elem_int    ival;
     struct elem_string sval;
+    struct elem_rope   rval;
     struct elem_map    mval;
+    struct elem_map_node nval;
     struct elem_fn     fval;
     struct elem_alloc  aval;
+    struct elem_frame  frval;
+    struct elem_code   cval;
     struct elem_error  eval;
+    struct elem_bigint bval;
+    struct elem_vector vval;
+    struct elem_pvec   pval;
+    struct elem_pvec_node pnval;
+    struct elem       *forward;
   };
 };
 
-extern struct elem EMPTY_LIST;
-extern struct elem NIL;
+/*
+ * The low three bits of a struct elem * are a tag. Odd words are fixnums
+ * holding the int shifted up by one, which leaves them 63 bits; ints
+ * outside that range are bigint cells. Words tagged ELEM_TAG_CONST hold
+ * a type above the tag bits and stand for nil, true, false and the empty
+ * list, set and map. Words tagged ELEM_TAG_LIST point to a headerless
+ * pair. Untagged words point to a struct elem.
+ */
+#define ELEM_TAG_BITS        3
+#define ELEM_TAG_MASK        7
+#define ELEM_TAG_FIXNUM      1
+#define ELEM_TAG_CONST       2
+#define ELEM_TAG_LIST        4
+
+#define ELEM_CONST(type)     ((struct elem *)(((uintptr_t)(type) << ELEM_TAG_BITS) | ELEM_TAG_CONST))
+#define ELEM_FIXNUM(i)       ((struct elem *)(((uintptr_t)(intptr_t)(i) << 1) | ELEM_TAG_FIXNUM))
+#define FIXNUM_MAX           (INTPTR_MAX >> 1)
+#define FIXNUM_MIN           (INTPTR_MIN >> 1)
+
+#define ELEM_NIL             ELEM_CONST(ELEM_TYPE_NIL)
+#define ELEM_TRUE            ELEM_CONST(ELEM_TYPE_TRUE)
+#define ELEM_FALSE           ELEM_CONST(ELEM_TYPE_FALSE)
+#define ELEM_EMPTY_LIST      ELEM_CONST(ELEM_TYPE_LIST)
+#define ELEM_EMPTY_SET       ELEM_CONST(ELEM_TYPE_SET)
+#define ELEM_EMPTY_MAP       ELEM_CONST(ELEM_TYPE_MAP)
+
+uint32_t elem_type(struct elem *e);
+int is_type(struct elem *e, int type);
+int64_t int_value(struct elem *e);
+struct elem *new_int(struct elem *frame, int64_t i);
+struct elem *new_native(struct elem *frame, native *native);
+struct elem *env_add_arithmetic(struct elem *frame, struct elem *env);
+struct elem *env_add_vectors(struct elem *frame, struct elem *env);
+struct elem *env_add_strings(struct elem *frame, struct elem *env);
+struct elem *env_add_builtins(struct elem *frame, struct elem *env);
 
 struct elem_cxt *new_elem_cxt();
 
@@ -89,6 +408,54 @@ int elem_eq(struct elem *frame, struct elem *a, struct elem *b);
 int sval_eq(struct elem *frame, struct elem *a, struct elem *b);
 int ival_eq(struct elem *frame, struct elem *a, struct elem *b);
 
+struct elem *intern(char *s);
+struct elem *intern_len(const char *s, uint32_t len);
+void free_symbol_table();
+
+void reader_init(struct reader *r, struct elem *frame, const char *input, size_t len);
+void reader_init_fd(struct reader *r, struct elem *frame, int fd);
+void reader_init_file(struct reader *r, struct elem *frame, FILE *file);
+void reader_free(struct reader *r);
+struct elem *elem_read(struct reader *r);
+struct elem *reader_next(struct reader *r);
+struct elem *frame_load(struct reader *r);
+struct elem *frame_load_file(struct elem *frame, char *path);
+struct elem *reader_read_buf(struct elem *frame, const char *input, size_t len);
+struct elem *reader_read(struct elem *frame, char *expr);
+
+void printer_init(struct printer *p);
+void printer_init_fd(struct printer *p, int fd);
+void printer_init_file(struct printer *p, FILE *file);
+int printer_flush(struct printer *p);
+void printer_free(struct printer *p);
+size_t elem_write(struct printer *p, struct elem *e);
+
+int snapshot_save(struct printer *p, struct elem *e);
+struct elem *snapshot_load(struct elem *frame, const char *buf, size_t len);
+struct elem *snapshot_load_checked(struct elem *frame, const char *buf, size_t len);
+struct elem *frame_load_snapshot(struct elem *frame, char *path);
+
+struct elem *new_root_frame();
+void free_root_frame(struct elem *frame);
+void instances_run(struct instance *instances, int n);
+void pool_start(int threads);
+void pool_stop();
+
+struct elem *frame_to_map(struct elem *frame);
+struct elem *frame_eval(struct elem *frame);
+
+struct elem *compile(struct elem *frame, struct elem *params, struct elem *expr);
+struct elem *vm_eval(struct elem *frame, struct elem *code);
+
+struct elem *frame_safepoint(struct elem *frame);
+struct elem *frame_collect(struct elem *frame);
+struct elem *frame_collect_young(struct elem *frame);
+void frame_push_roots(struct elem *frame, struct alloc_roots *roots);
+void frame_pop_roots(struct elem *frame, struct alloc_roots *roots);
+void frame_alloc_stats(struct elem *frame, struct alloc_stats *stats);
+
+uint32_t elem_hash(struct elem *frame, struct elem *e);
+
 int list_sublist_eq(struct elem *frame, struct elem *a, struct elem *b);
 int set_subset_eq(struct elem *frame, struct elem *a, struct elem *b);
 int map_submap_eq(struct elem *frame, struct elem *a, struct elem *b);